@@ -0,0 +1,780 @@
+/* byzantium.c - game engine for Byzantium: offers, attacks and battles, with no I/O */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "byzantium.h"
+
+/* skirmish worker pool, shared by all games - only one battle uses it at a time */
+pthread_mutex_t battlelock = PTHREAD_MUTEX_INITIALIZER; /* held by the battle using the pool */
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER; /* protects the pool variables below */
+pthread_cond_t poolwork = PTHREAD_COND_INITIALIZER; /* signalled when a new battle is handed to the pool */
+pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER; /* signalled when the last skirmish is resolved */
+int poolworkers = 1; /* number of threads in the pool, including the thread running the battle */
+int poolgeneration = 0; /* incremented for every battle handed to the pool */
+gamestate *poolgame = NULL; /* game whose skirmishes the pool is resolving */
+int poolskirmishes = 0; /* number of skirmishes in poolgame when it was handed to the pool */
+int nextskirmish = 0; /* next unclaimed index into poolgame->skirmishes */
+int skirmishesleft = 0; /* number of skirmishes not yet resolved */
+typedef struct {
+        int count;
+        int first;
+        int second;
+        int third;
+    } die; /* one side's dice in an exchange, for roll_exchanges_scalar() */
+
+/* helper functions */
+static unsigned int next_seed(gamestate *game);
+static void seed_dice(gamestate *game, dicestream *stream);
+static void *battle_worker(void *arg);
+static void resolve_skirmishes(gamestate *game, int workers);
+static void fight_skirmish(skirmishinfo *skirmish);
+static void sort_rolls(die *side);
+#ifdef GRIDCHECK
+static void dense_battle(gamestate *game);
+#endif
+static int  compare_skirmishes(const void *first, const void *second);
+
+
+
+
+void init_game(gamestate *game, int startingforce, unsigned int seed)
+{
+    int player;
+
+    memset(game, 0, sizeof(gamestate));
+    game->startingforce = startingforce;
+    game->seed = seed | 1; /* xorshift state must be nonzero */
+    for (player=0; player<MAXPLAYERS; player++) {
+        game->players[player].attacktarget = -1;
+    }
+    clear_round(game);
+}
+
+
+
+
+/* Bring a player into the game with a full force. */
+void add_player(gamestate *game, int player)
+{
+    game->players[player].playing = 1;
+    game->players[player].troops = game->startingforce;
+}
+
+
+
+
+/* Take a player out of the game, whether knocked out, dropped or at the end of a game. */
+void remove_player(gamestate *game, int player)
+{
+    game->players[player].playing = 0;
+    game->players[player].troops = 0;
+    game->players[player].fighting = 0;
+}
+
+
+
+
+/* Count the players still in the game. */
+int count_players(gamestate *game)
+{
+    int player, numplayers = 0;
+
+    for (player=0; player<MAXPLAYERS; player++) {
+        if (game->players[player].playing > 0) {
+            numplayers++;
+        }
+    }
+    return numplayers;
+}
+
+
+
+
+/* Record an offer from proposer to ally to attack target. */
+void add_offer(gamestate *game, int ally, int proposer, int target)
+{
+    playerinfo *players = game->players;
+
+    players[proposer].offer.target = target;
+    players[proposer].offer.next = NOPLAYER;
+    if (players[ally].offerhead == NOPLAYER) {
+        players[ally].offerhead = proposer;
+    }
+    else {
+        players[players[ally].offertail].offer.next = proposer;
+    }
+    players[ally].offertail = proposer;
+    players[ally].offers += 1;
+#ifdef GRIDCHECK
+    game->offergrid[ally][proposer].used = 1;
+    game->offergrid[ally][proposer].target = target;
+#endif
+}
+
+
+
+
+/* Record an attack from attacker on target. */
+void add_attack(gamestate *game, int attacker, int target)
+{
+    if (game->players[attacker].attacktarget < 0) {
+        game->attackers[game->numattacks++] = attacker;
+    }
+    game->players[attacker].attacktarget = target;
+#ifdef GRIDCHECK
+    game->attackgrid[attacker][target] = 1;
+#endif
+}
+
+
+
+
+/* Forget this round's offers and attacks. */
+void clear_round(gamestate *game)
+{
+    int player;
+
+    for (player=0; player<game->numattacks; player++) {
+        game->players[game->attackers[player]].attacktarget = -1;
+    }
+    game->numattacks = 0;
+    for (player=0; player<MAXPLAYERS; player++) {
+        game->players[player].offerhead = NOPLAYER;
+        game->players[player].offertail = NOPLAYER;
+        game->players[player].offer.next = NOPLAYER;
+        game->players[player].attacktarget = -1;
+        game->players[player].offers = 0;
+    }
+#ifdef GRIDCHECK
+    memset(game->offergrid, 0, sizeof(game->offergrid));
+    memset(game->attackgrid, 0, sizeof(game->attackgrid));
+#endif
+}
+
+
+
+
+/*
+ * Play a whole round from each player's decisions: offers, attacks and the
+ * battle. Decisions of players not playing are ignored, as are attacks on
+ * players not playing. Returns the number of players left in the game.
+ */
+int play_round(gamestate *game, decision *decisions)
+{
+    int player, numplayers;
+
+    for (player=0; player<MAXPLAYERS; player++) {
+        if (game->players[player].playing > 0 && decisions[player].ally >= 0 && decisions[player].ally != player) {
+            add_offer(game, decisions[player].ally, player, decisions[player].offertarget);
+        }
+    }
+    for (player=0; player<MAXPLAYERS; player++) {
+        int target = decisions[player].attack;
+        if (game->players[player].playing > 0 && target >= 0 && target != player && game->players[target].playing > 0) {
+            add_attack(game, player, target);
+        }
+    }
+#ifdef GRIDCHECK
+    game->mismatches += check_battle(game, 1);
+#else
+    do_battle(game, 1);
+#endif
+    numplayers = count_players(game);
+    clear_round(game);
+    return numplayers;
+}
+
+
+
+
+/*
+ * Resolve the round's attacks. Each player's troops are split evenly among
+ * their skirmishes, with leftover troops going to the lowest-numbered
+ * opponents. Afterwards game->skirmishes holds every skirmish fought, and the
+ * knockedout and bonus flags show who was knocked out and who was awarded
+ * troops for it. With workers > 1 the skirmishes are resolved on the pool
+ * started by start_battle_workers().
+ */
+void do_battle(gamestate *game, int workers)
+{
+    playerinfo *players = game->players;
+    int opponents[MAXPLAYERS] = {0}; /* number of skirmishes each player is in */
+    int leftover[MAXPLAYERS] = {0}; /* troops left after splitting a player's force evenly */
+    int remaining[MAXPLAYERS] = {0}; /* troops each player has after the battle */
+    int attack, attacker, target, player;
+    int i;
+    skirmishinfo *skirmish;
+
+    for (player=0; player<MAXPLAYERS; player++) {
+        players[player].knockedout = 0;
+        players[player].bonus = 0;
+    }
+
+    /* Build the list of skirmishes from the attacks, one per fighting pair, ordered by player number. */
+    game->numskirmishes = 0;
+    for (attack=0; attack<game->numattacks; attack++) {
+        attacker = game->attackers[attack];
+        target = players[attacker].attacktarget;
+        if (players[target].attacktarget == attacker && target < attacker) { /* mutual attack - already listed */
+            continue;
+        }
+        skirmish = &game->skirmishes[game->numskirmishes++];
+        skirmish->a = (attacker < target) ? attacker : target;
+        skirmish->b = (attacker < target) ? target : attacker;
+    }
+    qsort(game->skirmishes, game->numskirmishes, sizeof(skirmishinfo), compare_skirmishes);
+
+    /* Distribute each player's troops among their skirmishes. Dice streams are seeded here, in list order, so results do not depend on which thread fights which skirmish. */
+    for (i=0; i<game->numskirmishes; i++) {
+        opponents[game->skirmishes[i].a]++;
+        opponents[game->skirmishes[i].b]++;
+    }
+    for (player=0; player<MAXPLAYERS; player++) {
+        if (opponents[player] > 0) {
+            leftover[player] = players[player].troops % opponents[player];
+        }
+    }
+    for (i=0; i<game->numskirmishes; i++) { /* opponents are visited in player order, so the leftover troops go to the lowest-numbered ones */
+        skirmish = &game->skirmishes[i];
+        players[skirmish->a].fighting = 1;
+        players[skirmish->b].fighting = 1;
+        skirmish->acount = (players[skirmish->a].attacktarget == skirmish->b) ? 3 : 2; /* attacking - 3 rolls, defending - 2 rolls */
+        skirmish->bcount = (players[skirmish->b].attacktarget == skirmish->a) ? 3 : 2;
+        skirmish->starta = players[skirmish->a].troops/opponents[skirmish->a];
+        if (leftover[skirmish->a] > 0) {
+            skirmish->starta += 1;
+            leftover[skirmish->a]--;
+        }
+        skirmish->startb = players[skirmish->b].troops/opponents[skirmish->b];
+        if (leftover[skirmish->b] > 0) {
+            skirmish->startb += 1;
+            leftover[skirmish->b]--;
+        }
+        skirmish->troopsa = skirmish->starta;
+        skirmish->troopsb = skirmish->startb;
+        seed_dice(game, &skirmish->stream);
+    }
+
+    /* Do skirmishes. Each one only touches its own entry in skirmishes. */
+    resolve_skirmishes(game, workers);
+    for (i=0; i<game->numskirmishes; i++) { /* count up remaining troops */
+        skirmish = &game->skirmishes[i];
+        if (skirmish->troopsa > 0) {
+            remaining[skirmish->a] += skirmish->troopsa;
+        }
+        if (skirmish->troopsb > 0) {
+            remaining[skirmish->b] += skirmish->troopsb;
+        }
+    }
+
+    /* Do cleanup. */
+    for (player=0; player<MAXPLAYERS; player++) {
+        if (players[player].playing != 0 && players[player].fighting != 0) {
+            players[player].troops = remaining[player];
+            if (remaining[player] <= 0) {
+                players[player].playing = -1;
+                players[player].troops = 0;
+                players[player].knockedout = 1;
+            }
+        }
+    }
+    for (attack=0; attack<game->numattacks; attack++) { /* award new troops to any surviving attacker who contributed to a knockout */
+        attacker = game->attackers[attack];
+        target = players[attacker].attacktarget;
+        if (players[target].knockedout != 0 && players[attacker].playing > 0) {
+            players[attacker].bonus = 1;
+            players[attacker].troops += game->startingforce;
+            if (players[attacker].troops > MAXTROOPS) {
+                players[attacker].troops = MAXTROOPS;
+            }
+        }
+    }
+    for (i=0; i<game->numskirmishes; i++) {
+    	players[game->skirmishes[i].a].fighting = 0;
+    	players[game->skirmishes[i].b].fighting = 0;
+    }
+}
+
+
+
+
+static int compare_skirmishes(const void *first, const void *second)
+{
+    const skirmishinfo *x = first, *y = second;
+
+    if (x->a != y->a) {
+        return x->a - y->a;
+    }
+    return x->b - y->b;
+}
+
+
+
+
+/* Start the threads used by do_battle() when called with workers > 1. */
+void start_battle_workers(int workers)
+{
+    pthread_t thread;
+    int i;
+
+    for (i=1; i<workers; i++) { /* the thread running the battle is the first worker */
+        if (pthread_create(&thread, NULL, battle_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    if (workers > poolworkers) {
+        poolworkers = workers;
+    }
+}
+
+
+
+
+/*
+ * Fight skirmishes of each battle handed to the pool. A worker can wake after
+ * the battle it was woken for is over, while the next do_battle() is still
+ * rebuilding the list, so the game and its number of skirmishes are taken
+ * under poollock when the battle is handed over, and every claim is made
+ * under poollock and only while that battle is still the pool's.
+ */
+static void *battle_worker(void *arg)
+{
+    int generation = 0;
+    int claimed, count;
+    gamestate *game;
+
+    pthread_mutex_lock(&poollock);
+    while (1) {
+        while (poolgeneration == generation) { /* wait for a new battle */
+            pthread_cond_wait(&poolwork, &poollock);
+        }
+        generation = poolgeneration;
+        game = poolgame;
+        count = poolskirmishes;
+
+        /* Claim skirmishes one at a time until none are left. */
+        while (poolgeneration == generation && (claimed = __sync_fetch_and_add(&nextskirmish, 1)) < count) {
+            pthread_mutex_unlock(&poollock);
+            fight_skirmish(&game->skirmishes[claimed]);
+            pthread_mutex_lock(&poollock);
+            skirmishesleft--;
+            if (skirmishesleft == 0) {
+                pthread_cond_signal(&pooldone);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/*
+ * Resolve every skirmish in the game's list. Idle workers claim the next
+ * unresolved skirmish from a shared counter, so a thread that draws a long
+ * fight does not hold up the others. Returns once all skirmishes are done.
+ */
+static void resolve_skirmishes(gamestate *game, int workers)
+{
+    int claimed;
+
+    if (workers <= 1 || poolworkers <= 1 || game->numskirmishes <= 1) {
+        for (claimed=0; claimed<game->numskirmishes; claimed++) {
+            fight_skirmish(&game->skirmishes[claimed]);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&battlelock);
+    pthread_mutex_lock(&poollock);
+    poolgame = game;
+    poolskirmishes = game->numskirmishes;
+    nextskirmish = 0;
+    skirmishesleft = game->numskirmishes;
+    poolgeneration++;
+    pthread_cond_broadcast(&poolwork);
+    pthread_mutex_unlock(&poollock);
+
+    while ((claimed = __sync_fetch_and_add(&nextskirmish, 1)) < game->numskirmishes) {
+        fight_skirmish(&game->skirmishes[claimed]);
+        pthread_mutex_lock(&poollock);
+        skirmishesleft--;
+        pthread_mutex_unlock(&poollock);
+    }
+
+    pthread_mutex_lock(&poollock);
+    while (skirmishesleft > 0) {
+        pthread_cond_wait(&pooldone, &poollock);
+    }
+    pthread_mutex_unlock(&poollock);
+    pthread_mutex_unlock(&battlelock);
+}
+
+
+
+
+static void fight_skirmish(skirmishinfo *skirmish)
+{
+    int *troopsa = &skirmish->troopsa;
+    int *troopsb = &skirmish->troopsb;
+    int aloss[DICELANES], bloss[DICELANES]; /* troops lost by each side in each exchange */
+    int enda, endb, lane;
+
+    if (skirmish->starta >= 10 && skirmish->startb >= 10) { /* both sides have at least 10 troops - fight until one has lost half */
+        enda = skirmish->starta/2;
+        endb = skirmish->startb/2;
+    }
+    else { /* one or both sides has less than 10 troops - fight to the death! */
+        enda = 0;
+        endb = 0;
+    }
+    while (*troopsa > enda && *troopsb > endb) { /* skirmish */
+        /* Roll DICELANES exchanges at once and apply them in order until the skirmish ends. */
+#ifdef SCALARDICE
+        roll_exchanges_scalar(&skirmish->stream, skirmish->acount, skirmish->bcount, aloss, bloss);
+#else
+        roll_exchanges(&skirmish->stream, skirmish->acount, skirmish->bcount, aloss, bloss);
+#endif
+        for (lane=0; lane<DICELANES; lane++) {
+            if (*troopsa <= enda || *troopsb <= endb) {
+                break;
+            }
+            *troopsa -= aloss[lane];
+            *troopsb -= bloss[lane];
+        }
+    }
+}
+
+
+
+
+/* Step the game's own xorshift generator, so games never share random state. */
+static unsigned int next_seed(gamestate *game)
+{
+    unsigned int x = game->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    game->seed = x;
+    return x;
+}
+
+
+
+
+static void seed_dice(gamestate *game, dicestream *stream)
+{
+    int lane;
+
+    for (lane=0; lane<DICELANES; lane++) {
+        stream->state[lane] = next_seed(game) | 1; /* xorshift state must be nonzero */
+    }
+}
+
+
+
+
+/*
+ * Roll and sort the dice for DICELANES exchanges at once. Each lane keeps its
+ * own xorshift stream and the dice are ordered with a branchless min/max
+ * network, so every loop below has a fixed trip count and no data-dependent
+ * branches and can be vectorized by the compiler. A side rolling only two dice
+ * gets a zero third die, which never sorts above a real roll.
+ */
+void roll_exchanges(dicestream *stream, int acount, int bcount, int *aloss, int *bloss)
+{
+    int a1[DICELANES], a2[DICELANES], a3[DICELANES];
+    int b1[DICELANES], b2[DICELANES], b3[DICELANES];
+    int *dice[6] = {a1, a2, a3, b1, b2, b3};
+    int athird = (acount == 3), bthird = (bcount == 3);
+    int d, lane, lo, hi;
+
+    /* Roll six dice per lane, each between 1 and 10. */
+    for (d=0; d<6; d++) {
+        for (lane=0; lane<DICELANES; lane++) {
+            unsigned int x = stream->state[lane];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            stream->state[lane] = x;
+            dice[d][lane] = (int)(((unsigned long long)x * 10) >> 32) + 1;
+        }
+    }
+    for (lane=0; lane<DICELANES; lane++) {
+        a3[lane] *= athird;
+        b3[lane] *= bthird;
+    }
+
+    /* Sort each side's three dice into descending order. */
+    for (lane=0; lane<DICELANES; lane++) {
+        lo = a1[lane] < a2[lane] ? a1[lane] : a2[lane];
+        hi = a1[lane] < a2[lane] ? a2[lane] : a1[lane];
+        a1[lane] = hi; a2[lane] = lo;
+        lo = a1[lane] < a3[lane] ? a1[lane] : a3[lane];
+        hi = a1[lane] < a3[lane] ? a3[lane] : a1[lane];
+        a1[lane] = hi; a3[lane] = lo;
+        hi = a2[lane] < a3[lane] ? a3[lane] : a2[lane];
+        a2[lane] = hi;
+
+        lo = b1[lane] < b2[lane] ? b1[lane] : b2[lane];
+        hi = b1[lane] < b2[lane] ? b2[lane] : b1[lane];
+        b1[lane] = hi; b2[lane] = lo;
+        lo = b1[lane] < b3[lane] ? b1[lane] : b3[lane];
+        hi = b1[lane] < b3[lane] ? b3[lane] : b1[lane];
+        b1[lane] = hi; b3[lane] = lo;
+        hi = b2[lane] < b3[lane] ? b3[lane] : b2[lane];
+        b2[lane] = hi;
+    }
+
+    /* Compare the highest and second highest rolls - the lower roll loses a troop, ties lose nothing. */
+    for (lane=0; lane<DICELANES; lane++) {
+        aloss[lane] = (a1[lane] < b1[lane]) + (a2[lane] < b2[lane]);
+        bloss[lane] = (a1[lane] > b1[lane]) + (a2[lane] > b2[lane]);
+    }
+}
+
+
+
+
+/*
+ * The reference for roll_exchanges(): the same DICELANES exchanges from the
+ * same streams, rolled one exchange at a time and sorted with compare-and-swap
+ * as the server first did it. Built in with -DSCALARDICE, and checked against
+ * the lanes by dicebench.
+ */
+void roll_exchanges_scalar(dicestream *stream, int acount, int bcount, int *aloss, int *bloss)
+{
+    die a, b;
+    int rolls[6];
+    int d, lane;
+
+    for (lane=0; lane<DICELANES; lane++) {
+        for (d=0; d<6; d++) { /* a stream's dice come out in the order a1, a2, a3, b1, b2, b3 */
+            unsigned int x = stream->state[lane];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            stream->state[lane] = x;
+            rolls[d] = (int)(((unsigned long long)x * 10) >> 32) + 1;
+        }
+        a.count = acount;
+        a.first = rolls[0];
+        a.second = rolls[1];
+        a.third = (acount == 3) ? rolls[2] : 0;
+        b.count = bcount;
+        b.first = rolls[3];
+        b.second = rolls[4];
+        b.third = (bcount == 3) ? rolls[5] : 0;
+        sort_rolls(&a);
+        sort_rolls(&b);
+        aloss[lane] = 0;
+        bloss[lane] = 0;
+        if (a.first > b.first) { /* compare highest rolls */
+            bloss[lane]++;
+        }
+        else if (a.first < b.first) {
+            aloss[lane]++;
+        }
+        if (a.second > b.second) { /* compare second highest rolls */
+            bloss[lane]++;
+        }
+        else if (a.second < b.second) {
+            aloss[lane]++;
+        }
+    }
+}
+
+
+
+
+static void sort_rolls(die *side)
+{
+    int temp;
+
+    if (side->first < side->second) {
+        temp = side->first;
+        side->first = side->second;
+        side->second = temp;
+    }
+    if (side->first < side->third) {
+        temp = side->first;
+        side->first = side->third;
+        side->third = temp;
+    }
+    if (side->second < side->third) {
+        temp = side->second;
+        side->second = side->third;
+        side->third = temp;
+    }
+}
+
+
+
+
+#ifdef GRIDCHECK
+/* Compare this round's offer lists and attacks against the dense grids. Returns the number of disagreements. */
+int check_grids(gamestate *game)
+{
+    int ally, proposer, player, target, node, found;
+    int mismatches = 0;
+
+    for (ally=0; ally<MAXPLAYERS; ally++) {
+        for (proposer=0; proposer<MAXPLAYERS; proposer++) {
+            found = 0;
+            for (node=game->players[ally].offerhead; node!=NOPLAYER; node=game->players[node].offer.next) {
+                if (node == proposer) {
+                    found = 1;
+                }
+            }
+            if (found != game->offergrid[ally][proposer].used || (found != 0 && game->players[proposer].offer.target != game->offergrid[ally][proposer].target)) {
+                mismatches++;
+            }
+        }
+    }
+    for (player=0; player<MAXPLAYERS; player++) {
+        for (target=0; target<MAXPLAYERS; target++) {
+            if ((game->players[player].attacktarget == target) != (game->attackgrid[player][target] == 1)) {
+                mismatches++;
+            }
+        }
+    }
+    return mismatches;
+}
+
+
+
+
+/*
+ * Fight the battle with do_battle() and, on a copy of the game, with
+ * dense_battle(), and compare each player's troops, standing, knockout and
+ * award, and the seed left for the next battle. Returns the number of
+ * players they disagree on, plus one if the seeds differ.
+ */
+int check_battle(gamestate *game, int workers)
+{
+    gamestate *dense = malloc(sizeof(gamestate));
+    playerinfo *listed, *scanned;
+    int player, mismatches = 0;
+
+    if (dense == NULL) {
+        do_battle(game, workers);
+        return 0;
+    }
+    memcpy(dense, game, sizeof(gamestate));
+    dense_battle(dense);
+    do_battle(game, workers);
+    for (player=0; player<MAXPLAYERS; player++) {
+        listed = &game->players[player];
+        scanned = &dense->players[player];
+        if (listed->troops != scanned->troops || listed->playing != scanned->playing || listed->knockedout != scanned->knockedout || listed->bonus != scanned->bonus) {
+            mismatches++;
+        }
+    }
+    if (game->seed != dense->seed) {
+        mismatches++;
+    }
+    free(dense);
+    return mismatches;
+}
+
+
+
+
+/*
+ * The battle as it was fought before the lists, from the dense attack grid
+ * alone: every pair of players is scanned to split each player's troops
+ * into a battlegrid, with leftover troops to the lowest-numbered opponents,
+ * then each fighting pair is seeded and fought in player order and its
+ * result left in the grid, which is summed for each player's remaining
+ * troops. Knockouts and awards follow the same rules as do_battle().
+ */
+static void dense_battle(gamestate *game)
+{
+    playerinfo *players = game->players;
+    int battlegrid[MAXPLAYERS][MAXPLAYERS] = {{0}}; /* troops each player brings to, and has left from, each skirmish */
+    int opponents, leftover, remaining, player, i;
+    skirmishinfo skirmish;
+
+    /* Distribute each player's troops among their skirmishes. */
+    for (player=0; player<MAXPLAYERS; player++) {
+        players[player].knockedout = 0;
+        players[player].bonus = 0;
+        opponents = 0;
+        for (i=0; i<MAXPLAYERS; i++) {
+            if (game->attackgrid[player][i] == 1 || game->attackgrid[i][player] == 1) {
+                opponents++;
+            }
+        }
+        if (opponents == 0) {
+            continue;
+        }
+        leftover = players[player].troops % opponents;
+        for (i=0; i<MAXPLAYERS; i++) {
+            if (game->attackgrid[player][i] == 1 || game->attackgrid[i][player] == 1) {
+                battlegrid[player][i] = players[player].troops/opponents;
+                if (leftover > 0) {
+                    battlegrid[player][i] += 1;
+                    leftover--;
+                }
+            }
+        }
+    }
+
+    /* Do skirmishes, pair by pair. */
+    for (player=0; player<MAXPLAYERS; player++) {
+        for (i=player+1; i<MAXPLAYERS; i++) {
+            if (game->attackgrid[player][i] == 1 || game->attackgrid[i][player] == 1) {
+                players[player].fighting = 1;
+                players[i].fighting = 1;
+                skirmish.a = player;
+                skirmish.b = i;
+                skirmish.acount = (game->attackgrid[player][i] == 1) ? 3 : 2; /* attacking - 3 rolls, defending - 2 rolls */
+                skirmish.bcount = (game->attackgrid[i][player] == 1) ? 3 : 2;
+                skirmish.starta = battlegrid[player][i];
+                skirmish.startb = battlegrid[i][player];
+                skirmish.troopsa = skirmish.starta;
+                skirmish.troopsb = skirmish.startb;
+                seed_dice(game, &skirmish.stream);
+                fight_skirmish(&skirmish);
+                battlegrid[player][i] = skirmish.troopsa;
+                battlegrid[i][player] = skirmish.troopsb;
+            }
+        }
+    }
+
+    /* Do cleanup. */
+    for (player=0; player<MAXPLAYERS; player++) {
+        if (players[player].playing != 0 && players[player].fighting != 0) {
+            remaining = 0;
+            for (i=0; i<MAXPLAYERS; i++) { /* count up remaining troops */
+                if (battlegrid[player][i] > 0) {
+                    remaining += battlegrid[player][i];
+                }
+            }
+            players[player].troops = remaining;
+            if (remaining <= 0) {
+                players[player].playing = -1;
+                players[player].troops = 0;
+                players[player].knockedout = 1;
+            }
+        }
+    }
+    for (player=0; player<MAXPLAYERS; player++) { /* award new troops to any surviving attacker who contributed to a knockout */
+        for (i=0; i<MAXPLAYERS; i++) {
+            if (game->attackgrid[player][i] == 1 && players[i].knockedout != 0 && players[player].playing > 0) {
+                players[player].bonus = 1;
+                players[player].troops += game->startingforce;
+                if (players[player].troops > MAXTROOPS) {
+                    players[player].troops = MAXTROOPS;
+                }
+            }
+        }
+    }
+    for (player=0; player<MAXPLAYERS; player++) {
+        players[player].fighting = 0;
+    }
+}
+#endif
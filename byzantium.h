@@ -0,0 +1,111 @@
+/* byzantium.h - game engine for Byzantium, shared by the byzantiums server and the byzsim simulator */
+#ifndef BYZANTIUM_H
+#define BYZANTIUM_H
+
+/*------------------------------------------------------------------------
+* Module: byzantium
+*
+* Purpose: hold the rules of Byzantium with no sockets, names, timers or
+* output of any kind. A gamestate is advanced by telling it what each player
+* decided for the round:
+* (1) add_offer() for each APPROACH made in the planning phase
+* (2) add_attack() for each ATTACK made in the action phase
+* (3) do_battle() to resolve the round's skirmishes
+* (4) clear_round() before the next round
+* play_round() does all four from an array of decisions.
+*
+* Player numbers are indexes into gamestate.players, from 0 to MAXPLAYERS-1.
+* The server uses its client numbers as player numbers.
+*
+* Build: compile byzantium.c with the program using it and link -lpthread.
+* Building with -DGRIDCHECK keeps a dense copy of every round's offers and
+* attacks that check_grids() compares against the lists, and keeps the dense
+* battle the lists replaced: check_battle() fights each battle both ways and
+* compares the results. Building with
+* -DSCALARDICE rolls battle dice with roll_exchanges_scalar(), the reference
+* the lanes of roll_exchanges() are checked against by dicebench.
+*
+*------------------------------------------------------------------------
+*/
+
+#define MAXPLAYERS 30 /* maximum number of players in a game */
+#define NOPLAYER MAXPLAYERS /* end-of-list marker for offer lists */
+#define MAXTROOPS 99999 /* most troops a player can hold */
+#define DICELANES 8 /* number of exchanges rolled and sorted together by roll_exchanges() */
+#define MAXSKIRMISHES (MAXPLAYERS*(MAXPLAYERS-1)/2)
+
+typedef struct {
+        unsigned int state[DICELANES];
+    } dicestream;
+
+typedef struct {
+        int target; /* player the proposer wants to attack */
+        int next; /* next proposer with an offer for the same ally, NOPLAYER at end of list */
+    } offerinfo;
+
+typedef struct {
+        int a; /* lower-numbered player */
+        int b; /* higher-numbered player */
+        int acount; /* number of dice rolled by a */
+        int bcount; /* number of dice rolled by b */
+        int starta; /* troops a brought to the skirmish */
+        int startb; /* troops b brought to the skirmish */
+        int troopsa; /* troops a has left */
+        int troopsb; /* troops b has left */
+        dicestream stream; /* dice stream owned by this skirmish */
+    } skirmishinfo;
+
+typedef struct {
+        int playing; /* 1 if playing, -1 if knocked out, 0 if not in the game */
+        int troops;
+        int fighting; /* set during a battle if the player is in a skirmish */
+        int offers; /* number of offers received this round that have not been delivered */
+        int offerhead, offertail; /* offers received this round, in order received */
+        offerinfo offer; /* offer this player made this round (each player makes at most one) */
+        int attacktarget; /* player this player is attacking this round, -1 if none */
+        int knockedout; /* set by do_battle() if the player was knocked out in that battle */
+        int bonus; /* set by do_battle() if the player was awarded troops for a knockout */
+    } playerinfo;
+
+typedef struct {
+        int ally; /* player to make an offer to, -1 for none */
+        int offertarget; /* player the offer proposes to attack */
+        int attack; /* player to attack, -1 to pass */
+    } decision;
+
+typedef struct {
+        playerinfo players[MAXPLAYERS];
+        int startingforce; /* troops each player starts with and is awarded for a knockout */
+        unsigned int seed; /* state used to seed each skirmish's dice */
+        int attackers[MAXPLAYERS]; /* players that attacked this round, in order received */
+        int numattacks; /* number of entries in attackers */
+        skirmishinfo skirmishes[MAXSKIRMISHES]; /* skirmishes fought in the last battle, ordered by player number */
+        int numskirmishes; /* number of entries in skirmishes */
+#ifdef GRIDCHECK
+        struct {
+                int used;
+                int target;
+            } offergrid[MAXPLAYERS][MAXPLAYERS]; /* dense copy of the offers */
+        int attackgrid[MAXPLAYERS][MAXPLAYERS]; /* dense copy of the attacks */
+        int mismatches; /* players play_round()'s battles disagreed with the dense battle on */
+#endif
+    } gamestate;
+
+void init_game(gamestate *game, int startingforce, unsigned int seed);
+void add_player(gamestate *game, int player);
+void remove_player(gamestate *game, int player);
+int  count_players(gamestate *game);
+void add_offer(gamestate *game, int ally, int proposer, int target);
+void add_attack(gamestate *game, int attacker, int target);
+void do_battle(gamestate *game, int workers);
+void clear_round(gamestate *game);
+int  play_round(gamestate *game, decision *decisions);
+void start_battle_workers(int workers);
+void roll_exchanges(dicestream *stream, int acount, int bcount, int *aloss, int *bloss);
+void roll_exchanges_scalar(dicestream *stream, int acount, int bcount, int *aloss, int *bloss);
+#ifdef GRIDCHECK
+int  check_grids(gamestate *game);
+int  check_battle(gamestate *game, int workers);
+#endif
+
+#endif
@@ -1,7 +1,14 @@
 /* byzantiums.c - code for server program that allows clients to chat and play Byzantium with one another */
-#define closesocket close
+#define closesocket(sd) (replaying != 0 ? 0 : close(sd)) /* sockets are placeholders during replay */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -14,16 +21,34 @@
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
+#include <pthread.h>
+#include "byzantium.h"
+#include "logger.h"
+#include "metrics.h"
+#include "handoff.h"
 
 #define PROTOPORT 36724 /* default protocol port number */
+#define SPECPORT 36725 /* default spectator port number */
+#define STATSPORT 36726 /* default stats port number */
 #define QLEN 30 /* size of request queue */
-#define MAXCLIENTS 30 /* maximum allowable number of clients */
+#define MAXCLIENTS MAXPLAYERS /* maximum allowable number of clients - client numbers are player numbers */
 #define BUFSIZE 610  /* server's maximum buffer size */
 #define MAXMESSAGE 480 /* length of maximum allowable message */
 #define NAMESIZE 12 /* length of maximum allowable name */
 #define BODYSIZE 8 /* length of maximum name body */
 #define SUFFIXSIZE 3 /* length of maximum name suffix */
 #define CHATSIZE 80 /* maximum chat message length */
+#define NOTIFYSIZE 64 /* maximum length of one NOTIFY message */
+#define MAXSPECTATORS 10000 /* maximum number of spectators */
+#define SPECRINGSIZE (1<<18) /* bytes of the spectator stream kept for spectators who are behind */
+#define SPECENTRIES 16384 /* message boundaries kept for the spectator stream */
+#define SPECBATCH 512 /* spectators written to per pass of the main loop */
+#define HANDOFF_LISTEN 1 /* handoff record carrying the listening socket */
+#define HANDOFF_SPECLISTEN 2 /* handoff record carrying the spectator listening socket */
+#define HANDOFF_GAME 3 /* handoff record followed by a snapshot of the game and seats */
+#define HANDOFF_CLIENT 4 /* handoff record carrying a client's socket and connection state */
+#define HANDOFF_SPECTATOR 5 /* handoff record carrying a spectator's socket, followed by the rest of its message in progress if it has one */
+#define HANDOFF_DONE 6 /* last handoff record - the replacement answers it with a byte once it has everything */
 
 #define CLEAR 1
 #define NOCLEAR 0 /* indicators for whether a client's info should be cleared on write error */
@@ -35,21 +60,81 @@
 * (1) wait for input from a client or a new client connection
 * (2) receive client messages or accept a new client if MAXCLIENTS is not reached
 * (3) respond appropriately to any client messages
-* (4) implement the game
+* (4) implement the game, using the engine in byzantium.c for the rules
 * (4) go back to step (1)
 *
-* Syntax: byzantiums [-m minplayers] [-l lobbytime] [-t timeout] [-f forcesize]
+* Build: gcc -o byzantiums byzantiums.c byzantium.c logger.c metrics.c handoff.c -lpthread
+* Add -DLOGDEBUG to log every message, move and skirmish, not just
+* connections, strikes, phases and rounds.
+*
+* Syntax: byzantiums [-m minplayers] [-l lobbytime] [-t timeout] [-f forcesize] [-w workers]
+*                   [-j journal] [-R journal] [-S specport] [-M statsport]
+*                   [-s snapshot] [-i interval] [-g grace] [-U path] [-T path]
 *
 * minplayers    minimum number of players needed to start a game
 * lobbytime     number of seconds until game begins if numusers >= minplayers
 * timeout       number of seconds a player has to make a move
 * forcesize 	number of troops each player starts with
+* workers       number of threads used to resolve skirmishes during a battle
+* -j journal    record every input event to the file journal
+* -R journal    replay a journal recorded with -j offline and check that it
+*               produces the same output, then exit
+* specport      port spectators connect to, 0 for no spectators
+* statsport     port on 127.0.0.1 serving metrics in the Prometheus text
+*               format, 0 for none
+* -s snapshot   snapshot the game and seats to the file snapshot, and
+*               start from it if it is there
+* interval      seconds between snapshots
+* grace         seconds a seat loaded from a snapshot is held for its owner
+* -U path       wait on the Unix-domain socket path for a replacement server
+* -T path       take over from the server waiting on path
 *
 * All arguments are optional. The default values are as follows:
 * 	minplayers = 3
 * 	lobbytime = 10
 * 	timeout = 30
 *   forcesize = 1000
+*   workers = number of online processors
+*   specport = 36725
+*   statsport = 36726
+*   interval = 5
+*   grace = 60
+*
+* Spectators connect to specport and only ever receive. Each gets a snapshot
+* of the game, (ssnap(round,phase)(name,strikes,troops,state,...)) where
+* state is 1 playing, 0 waiting or -1 knocked out, and then one
+* (sdelta(round)(attacker,target,...)(name,strikes,troops,state,...)) per
+* round listing the attacks and the players that changed. A new snapshot is
+* sent whenever users join or leave. All spectators are fed from one shared
+* stream, after the players and a batch at a time, so the game never waits
+* on them. A spectator that falls too far behind skips to the latest
+* snapshot. Spectators are not journaled.
+*
+* With -s, the round, the phase, the move being waited on, each seat's name,
+* strikes and plan, and the offers and attacks made so far are snapshotted
+* every interval seconds they have changed - a few kilobytes, written by a
+* forked child - and loaded at startup. The loaded seats are held, with no
+* connection, until a client joins under the same name, which puts it back
+* in its seat and the game, or until grace seconds pass and the seat is
+* given up. The move being waited on is asked for again. A journal recorded
+* by a server that started from a snapshot cannot be replayed.
+*
+* Hot restart: a server started with -U path waits on a Unix-domain
+* socket at path for its replacement. The replacement, started with
+* -T path, connects and is sent the listening sockets, a snapshot of the
+* game and seats laid out as for -s along with how long the current timer
+* has run, then each client's socket with its unparsed input and each
+* spectator's socket. Every seat comes over held and is filled again by
+* its client's socket, so a seat still held in the old server stays held,
+* with its grace started over. Spectators are sent a fresh snapshot once
+* any message they were partway through is finished. The old server
+* closes its stats port first, so the replacement can open it, and exits
+* once the replacement has acknowledged the last record; if the
+* replacement fails before that, it reopens its stats port and carries
+* on. Players see no disconnect and the move being waited on is not asked
+* for again. A journal recorded by a server that took over cannot be
+* replayed. Both servers must be the same build of the handoff record
+* and the snapshot, which the replacement checks by size.
 *
 * Note: The port argument is optional. If no port is specified,
 * the server uses the default given by PROTOPORT.
@@ -60,70 +145,257 @@
 
 /* global variables */
 typedef struct {
-		int used;
-		int joined;
-        int playing;
-        int fighting;
-		int sent;
-        int offersent;
-		char *name;
+		char name[NAMESIZE+1]; /* kept inline so name lookups do not chase a pointer */
+		int namenext; /* next client in the same name bucket, MAXCLIENTS at end of list */
 		int socket;
-		char *clibuf;
 		int charcount;
 		int strikes;
 		int resync;
-        int troops;
+		char *clibuf; /* cold - only touched when the client sends; taken from bufslab on accept */
 		int plangiven;
-		int offers;
 	} clientinfo;
 clientinfo clientarray[MAXCLIENTS]; /* structure to hold client info */
+
+/* Hot per-client flags, kept as bitsets apart from clientarray so that roster scans and broadcasts touch a word per 64 clients and skip empty words. */
+#define SETWORDS ((MAXCLIENTS+63)/64)
+typedef unsigned long long clientset[SETWORDS];
+#define IN_SET(set, i) (((set)[(i)>>6] >> ((i)&63)) & 1ULL)
+#define ADD_TO_SET(set, i) ((set)[(i)>>6] |= 1ULL << ((i)&63))
+#define REMOVE_FROM_SET(set, i) ((set)[(i)>>6] &= ~(1ULL << ((i)&63)))
+clientset usedset, joinedset, offersentset; /* clients connected, joined, and sent an offer this round */
+typedef struct {
+		unsigned long long *set;
+		int word; /* word of set being walked */
+		unsigned long long bits; /* bits of that word not yet visited */
+	} setwalk; /* walk over a clientset - see first_in_set() */
+#define NAMEBUCKETS 64 /* number of name hash buckets - a power of two, at least MAXCLIENTS */
+int namebucket[NAMEBUCKETS]; /* first client in each name bucket, MAXCLIENTS if empty */
+unsigned int sentgen[MAXCLIENTS]; /* chatgen of the last chat message sent to each client */
+unsigned int chatgen = 0; /* number of the chat message being sent - bumped by send_chat() so sentgen never needs clearing */
+
+/* Client receive buffers and read_from_client()'s scratch buffer are carved from one arena allocated at startup, and handed out and taken back through a stack of free buffer numbers, so connecting, disconnecting and receiving never call malloc. */
+#define NUMBUFS (MAXCLIENTS+1) /* a receive buffer per client, plus the scratch buffer */
+typedef struct {
+		char *arena; /* NUMBUFS buffers of BUFSIZE bytes, back to back */
+		int freebufs[NUMBUFS]; /* numbers of the free buffers */
+		int numfree; /* number of entries in freebufs */
+		int inuse; /* buffers handed out and not given back */
+		int peak; /* most buffers ever in use at once */
+		long taken; /* buffers handed out since startup */
+		long returned; /* buffers given back since startup */
+	} bufslab;
+bufslab slab;
+char *scratch; /* read_from_client()'s buffer for the printable part of what was received */
 int numusers = 0; /* total number of users that have joined */
-fd_set total_set, read_set; /* fd_sets to use with select */
+fd_set total_set, read_set, write_set; /* fd_sets to use with select - only the stats port writes through write_set */
 char buf[BUFSIZE]; /* buffer for sending and receiving messages */
 int minplayers = 3; /* minimum number of players needed to start a game - default 3 */
 int lobbytime = 10; /* number of seconds until game begins if numusers >= minplayers - default 10 */
 int timeout = 30; /* number of seconds a player has to make a move - default 30 */
 int startingforce = 1000; /* number of troops each player starts with - default 1000 */
 char listbuf[BUFSIZE]; /* buffer for building user list */
+char notifybuf[MAXCLIENTS*NOTIFYSIZE+1]; /* this round's NOTIFY messages, shared by all users */
+char statbuf[BUFSIZE]; /* sstat message sent to all users at the end of a round */
 
 typedef struct {
-        int used;
-        int target;
-    } offerinfo;
-offerinfo offergrid[MAXCLIENTS][MAXCLIENTS] = {{{0}}}; /* 2-d array for keeping track of offer info */
-int attackgrid[MAXCLIENTS][MAXCLIENTS] = {{0}}; /* 2-d array for keeping track of attack info */
-int battlegrid[MAXCLIENTS][MAXCLIENTS] = {{0}}; /* 2-d array for keeping track of battle info */
-typedef struct {
-        int count;
-        int first;
-        int second;
-        int third;
-    } die;
-die a = {0}; die b = {0}; /* variables for keeping track of dice rolls during battles */
+        int socket;
+        unsigned long long pos; /* stream offset of the next byte to send, always at a message boundary */
+        char *tail; /* rest of a message that was only partly written, NULL if none */
+        int taillen;
+        int tailsent;
+    } spectatorinfo;
+spectatorinfo *spectators = NULL; /* allocated when the spectator port is opened */
+int numspectators = 0; /* number of entries in spectators */
+int speccursor = 0; /* next spectator to write to */
+int specport = SPECPORT; /* port spectators connect to, 0 for none */
+char specring[SPECRINGSIZE]; /* the most recent part of the spectator stream */
+unsigned long long spechead = 0; /* stream offset of the next byte appended */
+unsigned long long specends[SPECENTRIES]; /* stream offsets where recent messages end */
+unsigned long long specentries = 0; /* number of messages appended */
+char snapbuf[MAXCLIENTS*NOTIFYSIZE+64]; /* latest snapshot */
+int snaplen = 0;
+unsigned long long snapat = 0; /* stream offset just after the latest snapshot */
+int specdirty = 1; /* users joined or left since the latest snapshot */
+int specbehind = 0; /* set while some spectators have not been written to since the stream last grew */
+int specvisited = 0; /* spectators written to since the stream last grew */
+int spectroops[MAXCLIENTS], specstrikes[MAXCLIENTS], specplaying[MAXCLIENTS]; /* player values as last sent to spectators */
+long specskips = 0; /* times a spectator skipped to a snapshot */
+
+gamestate game; /* troops, offers and attacks of the game in progress */
+int numworkers = 1; /* number of threads resolving skirmishes, including the main thread */
 int roundnum = 1; int phase = 0; /* variables for keeping track of where we are in the game */
 int waiting = 0; int waitingfor = -1; int responseto = -1; /* variables for keeping track of what message the server is waiting for */
 time_t timestart; /* struct for implementing timeouts */
 int timerset = 0; /* variable for keeping track of whether the timer has been set */ 
 
+#define JOURNALVERSION 1
+#define JOURNALCHUNK (1<<20) /* journal file grows by at least this many bytes at a time */
+#define J_END 0 /* end of journal (zero fill) */
+#define J_ACCEPT 1 /* connection accepted as client_no */
+#define J_REFUSE 2 /* connection refused - no vacancy */
+#define J_DATA 3 /* bytes received from client_no */
+#define J_DROP 4 /* client_no closed its connection */
+#define J_ADVANCE 5 /* game state machine run after a batch of input */
+#define J_TIMER 6 /* a move or lobby timer expired */
+#define J_WRITEFAIL 7 /* write to client_no failed */
+#define J_HASH 8 /* hash of all output so far */
+typedef struct {
+        char magic[4]; /* "BYZJ" */
+        int version;
+        unsigned int seed; /* value passed to srand */
+        int minplayers;
+        int lobbytime;
+        int timeout;
+        int startingforce;
+    } journalheader;
+typedef struct {
+        unsigned char type;
+        unsigned char unused;
+        unsigned short length; /* number of data bytes following the record */
+        int client_no;
+    } journalrecord;
+int journalfd = -1; /* journal being written or replayed, -1 if none */
+char *journalmap = NULL; /* mapping of the journal file */
+size_t journalsize = 0; /* size of the journal file and mapping */
+size_t journalused = 0; /* offset of the next record */
+int replaying = 0; /* set while re-executing a journal */
+unsigned long long outputhash = 14695981039346656037ULL; /* FNV-1a hash of everything written to clients */
+
+#define SNAPSHOTVERSION 1
+typedef struct {
+        char magic[4]; /* "BYZS" */
+        int version;
+        int maxclients; /* MAXCLIENTS of the server that wrote it */
+        int roundnum;
+        int phase;
+        int waitingfor;
+        int responseto;
+        int timerset;
+        clientset joined; /* seats taken */
+        clientset offersent;
+    } snapshotheader;
+typedef struct {
+        char name[NAMESIZE+1];
+        int strikes;
+        int plangiven;
+    } seatinfo; /* what a snapshot keeps of each client - the connection is not kept */
+#define SNAPSHOTSIZE (sizeof(snapshotheader) + MAXCLIENTS*sizeof(seatinfo) + sizeof(gamestate))
+char *snapshotfile = NULL; /* file the state is snapshotted to and loaded from, NULL if none */
+char *snapshottemp = NULL; /* file a snapshot is written to before it is renamed over snapshotfile */
+int snapinterval = 5; /* seconds between snapshots - default 5 */
+int grace = 60; /* seconds a loaded seat is held for its owner to reclaim - default 60 */
+char snapimage[2][SNAPSHOTSIZE]; /* the last snapshot written, and the one being built */
+int snaplength[2] = {0, 0};
+int snapcurrent = 0; /* which of snapimage holds the last snapshot written */
+pid_t snapwriter = 0; /* child writing a snapshot, 0 if none */
+time_t snaptime; /* when the last snapshot was taken */
+time_t loadtime; /* when the snapshot was loaded that seats are held from */
+clientset awayset; /* seats loaded from a snapshot whose owner has not reconnected */
+int numaway = 0; /* number of entries in awayset */
+
+/* A socket as handed to a replacement server - see hand_off() and take_over(). */
+typedef struct {
+        int size; /* sizeof(handoffrecord), to catch a replacement built differently */
+        int kind; /* HANDOFF_LISTEN, HANDOFF_SPECLISTEN, HANDOFF_GAME, HANDOFF_CLIENT, HANDOFF_SPECTATOR or HANDOFF_DONE */
+        int client_no;
+        int charcount;
+        int strikes;
+        int resync;
+        int elapsed; /* seconds the current timer has run, for HANDOFF_GAME */
+        int length; /* bytes of the message after the record - the snapshot, or the rest of a spectator's message */
+        char clibuf[BUFSIZE];
+    } handoffrecord;
+char *handoffpath = NULL; /* where to wait for a replacement, NULL for nowhere */
+char *takeoverpath = NULL; /* where to find the server being replaced, NULL to start afresh */
+int handoffport = -1;
+
+/* Metrics served on the stats port - see register_metrics(). */
+int statsport = STATSPORT;
+int numconnected = 0; /* clients connected, joined or not */
+unsigned long long acceptcount, refusecount, dropcount; /* connections accepted, refused for no vacancy, and dropped for any reason */
+unsigned long long readcount, readbytes; /* recv() calls that returned data, and the bytes they returned */
+unsigned long long chatcount, deliverycount; /* cchat messages sent, and schat messages they were delivered as */
+unsigned long long malformedcount, badintcount, timeoutcount, toolongcount; /* strikes by reason */
+unsigned long long snapshotcount, reclaimcount, releasecount; /* snapshots written, and loaded seats reclaimed or released */
+histogram receivetime; /* from recv() returning to everything received being parsed */
+histogram delivertime; /* handling one cchat, moves to SERVER included */
+histogram plantime, offertime, actiontime, battletime; /* length of each phase of a round */
+histogram roundtime; /* length of a whole round, from entering phase 1 to the end of its battle */
+unsigned long long phasestart, roundbegin; /* when the current phase and round began, from now_micros() */
+
 
 /* helper functions */
 static void initialize_clientinfo(int client_no);
+static inline int first_in_set(setwalk *walk, clientset set);
+static inline int next_in_walk(setwalk *walk);
+static unsigned int hash_name(char *name);
+static void add_name(int client_no);
+static void remove_name(int client_no);
+static int  find_client(char *name);
 static void clear_clientinfo(int client_no);
-static void zero_grids();
+static void init_slab();
+static char *take_buffer();
+static void return_buffer(char *buffer);
+static void log_buffers();
+static void next_offer();
 static void write_to_client(int socket, int client_no, int clear);
+static void writev_to_client(int client_no, struct iovec *iov, int iovcnt);
+static void write_failed(int socket, int client_no);
+static int  send_to_socket(int socket, int client_no, struct iovec *iov, int iovcnt);
+static int  accept_client(int socket);
+static void client_died(int client_no);
+static void client_sent(int client_no);
+static int  advance_game();
+static void game_step();
+static int  timer_expired(int limit);
+static void open_journal(char *path, unsigned int seed);
+static void grow_journal(size_t need);
+static void journal_record(int type, int client_no, const void *data, int length);
+static int  peek_record(journalrecord *record);
+static int  replay_outcome(int type, int client_no);
+static void replay_journal(char *path);
+static int  build_snapshot(char *image);
+static int  copy_game(char *image, int saving);
+static void copy_field(char *image, int *length, void *field, int size, int saving);
+static void save_snapshot();
+static void reap_snapshot();
+static void load_snapshot();
+static int  check_snapshot(char *image, int length);
+static void restore_snapshot(char *image);
+static int  reclaim_seat(int seat, int client_no);
+static void release_seats();
+static void ask_again();
+static int  snapshot_wait();
+static void hand_off(int listensocket, int speclistensocket);
+static int  take_over(char *path, int *speclistensocket);
+static void restore_client(handoffrecord *record, int socket);
+static void restore_spectator(handoffrecord *record, int socket, char *rest);
 static void read_from_client(int socket, int client_no);
 static void parse_message(int client_no);
 static void send_chat(char **message, char **recipients, int client_no);
 static int  find_name_end(char **current);
 static void convert_name(char **name);
-static void assign_name(char **name, int client_no);
+static int  assign_name(char **name, int client_no);
 static void build_user_list_names();
 static void build_user_list();
+static void broadcast_user_list(int except);
 static int  find_right_paren(char **current, int *numchars);
 static void send_strike(int client_no, char reason);
 static void send_notifies();
-static void do_battle();
-static void sort_rolls();
+static void prepare_spectators();
+static int  open_spectator_port();
+static void accept_spectators(int socket);
+static spectatorinfo *add_spectator(int socket);
+static void spectate_round();
+static void publish_snapshot();
+static void append_spectator_stream(const char *message, int length);
+static void give_snapshot(spectatorinfo *spectator);
+static int  write_spectator(spectatorinfo *spectator);
+static void flush_spectators();
+static int  spectator_state(int client_no);
+static void log_battle();
+static unsigned long long end_phase(histogram *hist);
+static void register_metrics();
 
 
 
@@ -133,6 +405,8 @@ static void sort_rolls();
 int main(int argc, char **argv)
 {
 	signal(SIGPIPE, SIG_IGN);
+	log_start(LOGLEVEL);
+	register_metrics();
 
 	//struct hostent *ptrh; /* pointer to a host table entry */
 	struct protoent *ptrp; /* pointer to a protocol table entry */
@@ -146,9 +420,17 @@ int main(int argc, char **argv)
 	selecttime.tv_sec = 0; selecttime.tv_usec = 0; /*initialize timeval struct */
 	FD_ZERO (&total_set); /* initialize fd_set */
 	int i;
+	init_slab();
+	scratch = take_buffer();
 	for (i=0;i<30;i++) { /* initialize client info structure */
 		initialize_clientinfo(i);
 	}
+	for (i=0;i<NAMEBUCKETS;i++) { /* no names yet */
+		namebucket[i] = MAXCLIENTS;
+	}
+    numworkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char *journalfile = NULL; /* file to journal input events to */
+    char *replayfile = NULL; /* journal to replay */
     
     /* Get values from command line. */
     for (i=1;i<argc;i++) {
@@ -164,6 +446,36 @@ int main(int argc, char **argv)
         else if (strcmp(argv[i], "-f") == 0) {
             sscanf(argv[i+1], "%d", &startingforce);
         }
+        else if (strcmp(argv[i], "-w") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &numworkers);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && (i+1) < argc) {
+            journalfile = argv[i+1];
+        }
+        else if (strcmp(argv[i], "-R") == 0 && (i+1) < argc) {
+            replayfile = argv[i+1];
+        }
+        else if (strcmp(argv[i], "-S") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &specport);
+        }
+        else if (strcmp(argv[i], "-M") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &statsport);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+            snapshotfile = argv[i+1];
+        }
+        else if (strcmp(argv[i], "-i") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &snapinterval);
+        }
+        else if (strcmp(argv[i], "-g") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &grace);
+        }
+        else if (strcmp(argv[i], "-U") == 0 && (i+1) < argc) {
+            handoffpath = argv[i+1];
+        }
+        else if (strcmp(argv[i], "-T") == 0 && (i+1) < argc) {
+            takeoverpath = argv[i+1];
+        }
     }
     if (minplayers < 0) {
         minplayers = 3;
@@ -177,11 +489,42 @@ int main(int argc, char **argv)
     if (startingforce < 0) {
         startingforce = 1000;
     }
+    if (numworkers < 1) {
+        numworkers = 1;
+    }
+    if (snapinterval < 1) {
+        snapinterval = 5;
+    }
+    if (grace < 0) {
+        grace = 60;
+    }
 	
-	srand(time(NULL));
+	unsigned int seed = (unsigned int) time(NULL);
+	srand(seed);
+	init_game(&game, startingforce, rand());
+	if (snapshotfile != NULL) {
+		snapshottemp = malloc(strlen(snapshotfile)+5);
+		sprintf(snapshottemp, "%s.tmp", snapshotfile);
+	}
+	if (snapshotfile != NULL && replayfile == NULL && takeoverpath == NULL) { /* a server taking over gets the game from the one it replaces */
+		load_snapshot();
+	}
+	if (journalfile != NULL && replayfile == NULL) {
+		open_journal(journalfile, seed);
+		if (numaway > 0) {
+log_warn("Journal: %s starts from a snapshot and cannot be replayed", journalfile);
+		}
+		else if (takeoverpath != NULL) {
+log_warn("Journal: %s starts from a game taken over and cannot be replayed", journalfile);
+		}
+	}
+	start_battle_workers(numworkers);
 	
 	memset(buf, '\0', BUFSIZE); /* clear read/write buffer */
 	memset(listbuf, '\0', MAXMESSAGE); /* clear user list buffer */
+	if (replayfile != NULL) { /* re-execute a journal offline instead of serving clients - no port is opened, so it runs beside a live server */
+		replay_journal(replayfile);
+	}
 	memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
 	sad.sin_family = AF_INET; /* set family to Internet */
 	sad.sin_addr.s_addr = INADDR_ANY; /* set the local IP address */
@@ -194,535 +537,885 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	
-	/* Map TCP transport protocol name to protocol number */
-	if ( ((long)(ptrp = getprotobyname("tcp"))) == 0) {
-		fprintf(stderr, "cannot map \"tcp\" to protocol number");
-		exit(1);
+	int speclistensocket = -1; /* socket spectators connect to */
+	if (takeoverpath != NULL) { /* take the listening sockets, the game and every client and spectator from the running server */
+		listensocket = take_over(takeoverpath, &speclistensocket);
 	}
+	else {
+		/* Map TCP transport protocol name to protocol number */
+		if ( ((long)(ptrp = getprotobyname("tcp"))) == 0) {
+			fprintf(stderr, "cannot map \"tcp\" to protocol number");
+			exit(1);
+		}
 	
-	/* Create a socket */
-	listensocket = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
-	if (listensocket < 0) {
-		perror ("socket");
-		exit(1);
-	}
+		/* Create a socket */
+		listensocket = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
+		if (listensocket < 0) {
+			perror ("socket");
+			exit(1);
+		}
 	
-	/* Eliminate "Address already in use" error message. */
-	int flag = 1;
-	if (setsockopt(listensocket,SOL_SOCKET,SO_REUSEADDR,&flag,sizeof(int)) == -1) { 
-    	perror("setsockopt"); 
-    	exit(1); 
-	}
+		/* Eliminate "Address already in use" error message. */
+		int flag = 1;
+		if (setsockopt(listensocket,SOL_SOCKET,SO_REUSEADDR,&flag,sizeof(int)) == -1) { 
+	    	perror("setsockopt"); 
+	    	exit(1); 
+		}
 	
-	/* Bind a local address to the socket */
-	if (bind(listensocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
-		perror ("bind");
-		exit(1);
-	}
+		/* Bind a local address to the socket */
+		if (bind(listensocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+			perror ("bind");
+			exit(1);
+		}
 	
-	/* Specify size of request queue */
-	if (listen(listensocket, QLEN) < 0) {
-		perror ("listen");
-		exit(1);
+		/* Specify size of request queue */
+		if (listen(listensocket, QLEN) < 0) {
+			perror ("listen");
+			exit(1);
+		}
 	}
 	FD_SET (listensocket, &total_set);
 	
 	int client_no;
 	
+	if (specport > 0 && speclistensocket < 0) {
+		speclistensocket = open_spectator_port();
+	}
+	if (speclistensocket >= 0) {
+		FD_SET (speclistensocket, &total_set);
+	}
+	if (statsport > 0) {
+		open_stats_port(statsport);
+	}
+	if (handoffpath != NULL) {
+		handoffport = open_handoff_port(handoffpath);
+		if (handoffport < 0) {
+			exit(1);
+		}
+		FD_SET (handoffport, &total_set);
+	}
+	
 	/* Main server loop */
+	int pending = (takeoverpath != NULL); /* set when the game stopped at the end of a round and should continue without waiting - a game taken over may have stopped there */
 	while (1) {
 		read_set = total_set;
-		if (select (FD_SETSIZE, &read_set, NULL, NULL, &selecttime) < 0) {
+		if (pending != 0) { /* keep the game moving */
+			selecttime.tv_sec = 0; selecttime.tv_usec = 0;
+		}
+		else if (timerset != 0) { /* sleep until the current timer can expire */
+			double remaining = (double)(phase == 0 ? lobbytime : timeout) - difftime(time(NULL), timestart);
+			selecttime.tv_sec = (remaining > 0) ? (long)remaining : 0;
+			selecttime.tv_usec = (remaining > 0) ? 0 : 10000;
+		}
+		if (specbehind != 0) { /* keep going until every spectator has had its turn */
+			selecttime.tv_sec = 0; selecttime.tv_usec = 0;
+		}
+		int timed = (pending != 0 || timerset != 0 || specbehind != 0);
+		int wait = snapshot_wait();
+		if (wait >= 0 && (timed == 0 || wait < selecttime.tv_sec)) { /* wake for the next snapshot or held seat release */
+			selecttime.tv_sec = wait; selecttime.tv_usec = 0;
+			timed = 1;
+		}
+		FD_ZERO (&write_set);
+		set_stats_fds(&read_set, &write_set);
+		if (select (FD_SETSIZE, &read_set, &write_set, NULL, timed != 0 ? &selecttime : NULL) < 0) {
 			perror ("select");
 			exit (1);
 		}		
+		serve_stats(&read_set, &write_set); /* takes the stats fds out of read_set */
 		for (i=0; i<FD_SETSIZE; i++) {
 			if (FD_ISSET (i, &read_set)) {
-				if (i == listensocket) {
+				if (i == handoffport) { /* a replacement has come for the sockets */
+					hand_off(listensocket, speclistensocket);
+				}
+				else if (i == speclistensocket) {
+					accept_spectators(speclistensocket);
+				}
+				else if (i == listensocket) {
 					/* connection ready to be accepted */
 					alen = sizeof(cad);
 					if ((tempsd = accept(listensocket, (struct sockaddr *)&cad, &alen)) < 0) {
 						perror ("accept");
 						exit (1);
 					}
-					for (client_no=0; client_no<MAXCLIENTS; client_no++) {
-						if (clientarray[client_no].used == 0)
-						break;
-					}
-					if (client_no < MAXCLIENTS) { /* add new connection to clientarray */
-fprintf (stderr, "Accepted: Client %d\n", client_no);
-						FD_SET (tempsd, &total_set);
-						clientarray[client_no].used = 1;
-						clientarray[client_no].socket = tempsd;
-					}
-					else { /* send no vacancy message and drop connection */
-fprintf (stderr, "Refused: Client %d\n", client_no);
-						sprintf(buf, "(snovac)");
-						write_to_client(tempsd, client_no, NOCLEAR);
-						closesocket(tempsd);
-					}
+					client_no = accept_client(tempsd);
+					journal_record(client_no < MAXCLIENTS ? J_ACCEPT : J_REFUSE, client_no, NULL, 0);
 				}
 				else {
 					/* data available on already-connected socket */
-					int nbytes = recv (i, buf, BUFSIZE, MSG_DONTWAIT);
+					int nbytes;
 					for (client_no=0; client_no<MAXCLIENTS; client_no++) {
 						if (clientarray[client_no].socket == i)
 						break;
 					}
+					if (client_no == MAXCLIENTS) { /* no client owns it - dropped earlier in this pass, or left behind */
+						if (FD_ISSET (i, &total_set)) {
+							closesocket(i);
+							FD_CLR (i, &total_set);
+						}
+						continue;
+					}
+					nbytes = recv (i, buf, BUFSIZE, MSG_DONTWAIT);
 					if (nbytes < 0) {
-fprintf (stderr, "Error: recv on client %d\n", client_no);
+log_error("recv on client %d", client_no);
 					}
 					else if (nbytes == 0) { /* client has died - drop its connection and clear its info */
-						closesocket(i);
-fprintf (stderr, "Dropped: Client %d - died\n", client_no);
-						if (clientarray[client_no].joined != 0) { /* client had joined - send sstat to all users */
-							numusers--;
-							clientarray[client_no].joined = 0;
-							build_user_list();
-							int i;
-							for (i=0; i<MAXCLIENTS; i++) {
-								if (clientarray[i].joined != 0 && i != client_no) {
-									sprintf(buf, "(sstat(%s))", listbuf);
-									write_to_client(clientarray[i].socket, i, CLEAR);
-								}
-							}
-							memset(listbuf, '\0', MAXMESSAGE);
-						}
-						FD_CLR (i, &total_set);
-						clear_clientinfo(client_no);
+						journal_record(J_DROP, client_no, NULL, 0);
+						client_died(client_no);
 					}
 					else { /* transfer data to client's buffer and attempt to parse message */
-						read_from_client(i, client_no);
-                        memset(buf, '\0', BUFSIZE);
-						parse_message(client_no);
-						memset(buf, '\0', BUFSIZE);
+						journal_record(J_DATA, client_no, buf, nbytes);
+						client_sent(client_no);
 					}
 				}
 			}
 		}
-        /* Game logic */
-        if (phase == 0) { /* we are in the lobby */
-            if (timerset != 0) { /* check if timer has been set */
-            	if (numusers >= minplayers) { /* check if minplayers has been met */
-                	if (difftime(time(NULL), timestart) >= (double)lobbytime) { /* check if timer has expired */
-                    	/* Minplayers has been met and lobbytime has expired - enter phase 1. */
-                    	for (i=0; i<MAXCLIENTS; i++) {
-                       		if (clientarray[i].joined != 0) {
-                            	clientarray[i].playing = 1;
-                            	clientarray[i].troops = startingforce;
-                        	}
-                    	}
-                    	timerset = 0;
-                    	phase = 1;
-                    	waitingfor = -1;
-                    	fprintf(stderr, "-------- Phase 1: entering phase 1 --------\n");
+		if (numaway > 0) {
+			release_seats();
+		}
+		journal_record(J_ADVANCE, 0, NULL, 0);
+		pending = advance_game();
+		journal_record(J_HASH, 0, &outputhash, sizeof(outputhash));
+		if (snapshotfile != NULL) {
+			save_snapshot();
+		}
+		if (speclistensocket >= 0) { /* spectators go last, so they never hold up the players */
+			if (specdirty != 0) {
+				publish_snapshot();
+			}
+			flush_spectators();
+		}
+	}
+	
+	exit(0);
+}
+
+
+
+
+/* Add a new connection to clientarray, or send no vacancy message and drop it. Returns the client number, MAXCLIENTS if refused. */
+static int accept_client(int socket)
+{
+	int client_no;
+	for (client_no=0; client_no<MAXCLIENTS; client_no++) {
+		if (IN_SET(usedset, client_no) == 0)
+		break;
+	}
+	if (client_no < MAXCLIENTS) { /* add new connection to clientarray */
+log_info("Accepted: Client %d", client_no);
+		FD_SET (socket, &total_set);
+		ADD_TO_SET(usedset, client_no);
+		clientarray[client_no].socket = socket;
+		clientarray[client_no].clibuf = take_buffer();
+		log_buffers();
+		numconnected++;
+		count_event(&acceptcount);
+	}
+	else { /* send no vacancy message and drop connection */
+log_info("Refused: Client %d", client_no);
+		count_event(&refusecount);
+		sprintf(buf, "(snovac)");
+		write_to_client(socket, client_no, NOCLEAR);
+		closesocket(socket);
+	}
+	return client_no;
+}
+
+
+
+
+/* Client has died - drop its connection and clear its info. */
+static void client_died(int client_no)
+{
+	if (client_no < 0 || client_no >= MAXCLIENTS || IN_SET(usedset, client_no) == 0) { /* not a connected client */
+		return;
+	}
+	int socket = clientarray[client_no].socket;
+	closesocket(socket);
+log_info("Dropped: Client %d - died", client_no);
+	if (IN_SET(joinedset, client_no) != 0) { /* client had joined - send sstat to all users */
+		numusers--;
+		REMOVE_FROM_SET(joinedset, client_no);
+		broadcast_user_list(client_no);
+	}
+	FD_CLR (socket, &total_set);
+	clear_clientinfo(client_no);
+}
+
+
+
+
+/* Transfer the data in buf to the client's buffer and attempt to parse message. */
+static void client_sent(int client_no)
+{
+	unsigned long long received = now_micros();
+	count_event(&readcount);
+	__atomic_fetch_add(&readbytes, strnlen(buf, BUFSIZE), __ATOMIC_RELAXED);
+	read_from_client(clientarray[client_no].socket, client_no);
+	memset(buf, '\0', BUFSIZE);
+	parse_message(client_no);
+	memset(buf, '\0', BUFSIZE);
+	record_value(&receivetime, now_micros() - received);
+}
+
+
+
+
+/*
+ * Run the game until it is waiting on a client or a timer. Returns 1 if it
+ * stopped at the end of a round and should be run again without waiting.
+ */
+static int advance_game()
+{
+	int oldphase, oldwaitingfor, oldresponseto, oldtimerset, oldroundnum;
+	do {
+		oldphase = phase;
+		oldwaitingfor = waitingfor;
+		oldresponseto = responseto;
+		oldtimerset = timerset;
+		oldroundnum = roundnum;
+		game_step();
+		if (oldphase == 3 && phase != 3) { /* round finished */
+			return 1;
+		}
+	} while (phase != oldphase || waitingfor != oldwaitingfor || responseto != oldresponseto || timerset != oldtimerset || roundnum != oldroundnum);
+	return 0;
+}
+
+
+
+
+/* Take one step of the game state machine. */
+static void game_step()
+{
+    int i;
+    
+    if (phase == 0) { /* we are in the lobby */
+        if (timerset != 0) { /* check if timer has been set */
+        	if (numusers >= minplayers) { /* check if minplayers has been met */
+            	if (timer_expired(lobbytime) != 0) { /* check if timer has expired */
+                	/* Minplayers has been met and lobbytime has expired - enter phase 1. */
+                	setwalk walk;
+                	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+                   		add_player(&game, i);
                 	}
-                }
-                else {
                 	timerset = 0;
-                }
+                	phase = 1;
+                	waitingfor = -1;
+                	specdirty = 1;
+                	phasestart = roundbegin = now_micros();
+                	log_info("-------- Phase 1: entering phase 1 --------");
+            	}
             }
             else {
-            	if (numusers >= minplayers) { /* check if minplayers has been met */
-                	/* Minplayers has been met and lobbytime has not been started - start timer. */
-                	fprintf(stderr, "-------- Phase 0: starting countdown --------\n");
-                	time(&timestart);
-                	timerset = 1;
-                }
+            	timerset = 0;
+            }
+        }
+        else {
+        	if (numusers >= minplayers) { /* check if minplayers has been met */
+            	/* Minplayers has been met and lobbytime has not been started - start timer. */
+            	log_info("-------- Phase 0: starting countdown --------");
+            	time(&timestart);
+            	timerset = 1;
             }
         }
-        else if (phase == 1) { /* we are in the planning phase */
-            if (waitingfor < 0) {
-                waitingfor = 0;
+    }
+    else if (phase == 1) { /* we are in the planning phase */
+        if (waitingfor < 0) {
+            waitingfor = 0;
+        }
+        if (waitingfor < MAXCLIENTS) {
+            if (game.players[waitingfor].playing > 0) {
+                if (timerset == 0) {
+                    /* Send PLAN message to waitingfor and start timer. */
+                    log_debug("Sending to %s", clientarray[waitingfor].name);
+                    sprintf(buf, "(schat(SERVER)(PLAN,%d))", roundnum);
+                    write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                    time(&timestart);
+                    timerset = 1;
+                }
+                else { /* check if timer has expired */
+                    if (timer_expired(timeout) != 0) {
+                        /* waitingfor has timed out - send strike and move on to next player. */
+                        send_strike(waitingfor, 't');
+                        log_info("%s timed out", clientarray[waitingfor].name);
+                        waitingfor++;
+                        timerset = 0;
+                    }
+                }
+            }
+            else { /* waitingfor is not playing - move to next client */
+                waitingfor++;
             }
-            if (waitingfor < MAXCLIENTS) {
-                if (clientarray[waitingfor].playing > 0) {
+        }
+        else {
+            /* Phase 1 finished - enter phase 2. */
+            log_info("-------- Phase 2: entering phase 2 --------");
+            phasestart = end_phase(&plantime);
+            waitingfor = -1;
+            phase = 2;
+        }
+    }
+    else if (phase == 2) { /* we are in the offer/response phase */
+        if (waitingfor < 0) {
+            waitingfor = 0;
+        }
+        if (waitingfor < MAXCLIENTS) {
+            if (game.players[waitingfor].playing > 0) { /* check if waitingfor is playing */
+                if (responseto < 0) { /* start at the first offer for waitingfor */
+                    responseto = game.players[waitingfor].offerhead;
+                }
+                if (responseto != NOPLAYER) { /* waitingfor has an offer from responseto */
                     if (timerset == 0) {
-                        /* Send PLAN message to waitingfor and start timer. */
-                        fprintf(stderr, "Sending to %s\n", clientarray[waitingfor].name);
-                        sprintf(buf, "(schat(SERVER)(PLAN,%d))", roundnum);
-                        write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                        /* Send OFFER message to waitingfor, decrement waitingfor's offers, and start timer. */
+                        if (game.players[waitingfor].offers > 1) {
+                            //send offer with OFFER message
+                            log_debug("Sending %s's offer to %s", clientarray[responseto].name, clientarray[waitingfor].name);
+                            ADD_TO_SET(offersentset, waitingfor);
+                            int target = game.players[responseto].offer.target;
+                            sprintf(buf, "(schat(SERVER)(OFFER,%d,%s,%s))", roundnum, clientarray[responseto].name, clientarray[target].name);
+                            write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                            game.players[waitingfor].offers -= 1;
+                        }
+                        else if (game.players[waitingfor].offers == 1) {
+                            //send last offer with OFFERL message
+                            log_debug("Sending %s's offer to %s", clientarray[responseto].name, clientarray[waitingfor].name);
+                            ADD_TO_SET(offersentset, waitingfor);
+                            int target = game.players[responseto].offer.target;
+                            sprintf(buf, "(schat(SERVER)(OFFERL,%d,%s,%s))", roundnum, clientarray[responseto].name, clientarray[target].name);
+                            write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                            game.players[waitingfor].offers -= 1;
+                        }
                         time(&timestart);
                         timerset = 1;
                     }
                     else { /* check if timer has expired */
-                        if (difftime(time(NULL), timestart) >= (double)timeout) {
-                            /* waitingfor has timed out - send strike and move on to next player. */
+                        if (timer_expired(timeout) != 0) {
+                            /* waitingfor has timed out - send strike and move on to next offer. */
                             send_strike(waitingfor, 't');
-                            fprintf(stderr, "%s timed out\n", clientarray[waitingfor].name);
-                            waitingfor++;
+                            log_info("%s has timed out on %s", clientarray[waitingfor].name, clientarray[responseto].name);
+                            next_offer();
                             timerset = 0;
                         }
                     }
                 }
-                else { /* waitingfor is not playing - move to next client */
+                else if (IN_SET(offersentset, waitingfor) == 0) { /* no offers for waitingfor - send empty OFFERL message and move to next client */
+                	log_debug("Sending empty message to %s", clientarray[waitingfor].name);
+                    sprintf(buf, "(schat(SERVER)(OFFERL,%d))", roundnum);
+                    write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                    waitingfor++;
+                    responseto = -1;
+                }
+                else { /* done with offers for waitingfor - reset offersent and responseto and move to next client */
+                    REMOVE_FROM_SET(offersentset, waitingfor);
                     waitingfor++;
+                    responseto = -1;
                 }
             }
-            else {
-                /* Phase 1 finished - enter phase 2. */
-                fprintf(stderr, "-------- Phase 2: entering phase 2 --------\n");
-                waitingfor = -1;
-                phase = 2;
+            else { /* waitingfor is not playing - move to next client */
+                waitingfor++;
+                responseto = -1;
             }
         }
-        else if (phase == 2) { /* we are in the offer/response phase */
-            if (waitingfor < 0) {
-                waitingfor = 0;
-            }
-            if (responseto < 0) {
-                responseto = 0;
-            }
-            if (waitingfor < MAXCLIENTS) {
-                if (responseto < MAXCLIENTS) {
-                    if (clientarray[waitingfor].playing > 0) { /* check if waitingfor is playing */
-                        if (offergrid[waitingfor][responseto].used != 0) { /* check if waitingfor has an offer from responseto */
-                            if (timerset == 0) {
-                                /* Send OFFER message to waitingfor, decrement waitingfor's offers, and start timer. */
-                                if (clientarray[waitingfor].offers > 1) {
-                                    //send offer with OFFER message
-                                    fprintf(stderr, "Sending %s's offer to %s\n", clientarray[responseto].name, clientarray[waitingfor].name);
-                                    clientarray[waitingfor].offersent = 1;
-                                    int target = offergrid[waitingfor][responseto].target;
-                                    sprintf(buf, "(schat(SERVER)(OFFER,%d,%s,%s))", roundnum, clientarray[responseto].name, clientarray[target].name);
-                                    write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
-                                    clientarray[waitingfor].offers -= 1;
-                                }
-                                else if (clientarray[waitingfor].offers == 1) {
-                                    //send last offer with OFFERL message
-                                    fprintf(stderr, "Sending %s's offer to %s\n", clientarray[responseto].name, clientarray[waitingfor].name);
-                                    clientarray[waitingfor].offersent = 1;
-                                    int target = offergrid[waitingfor][responseto].target;
-                                    sprintf(buf, "(schat(SERVER)(OFFERL,%d,%s,%s))", roundnum, clientarray[responseto].name, clientarray[target].name);
-                                    write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
-                                    clientarray[waitingfor].offers -= 1;
-                                }
-                                time(&timestart);
-                                timerset = 1;
-                            }
-                            else { /* check if timer has expired */
-                                if (difftime(time(NULL), timestart) >= (double)timeout) {
-                                    /* waitingfor has timed out - send strike and move on to next offer. */
-                                    send_strike(waitingfor, 't');
-                                    fprintf(stderr, "%s has timed out on %s\n", clientarray[waitingfor].name, clientarray[responseto].name);
-                                    responseto++;
-                                    timerset = 0;
-                                }
-                            }
-                        }
-                        else if (clientarray[waitingfor].offers == 0 && clientarray[waitingfor].offersent == 0) { /* no offers for waitingfor - send empty OFFERL message and move to next client */
-                        	fprintf(stderr, "Sending empty message to %s\n", clientarray[waitingfor].name);
-                            sprintf(buf, "(schat(SERVER)(OFFERL,%d))", roundnum);
-                            write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
-                            waitingfor++;
-                        }
-                        else { /* no offer from responseto - move to next offer */
-                            responseto++;
-                        }
-                    }
-                    else { /* waitingfor is not playing - move to next client */
+        else {
+            /* Phase 2 finished - enter phase 3. */
+            log_info("-------- Phase 3: entering phase 3 --------");
+            phasestart = end_phase(&offertime);
+            waitingfor = -1;
+            phase = 3;
+        }
+    }
+    else if (phase == 3) { /* we are in the action phase */
+        if (waitingfor < 0) {
+            waitingfor = 0;
+        }
+        if (waitingfor < MAXCLIENTS) {
+            if (game.players[waitingfor].playing > 0) {
+                if (timerset == 0) {
+                    /* Send ACTION message to waitingfor and start timer. */
+                    log_debug("Sending to %s", clientarray[waitingfor].name);
+                    sprintf(buf, "(schat(SERVER)(ACTION,%d))", roundnum);
+                    write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
+                    time(&timestart);
+                    timerset = 1;
+                }
+                else { /* check if timer has expired */
+                    if (timer_expired(timeout) != 0) {
+                        /* waitingfor has timed out - send strike and move on to next player. */
+                        send_strike(waitingfor, 't');
+                        log_info("%s has timed out", clientarray[waitingfor].name);
                         waitingfor++;
+                        timerset = 0;
                     }
                 }
-                else { /* done with offers for waitingfor - reset offersent and responseto and move to next client */
-                    clientarray[waitingfor].offersent = 0;
-                    waitingfor++;
-                    responseto = 0;
-                }
             }
-            else {
-                /* Phase 2 finished - enter phase 3. */
-                fprintf(stderr, "-------- Phase 3: entering phase 3 --------\n");
-                waitingfor = -1;
-                phase = 3;
+            else { /* waitingfor is not playing - move to next client */
+                waitingfor++;
             }
         }
-        else if (phase == 3) { /* we are in the action phase */
-            if (waitingfor < 0) {
-                waitingfor = 0;
+        else {
+            /* Phase 3 messages finished - enter battle. */
+            log_info("-------- Phase 3: entering battle --------");
+            phasestart = end_phase(&actiontime);
+            struct timeval roundstart, roundend;
+            gettimeofday(&roundstart, NULL);
+#ifdef GRIDCHECK
+            if (check_grids(&game) > 0) {
+                log_error("offer and attack lists do not match the grids");
             }
-            if (waitingfor < MAXCLIENTS) {
-                if (clientarray[waitingfor].playing > 0) {
-                    if (timerset == 0) {
-                        /* Send ACTION message to waitingfor and start timer. */
-                        fprintf(stderr, "Sending to %s\n", clientarray[waitingfor].name);
-                        sprintf(buf, "(schat(SERVER)(ACTION,%d))", roundnum);
-                        write_to_client(clientarray[waitingfor].socket, waitingfor, CLEAR);
-                        time(&timestart);
-                        timerset = 1;
-                    }
-                    else { /* check if timer has expired */
-                        if (difftime(time(NULL), timestart) >= (double)timeout) {
-                            /* waitingfor has timed out - send strike and move on to next player. */
-                            send_strike(waitingfor, 't');
-                            fprintf(stderr, "%s has timed out\n", clientarray[waitingfor].name);
-                            waitingfor++;
-                            timerset = 0;
-                        }
-                    }
-                }
-                else { /* waitingfor is not playing - move to next client */
-                    waitingfor++;
-                }
+            if (check_battle(&game, numworkers) > 0) {
+                log_error("battle results do not match the dense battle");
             }
-            else {
-                /* Phase 3 messages finished - enter battle. */
-                fprintf(stderr, "-------- Phase 3: entering battle --------\n");
-                send_notifies();
-                do_battle();
-                build_user_list();
-                memset(buf, '\0', BUFSIZE);
-                for (i=0; i<MAXCLIENTS; i++) { /* send sstat to all users */
-                    if (clientarray[i].joined != 0) {
-                        sprintf(buf, "(sstat(%s))", listbuf);
-                        write_to_client(clientarray[i].socket, i, CLEAR);
-                    }
-                }
-                memset(listbuf, '\0', BUFSIZE);
-                zero_grids(); /* zero out offergrid and attackgrid */
-                int numplayers = 0;
-                for (i=0; i<MAXCLIENTS; i++) {
-                    if (clientarray[i].playing > 0) {
-                        numplayers++;
-                    }
+#else
+            do_battle(&game, numworkers);
+#endif
+            log_battle();
+            send_notifies(); /* send NOTIFY messages and sstat to all users */
+            if (specport > 0) { /* only when spectators can connect */
+                spectate_round(); /* queue the round for spectators */
+            }
+            gettimeofday(&roundend, NULL);
+            log_info("Round %d: battle and notifies took %ld us for %d users (%d spectators, %ld skips)", roundnum, (long)(roundend.tv_sec-roundstart.tv_sec)*1000000L + (long)(roundend.tv_usec-roundstart.tv_usec), numusers, numspectators, specskips);
+            clear_round(&game); /* clear this round's offers and attacks */
+            phasestart = end_phase(&battletime);
+            record_value(&roundtime, phasestart - roundbegin);
+            roundbegin = phasestart;
+            int numplayers = count_players(&game);
+            if (numplayers > 1) { /* game is not over - increment roundnum, add any newly joined users, and enter phase 1 */
+                roundnum++;
+                if (roundnum > 99999) {
+                    roundnum = 1;
                 }
-                if (numplayers > 1) { /* game is not over - increment roundnum, add any newly joined users, and enter phase 1 */
-                    roundnum++;
-                    if (roundnum > 99999) {
-                        roundnum = 1;
-                    }
-                    for (i=0; i<MAXCLIENTS; i++) {
-                        if (clientarray[i].joined != 0 && clientarray[i].playing == 0) {
-                            clientarray[i].playing = 1;
-                            clientarray[i].troops = startingforce;
-                        }
+                setwalk walk;
+                for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+                    if (game.players[i].playing == 0) {
+                        add_player(&game, i);
                     }
-                    waitingfor = -1;
-                    phase = 1;
-                    fprintf(stderr, "-------- Phase 1: entering phase 1 --------\n");
                 }
-                else { /* game is over - set roundnum to 1, set all joined users' playing status to 0, enter phase 0 */
-                    roundnum = 1;
-                    for (i=0; i<MAXCLIENTS; i++) {
-                        if (clientarray[i].joined != 0) {
-                            clientarray[i].playing = 0;
-                            clientarray[i].troops = 0;
-                        }
-                    }
-                    waitingfor = -1;
-                    phase = 0;
-                    fprintf(stderr, "-------- Phase 0: entering lobby --------\n");
+                waitingfor = -1;
+                phase = 1;
+                log_info("-------- Phase 1: entering phase 1 --------");
+            }
+            else { /* game is over - set roundnum to 1, set all joined users' playing status to 0, enter phase 0 */
+                roundnum = 1;
+                setwalk walk;
+                for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+                    remove_player(&game, i);
                 }
+                waitingfor = -1;
+                phase = 0;
+                specdirty = 1;
+                log_info("-------- Phase 0: entering lobby --------");
             }
         }
-        else {
-            fprintf(stderr, "Error: phase is out of bounds\n");
-            exit(1);
-        }
+    }
+    else {
+        log_error("phase is out of bounds");
+        exit(1);
+    }
+}
+
+
+
+
+/* Record how long the phase now ending took. Returns the time, for the start of the next. */
+static unsigned long long end_phase(histogram *hist)
+{
+    unsigned long long now = now_micros();
+
+    record_value(hist, now - phasestart);
+    return now;
+}
+
+
+
+
+/* Check whether the current move or lobby timer has run out. */
+static int timer_expired(int limit)
+{
+	if (replaying != 0) {
+		return replay_outcome(J_TIMER, 0);
 	}
-	
-	exit(0);
+	if (difftime(time(NULL), timestart) >= (double)limit) {
+		journal_record(J_TIMER, 0, NULL, 0);
+		return 1;
+	}
+	return 0;
 }
 
 
 
 
+/*
+ * Send the round's results to every joined user. All NOTIFY messages are
+ * formatted once into notifybuf, and each user gets them followed by the
+ * updated sstat in a single writev.
+ */
 static void send_notifies()
 {
-	int attacker, target, user;
+	int attack, attacker, user;
+	int notifylen = 0;
+	struct iovec iov[2];
+	for (attack=0; attack<game.numattacks; attack++) {
+		attacker = game.attackers[attack];
+		notifylen += sprintf(notifybuf+notifylen, "(schat(SERVER)(NOTIFY,%d,%s,%s))", roundnum, clientarray[attacker].name, clientarray[game.players[attacker].attacktarget].name);
+	}
+#ifdef GRIDCHECK
+	/* The dense path: a NOTIFY for every attack found by scanning the grid. The lists send them in the order received, so each is looked for in notifybuf, and the counts compared. */
+	int scanned = 0, target;
+	char dense[NOTIFYSIZE];
+	notifybuf[notifylen] = '\0';
 	for (attacker=0; attacker<MAXCLIENTS; attacker++) {
 		for (target=0; target<MAXCLIENTS; target++) {
-			if (attackgrid[attacker][target] == 1) {
-				for (user=0; user<MAXCLIENTS; user++) {
-					if (clientarray[user].joined != 0) {
-						sprintf(buf, "(schat(SERVER)(NOTIFY,%d,%s,%s))", roundnum, clientarray[attacker].name, clientarray[target].name);
-						write_to_client(clientarray[user].socket, user, CLEAR);
-					}
+			if (game.attackgrid[attacker][target] == 1) {
+				snprintf(dense, NOTIFYSIZE, "(schat(SERVER)(NOTIFY,%d,%s,%s))", roundnum, clientarray[attacker].name, clientarray[target].name);
+				if (strstr(notifybuf, dense) == NULL) {
+					log_error("NOTIFY of %s attacking %s is missing", clientarray[attacker].name, clientarray[target].name);
 				}
+				scanned++;
 			}
 		}
 	}
+	if (scanned != game.numattacks) {
+		log_error("%d NOTIFY messages sent for %d attacks in the grid", game.numattacks, scanned);
+	}
+#endif
+	build_user_list();
+	snprintf(statbuf, BUFSIZE, "(sstat(%s))", listbuf);
+	memset(listbuf, '\0', BUFSIZE);
+	iov[0].iov_base = notifybuf;
+	iov[0].iov_len = notifylen;
+	iov[1].iov_base = statbuf;
+	iov[1].iov_len = strlen(statbuf);
+	setwalk walk;
+	for (user=first_in_set(&walk, joinedset); user<MAXCLIENTS; user=next_in_walk(&walk)) {
+		writev_to_client(user, iov, 2);
+	}
 }
 
 
 
 
-static void do_battle()
+
+/* Make room for spectators. They may use more descriptors than select() can watch, so they are never passed to it. */
+static void prepare_spectators()
 {
-    int opponents = 0;
-    int player = 0;
-    int i;
-    int starta, startb;
-    
-    /* Distribute each player's troops among their skirmishes. */
-    for (player=0; player<MAXCLIENTS; player++) {
-        if (clientarray[player].playing > 0) {
-            for (i=0; i<MAXCLIENTS; i++) {
-                if (attackgrid[player][i] == 1 || attackgrid[i][player] == 1) {
-                    opponents++;
-//fprintf(stderr, "%s is fighting %s\n", clientarray[player].name, clientarray[i].name);
-                }
-            }
-//fprintf(stderr, "%s has %d opponents\n", clientarray[player].name, opponents);
-            if (opponents > 0) {
-                for (i=0; i<MAXCLIENTS; i++) {
-                    if (attackgrid[player][i] == 1 || attackgrid[i][player] == 1) {
-                        battlegrid[player][i] = clientarray[player].troops/opponents;
-                    }
-                }
-                int leftover = clientarray[player].troops % ((clientarray[player].troops/opponents)*opponents);
-                i = 0;
-                while (leftover > 0) {
-                    if (attackgrid[player][i] == 1 || attackgrid[i][player] == 1) {
-                        battlegrid[player][i] += 1;
-                        leftover--;
-                    }
-                    i++;
-                }
-            }
-        }
-        opponents = 0;
-    }
-    
-    /* Do skirmishes. */
-    for (player=0; player<MAXCLIENTS; player++) {
-//if (clientarray[player].playing == 1) fprintf(stderr, "Start: %s: %d\n", clientarray[player].name, clientarray[player].troops);
-        for (i=0; i<MAXCLIENTS; i++) {
-            if (i > player && (attackgrid[player][i] == 1 || attackgrid[i][player] == 1)) {
-            	clientarray[player].fighting = 1;
-            	clientarray[i].fighting = 1;
-                if (attackgrid[player][i] == 1) { /* player is attacking - 3 rolls */
-                    a.count = 3;
-fprintf(stderr, "%s (attacking) vs. %s ", clientarray[player].name, clientarray[i].name);
-                }
-                else if (attackgrid[i][player] == 1) { /* player is not attacking - 2 rolls */
-                    a.count = 2;
-fprintf(stderr, "%s (defending) vs. %s ", clientarray[player].name, clientarray[i].name);
-                }
-                if (attackgrid[i][player] == 1) { /* i is attacking - 3 rolls */
-                    b.count = 3;
-fprintf(stderr, "(attacking)\n");
-                }
-                else if (attackgrid[player][i] == 1) { /* i is not attacking - 2 rolls */
-                    b.count = 2;
-fprintf(stderr, "(defending)\n");
-                }
-                starta = battlegrid[player][i]; // a = player
-                startb = battlegrid[i][player]; // b = i
-fprintf(stderr, "Start: %s: %d, %s: %d\n", clientarray[player].name, battlegrid[player][i], clientarray[i].name, battlegrid[i][player]);
-                if (starta >= 10 && startb >= 10) { /* both sides have at least 10 troops - fight until one has lost half */
-                    starta = starta/2;
-                    startb = startb/2;
-                }
-                else { /* one or both sides has less than 10 troops - fight to the death! */
-                    starta = 0;
-                    startb = 0;
-                }
-                while (battlegrid[player][i] > starta && battlegrid[i][player] > startb) { /* skirmish */
-                    a.first = (rand()%10)+1;
-                    a.second = (rand()%10)+1;
-                    if (a.count == 3) {
-                        a.third = (rand()%10)+1;
-                    }
-                    b.first = (rand()%10)+1;
-                    b.second = (rand()%10)+1;
-                    if (b.count == 3) {
-                        b.third = (rand()%10)+1;
-                    }
-                    sort_rolls();
-                    //compare highest rolls
-                    if (a.first > b.first) {
-                        //b loses a troop
-                        battlegrid[i][player] -= 1;
-                    }
-                    else if (a.first < b.first) {
-                        //a loses a troop
-                        battlegrid[player][i] -= 1;
-                    }
-                    //compare second highest rolls
-                    if (a.second > b.second) {
-                        //b loses a troop
-                        battlegrid[i][player] -= 1;
-                    }
-                    else if (a.second < b.second) {
-                        //a loses a troop
-                        battlegrid[player][i] -= 1;
-                    }
-                }
-fprintf(stderr, "Result: %s: %d, %s: %d\n", clientarray[player].name, battlegrid[player][i], clientarray[i].name, battlegrid[i][player]);
-            }
-        }
-    }
-    
-    /* Do cleanup. */
-    for (player=0; player<MAXCLIENTS; player++) {
-        if (clientarray[player].playing != 0 && clientarray[player].fighting != 0) {
-            int remaining = 0;
-            for (i=0; i<MAXCLIENTS; i++) { /* count up remaining troops */
-                if (battlegrid[player][i] > 0) {
-                    remaining += battlegrid[player][i];
-                }
-            }
-//fprintf(stderr, "Final: %s: %d\n", clientarray[player].name, remaining);
-            clientarray[player].troops = remaining;
-            if (remaining <= 0) {
-fprintf(stderr, "%s was killed!\n", clientarray[player].name);
-                clientarray[player].playing = -1;
-                clientarray[player].troops = 0;
-                int j;
-                for (j=0; j<MAXCLIENTS; j++) { /* award new troops to any who contributed to a knockout */
-                    if (attackgrid[j][player] == 1) {
-fprintf(stderr, "%s got new troops for killing %s\n", clientarray[j].name, clientarray[player].name);
-                        clientarray[j].troops += startingforce;
-                        if (clientarray[j].troops > 99999) {
-                            clientarray[j].troops = 99999;
-                        }
-                    }
-                }
-            }
-        }
-    }
-    for (player=0; player<MAXCLIENTS; player++) {
-    	clientarray[player].fighting = 0;
-    }
+	struct rlimit limit;
+
+	getrlimit(RLIMIT_NOFILE, &limit); /* allow as many descriptors as we are permitted */
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	spectators = malloc(MAXSPECTATORS*sizeof(spectatorinfo));
+}
+
+
+
+
+/* Open the spectator listening port. */
+static int open_spectator_port()
+{
+	struct sockaddr_in sad; /* structure to hold spectator port address */
+	int specsocket, flag = 1;
+
+	prepare_spectators();
+	memset((char *)&sad,0,sizeof(sad));
+	sad.sin_family = AF_INET;
+	sad.sin_addr.s_addr = INADDR_ANY;
+	sad.sin_port = htons((u_short)specport);
+	specsocket = socket(PF_INET, SOCK_STREAM, 0);
+	if (specsocket < 0) {
+		perror ("socket");
+		exit(1);
+	}
+	if (setsockopt(specsocket,SOL_SOCKET,SO_REUSEADDR,&flag,sizeof(int)) == -1) {
+		perror("setsockopt");
+		exit(1);
+	}
+	if (bind(specsocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+		perror ("bind");
+		exit(1);
+	}
+	if (listen(specsocket, SOMAXCONN) < 0) {
+		perror ("listen");
+		exit(1);
+	}
+	fcntl(specsocket, F_SETFL, O_NONBLOCK);
+	return specsocket;
+}
+
+
+
+
+/* Accept every waiting spectator. Each starts with the latest snapshot. */
+static void accept_spectators(int socket)
+{
+	int specsd;
+
+	while ((specsd = accept(socket, NULL, NULL)) >= 0) {
+		add_spectator(specsd);
+	}
+}
+
+
+
+
+/* Add a spectator on socket, starting it with the latest snapshot, or drop it if there is no room. Returns the spectator, NULL if dropped. */
+static spectatorinfo *add_spectator(int socket)
+{
+	spectatorinfo *spectator;
+	int specsd = fcntl(socket, F_DUPFD, FD_SETSIZE); /* keep descriptors select() can watch free for players */
+
+	close(socket);
+	if (specsd < 0 || numspectators >= MAXSPECTATORS) {
+log_info("Refused: spectator - no vacancy");
+		if (specsd >= 0) {
+			close(specsd);
+		}
+		return NULL;
+	}
+	fcntl(specsd, F_SETFL, O_NONBLOCK);
+	shutdown(specsd, SHUT_RD); /* spectators have nothing to say */
+	spectator = &spectators[numspectators];
+	spectator->socket = specsd;
+	spectator->tail = NULL;
+	if (specdirty != 0) {
+		publish_snapshot();
+	}
+	give_snapshot(spectator);
+	numspectators++;
+	specvisited = 0;
+	specbehind = 1;
+	return spectator;
+}
+
+
+
+
+/* Append this round's attacks and the players whose standing changed to the spectator stream. */
+static void spectate_round()
+{
+	char delta[MAXCLIENTS*NOTIFYSIZE*2+64];
+	int length, attack, attacker, player, state, first;
+
+	length = sprintf(delta, "(sdelta(%d)(", roundnum);
+	for (attack=0; attack<game.numattacks; attack++) {
+		attacker = game.attackers[attack];
+		length += sprintf(delta+length, "%s%s,%s", attack > 0 ? "," : "", clientarray[attacker].name, clientarray[game.players[attacker].attacktarget].name);
+	}
+	length += sprintf(delta+length, ")(");
+	first = 1;
+	setwalk walk;
+	for (player=first_in_set(&walk, joinedset); player<MAXCLIENTS; player=next_in_walk(&walk)) {
+		state = spectator_state(player);
+		if (game.players[player].troops != spectroops[player] || clientarray[player].strikes != specstrikes[player] || state != specplaying[player]) {
+			length += sprintf(delta+length, "%s%s,%d,%d,%d", first != 0 ? "" : ",", clientarray[player].name, clientarray[player].strikes, game.players[player].troops, state);
+			spectroops[player] = game.players[player].troops;
+			specstrikes[player] = clientarray[player].strikes;
+			specplaying[player] = state;
+			first = 0;
+		}
+	}
+	length += sprintf(delta+length, "))");
+	append_spectator_stream(delta, length);
+}
+
+
+
+
+/* Build a snapshot of every joined user and append it to the spectator stream. Spectators who are new or behind start here. */
+static void publish_snapshot()
+{
+	int player, first = 1;
+
+	snaplen = sprintf(snapbuf, "(ssnap(%d,%d)(", roundnum, phase);
+	setwalk walk;
+	for (player=first_in_set(&walk, joinedset); player<MAXCLIENTS; player=next_in_walk(&walk)) {
+		spectroops[player] = game.players[player].troops;
+		specstrikes[player] = clientarray[player].strikes;
+		specplaying[player] = spectator_state(player);
+		snaplen += sprintf(snapbuf+snaplen, "%s%s,%d,%d,%d", first != 0 ? "" : ",", clientarray[player].name, specstrikes[player], spectroops[player], specplaying[player]);
+		first = 0;
+	}
+	snaplen += sprintf(snapbuf+snaplen, "))");
+	specdirty = 0;
+	append_spectator_stream(snapbuf, snaplen);
+	snapat = spechead;
+}
+
+
+
+
+static void append_spectator_stream(const char *message, int length)
+{
+	int offset = (int)(spechead % SPECRINGSIZE);
+	int first = (length < SPECRINGSIZE - offset) ? length : SPECRINGSIZE - offset;
+
+	memcpy(specring + offset, message, first);
+	memcpy(specring, message + first, length - first);
+	spechead += length;
+	specends[specentries % SPECENTRIES] = spechead;
+	specentries++;
+	if (spechead - snapat > SPECRINGSIZE/2) { /* keep the latest snapshot's catch-up point inside the ring */
+		specdirty = 1;
+	}
+	specvisited = 0;
+	specbehind = (numspectators > 0); /* with nobody watching there is nothing to flush */
+}
+
+
+
+
+/* Start a spectator over from the latest snapshot. */
+static void give_snapshot(spectatorinfo *spectator)
+{
+	free(spectator->tail);
+	spectator->tail = malloc(snaplen);
+	memcpy(spectator->tail, snapbuf, snaplen);
+	spectator->taillen = snaplen;
+	spectator->tailsent = 0;
+	spectator->pos = snapat;
+}
+
+
+
+
+/*
+ * Send a spectator whatever it has not yet received, without blocking.
+ * Returns 1 if it is caught up, 0 if it cannot take more yet and -1 if the
+ * connection failed.
+ */
+static int write_spectator(spectatorinfo *spectator)
+{
+	struct iovec iov[2];
+	unsigned long long end;
+	int n, offset, entry;
+
+	while (1) {
+		if (spectator->tail != NULL) { /* finish the message in progress first */
+			n = send(spectator->socket, spectator->tail + spectator->tailsent, spectator->taillen - spectator->tailsent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0) {
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			}
+			spectator->tailsent += n;
+			if (spectator->tailsent < spectator->taillen) {
+				return 0;
+			}
+			free(spectator->tail);
+			spectator->tail = NULL;
+		}
+		if (spechead - spectator->pos <= SPECRINGSIZE) {
+			break;
+		}
+		/* Too far behind - what it needs next has been overwritten, so skip to the latest snapshot. */
+		if (spechead - snapat > SPECRINGSIZE) {
+			publish_snapshot();
+		}
+		give_snapshot(spectator);
+		specskips++;
+	}
+	if (spectator->pos == spechead) {
+		return 1;
+	}
+
+	offset = (int)(spectator->pos % SPECRINGSIZE);
+	iov[0].iov_base = specring + offset;
+	iov[0].iov_len = (spechead - spectator->pos < (unsigned long long)(SPECRINGSIZE - offset)) ? spechead - spectator->pos : SPECRINGSIZE - offset;
+	iov[1].iov_base = specring;
+	iov[1].iov_len = (spechead - spectator->pos) - iov[0].iov_len;
+	n = writev(spectator->socket, iov, 2);
+	if (n < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	spectator->pos += n;
+	if (spectator->pos == spechead) {
+		return 1;
+	}
+
+	/* Partly written - keep the rest of the current message so the spectator can skip ahead later at a message boundary. */
+	end = spechead;
+	for (entry=1; entry<=SPECENTRIES && (unsigned long long)entry<=specentries; entry++) {
+		if (specends[(specentries - entry) % SPECENTRIES] <= spectator->pos) {
+			break;
+		}
+		end = specends[(specentries - entry) % SPECENTRIES];
+	}
+	if (end > spectator->pos) {
+		spectator->taillen = (int)(end - spectator->pos);
+		spectator->tailsent = 0;
+		spectator->tail = malloc(spectator->taillen);
+		for (n=0; n<spectator->taillen; n++) {
+			spectator->tail[n] = specring[(spectator->pos + n) % SPECRINGSIZE];
+		}
+		spectator->pos = end;
+	}
+	return 0;
+}
+
+
+
+
+/* Write to the next batch of spectators, dropping any whose connection failed. Spectators that cannot take more are retried on a later pass. */
+static void flush_spectators()
+{
+	int count;
+
+	for (count=0; count<SPECBATCH && specvisited<numspectators; count++) {
+		if (speccursor >= numspectators) {
+			speccursor = 0;
+		}
+		if (write_spectator(&spectators[speccursor]) < 0) {
+			close(spectators[speccursor].socket);
+			free(spectators[speccursor].tail);
+			spectators[speccursor] = spectators[--numspectators];
+			continue;
+		}
+		speccursor++;
+		specvisited++;
+	}
+	specbehind = (specvisited < numspectators);
+}
+
+
+
+
+static int spectator_state(int client_no)
+{
+	if (game.players[client_no].playing > 0) {
+		return 1;
+	}
+	return (game.players[client_no].playing < 0) ? -1 : 0;
 }
 
 
 
 
-static void sort_rolls()
+/* Log the skirmishes, knockouts and awards of the battle just fought. */
+static void log_battle()
 {
-    int temp;
+    int attack, attacker, target, player;
     
-    if (a.first < a.second) {
-        temp = a.first;
-        a.first = a.second;
-        a.second = temp;
-    }
-    if (a.first < a.third) {
-        temp = a.first;
-        a.first = a.third;
-        a.third = temp;
-    }
-    if (a.second < a.third) {
-        temp = a.second;
-        a.second = a.third;
-        a.third = temp;
-    }
-    if (b.first < b.second) {
-        temp = b.first;
-        b.first = b.second;
-        b.second = temp;
+#ifdef LOGDEBUG
+    int i;
+    skirmishinfo *skirmish;
+    for (i=0; i<game.numskirmishes; i++) {
+        skirmish = &game.skirmishes[i];
+log_debug("%s (%s) vs. %s (%s)", clientarray[skirmish->a].name, skirmish->acount == 3 ? "attacking" : "defending", clientarray[skirmish->b].name, skirmish->bcount == 3 ? "attacking" : "defending");
+log_debug("Start: %s: %d, %s: %d", clientarray[skirmish->a].name, skirmish->starta, clientarray[skirmish->b].name, skirmish->startb);
+log_debug("Result: %s: %d, %s: %d", clientarray[skirmish->a].name, skirmish->troopsa, clientarray[skirmish->b].name, skirmish->troopsb);
     }
-    if (b.first < b.third) {
-        temp = b.first;
-        b.first = b.third;
-        b.third = temp;
+#endif
+    for (player=0; player<MAXCLIENTS; player++) {
+        if (game.players[player].knockedout != 0) {
+log_info("%s was killed!", clientarray[player].name);
+        }
     }
-    if (b.second < b.third) {
-        temp = b.second;
-        b.second = b.third;
-        b.third = temp;
+    for (attack=0; attack<game.numattacks; attack++) {
+        attacker = game.attackers[attack];
+        target = game.players[attacker].attacktarget;
+        if (game.players[attacker].bonus != 0 && game.players[target].knockedout != 0) {
+log_info("%s got new troops for killing %s", clientarray[attacker].name, clientarray[target].name);
+        }
     }
 }
 
@@ -733,7 +1426,7 @@ static void sort_rolls()
 
 void read_from_client(int socket, int client_no)
 {
-	char *tempstart = malloc(BUFSIZE*sizeof(char));
+	char *tempstart = scratch;
 	char *tempend = tempstart;
 	char *tempbufp = buf;
 	int numchars = clientarray[client_no].charcount;
@@ -748,7 +1441,6 @@ void read_from_client(int socket, int client_no)
 	*tempend = '\0';
 	strncat(clientarray[client_no].clibuf, tempstart, BUFSIZE-clientarray[client_no].charcount);
     clientarray[client_no].charcount = numchars;
-	free(tempstart);
 }
 
 
@@ -758,10 +1450,10 @@ void read_from_client(int socket, int client_no)
 
 static void parse_message(int client_no)
 {
-    char *tempbufp = clientarray[client_no].clibuf;
+    char *tempbufp = clientarray[client_no].clibuf; /* walks clibuf - what is left is moved down to its start, so copies overlap and use memmove */
     int numchars;
     
-fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf, client_no);
+log_debug("Message: '%s' from client %d", clientarray[client_no].clibuf, client_no);
     
     if (clientarray[client_no].resync == 0) { /* not resychronizing - parse normally */
         numchars = 0;
@@ -770,8 +1462,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                 return;
             }
             send_strike(client_no, 'm');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 clientarray[client_no].charcount = 0;
                 parse_message(client_no);
             }
@@ -783,8 +1475,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                 return;
             }
             send_strike(client_no, 'm');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 clientarray[client_no].charcount = 0;
                 parse_message(client_no);
             }
@@ -811,9 +1503,9 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                             }
                             else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                 send_strike(client_no, 'l');
-                                if (clientarray[client_no].used != 0) {
+                                if (IN_SET(usedset, client_no) != 0) {
                                 	clientarray[client_no].resync = 1;
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -828,9 +1520,9 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                 }
                                 else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                     send_strike(client_no, 'l');
-                                    if (clientarray[client_no].used != 0) {
+                                    if (IN_SET(usedset, client_no) != 0) {
                                     	clientarray[client_no].resync = 1;
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -839,8 +1531,11 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                 tempbufp++;
                                 if (*tempbufp == ')') { /* proper cchat - send to valid recipients */
 //fprintf (stderr, "Cchat: client %d\n", client_no);
-									if (clientarray[client_no].joined != 0) {
+									if (IN_SET(joinedset, client_no) != 0) {
+										unsigned long long chatstart = now_micros();
+										count_event(&chatcount);
 										send_chat(&message, &recipients, client_no);
+										record_value(&delivertime, now_micros() - chatstart);
 									}
 									else {
 //fprintf(stderr, "Not joined\n");
@@ -853,7 +1548,7 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                         return;
                                     }
                                     else {
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -864,8 +1559,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                 else { /* message malformed - send strike and resynchronize */
 //fprintf(stderr, "No ')'\n");
                                     send_strike(client_no, 'm');
-                                    if (clientarray[client_no].used != 0) {
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -877,8 +1572,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                             else {
 //fprintf(stderr, "No second '('\n");
                                 send_strike(client_no, 'm');
-                                if (clientarray[client_no].used != 0) {
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                if (IN_SET(usedset, client_no) != 0) {
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -890,8 +1585,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                         else {
 //fprintf(stderr, "No first '('\n");
                             send_strike(client_no, 'm');
-                            if (clientarray[client_no].used != 0) {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -903,8 +1598,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                     else {
 //fprintf(stderr, "No 't'\n");
                         send_strike(client_no, 'm');
-                        if (clientarray[client_no].used != 0) {
-                            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             clientarray[client_no].charcount = 0;
                             parse_message(client_no);
                         }
@@ -916,8 +1611,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                 else {
 //fprintf(stderr, "No 'a'\n");
                     send_strike(client_no, 'm');
-                    if (clientarray[client_no].used != 0) {
-                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         clientarray[client_no].charcount = 0;
                         parse_message(client_no);
                     }
@@ -929,8 +1624,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
             else {
 //fprintf(stderr, "No 'h'\n");
                 send_strike(client_no, 'm');
-                if (clientarray[client_no].used != 0) {
-                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     clientarray[client_no].charcount = 0;
                     parse_message(client_no);
                 }
@@ -956,9 +1651,9 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                             }
                             else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                 send_strike(client_no, 'l');
-                                if (clientarray[client_no].used != 0) {
+                                if (IN_SET(usedset, client_no) != 0) {
                                 	clientarray[client_no].resync = 1;
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -966,16 +1661,15 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                             numchars++;
                             tempbufp++;
                             if (*tempbufp == ')') { /* proper cjoin - apply naming algorithm if necessary and assign name */
-fprintf (stderr, "Cjoin: client %d - ", client_no);
-                            	if (clientarray[client_no].joined == 0) {
-fprintf (stderr, "new user\n");
-                                	assign_name(&name, client_no);
+                            	if (IN_SET(joinedset, client_no) == 0) {
+log_debug("Cjoin: client %d - new user", client_no);
+                                	client_no = assign_name(&name, client_no); /* a client taking back a held seat moves to it */
                                 }
                                 else {
-fprintf (stderr, "already joined\n");
+log_debug("Cjoin: client %d - already joined", client_no);
 									send_strike(client_no, 'm');
                                 }
-fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name);
+log_info("Name: client %d: %s", client_no, clientarray[client_no].name);
                             	tempbufp++;
                             	if (*tempbufp == '\0') {
                                 	memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
@@ -983,7 +1677,7 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                                 	return;
                             	}
                             	else {
-                                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 	clientarray[client_no].charcount = 0;
                                 	parse_message(client_no);
                             	}
@@ -993,8 +1687,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                         	}
                         	else { /* message malformed - send strike and resynchronize */
                             	send_strike(client_no, 'm');
-                            	if (clientarray[client_no].used != 0) {
-                                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            	if (IN_SET(usedset, client_no) != 0) {
+                                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 	clientarray[client_no].charcount = 0;
                                 	parse_message(client_no);
                             	}
@@ -1005,8 +1699,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                     	}
                     	else {
                         	send_strike(client_no, 'm');
-                        	if (clientarray[client_no].used != 0) {
-                            	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        	if (IN_SET(usedset, client_no) != 0) {
+                            	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             	clientarray[client_no].charcount = 0;
                             	parse_message(client_no);
                         	}
@@ -1017,8 +1711,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                 	}
                  	else {
                     	send_strike(client_no, 'm');
-                    	if (clientarray[client_no].used != 0) {
-                        	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    	if (IN_SET(usedset, client_no) != 0) {
+                        	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         	clientarray[client_no].charcount = 0;
                         	parse_message(client_no);
                     	}
@@ -1029,8 +1723,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
             	}
             	else {
                 	send_strike(client_no, 'm');
-                	if (clientarray[client_no].used != 0) {
-                    	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                	if (IN_SET(usedset, client_no) != 0) {
+                    	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     	clientarray[client_no].charcount = 0;
                     	parse_message(client_no);
                 	}
@@ -1041,8 +1735,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
         	}
         	else {
             	send_strike(client_no, 'm');
-           		if (clientarray[client_no].used != 0) {
-                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+           		if (IN_SET(usedset, client_no) != 0) {
+                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 	clientarray[client_no].charcount = 0;
                 	parse_message(client_no);
             	}
@@ -1057,9 +1751,9 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                     if (*tempbufp == 't') {
                         tempbufp++;
                         if (*tempbufp == ')') { /* proper cstat - respond with sstat */
-fprintf (stderr, "Cstat: client %d\n", client_no);
-							if (clientarray[client_no].joined != 0) {
-fprintf (stderr, "Sending sstat to client %d\n", client_no);
+log_debug("Cstat: client %d", client_no);
+							if (IN_SET(joinedset, client_no) != 0) {
+log_debug("Sending sstat to client %d", client_no);
                             	build_user_list();
                             	sprintf(buf, "(sstat(%s))", listbuf);
                             	memset(listbuf, '\0', MAXMESSAGE);
@@ -1075,7 +1769,7 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
                                 return;
                             }
                             else {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -1085,8 +1779,8 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
                         }
                         else { /* message malformed - send strike and resynchronize */
                             send_strike(client_no, 'm');
-                            if (clientarray[client_no].used != 0) {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -1097,8 +1791,8 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
                     }
                     else {
                         send_strike(client_no, 'm');
-                        if (clientarray[client_no].used != 0) {
-                            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             clientarray[client_no].charcount = 0;
                             parse_message(client_no);
                         }
@@ -1109,8 +1803,8 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
                 }
                 else {
                     send_strike(client_no, 'm');
-                    if (clientarray[client_no].used != 0) {
-                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         clientarray[client_no].charcount = 0;
                         parse_message(client_no);
                     }
@@ -1121,8 +1815,8 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
             }
             else {
                 send_strike(client_no, 'm');
-                if (clientarray[client_no].used != 0) {
-                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     clientarray[client_no].charcount = 0;
                     parse_message(client_no);
                 }
@@ -1133,8 +1827,8 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
     	}
     	else {
         	send_strike(client_no, 'm');
-        	if (clientarray[client_no].used != 0) {
-            	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+        	if (IN_SET(usedset, client_no) != 0) {
+            	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
             	clientarray[client_no].charcount = 0;
             	parse_message(client_no);
        		}
@@ -1156,14 +1850,14 @@ fprintf (stderr, "Sending sstat to client %d\n", client_no);
         }
         if (success != 0) {
             clientarray[client_no].resync = 0;
-            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
             clientarray[client_no].charcount = 0;
             parse_message(client_no);
         }
         else if (numchars > MAXMESSAGE) { /* exceeded max message length - send strike and resynchronize */
             send_strike(client_no, 'l');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 clientarray[client_no].charcount = 0;
                 parse_message(client_no);
             }
@@ -1223,10 +1917,12 @@ static void send_chat(char **message, char **recipients, int client_no)
             /* Cchat to ANY - send to valid user. */
 			if (numusers > 1) {
 				if (numusers == 2) {
-					for (i=0; i<MAXCLIENTS; i++) {
-						if (i != client_no && clientarray[i].joined != 0) {
+					setwalk walk;
+					for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+						if (i != client_no) {
 							sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
 							write_to_client(clientarray[i].socket, i, CLEAR);
+							count_event(&deliverycount);
 						}
 					}
 				}
@@ -1235,23 +1931,24 @@ static void send_chat(char **message, char **recipients, int client_no)
 					int i = client_no;
 					while(numhops > 0) {
 						i = (i+1) % MAXCLIENTS;
-						if (clientarray[i].joined != 0) {
+						if (IN_SET(joinedset, i) != 0) {
 							numhops--;
 						}
 					}
 					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
 					write_to_client(clientarray[i].socket, i, CLEAR);
+					count_event(&deliverycount);
 				}
 			}
 			return;
 		}
 		else if (strcasecmp("ALL", namestart) == 0) {
             /* Cchat to ALL - send to all users. */
-			for (i=0; i<MAXCLIENTS; i++) {
-				if (clientarray[i].joined != 0) {
-					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-					write_to_client(clientarray[i].socket, i, CLEAR);
-				}
+			setwalk walk;
+			for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+				sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
+				write_to_client(clientarray[i].socket, i, CLEAR);
+				count_event(&deliverycount);
 			}
 			return;
 		}
@@ -1260,7 +1957,7 @@ static void send_chat(char **message, char **recipients, int client_no)
             // Process SERVER message.
             if (client_no != waitingfor) {
                 // Not expecting a SERVER message from this client - strike and return.
-fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, client_no);
+log_debug("SERVER: waiting for %d, got message from %d", waitingfor, client_no);
                 send_strike(client_no, 'm');
                 return;
             }
@@ -1303,7 +2000,7 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                     *fieldend = '\0';
                     if (result == -1 && strcmp("PASS", fieldstart) == 0) { // check for PASS action
                         // Player passes - increment waitingfor, reset timer, and return.
-                        fprintf(stderr, "PASS: %s\n", clientarray[client_no].name);
+                        log_debug("PASS: %s", clientarray[client_no].name);
                         waitingfor++;
                         timerset = 0;
                         return;
@@ -1327,10 +2024,6 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                             }
                         }
                         if (ally < MAXCLIENTS) { // check for valid ally (message ignored if ally = self)
-                            if (ally != client_no) {
-                                offergrid[ally][client_no].used = 1;
-                                clientarray[ally].offers += 1;
-                            }
                             fieldend++;
                             fieldstart = fieldend;
                             result = find_name_end(&fieldend);
@@ -1347,28 +2040,20 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                                     break;
                                 }
                             }
-                            if (target < MAXCLIENTS && clientarray[target].used != 0) { // check for valid target
-                                // Player has made a valid offer - add info to offergrid, increment waitingfor, reset timer, and return.
+                            if (target < MAXCLIENTS && IN_SET(usedset, target) != 0) { // check for valid target
+                                // Player has made a valid offer - add it to ally's offers, increment waitingfor, reset timer, and return.
                                 if (ally != client_no) {
-                                    fprintf(stderr, "APPROACH: %s to %s, attacking %s\n", clientarray[client_no].name, clientarray[ally].name, clientarray[target].name);
-                                    offergrid[ally][client_no].target = target;
-//fprintf(stderr, "offergrid[ally][client_no].used = %d\n", offergrid[ally][client_no].used);
-//fprintf(stderr, "offergrid[ally][client_no].target = %d\n", offergrid[ally][client_no].target);
+                                    log_debug("APPROACH: %s to %s, attacking %s", clientarray[client_no].name, clientarray[ally].name, clientarray[target].name);
+                                    add_offer(&game, ally, client_no, target);
                                 }
                                 else {
-                                    fprintf(stderr, "APPROACH: %s to self, attacking %s\n", clientarray[client_no].name, clientarray[target].name);
-//fprintf(stderr, "offergrid[ally][client_no].used = %d\n", offergrid[ally][client_no].used);
-//fprintf(stderr, "offergrid[ally][client_no].target = %d\n", offergrid[ally][client_no].target);
+                                    log_debug("APPROACH: %s to self, attacking %s", clientarray[client_no].name, clientarray[target].name);
                                 }
                                 waitingfor++;
                                 timerset = 0;
                                 return;
                             }
-                            else { // invalid target - erase any changes to offergrid, strike, increment waitingfor, reset timer, and return
-                                if (ally != client_no) {
-                                    offergrid[ally][client_no].used = 0;
-                                    clientarray[ally].offers -= 1;
-                                }
+                            else { // invalid target - strike, increment waitingfor, reset timer, and return
                                 send_strike(client_no, 'm');
                                 waitingfor++;
                                 timerset = 0;
@@ -1397,6 +2082,10 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                 }
             }
             else if (phase == 2) {
+                if (responseto < 0 || responseto == NOPLAYER) { // no offer outstanding - strike and return
+                    send_strike(client_no, 'm');
+                    return;
+                }
                 if (strcmp("ACCEPT", fieldstart) == 0 || strcmp("DECLINE", fieldstart) == 0) { // look for ACCEPT or DECLINE type message
                     char *action = fieldstart;
                     fieldend++;
@@ -1405,20 +2094,20 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                     *fieldend = '\0';
                     if (result != 1) { // not enough fields - strike, increment responseto, reset timer, and return
                         send_strike(client_no, 'm');
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
                     int givenround = (int) strtol(fieldstart, NULL, 10); // look for correct round number
                     if (givenround > 99999) { // badint - strike, increment responseto, reset timer, and return
                         send_strike(client_no, 'b');
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
                     else if (givenround != roundnum) { // client has wrong round number - strike, increment responseto, reset timer, and return
                         send_strike(client_no, 'm');
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
@@ -1428,7 +2117,7 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                     *fieldend = '\0';
                     if (result != -1) { // too many fields - strike, increment responseto, reset timer, and return
                         send_strike(client_no, 'm');
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
@@ -1436,29 +2125,29 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                         // Valid offer response - send response to ally, increment responseto, reset timer, and return.
                         char actionbuf[8];
                         sprintf(actionbuf, "%s", action);
-						fprintf(stderr, "%s: %s to %s\n", actionbuf, clientarray[client_no].name, clientarray[responseto].name);
+						log_debug("%s: %s to %s", actionbuf, clientarray[client_no].name, clientarray[responseto].name);
                         sprintf(buf, "(schat(SERVER)(%s,%d,%s))", actionbuf, roundnum, clientarray[client_no].name);
                         write_to_client(clientarray[responseto].socket, responseto, CLEAR);
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
                     else { // response to wrong user - strike, increment responseto, reset timer, and return
                         send_strike(client_no, 'm');
-                        responseto++;
+                        next_offer();
                         timerset = 0;
                         return;
                     }
                 }
                 else { // invalid message type - strike, increment responseto, reset timer, and return
                     send_strike(client_no, 'm');
-                    responseto++;
+                    next_offer();
                     timerset = 0;
                     return;
                 }
             }
             else if (phase == 3) {
-                //if not malformed, add action to offergrid (if applicable) and send notify to all joined users
+                //if not malformed, record action (if applicable) to be sent in notifies to all joined users
                 //else, strike and assume PASS
                 if (strcmp("ACTION", fieldstart) == 0) { // look for ACTION type message
                     fieldend++;
@@ -1490,7 +2179,7 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                     *fieldend = '\0';
                     if (result == -1 && strcmp("PASS", fieldstart) == 0) {
                         // Player passes - increment waitingfor, reset timer, and return.
-                        fprintf(stderr, "PASS: %s\n", clientarray[client_no].name);
+                        log_debug("PASS: %s", clientarray[client_no].name);
                         waitingfor++;
                         timerset = 0;
                         return;
@@ -1503,15 +2192,15 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                         *fieldend = '\0';
                         if (result == -1) {
                             for (i=0; i<MAXCLIENTS; i++) {
-                                if (strcmp(clientarray[i].name, fieldstart) == 0 && clientarray[i].playing == 1) {
+                                if (strcmp(clientarray[i].name, fieldstart) == 0 && game.players[i].playing == 1) {
                                     break;
                                 }
                             }
                             if (i < MAXCLIENTS) {
-                                // Valid attack message - update attackgrid, increment waitingfor, reset timer, and return.
-                                fprintf(stderr, "ATTACK: %s to %s\n", clientarray[client_no].name, clientarray[i].name);
+                                // Valid attack message - record attack, increment waitingfor, reset timer, and return.
+                                log_debug("ATTACK: %s to %s", clientarray[client_no].name, clientarray[i].name);
                                 if (i != client_no) {
-                                	attackgrid[client_no][i] = 1;
+                                	add_attack(&game, client_no, i);
                                 }
                                 waitingfor++;
                                 timerset = 0;
@@ -1546,33 +2235,31 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
                 }
             }
             else {
-                fprintf(stderr, "Error: phase is out of bounds\n");
+                log_error("phase is out of bounds");
                 exit(1);
             }
         }
 	}
 	
-	/* Send message to all valid recipients. */
-	int namefound = 0; int strikesent = 0;
+	/* Send message to all valid recipients. Each name is looked up in its name bucket, and a client has already been sent this message if its sentgen is the current chatgen. */
+	int strikesent = 0;
+	if (++chatgen == 0) { /* wrapped - forget the old generations */
+		memset(sentgen, 0, sizeof(sentgen));
+		chatgen = 1;
+	}
 	while (result != 0) {
-		namefound = 0;
-		for (i=0; i<MAXCLIENTS; i++) {
-			if (strcmp(clientarray[i].name, namestart) == 0) {
-				namefound = 1;
-				if (clientarray[i].sent == 0) {
-					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-					write_to_client(clientarray[i].socket, i, CLEAR);
-					clientarray[i].sent = 1;
-				}
-				else if (strikesent == 0) {
-					send_strike(client_no, 'm');
-					strikesent = 1;
-				}
+		i = find_client(namestart);
+		if (i == MAXCLIENTS || sentgen[i] == chatgen) { /* unknown name, or named twice */
+			if (strikesent == 0) {
+				send_strike(client_no, 'm');
+				strikesent = 1;
 			}
 		}
-		if (namefound == 0 && strikesent == 0) {
-			send_strike(client_no, 'm');
-			strikesent = 1;
+		else {
+			sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
+			write_to_client(clientarray[i].socket, i, CLEAR);
+			count_event(&deliverycount);
+			sentgen[i] = chatgen;
 		}
 		nameend++;
 		namestart = nameend;
@@ -1582,29 +2269,18 @@ fprintf(stderr, "SERVER: waiting for %d, got message from %d\n", waitingfor, cli
 		sprintf(convertedname, "%s", namestart);
 		convert_name(&cnameptr);
 	}
-	namefound = 0;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (strcmp(clientarray[i].name, namestart) == 0) {
-			namefound = 1;
-			if (clientarray[i].sent == 0) {
-				sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-				write_to_client(clientarray[i].socket, i, CLEAR);
-				clientarray[i].sent = 1;
-			}
-			else if (strikesent == 0) {
-				send_strike(client_no, 'm');
-				strikesent = 1;
-			}
+	i = find_client(namestart);
+	if (i == MAXCLIENTS || sentgen[i] == chatgen) { /* unknown name, or named twice */
+		if (strikesent == 0) {
+			send_strike(client_no, 'm');
+			strikesent = 1;
 		}
 	}
-	if (namefound == 0 && strikesent == 0) {
-		send_strike(client_no, 'm');
-		strikesent = 1;
-	}
-	
-	/* Reset 'sent' flag for all users. */
-	for (i=0; i<MAXCLIENTS; i++) {
-		clientarray[i].sent = 0;
+	else {
+		sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
+		write_to_client(clientarray[i].socket, i, CLEAR);
+		count_event(&deliverycount);
+		sentgen[i] = chatgen;
 	}
 }
 
@@ -1754,7 +2430,8 @@ static void convert_name(char **name)
 
 
 
-static void assign_name(char **name, int client_no)
+/* Name a client and join it. Returns its client number - a different one if it took back a seat held from a snapshot. */
+static int assign_name(char **name, int client_no)
 {
 	char temp[480];
 	char *temppos = temp;
@@ -1764,22 +2441,23 @@ static void assign_name(char **name, int client_no)
 	/* Send strike if name is empty. */
 	if (strlen(temp) == 0) { /* zero length name - send strike */
 		send_strike(client_no, 'm');
-		return;
+		return client_no;
 	}
 	
 	/* Send strike if name is a reserved word. */
 	if (strcmp("ALL", temp) == 0 || strcmp("ANY", temp) == 0 || strcmp("SERVER", temp) == 0) {
 		send_strike(client_no, 'm');
-		return;
+		return client_no;
 	}
 
 	/* Check for matches. */
-	int i, j, match = 0;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (strcmp(clientarray[i].name, temp) == 0) {
-			match = 1;
-			break;
-		}
+	int j, match = 0;
+	int seat = find_client(temp);
+	if (seat != MAXCLIENTS && IN_SET(awayset, seat) != 0) { /* its owner is back */
+		return reclaim_seat(seat, client_no);
+	}
+	if (seat != MAXCLIENTS) {
+		match = 1;
 	}
 	if (match == 0) { /* no matches - assign name */
 		sprintf(clientarray[client_no].name, "%s", temp);
@@ -1813,13 +2491,10 @@ static void assign_name(char **name, int client_no)
 			if (num_dots > 0) {
 				strcat(tentative, temppos);
 			}
-			for (i=0; i<MAXCLIENTS; i++) {
-				match = 0;
-				if (strcmp(clientarray[i].name, tentative) == 0) {
-					match = 1;
-					offset++;
-					break;
-				}
+			match = 0;
+			if (find_client(tentative) != MAXCLIENTS) {
+				match = 1;
+				offset++;
 			}
 			if (match == 0) {
 				break;
@@ -1827,22 +2502,18 @@ static void assign_name(char **name, int client_no)
 		}
 		sprintf(clientarray[client_no].name, "%s", tentative);
 	}
+	add_name(client_no);
 
 	/* update user information, send sjoin to new user and sstat to all other users */
-	clientarray[client_no].joined = 1;
+	ADD_TO_SET(joinedset, client_no);
 	numusers++;
+	specdirty = 1;
 	build_user_list_names();
 	sprintf(buf, "(sjoin(%s)(%s)(%d,%d,%d))", clientarray[client_no].name, listbuf, minplayers, lobbytime, timeout);
 	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
 	memset(listbuf, '\0', MAXMESSAGE);
-	build_user_list();
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (clientarray[i].joined == 1 && i != client_no) {
-			sprintf(buf, "(sstat(%s))", listbuf);
-			write_to_client(clientarray[i].socket, i, CLEAR);
-		}
-	}
-	memset(listbuf, '\0', MAXMESSAGE);
+	broadcast_user_list(client_no);
+	return client_no;
 }
 
 
@@ -1852,22 +2523,21 @@ static void build_user_list_names()
 {
 	int added = 0;
 	int i;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (clientarray[i].joined != 0) {
-			if (added == 0) {
-				sprintf(listbuf, "%s", clientarray[i].name);
-			}
-			else {
-				strcat(listbuf, ",");
-				strcat(listbuf, clientarray[i].name);
-			}
-			added++;
+	setwalk walk;
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (added == 0) {
+			sprintf(listbuf, "%s", clientarray[i].name);
 		}
+		else {
+			strcat(listbuf, ",");
+			strcat(listbuf, clientarray[i].name);
+		}
+		added++;
 	}
 	if (added == numusers) {
 	}
 	else {
-fprintf(stderr, "Error: user list does not agree with numusers\n");
+log_error("user list does not agree with numusers");
 	}
 }
 
@@ -1876,29 +2546,50 @@ fprintf(stderr, "Error: user list does not agree with numusers\n");
 
 
 
+/* Send sstat to every joined user but except - MAXCLIENTS for none. It is formatted once, before a failed write can drop a user and change the list. */
+static void broadcast_user_list(int except)
+{
+	char text[sizeof(listbuf)+16]; /* the list, with strikes and troops, can run well past MAXMESSAGE */
+	struct iovec iov;
+	int i;
+	setwalk walk;
+
+	build_user_list();
+	iov.iov_base = text;
+	iov.iov_len = snprintf(text, sizeof(text), "(sstat(%s))", listbuf);
+	memset(listbuf, '\0', MAXMESSAGE);
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (i != except) {
+			writev_to_client(i, &iov, 1);
+		}
+	}
+}
+
+
+
+
 static void build_user_list()
 {
     char triple[21];
 	int added = 0;
 	int i;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (clientarray[i].joined != 0) {
-			if (added == 0) {
-				sprintf(listbuf, "%s,%d,%d", clientarray[i].name, clientarray[i].strikes, clientarray[i].troops);
-			}
-			else {
-				strcat(listbuf, ",");
-                sprintf(triple, "%s,%d,%d", clientarray[i].name, clientarray[i].strikes, clientarray[i].troops);
-				strcat(listbuf, triple);
+	setwalk walk;
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (added == 0) {
+			sprintf(listbuf, "%s,%d,%d", clientarray[i].name, clientarray[i].strikes, game.players[i].troops);
+		}
+		else {
+			strcat(listbuf, ",");
+                sprintf(triple, "%s,%d,%d", clientarray[i].name, clientarray[i].strikes, game.players[i].troops);
+			strcat(listbuf, triple);
                 memset(triple, '\0', 21);
-			}
-			added++;
 		}
+		added++;
 	}
 	if (added == numusers) {
 	}
 	else {
-fprintf(stderr, "Error: user list does not agree with numusers\n");
+log_error("user list does not agree with numusers");
 	}
 }
 
@@ -1945,42 +2636,43 @@ void send_strike(int client_no, char reason)
     
     if (reason == 'm') { /* send 'malformed' strike */
         sprintf(buf, "(strike(%d)(malformed))", clientarray[client_no].strikes);
+        count_event(&malformedcount);
         clientarray[client_no].resync = 1;
         clientarray[client_no].charcount = 0;
     }
     else if (reason == 'b') { /* send 'badint' strike */
         sprintf(buf, "(strike(%d)(badint))", clientarray[client_no].strikes);
+        count_event(&badintcount);
         clientarray[client_no].resync = 1;
         clientarray[client_no].charcount = 0;
     }
     else if (reason == 't') { /* send 'timeout' strike */
         sprintf(buf, "(strike(%d)(timeout))", clientarray[client_no].strikes);
+        count_event(&timeoutcount);
     }
     else if (reason == 'l') { /* send 'toolong' strike */
         sprintf(buf, "(strike(%d)(toolong))", clientarray[client_no].strikes);
+        count_event(&toolongcount);
         clientarray[client_no].resync = 1;
         clientarray[client_no].charcount = 0;
     }
     write_to_client(clientarray[client_no].socket, client_no, CLEAR);
-fprintf(stderr, "Strike: %d to client %d\n", clientarray[client_no].strikes, client_no);
+log_info("Strike: %d to client %d", clientarray[client_no].strikes, client_no);
     
-    if (clientarray[client_no].used != 0 && clientarray[client_no].strikes == 3) { /* 3rd strike - drop client connection */
-        closesocket(clientarray[client_no].socket);
-fprintf (stderr, "Dropped: Client %d - 3 strikes\n", client_no);
-        if (clientarray[client_no].joined != 0) { /* client had joined - send sstat to all users */
+    if (IN_SET(usedset, client_no) != 0 && clientarray[client_no].strikes == 3) { /* 3rd strike - drop client connection */
+        int socket = clientarray[client_no].socket; /* -1 for a held seat */
+        if (socket >= 0) {
+            closesocket(socket);
+        }
+log_info("Dropped: Client %d - 3 strikes", client_no);
+        if (IN_SET(joinedset, client_no) != 0) { /* client had joined - send sstat to all users */
 				numusers--;
-				clientarray[client_no].joined = 0;
-				build_user_list();
-				int i;
-				for (i=0; i<MAXCLIENTS; i++) {
-					if (clientarray[i].joined != 0 && i != client_no) {
-						sprintf(buf, "(sstat(%s))", listbuf);
-						write_to_client(clientarray[i].socket, i, CLEAR);
-					}
-				}
-				memset(listbuf, '\0', MAXMESSAGE); 
+				REMOVE_FROM_SET(joinedset, client_no);
+				broadcast_user_list(client_no);
 		}
-        FD_CLR (clientarray[client_no].socket, &total_set);
+        if (socket >= 0) {
+            FD_CLR (socket, &total_set);
+        }
         clear_clientinfo(client_no);
     }
 }
@@ -1992,24 +2684,15 @@ fprintf (stderr, "Dropped: Client %d - 3 strikes\n", client_no);
 
 void write_to_client(int socket, int client_no, int clear)
 {
-	if (write(socket, &buf, strlen(buf)*sizeof(char)) < 0) {
-fprintf (stderr, "Dropped: Client %d - Write error\n", client_no);
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = strlen(buf)*sizeof(char);
+	if (send_to_socket(socket, client_no, &iov, 1) < 0) {
 		if (clear == CLEAR) {
-			if (clientarray[client_no].joined != 0) { /* client had joined - send sstat to all users */
-				numusers--;
-				clientarray[client_no].joined = 0;
-				build_user_list();
-				int i;
-				for (i=0; i<MAXCLIENTS; i++) {
-					if (clientarray[i].joined != 0 && i != client_no) {
-						sprintf(buf, "(sstat(%s))", listbuf);
-						write_to_client(clientarray[i].socket, i, CLEAR);
-					}
-				}
-				memset(listbuf, '\0', MAXMESSAGE);
-			}
-			FD_CLR (socket, &total_set);
-			clear_clientinfo(client_no);
+			write_failed(socket, client_no);
+		}
+		else {
+log_info("Dropped: Client %d - Write error", client_no);
 		}
 	}
 	memset(buf, '\0', BUFSIZE);
@@ -2018,62 +2701,1085 @@ fprintf (stderr, "Dropped: Client %d - Write error\n", client_no);
 
 
 
-static void zero_grids()
+static void writev_to_client(int client_no, struct iovec *iov, int iovcnt)
 {
-    int i, j;
-    for (i=0; i<MAXCLIENTS; i++) {
-        for (j=0; j<MAXCLIENTS; j++) {
-            offergrid[i][j].used = 0;
-            attackgrid[i][j] = 0;
-            battlegrid[i][j] = 0;
-        }
-    }
+	if (send_to_socket(clientarray[client_no].socket, client_no, iov, iovcnt) < 0) {
+		write_failed(clientarray[client_no].socket, client_no);
+	}
 }
 
 
 
 
+/*
+ * Write to a client's socket. While journaling or replaying, every byte
+ * successfully written is folded into outputhash, and write failures are
+ * journaled so a replay fails the same writes.
+ */
+static int send_to_socket(int socket, int client_no, struct iovec *iov, int iovcnt)
+{
+	int failed, k;
+	size_t n;
+	if (client_no < MAXCLIENTS && IN_SET(awayset, client_no) != 0) { /* held seat - no one to tell */
+		return 0;
+	}
+	if (replaying != 0) {
+		failed = replay_outcome(J_WRITEFAIL, client_no);
+	}
+	else {
+		failed = (writev(socket, iov, iovcnt) < 0);
+		if (failed != 0) {
+			journal_record(J_WRITEFAIL, client_no, NULL, 0);
+		}
+	}
+	if (failed != 0) {
+		return -1;
+	}
+	if (journalfd >= 0 || replaying != 0) {
+		outputhash = (outputhash ^ (unsigned long long)client_no) * 1099511628211ULL;
+		for (k=0; k<iovcnt; k++) {
+			for (n=0; n<iov[k].iov_len; n++) {
+				outputhash = (outputhash ^ ((unsigned char *)iov[k].iov_base)[n]) * 1099511628211ULL;
+			}
+		}
+	}
+	return 0;
+}
+
+
 
 
-void clear_clientinfo(int client_no)
+static void write_failed(int socket, int client_no)
 {
-	clientarray[client_no].used = 0;
-	clientarray[client_no].joined = 0;
-    clientarray[client_no].playing = 0;
-    clientarray[client_no].fighting = 0;
-	clientarray[client_no].sent = 0;
-    clientarray[client_no].offersent = 0;
-	clientarray[client_no].socket = -1;
-	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
-	memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
-	clientarray[client_no].charcount = 0;
-	clientarray[client_no].strikes = 0;
-	clientarray[client_no].resync = 0;
-    clientarray[client_no].troops = 0;
-	clientarray[client_no].plangiven = 0;
-	clientarray[client_no].offers = 0;
+	if (IN_SET(usedset, client_no) == 0 || socket < 0) { /* already dropped - by a write that failed earlier in the same broadcast */
+		return;
+	}
+log_info("Dropped: Client %d - Write error", client_no);
+	if (IN_SET(joinedset, client_no) != 0) { /* client had joined - send sstat to all users */
+		numusers--;
+		REMOVE_FROM_SET(joinedset, client_no);
+		broadcast_user_list(client_no);
+	}
+	closesocket(socket);
+	FD_CLR (socket, &total_set);
+	clear_clientinfo(client_no);
 }
 
 
 
 
+static void next_offer()
+{
+    if (responseto >= 0 && responseto != NOPLAYER) {
+        responseto = game.players[responseto].offer.next;
+    }
+}
+
 
 
-void initialize_clientinfo(int client_no)
+
+/* Start walking set and return its first client, MAXCLIENTS if none. */
+static inline int first_in_set(setwalk *walk, clientset set)
 {
-	clientarray[client_no].used = 0;
-	clientarray[client_no].joined = 0;
-    clientarray[client_no].playing = 0;
-    clientarray[client_no].fighting = 0;
-	clientarray[client_no].sent = 0;
-    clientarray[client_no].offersent = 0;
-	clientarray[client_no].socket = -1;
-	clientarray[client_no].name = malloc((NAMESIZE+1)*sizeof(char));
-	clientarray[client_no].clibuf = malloc(BUFSIZE*sizeof(char));
-	clientarray[client_no].charcount = 0;
-	clientarray[client_no].strikes = 0;
-	clientarray[client_no].resync = 0;
-    clientarray[client_no].troops = 0;
-	clientarray[client_no].plangiven = 0;
-	clientarray[client_no].offers = 0;
+	walk->set = set;
+	walk->word = 0;
+	walk->bits = set[0];
+	return next_in_walk(walk);
+}
+
+
+
+
+/* Return the next client in the set being walked, MAXCLIENTS once all have been visited. Clients removed from the set during the walk - dropped by a failed write, say - are skipped. */
+static inline int next_in_walk(setwalk *walk)
+{
+	int client;
+	
+	walk->bits &= walk->set[walk->word];
+	while (walk->bits == 0) {
+		if (++walk->word >= SETWORDS) {
+			return MAXCLIENTS;
+		}
+		walk->bits = walk->set[walk->word];
+	}
+	client = (walk->word<<6) + __builtin_ctzll(walk->bits);
+	walk->bits &= walk->bits - 1;
+	return client;
+}
+
+
+
+
+
+
+/* FNV-1a hash of a name, reduced to its name bucket. */
+static unsigned int hash_name(char *name)
+{
+	unsigned int hash = 2166136261U;
+	
+	while (*name != '\0') {
+		hash ^= (unsigned char) *name;
+		hash *= 16777619U;
+		name++;
+	}
+	return hash & (NAMEBUCKETS-1);
+}
+
+
+
+
+/* Put a newly named client at the head of its name bucket. */
+static void add_name(int client_no)
+{
+	unsigned int bucket = hash_name(clientarray[client_no].name);
+	clientarray[client_no].namenext = namebucket[bucket];
+	namebucket[bucket] = client_no;
+}
+
+
+
+
+/* Unlink a client from its name bucket. Clients that never joined have no name and are in no bucket. */
+static void remove_name(int client_no)
+{
+	int *link;
+	
+	if (clientarray[client_no].name[0] == '\0') {
+		return;
+	}
+	link = &namebucket[hash_name(clientarray[client_no].name)];
+	while (*link != MAXCLIENTS) {
+		if (*link == client_no) {
+			*link = clientarray[client_no].namenext;
+			break;
+		}
+		link = &clientarray[*link].namenext;
+	}
+	clientarray[client_no].namenext = MAXCLIENTS;
+}
+
+
+
+
+/* Return the client with the given name, MAXCLIENTS if there is none. */
+static int find_client(char *name)
+{
+	int i;
+	
+	for (i=namebucket[hash_name(name)]; i!=MAXCLIENTS; i=clientarray[i].namenext) {
+		if (strcmp(clientarray[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return MAXCLIENTS;
+}
+
+
+
+
+
+
+/* Carve the arena into buffers, zeroed, and mark them all free. */
+static void init_slab()
+{
+	int n;
+	
+	slab.arena = calloc(NUMBUFS*BUFSIZE, sizeof(char));
+	if (slab.arena == NULL) {
+		log_error("cannot allocate buffer arena");
+		exit(1);
+	}
+	for (n=0; n<NUMBUFS; n++) {
+		slab.freebufs[n] = NUMBUFS-1-n; /* lowest-numbered buffer on top */
+	}
+	slab.numfree = NUMBUFS;
+	slab.inuse = 0;
+	slab.peak = 0;
+	slab.taken = 0;
+	slab.returned = 0;
+}
+
+
+
+
+/* Hand out a buffer - free buffers are always zeroed. There is a buffer for every client slot, so running out is a bug. */
+static char *take_buffer()
+{
+	char *buffer;
+	
+	if (slab.numfree == 0) {
+		log_error("buffer arena exhausted");
+		exit(1);
+	}
+	buffer = slab.arena + slab.freebufs[--slab.numfree]*BUFSIZE;
+	slab.taken++;
+	slab.inuse++;
+	if (slab.inuse > slab.peak) {
+		slab.peak = slab.inuse;
+	}
+	return buffer;
+}
+
+
+
+
+/* Take a buffer back. It is zeroed and left alone until it is handed out again. */
+static void return_buffer(char *buffer)
+{
+	memset(buffer, '\0', BUFSIZE);
+	slab.freebufs[slab.numfree++] = (int) ((buffer-slab.arena)/BUFSIZE);
+	slab.returned++;
+	slab.inuse--;
+}
+
+
+
+
+/* Log the arena's use - at debug level, as it is called on every connect and drop; the stats port serves the same counts. */
+static void log_buffers()
+{
+log_debug("Buffers: %d of %d in use (peak %d), %ld taken, %ld returned, %d bytes of arena", slab.inuse, NUMBUFS, slab.peak, slab.taken, slab.returned, NUMBUFS*BUFSIZE);
+}
+
+
+
+
+
+
+void clear_clientinfo(int client_no)
+{
+	if (IN_SET(usedset, client_no) == 0 && IN_SET(awayset, client_no) == 0) { /* already cleared */
+		return;
+	}
+	if (IN_SET(awayset, client_no) != 0) { /* held seat - there is no connection or buffer */
+		REMOVE_FROM_SET(awayset, client_no);
+		numaway--;
+	}
+	else if (IN_SET(usedset, client_no) != 0) { /* give back its buffer - clibuf is left pointing at it, zeroed, so a parse that dropped its own client can finish */
+		return_buffer(clientarray[client_no].clibuf);
+		log_buffers();
+		numconnected--;
+		count_event(&dropcount);
+	}
+	REMOVE_FROM_SET(usedset, client_no);
+	REMOVE_FROM_SET(joinedset, client_no);
+    REMOVE_FROM_SET(offersentset, client_no);
+	clientarray[client_no].socket = -1;
+	remove_name(client_no);
+	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
+	clientarray[client_no].charcount = 0;
+	clientarray[client_no].strikes = 0;
+	clientarray[client_no].resync = 0;
+	clientarray[client_no].plangiven = 0;
+	remove_player(&game, client_no);
+	specdirty = 1;
+}
+
+
+
+
+
+
+void initialize_clientinfo(int client_no)
+{
+	REMOVE_FROM_SET(usedset, client_no);
+	REMOVE_FROM_SET(awayset, client_no);
+	REMOVE_FROM_SET(joinedset, client_no);
+    REMOVE_FROM_SET(offersentset, client_no);
+	clientarray[client_no].socket = -1;
+	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
+	clientarray[client_no].namenext = MAXCLIENTS;
+	clientarray[client_no].clibuf = NULL;
+	clientarray[client_no].charcount = 0;
+	clientarray[client_no].strikes = 0;
+	clientarray[client_no].resync = 0;
+	clientarray[client_no].plangiven = 0;
+	remove_player(&game, client_no);
+	specdirty = 1;
+}
+
+
+
+
+
+
+static void open_journal(char *path, unsigned int seed)
+{
+	journalheader header;
+	journalfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (journalfd < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "BYZJ", 4);
+	header.version = JOURNALVERSION;
+	header.seed = seed;
+	header.minplayers = minplayers;
+	header.lobbytime = lobbytime;
+	header.timeout = timeout;
+	header.startingforce = startingforce;
+	grow_journal(sizeof(header));
+	memcpy(journalmap, &header, sizeof(header));
+	journalused = sizeof(header);
+}
+
+
+
+
+/* Extend the journal file and its mapping by at least need bytes. The new space is zero filled, which reads back as J_END. */
+static void grow_journal(size_t need)
+{
+	if (journalmap != NULL) {
+		munmap(journalmap, journalsize);
+	}
+	journalsize += (need > JOURNALCHUNK) ? need : JOURNALCHUNK;
+	if (ftruncate(journalfd, journalsize) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+	journalmap = mmap(NULL, journalsize, PROT_READ | PROT_WRITE, MAP_SHARED, journalfd, 0);
+	if (journalmap == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+}
+
+
+
+
+/* Append one event to the journal. Does nothing unless the server was started with -j. */
+static void journal_record(int type, int client_no, const void *data, int length)
+{
+	journalrecord record;
+	if (journalfd < 0) {
+		return;
+	}
+	if (journalused + sizeof(record) + length + sizeof(record) > journalsize) { /* leave room for a zero J_END record */
+		grow_journal(sizeof(record) + length);
+	}
+	record.type = type;
+	record.unused = 0;
+	record.length = length;
+	record.client_no = client_no;
+	memcpy(journalmap + journalused, &record, sizeof(record));
+	journalused += sizeof(record);
+	if (length > 0) {
+		memcpy(journalmap + journalused, data, length);
+		journalused += length;
+	}
+}
+
+
+
+
+/* Read the next record of the journal being replayed without consuming it. Returns 0 at the end of the journal. */
+static int peek_record(journalrecord *record)
+{
+	if (journalused + sizeof(journalrecord) > journalsize) {
+		return 0;
+	}
+	memcpy(record, journalmap + journalused, sizeof(journalrecord));
+	if (record->type == J_END || journalused + sizeof(journalrecord) + record->length > journalsize) {
+		return 0;
+	}
+	return 1;
+}
+
+
+
+
+/* During replay, report whether the live server saw a timer expire or a write fail at this point. */
+static int replay_outcome(int type, int client_no)
+{
+	journalrecord record;
+	if (peek_record(&record) != 0 && record.type == type && record.client_no == client_no) {
+		journalused += sizeof(journalrecord) + record.length;
+		return 1;
+	}
+	return 0;
+}
+
+
+
+
+/*
+ * Re-execute a journal written with -j. Connections, received data, drops,
+ * timer expiries and write failures are fed back through the same handlers
+ * the live server uses, with writes discarded, and the hash of everything
+ * written is checked against the live server's after every step. Exits with
+ * status 0 if the replay matches and 1 if it diverges.
+ */
+static void replay_journal(char *path)
+{
+	journalheader header;
+	journalrecord record;
+	struct stat info;
+	long events = 0, steps = 0;
+	int client_no;
+	
+	journalfd = open(path, O_RDONLY);
+	if (journalfd < 0 || fstat(journalfd, &info) < 0) {
+		perror(path);
+		exit(1);
+	}
+	journalsize = info.st_size;
+	if (journalsize < sizeof(header)) {
+		log_error("Replay: %s is not a journal", path);
+		exit(1);
+	}
+	journalmap = mmap(NULL, journalsize, PROT_READ, MAP_PRIVATE, journalfd, 0);
+	if (journalmap == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memcpy(&header, journalmap, sizeof(header));
+	if (memcmp(header.magic, "BYZJ", 4) != 0 || header.version != JOURNALVERSION) {
+		log_error("Replay: %s is not a version %d journal", path, JOURNALVERSION);
+		exit(1);
+	}
+	journalused = sizeof(header);
+	replaying = 1;
+	journalfd = -1; /* nothing is journaled while replaying */
+	minplayers = header.minplayers;
+	lobbytime = header.lobbytime;
+	timeout = header.timeout;
+	startingforce = header.startingforce;
+	srand(header.seed);
+	init_game(&game, startingforce, rand());
+	
+	while (peek_record(&record) != 0) {
+		journalused += sizeof(journalrecord);
+		memset(buf, '\0', BUFSIZE);
+		if (record.length > 0) {
+			memcpy(buf, journalmap + journalused, record.length < BUFSIZE ? record.length : BUFSIZE);
+			journalused += record.length;
+		}
+		events++;
+		if (record.type == J_ACCEPT || record.type == J_REFUSE) {
+			client_no = accept_client(FD_SETSIZE - 1 - (record.client_no % MAXCLIENTS)); /* placeholder socket - never written */
+			if (client_no != record.client_no) {
+				log_error("Replay: diverged at event %ld - connection got client %d, journal has %d", events, client_no, record.client_no);
+				exit(1);
+			}
+		}
+		else if (record.type == J_DATA) {
+			client_sent(record.client_no);
+		}
+		else if (record.type == J_DROP) {
+			client_died(record.client_no);
+		}
+		else if (record.type == J_ADVANCE) {
+			advance_game();
+			steps++;
+		}
+		else if (record.type == J_HASH) {
+			if (memcmp(buf, &outputhash, sizeof(outputhash)) != 0) {
+				log_error("Replay: diverged at event %ld - output differs after step %ld", events, steps);
+				exit(1);
+			}
+		}
+		else {
+			log_error("Replay: diverged at event %ld - unexpected event type %d", events, record.type);
+			exit(1);
+		}
+	}
+	log_info("Replay: %ld events, %ld steps, round %d, output matches", events, steps, roundnum);
+	exit(0);
+}
+
+
+
+
+
+
+/*
+ * Lay out a snapshot of the game and the seats in image: a header with the
+ * round, phase, whose move is awaited and who has joined, the name, strikes
+ * and plan of each seat, then the game state. Connections are not kept.
+ * Returns its length.
+ */
+static int build_snapshot(char *image)
+{
+	snapshotheader header;
+	seatinfo seat;
+	int length = sizeof(header);
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "BYZS", 4);
+	header.version = SNAPSHOTVERSION;
+	header.maxclients = MAXCLIENTS;
+	header.roundnum = roundnum;
+	header.phase = phase;
+	header.waitingfor = waitingfor;
+	header.responseto = responseto;
+	header.timerset = timerset;
+	memcpy(header.joined, joinedset, sizeof(clientset));
+	memcpy(header.offersent, offersentset, sizeof(clientset));
+	memcpy(image, &header, sizeof(header));
+	for (i=0; i<MAXCLIENTS; i++) {
+		memset(&seat, 0, sizeof(seat));
+		if (IN_SET(joinedset, i) != 0) {
+			memcpy(seat.name, clientarray[i].name, NAMESIZE+1);
+			seat.strikes = clientarray[i].strikes;
+			seat.plangiven = clientarray[i].plangiven;
+		}
+		memcpy(image+length, &seat, sizeof(seat));
+		length += sizeof(seat);
+	}
+	length += copy_game(image+length, 1);
+	return length;
+}
+
+
+
+
+/* Copy the game state a snapshot keeps to or from image. The last battle's skirmishes are left out - they are only there to be logged. Returns the bytes copied. */
+static int copy_game(char *image, int saving)
+{
+	int length = 0;
+
+	copy_field(image, &length, game.players, sizeof(game.players), saving);
+	copy_field(image, &length, &game.startingforce, sizeof(game.startingforce), saving);
+	copy_field(image, &length, &game.seed, sizeof(game.seed), saving);
+	copy_field(image, &length, game.attackers, sizeof(game.attackers), saving);
+	copy_field(image, &length, &game.numattacks, sizeof(game.numattacks), saving);
+#ifdef GRIDCHECK
+	copy_field(image, &length, game.offergrid, sizeof(game.offergrid), saving);
+	copy_field(image, &length, game.attackgrid, sizeof(game.attackgrid), saving);
+#endif
+	return length;
+}
+
+
+
+
+static void copy_field(char *image, int *length, void *field, int size, int saving)
+{
+	if (saving != 0) {
+		memcpy(image + *length, field, size);
+	}
+	else {
+		memcpy(field, image + *length, size);
+	}
+	*length += size;
+}
+
+
+
+
+/*
+ * Every snapinterval seconds, snapshot the game and seats if they changed
+ * since the last snapshot written. The snapshot is built here, which takes
+ * microseconds, and written, synced and renamed over snapshotfile by a
+ * forked child, so the game never waits on the disk and a crash leaves the
+ * last whole snapshot in place. A snapshot is skipped if the last one is
+ * still being written.
+ */
+static void save_snapshot()
+{
+	time_t now = time(NULL);
+	int next = 1 - snapcurrent;
+	pid_t pid;
+
+	if (snapwriter != 0) {
+		reap_snapshot();
+	}
+	if (difftime(now, snaptime) < (double)snapinterval) {
+		return;
+	}
+	snaptime = now;
+	if (snapwriter != 0) {
+		return;
+	}
+	snaplength[next] = build_snapshot(snapimage[next]);
+	if (snaplength[next] == snaplength[snapcurrent] && memcmp(snapimage[next], snapimage[snapcurrent], snaplength[next]) == 0) {
+		return;
+	}
+	pid = fork();
+	if (pid < 0) {
+log_warn("Snapshot: cannot fork to write %s", snapshotfile);
+		return;
+	}
+	if (pid == 0) { /* child - it must not log, as the logger's thread is not copied */
+		int fd = open(snapshottemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, snapimage[next], snaplength[next]) != snaplength[next] || fsync(fd) < 0 || rename(snapshottemp, snapshotfile) < 0) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	snapwriter = pid;
+	snapcurrent = next;
+}
+
+
+
+
+/* Collect the child writing a snapshot if it has finished. One that failed is written again at the next interval. */
+static void reap_snapshot()
+{
+	int status;
+
+	if (waitpid(snapwriter, &status, WNOHANG) != snapwriter) {
+		return;
+	}
+	snapwriter = 0;
+	if (WIFEXITED(status) != 0 && WEXITSTATUS(status) == 0) {
+		count_event(&snapshotcount);
+log_debug("Snapshot: wrote %d bytes, round %d", snaplength[snapcurrent], roundnum);
+	}
+	else {
+log_warn("Snapshot: could not write %s", snapshotfile);
+		snaplength[snapcurrent] = 0;
+	}
+}
+
+
+
+
+/*
+ * Start from the snapshot in snapshotfile, if there is one. Its seats are
+ * held, joined and in the game but with no connection, until their owners
+ * join again under the same names or grace seconds pass. The move being
+ * waited on when the snapshot was taken is asked for again, and a lobby
+ * countdown starts over. A snapshot written by a build with different
+ * limits is ignored.
+ */
+static void load_snapshot()
+{
+	struct stat info;
+	unsigned long long start = now_micros();
+	char *image = snapimage[0];
+	int fd, length, problem;
+
+	fd = open(snapshotfile, O_RDONLY);
+	if (fd < 0) {
+log_info("Snapshot: none at %s - starting cold", snapshotfile);
+		return;
+	}
+	length = (int) read(fd, image, SNAPSHOTSIZE);
+	if (fstat(fd, &info) < 0) {
+		info.st_mtime = time(NULL);
+	}
+	close(fd);
+	problem = check_snapshot(image, length);
+	if (problem == 1) {
+log_warn("Snapshot: %s is not a version %d snapshot from this build - starting cold", snapshotfile, SNAPSHOTVERSION);
+		return;
+	}
+	if (problem == 2) {
+log_warn("Snapshot: %s is damaged - starting cold", snapshotfile);
+		return;
+	}
+
+	restore_snapshot(image);
+	if (phase == 0 && timerset != 0) {
+		time(&timestart);
+	}
+	ask_again();
+	phasestart = roundbegin = now_micros();
+	specdirty = 1;
+	time(&loadtime);
+	snaplength[0] = length; /* what was loaded is the last snapshot written */
+	snapcurrent = 0;
+log_info("Snapshot: loaded round %d phase %d from %s, %ld seconds old, in %llu us - %d seats held for %d seconds", roundnum, phase, snapshotfile, (long) difftime(loadtime, info.st_mtime), now_micros() - start, numaway, grace);
+}
+
+
+
+
+/* Check that the length bytes in image are a snapshot this build can restore. Returns 0 if they are, 1 if they come from another version or build and 2 if they are damaged. */
+static int check_snapshot(char *image, int length)
+{
+	snapshotheader header;
+
+	if (length < (int) sizeof(header)) {
+		return 1;
+	}
+	memcpy(&header, image, sizeof(header));
+	if (memcmp(header.magic, "BYZS", 4) != 0 || header.version != SNAPSHOTVERSION || header.maxclients != MAXCLIENTS || length != build_snapshot(snapimage[1])) {
+		return 1;
+	}
+	if (header.phase < 0 || header.phase > 3 || header.waitingfor < -1 || header.waitingfor > MAXCLIENTS || header.responseto < -1 || header.responseto > NOPLAYER) {
+		return 2;
+	}
+	return 0;
+}
+
+
+
+
+/* Set the game and seats to the snapshot in image, checked by check_snapshot(). Every seat is held, with no connection. */
+static void restore_snapshot(char *image)
+{
+	snapshotheader header;
+	seatinfo seat;
+	int i;
+
+	memcpy(&header, image, sizeof(header));
+	for (i=0; i<MAXCLIENTS; i++) {
+		memcpy(&seat, image + sizeof(header) + i*sizeof(seat), sizeof(seat));
+		if (IN_SET(header.joined, i) == 0) {
+			continue;
+		}
+		seat.name[NAMESIZE] = '\0';
+		memcpy(clientarray[i].name, seat.name, NAMESIZE+1);
+		clientarray[i].strikes = seat.strikes;
+		clientarray[i].plangiven = seat.plangiven;
+		add_name(i);
+		ADD_TO_SET(usedset, i);
+		ADD_TO_SET(joinedset, i);
+		ADD_TO_SET(awayset, i);
+		numusers++;
+		numaway++;
+	}
+	memcpy(offersentset, header.offersent, sizeof(clientset));
+	copy_game(image + sizeof(header) + MAXCLIENTS*sizeof(seat), 0);
+	roundnum = header.roundnum;
+	phase = header.phase;
+	waitingfor = header.waitingfor;
+	responseto = header.responseto;
+	timerset = header.timerset;
+}
+
+
+
+
+/* Move a connection that joined under a held seat's name into the seat, and welcome it back. Returns the seat. */
+static int reclaim_seat(int seat, int client_no)
+{
+	clientarray[seat].socket = clientarray[client_no].socket;
+	clientarray[seat].clibuf = clientarray[client_no].clibuf;
+	clientarray[seat].charcount = clientarray[client_no].charcount;
+	clientarray[seat].resync = clientarray[client_no].resync;
+	REMOVE_FROM_SET(awayset, seat);
+	numaway--;
+	initialize_clientinfo(client_no); /* its old slot is free - the buffer went with the connection */
+	count_event(&reclaimcount);
+log_info("Reclaimed: client %d took back seat %d as %s", client_no, seat, clientarray[seat].name);
+	build_user_list_names();
+	sprintf(buf, "(sjoin(%s)(%s)(%d,%d,%d))", clientarray[seat].name, listbuf, minplayers, lobbytime, timeout);
+	write_to_client(clientarray[seat].socket, seat, CLEAR);
+	memset(listbuf, '\0', MAXMESSAGE);
+	if (waitingfor == seat) {
+		ask_again();
+	}
+	return seat;
+}
+
+
+
+
+/* Once grace seconds have passed since the snapshot was loaded, give up the seats no one reclaimed, as if their owners had left. */
+static void release_seats()
+{
+	int i;
+	setwalk walk;
+
+	if (difftime(time(NULL), loadtime) < (double)grace) {
+		return;
+	}
+	for (i=first_in_set(&walk, awayset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+log_info("Released: seat %d (%s) - not reclaimed", i, clientarray[i].name);
+		count_event(&releasecount);
+		if (waitingfor == i) { /* the game moves on to the next player, who needs a timer of their own */
+			timerset = 0;
+		}
+		numusers--;
+		REMOVE_FROM_SET(joinedset, i);
+		clear_clientinfo(i);
+	}
+	broadcast_user_list(MAXCLIENTS);
+}
+
+
+
+
+/* Have the game ask again for the move it is waiting on, with a fresh timer - the player it asked was not there to hear it. */
+static void ask_again()
+{
+	if (phase == 0 || timerset == 0) {
+		return;
+	}
+	if (phase == 2) { /* the offer is sent again, so it is not yet delivered */
+		game.players[waitingfor].offers += 1;
+	}
+	timerset = 0;
+}
+
+
+
+
+/* Seconds until a snapshot or the release of held seats is due, -1 if neither ever is. */
+static int snapshot_wait()
+{
+	double wait;
+
+	if (snapshotfile == NULL) {
+		return -1;
+	}
+	wait = (double)snapinterval - difftime(time(NULL), snaptime);
+	if (numaway > 0 && (double)grace - difftime(time(NULL), loadtime) < wait) {
+		wait = (double)grace - difftime(time(NULL), loadtime);
+	}
+	return (wait > 0) ? (int)wait : 0;
+}
+
+
+
+
+
+/*
+ * Hand the listening sockets, the game and every client and spectator to the
+ * replacement connecting on the handoff port, and exit once it has them
+ * all. The game goes over as a snapshot, with the seconds its timer has
+ * run. If it fails, carry on as before.
+ */
+static void hand_off(int listensocket, int speclistensocket)
+{
+	handoffrecord record;
+	spectatorinfo *spectator;
+	char *image = snapimage[1-snapcurrent]; /* save_snapshot() builds its next snapshot afresh, so this is free */
+	int conn, client_no, k, sent;
+	char ack;
+	setwalk walk;
+
+	conn = accept_handoff(handoffport);
+	if (conn < 0) {
+		return;
+	}
+log_info("Handoff: replacement connected - handing over round %d phase %d, %d clients and %d spectators", roundnum, phase, numconnected, numspectators);
+	close_stats_port();
+	memset(&record, 0, sizeof(record));
+	record.size = sizeof(record);
+	record.kind = HANDOFF_LISTEN;
+	sent = write_fd(conn, &record, sizeof(record), listensocket) == sizeof(record);
+	if (sent != 0 && speclistensocket >= 0) {
+		record.kind = HANDOFF_SPECLISTEN;
+		sent = write_fd(conn, &record, sizeof(record), speclistensocket) == sizeof(record);
+	}
+	if (sent != 0) {
+		record.kind = HANDOFF_GAME;
+		record.elapsed = (timerset != 0) ? (int) difftime(time(NULL), timestart) : 0;
+		record.length = build_snapshot(image);
+		sent = write_fd(conn, &record, sizeof(record), -1) == sizeof(record) && write_fd(conn, image, record.length, -1) == record.length;
+	}
+	for (client_no=first_in_set(&walk, usedset); sent != 0 && client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		if (IN_SET(awayset, client_no) != 0) { /* a held seat has no socket - it goes over in the snapshot */
+			continue;
+		}
+		memset(&record, 0, sizeof(record));
+		record.size = sizeof(record);
+		record.kind = HANDOFF_CLIENT;
+		record.client_no = client_no;
+		record.charcount = clientarray[client_no].charcount;
+		record.strikes = clientarray[client_no].strikes;
+		record.resync = clientarray[client_no].resync;
+		memcpy(record.clibuf, clientarray[client_no].clibuf, BUFSIZE);
+		sent = write_fd(conn, &record, sizeof(record), clientarray[client_no].socket) == sizeof(record);
+	}
+	for (k=0; sent != 0 && k<numspectators; k++) {
+		spectator = &spectators[k];
+		memset(&record, 0, sizeof(record));
+		record.size = sizeof(record);
+		record.kind = HANDOFF_SPECTATOR;
+		record.length = (spectator->tail != NULL) ? spectator->taillen - spectator->tailsent : 0;
+		sent = write_fd(conn, &record, sizeof(record), spectator->socket) == sizeof(record);
+		if (sent != 0 && record.length > 0) { /* the rest of the message it was partway through */
+			sent = write_fd(conn, spectator->tail + spectator->tailsent, record.length, -1) == record.length;
+		}
+	}
+	if (sent != 0) {
+		memset(&record, 0, sizeof(record));
+		record.size = sizeof(record);
+		record.kind = HANDOFF_DONE;
+		sent = write_fd(conn, &record, sizeof(record), -1) == sizeof(record);
+	}
+	if (sent != 0 && read(conn, &ack, 1) == 1) { /* the replacement has everything - its copies of the sockets keep them open */
+		if (snapwriter != 0) { /* let the last snapshot land before the replacement writes its own */
+			waitpid(snapwriter, NULL, 0);
+		}
+log_info("Handoff: complete - exiting");
+		exit(0);
+	}
+log_error("Handoff: replacement failed - carrying on");
+	close(conn);
+	if (statsport > 0) {
+		open_stats_port(statsport);
+	}
+}
+
+
+
+
+/*
+ * Take the listening sockets, the game and every client and spectator from
+ * the server waiting on path, and acknowledge them. Seats whose client
+ * comes with a socket are filled; the rest stay held, with their grace
+ * started over. Returns the listening socket, and the spectator listening
+ * socket, if any, in speclistensocket.
+ */
+static int take_over(char *path, int *speclistensocket)
+{
+	handoffrecord record;
+	char rest[MAXCLIENTS*NOTIFYSIZE*2+64]; /* as long as the longest spectator message, an sdelta */
+	int conn, fd, length, listensocket = -1, restored = 0;
+	char ack = 1;
+
+	conn = connect_handoff(path);
+	if (conn < 0) {
+		exit(1);
+	}
+	while (1) {
+		if (read_fd(conn, &record, sizeof(record), &fd) != sizeof(record) || record.size != sizeof(record)) {
+log_error("Handoff: bad record from %s - is it the same build?", path);
+			exit(1);
+		}
+		if (record.kind == HANDOFF_DONE) {
+			break;
+		}
+		else if (record.kind == HANDOFF_LISTEN && fd >= 0) {
+			listensocket = fd;
+		}
+		else if (record.kind == HANDOFF_SPECLISTEN && fd >= 0) {
+			if (specport > 0) {
+				prepare_spectators();
+				*speclistensocket = fd;
+			}
+			else { /* this server takes no spectators */
+				close(fd);
+			}
+		}
+		else if (record.kind == HANDOFF_GAME && restored == 0) {
+			length = (int) read_fd(conn, snapimage[0], SNAPSHOTSIZE, &fd);
+			if (length != record.length || check_snapshot(snapimage[0], length) != 0) {
+log_error("Handoff: bad snapshot from %s - is it the same build?", path);
+				exit(1);
+			}
+			restore_snapshot(snapimage[0]);
+			timestart = time(NULL) - record.elapsed;
+			restored = 1;
+		}
+		else if (record.kind == HANDOFF_CLIENT && fd >= 0 && restored != 0) {
+			restore_client(&record, fd);
+		}
+		else if (record.kind == HANDOFF_SPECTATOR && fd >= 0 && restored != 0) {
+			if (record.length > 0 && (record.length > (int) sizeof(rest) || read_fd(conn, rest, sizeof(rest), &length) != record.length)) {
+log_error("Handoff: bad spectator record from %s", path);
+				exit(1);
+			}
+			restore_spectator(&record, fd, rest);
+		}
+		else {
+log_error("Handoff: record of kind %d out of place or without a socket from %s", record.kind, path);
+			exit(1);
+		}
+	}
+	if (listensocket < 0 || restored == 0) {
+log_error("Handoff: no listening socket or game from %s", path);
+		exit(1);
+	}
+	if (write(conn, &ack, 1) != 1) {
+		perror("write");
+		exit(1);
+	}
+	close(conn);
+	phasestart = roundbegin = now_micros();
+	specdirty = 1;
+	time(&loadtime); /* the held seats' grace starts over */
+log_info("Handoff: took over round %d phase %d, %d clients, %d held seats and %d spectators from %s", roundnum, phase, numconnected, numaway, numspectators, path);
+	return listensocket;
+}
+
+
+
+
+/* Set up a client handed over by the server being replaced - in its held seat if it had joined, as it was there. */
+static void restore_client(handoffrecord *record, int socket)
+{
+	int client_no = record->client_no;
+
+	if (client_no < 0 || client_no >= MAXCLIENTS || IN_SET(usedset, client_no) != IN_SET(awayset, client_no)) { /* neither a held seat nor free */
+log_error("Handoff: bad client number %d", client_no);
+		close(socket);
+		return;
+	}
+	if (IN_SET(awayset, client_no) != 0) {
+		REMOVE_FROM_SET(awayset, client_no);
+		numaway--;
+	}
+	ADD_TO_SET(usedset, client_no);
+	FD_SET (socket, &total_set);
+	clientarray[client_no].socket = socket;
+	clientarray[client_no].clibuf = take_buffer();
+	memcpy(clientarray[client_no].clibuf, record->clibuf, BUFSIZE);
+	clientarray[client_no].charcount = record->charcount;
+	clientarray[client_no].strikes = record->strikes;
+	clientarray[client_no].resync = record->resync;
+	numconnected++;
+}
+
+
+
+
+/* Set up a spectator handed over by the server being replaced. It finishes the length bytes of rest it was partway through, then starts over from a snapshot. */
+static void restore_spectator(handoffrecord *record, int socket, char *rest)
+{
+	spectatorinfo *spectator;
+	char *tail;
+
+	if (spectators == NULL) { /* this server takes no spectators */
+		close(socket);
+		return;
+	}
+	spectator = add_spectator(socket);
+	if (spectator == NULL || record->length == 0) {
+		return;
+	}
+	tail = malloc(record->length + spectator->taillen);
+	memcpy(tail, rest, record->length);
+	memcpy(tail + record->length, spectator->tail, spectator->taillen);
+	free(spectator->tail);
+	spectator->tail = tail;
+	spectator->taillen += record->length;
+}
+
+
+
+
+
+
+/* Register everything served on the stats port. */
+static void register_metrics()
+{
+	add_gauge("byzantiums_clients", "state=\"connected\"", "Clients connected, by state.", &numconnected);
+	add_gauge("byzantiums_clients", "state=\"joined\"", "Clients connected, by state.", &numusers);
+	add_gauge("byzantiums_receive_buffers", "", "Receive buffers held - one per connected client, and the scratch buffer.", &slab.inuse);
+	add_gauge("byzantiums_receive_buffers_peak", "", "Most receive buffers ever held at once.", &slab.peak);
+	add_gauge("byzantiums_held_seats", "", "Seats loaded from a snapshot that their owners have not come back for.", &numaway);
+	add_gauge("byzantiums_spectators", "", "Spectators connected.", &numspectators);
+	add_gauge("byzantiums_phase", "", "Phase of the game - 0 lobby, 1 plan, 2 offer, 3 action and battle.", &phase);
+	add_gauge("byzantiums_round", "", "Round of the game in progress.", &roundnum);
+	add_counter("byzantiums_connections_total", "result=\"accepted\"", "Connections accepted or refused for want of a free slot.", &acceptcount);
+	add_counter("byzantiums_connections_total", "result=\"refused\"", "Connections accepted or refused for want of a free slot.", &refusecount);
+	add_counter("byzantiums_disconnections_total", "", "Clients dropped - died, struck out or failed a write.", &dropcount);
+	add_counter("byzantiums_reads_total", "", "Reads that returned data.", &readcount);
+	add_counter("byzantiums_read_bytes_total", "", "Bytes read from clients.", &readbytes);
+	add_counter("byzantiums_chats_total", "", "Chat messages sent by clients, moves to SERVER included.", &chatcount);
+	add_counter("byzantiums_deliveries_total", "", "Chat messages delivered to recipients.", &deliverycount);
+	add_counter("byzantiums_strikes_total", "reason=\"malformed\"", "Strikes given, by reason.", &malformedcount);
+	add_counter("byzantiums_strikes_total", "reason=\"badint\"", "Strikes given, by reason.", &badintcount);
+	add_counter("byzantiums_strikes_total", "reason=\"timeout\"", "Strikes given, by reason.", &timeoutcount);
+	add_counter("byzantiums_strikes_total", "reason=\"toolong\"", "Strikes given, by reason.", &toolongcount);
+	add_counter("byzantiums_snapshots_total", "", "Snapshots of the game and seats written.", &snapshotcount);
+	add_counter("byzantiums_held_seats_total", "result=\"reclaimed\"", "Seats loaded from a snapshot, by whether their owner came back for them.", &reclaimcount);
+	add_counter("byzantiums_held_seats_total", "result=\"released\"", "Seats loaded from a snapshot, by whether their owner came back for them.", &releasecount);
+	add_histogram("byzantiums_receive_seconds", "", "Time from a read returning to everything in it being parsed.", &receivetime);
+	add_histogram("byzantiums_deliver_seconds", "", "Time to handle one chat message, moves to SERVER included.", &delivertime);
+	add_histogram("byzantiums_phase_seconds", "phase=\"plan\"", "Length of each phase of a round.", &plantime);
+	add_histogram("byzantiums_phase_seconds", "phase=\"offer\"", "Length of each phase of a round.", &offertime);
+	add_histogram("byzantiums_phase_seconds", "phase=\"action\"", "Length of each phase of a round.", &actiontime);
+	add_histogram("byzantiums_phase_seconds", "phase=\"battle\"", "Length of each phase of a round.", &battletime);
+	add_histogram("byzantiums_round_seconds", "", "Length of a round, from entering phase 1 to the end of its battle.", &roundtime);
 }
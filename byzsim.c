@@ -0,0 +1,361 @@
+/* byzsim.c - batch tournament simulator that plays Byzantium games between bots using the byzantium.c engine */
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "byzantium.h"
+
+#define MAXSTRATEGIES 4
+
+/*------------------------------------------------------------------------
+* Program: byzsim
+*
+* Purpose: play a batch of Byzantium games between bots with no server or
+* sockets, and report how fast the engine runs and how each strategy fared.
+* Each thread repeatedly does the following:
+* (1) claim the next unplayed game
+* (2) seat the bots and have each decide its offer and attack every round
+* (3) play rounds with play_round() until one player or none is left, or the
+*     round limit is reached
+* (4) add the result to the thread's tally
+*
+* Build: gcc -O3 -o byzsim byzsim.c byzantium.c -lpthread
+* Add -DGRIDCHECK to fight every battle with the dense grid as well and
+* report the players the two disagreed on.
+*
+* Syntax: byzsim [-g games] [-p players] [-f forcesize] [-r maxrounds] [-t threads]
+*                [-s seed] [-b bots]
+*
+* games         number of games to play
+* players       number of players in each game
+* forcesize     number of troops each player starts with
+* maxrounds     number of rounds after which a game is scored as a draw
+* threads       number of threads playing games
+* seed          seed for the whole batch - game n is always played the same
+*               way for the same seed, whichever thread plays it
+* bots          comma-separated strategies seated in turn around the table,
+*               from: random, weakest, strongest, pacifist
+*
+* All arguments are optional. The default values are as follows:
+*   games = 10000
+*   players = 6
+*   forcesize = 1000
+*   maxrounds = 1000
+*   threads = number of online processors
+*   seed = current time
+*   bots = random,weakest,strongest,pacifist
+*
+*------------------------------------------------------------------------
+*/
+
+
+/* global variables */
+typedef struct {
+        long wins[MAXSTRATEGIES]; /* games won by each strategy */
+        long seats[MAXSTRATEGIES]; /* seats each strategy was given */
+        long draws; /* games with no single winner */
+        long rounds; /* rounds played */
+        long mismatches; /* players battles disagreed with the dense battle on - with -DGRIDCHECK */
+    } tally;
+const char *strategynames[MAXSTRATEGIES] = {"random", "weakest", "strongest", "pacifist"};
+int numgames = 10000; /* number of games to play - default 10000 */
+int numplayers = 6; /* number of players in each game - default 6 */
+int startingforce = 1000; /* number of troops each player starts with - default 1000 */
+int maxrounds = 1000; /* rounds before a game is a draw - default 1000 */
+int numthreads = 1; /* number of threads playing games */
+unsigned int batchseed; /* seed for the whole batch */
+int seating[MAXPLAYERS]; /* strategy of the bot in each seat */
+int numseating = 0; /* number of strategies in the seating list */
+int nextgame = 0; /* next unclaimed game number */
+tally total; /* results of all threads */
+pthread_mutex_t totallock = PTHREAD_MUTEX_INITIALIZER; /* protects total */
+
+
+/* helper functions */
+static void *play_games(void *arg);
+static int  play_game(int gamenum, tally *results);
+static void decide(gamestate *game, int player, int strategy, unsigned int *rng, decision *choice);
+static int  pick_opponent(gamestate *game, int player, int strongest);
+static int  pick_random(gamestate *game, int player, unsigned int *rng);
+static unsigned int next_random(unsigned int *rng);
+static int  parse_bots(char *list);
+
+
+
+
+
+/* Main */
+int main(int argc, char **argv)
+{
+    struct timeval start, end;
+    pthread_t threads[256];
+    double seconds;
+    int i;
+
+    numthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    batchseed = (unsigned int) time(NULL);
+    numseating = parse_bots("random,weakest,strongest,pacifist");
+
+    /* Get values from command line. */
+    for (i=1;i<argc;i++) {
+        if (strcmp(argv[i], "-g") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &numgames);
+        }
+        else if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &numplayers);
+        }
+        else if (strcmp(argv[i], "-f") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &startingforce);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &maxrounds);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%d", &numthreads);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+            sscanf(argv[i+1], "%u", &batchseed);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && (i+1) < argc) {
+            numseating = parse_bots(argv[i+1]);
+            if (numseating == 0) {
+                fprintf(stderr, "bad bot list %s\n", argv[i+1]);
+                exit(1);
+            }
+        }
+    }
+    if (numgames < 0) {
+        numgames = 10000;
+    }
+    if (numplayers < 2 || numplayers > MAXPLAYERS) {
+        numplayers = 6;
+    }
+    if (startingforce < 1) {
+        startingforce = 1000;
+    }
+    if (maxrounds < 1) {
+        maxrounds = 1000;
+    }
+    if (numthreads < 1) {
+        numthreads = 1;
+    }
+    if (numthreads > 256) {
+        numthreads = 256;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i=0; i<numthreads; i++) {
+        if (pthread_create(&threads[i], NULL, play_games, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i=0; i<numthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    gettimeofday(&end, NULL);
+    seconds = (double)(end.tv_sec-start.tv_sec) + (double)(end.tv_usec-start.tv_usec)/1000000.0;
+    if (seconds <= 0) {
+        seconds = 0.000001;
+    }
+
+    printf("%d games, %d players, %d threads, seed %u\n", numgames, numplayers, numthreads, batchseed);
+    printf("%.3f s, %.0f games/s, %.0f games/s per thread, %.0f rounds/s\n", seconds, numgames/seconds, numgames/seconds/numthreads, total.rounds/seconds);
+    printf("%.1f rounds per game, %ld draws\n", numgames > 0 ? (double)total.rounds/numgames : 0.0, total.draws);
+    for (i=0; i<MAXSTRATEGIES; i++) {
+        if (total.seats[i] > 0) {
+            printf("%-10s %8ld seats %8ld wins  %5.1f%% of seats\n", strategynames[i], total.seats[i], total.wins[i], 100.0*total.wins[i]/total.seats[i]);
+        }
+    }
+#ifdef GRIDCHECK
+    printf("%ld players disagreed with the dense battle\n", total.mismatches);
+#endif
+    exit(0);
+}
+
+
+
+
+/* Thread body - claim and play games until none are left, then add the thread's results to the total. */
+static void *play_games(void *arg)
+{
+    tally results;
+    int gamenum, i;
+
+    memset(&results, 0, sizeof(results));
+    while ((gamenum = __sync_fetch_and_add(&nextgame, 1)) < numgames) {
+        play_game(gamenum, &results);
+    }
+
+    pthread_mutex_lock(&totallock);
+    for (i=0; i<MAXSTRATEGIES; i++) {
+        total.wins[i] += results.wins[i];
+        total.seats[i] += results.seats[i];
+    }
+    total.draws += results.draws;
+    total.rounds += results.rounds;
+    total.mismatches += results.mismatches;
+    pthread_mutex_unlock(&totallock);
+    return NULL;
+}
+
+
+
+
+/* Play one game to the end. Returns the winning player, -1 for a draw. */
+static int play_game(int gamenum, tally *results)
+{
+    gamestate game; /* each game owns its state and random streams, so threads share nothing */
+    decision decisions[MAXPLAYERS];
+    unsigned int rng = (batchseed ^ ((unsigned int)gamenum * 2654435761U)) | 1;
+    int player, round, left, winner = -1;
+
+    init_game(&game, startingforce, next_random(&rng));
+    for (player=0; player<numplayers; player++) {
+        add_player(&game, player);
+        results->seats[seating[player % numseating]]++;
+    }
+    for (player=0; player<MAXPLAYERS; player++) {
+        decisions[player].ally = -1;
+        decisions[player].offertarget = -1;
+        decisions[player].attack = -1;
+    }
+
+    left = numplayers;
+    for (round=0; round<maxrounds && left>1; round++) {
+        for (player=0; player<numplayers; player++) {
+            if (game.players[player].playing > 0) {
+                decide(&game, player, seating[player % numseating], &rng, &decisions[player]);
+            }
+        }
+        left = play_round(&game, decisions);
+        results->rounds++;
+    }
+
+#ifdef GRIDCHECK
+    results->mismatches += game.mismatches;
+#endif
+    if (left == 1) {
+        for (player=0; player<numplayers; player++) {
+            if (game.players[player].playing > 0) {
+                winner = player;
+            }
+        }
+        results->wins[seating[winner % numseating]]++;
+    }
+    else { /* round limit reached, or the last players knocked each other out */
+        results->draws++;
+    }
+    return winner;
+}
+
+
+
+
+/* Choose a bot's offer and attack for this round. */
+static void decide(gamestate *game, int player, int strategy, unsigned int *rng, decision *choice)
+{
+    choice->ally = -1;
+    choice->offertarget = -1;
+    choice->attack = -1;
+    if (strategy == 0) { /* random - attack anyone, ask anyone for help */
+        choice->attack = pick_random(game, player, rng);
+        choice->ally = pick_random(game, player, rng);
+        choice->offertarget = choice->attack;
+    }
+    else if (strategy == 1) { /* weakest - pick on the smallest force, ask the largest for help */
+        choice->attack = pick_opponent(game, player, 0);
+        choice->ally = pick_opponent(game, player, 1);
+        choice->offertarget = choice->attack;
+    }
+    else if (strategy == 2) { /* strongest - go after the leader, ask the smallest for help */
+        choice->attack = pick_opponent(game, player, 1);
+        choice->ally = pick_opponent(game, player, 0);
+        choice->offertarget = choice->attack;
+    }
+    /* pacifist - never attacks and makes no offers */
+    if (choice->ally == choice->attack) {
+        choice->ally = -1;
+    }
+}
+
+
+
+
+/* Find the opponent with the most (strongest = 1) or fewest troops, -1 if none. Ties go to the lowest-numbered player. */
+static int pick_opponent(gamestate *game, int player, int strongest)
+{
+    int other, best = -1;
+
+    for (other=0; other<numplayers; other++) {
+        if (other == player || game->players[other].playing <= 0) {
+            continue;
+        }
+        if (best < 0 || (strongest != 0 && game->players[other].troops > game->players[best].troops) || (strongest == 0 && game->players[other].troops < game->players[best].troops)) {
+            best = other;
+        }
+    }
+    return best;
+}
+
+
+
+
+/* Pick a random opponent still in the game, -1 if none. */
+static int pick_random(gamestate *game, int player, unsigned int *rng)
+{
+    int candidates[MAXPLAYERS];
+    int other, count = 0;
+
+    for (other=0; other<numplayers; other++) {
+        if (other != player && game->players[other].playing > 0) {
+            candidates[count++] = other;
+        }
+    }
+    if (count == 0) {
+        return -1;
+    }
+    return candidates[next_random(rng) % count];
+}
+
+
+
+
+static unsigned int next_random(unsigned int *rng)
+{
+    unsigned int x = *rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+    return x;
+}
+
+
+
+
+/* Fill seating from a comma-separated list of strategy names. Returns the number of entries, 0 if a name is unknown. */
+static int parse_bots(char *list)
+{
+    char copy[256];
+    char *name;
+    int count = 0, strategy;
+
+    strncpy(copy, list, sizeof(copy)-1);
+    copy[sizeof(copy)-1] = '\0';
+    for (name=strtok(copy, ","); name!=NULL && count<MAXPLAYERS; name=strtok(NULL, ",")) {
+        for (strategy=0; strategy<MAXSTRATEGIES; strategy++) {
+            if (strcmp(name, strategynames[strategy]) == 0) {
+                break;
+            }
+        }
+        if (strategy == MAXSTRATEGIES) {
+            return 0;
+        }
+        seating[count++] = strategy;
+    }
+    return count;
+}
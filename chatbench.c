@@ -0,0 +1,934 @@
+/* chatbench.c - end-to-end latency and throughput benchmark of a chat server over the chat protocol */
+#define _GNU_SOURCE /* for ppoll() */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define PROTOPORT 36724 /* default protocol port number */
+#define SERVERCLIENTS 30 /* the server's MAXCLIENTS */
+#define MAXPORTS 4 /* servers of a federation driven at once */
+#define MAXCONNS (SERVERCLIENTS*MAXPORTS)
+#define CHATSIZE 80 /* the server's maximum chat message length */
+#define NAMESIZE 12 /* the server's maximum name length */
+#define INSIZE 4096 /* bytes of unparsed input kept per connection */
+#define DRAINSECS 2 /* seconds to wait for messages still in flight after the run */
+#define BIN_CHAT 0x01 /* the server's binary frame opcodes */
+#define BIN_ANY 0x02
+#define BIN_ENTER 0x04
+#define BIN_CHANNEL 0x06
+#define BIN_TEXT 0x80
+#define BIN_SCHAT 0x81
+#define BIN_ROSTER 0x82
+
+/*------------------------------------------------------------------------
+* Program: chatbench
+*
+* Purpose: measure a chat server end to end, the way clients see it:
+* (1) connect senders + receivers clients and join each one
+* (2) have every sender send cchat messages for the length of the run,
+*     each carrying the time it was sent in its body, keeping at most
+*     window messages in flight per sender
+* (3) read every connection, and for each schat that arrives take the
+*     time from its body to get the send-to-receive latency
+* (4) print one line of key=value results
+* Every connection reads, as ANY and ALL deliver to senders too. A message
+* is in flight until all of its deliveries have arrived: one per recipient
+* named, one for ANY, one per connection for ALL, and one per member for
+* channel. In channel mode each sender has a channel of its own, entered
+* before the run by the sender and the recipients receivers it would have
+* named in turn, so channel and named runs of the same size compare
+* fan-out through a channel with fan-out by name.
+*
+* Messages sent during the warmup are delivered but not counted. Rates are
+* over the measured part of the run. Delivered bytes are whole schat
+* messages as read off the socket.
+*
+* The results line holds mode, senders, receivers, recipients, size,
+* window, seconds, sent, delivered, strikes, msgs_per_sec, bytes_per_sec,
+* and p50_us, p99_us, p999_us and max_us latency. Compare lines from runs
+* against different server builds to catch regressions.
+*
+* With -e binary every client joins in text, then sends (cbin) and speaks
+* the server's length-prefixed binary frames for the rest of the run,
+* addressing receivers by the IDs in the roster frame. Given the server's
+* process ID with -P, chatbench also reads the server's CPU time from
+* /proc at the start and end of the measured part of the run and adds
+* server_cpu_us_per_msg - CPU microseconds per delivery - to the results,
+* to compare the cost of the two encodings.
+*
+* With -f, flooders more clients join as FLOOD<n> and, for the length of
+* the run, send chats to ALL as fast as their sockets take them, reading
+* and discarding whatever arrives - the abusive clients a server's rate
+* limits are meant to contain. Give -i a rate to hold the senders to it,
+* so that they stay within the limits themselves. The results then add flood_sent, the
+* flooders' chats written, and flooders_dropped. Comparing p99_us with
+* and without flooders, against a server with and without limits, shows
+* whether one noisy client hurts everyone else.
+*
+* Given a comma-separated list of ports, chatbench spreads its clients
+* over the servers of a federation round-robin - client i connects to
+* port i mod the number of ports - so named and ALL chats cross the relay
+* links between them. Binary and channel runs, whose IDs and channels do
+* not cross servers, take a single port.
+*
+* Build: gcc -O2 -o chatbench chatbench.c
+*
+* Syntax: chatbench [-h host] [-p port] [-s senders] [-r receivers]
+*                   [-m mode] [-k recipients] [-b size] [-w window]
+*                   [-d seconds] [-W warmup] [-e encoding] [-P pid]
+*                   [-f flooders] [-i rate]
+*
+* host          address of the server
+* port          port of the server, or comma-separated ports of servers
+*               in one federation
+* senders       number of clients sending
+* receivers     number of clients only receiving
+* mode          named, any, all or channel - who each message is sent to
+* recipients    receivers named in each message, or in each channel
+* size          length of each chat message, at most CHATSIZE
+* window        messages each sender may have in flight
+* seconds       length of the measured run
+* warmup        seconds run before measuring
+* encoding      text or binary - the protocol clients speak
+* pid           process ID of the server, to measure its CPU time
+* flooders      clients flooding the server with chats to ALL
+* rate          chats a second each sender sends at most, 0 for as many
+*               as its window allows
+*
+* All arguments are optional. The default values are as follows:
+*   host = 127.0.0.1
+*   port = 36724
+*   senders = 4
+*   receivers = 8
+*   mode = named
+*   recipients = 1
+*   size = 64
+*   window = 1
+*   seconds = 5
+*   warmup = 1
+*   encoding = text
+*   pid = none
+*   flooders = 0
+*   rate = 0
+*
+* senders + receivers + flooders may not be more than the server's
+* MAXCLIENTS for each port. A window of chats longer than the server's receive buffer draws toolong
+* strikes.
+*
+*------------------------------------------------------------------------
+*/
+
+typedef struct {
+		int socket;
+		char name[NAMESIZE+1]; /* as assigned by the server */
+		char in[INSIZE+1]; /* received and not yet parsed */
+		int inlen;
+		long pending; /* deliveries of this sender's messages still to arrive */
+		long sent; /* chats sent by this connection */
+		unsigned int id; /* as given in the roster, for binary frames */
+		int floodoffset; /* a flooder's place in floodbatch */
+		unsigned long long nextsend; /* when a paced sender may send again, from now_nanos() */
+	} conninfo;
+
+conninfo conns[MAXCONNS]; /* senders first, then receivers, then flooders */
+int numflooders = 0;
+int pace = 0; /* -i: chats a second per sender, 0 for unpaced */
+char floodbatch[4096]; /* chats to ALL back to back, written round and round by each flooder */
+int floodlength, floodchat; /* bytes in floodbatch, and in each chat in it */
+int numsenders = 4, numreceivers = 8, numconns;
+char mode = 'n'; /* 'n' named, 'a' ANY, 'l' ALL, 'c' channel */
+int recipients = 1, size = 64, window = 1;
+int perchat; /* deliveries each chat makes */
+unsigned long long *latencies = NULL; /* measured latencies, in nanoseconds */
+long numlatencies = 0, maxlatencies = 0;
+unsigned long long measurestart, measureend; /* send times counted, from now_nanos() */
+long delivered = 0; /* deliveries counted */
+long deliveredbytes = 0;
+long strikes = 0;
+long entered = 0; /* senter answers received */
+int binary = 0; /* 1 once clients speak binary frames */
+int serverpid = 0; /* 0 if not measuring the server's CPU time */
+
+/* helper functions */
+static int  connect_client(char *host, int port);
+static void join_client(conninfo *conn, int number);
+static void switch_to_binary(conninfo *conn);
+static void take_roster(unsigned char *roster, int length);
+static void enter_channel(conninfo *conn, int sender);
+static void send_chat(int sender, unsigned long long now);
+static void read_conn(conninfo *conn);
+static void flood(conninfo *conn, struct pollfd *fd);
+static void drain_flooder(conninfo *conn, struct pollfd *fd);
+static void read_frames(conninfo *conn);
+static void take_message(char *message, int length);
+static void take_chat(char *body, int length);
+static int  put_varint(unsigned char *out, unsigned int value);
+static int  get_varint(unsigned char *pos, unsigned char *end, unsigned int *value);
+static unsigned long long server_cpu();
+static void add_latency(unsigned long long nanos);
+static int  compare_latencies(const void *a, const void *b);
+static double percentile(double fraction);
+static unsigned long long now_nanos();
+
+
+
+
+int main(int argc, char **argv)
+{
+	char *host = "127.0.0.1";
+	int ports[MAXPORTS] = { PROTOPORT };
+	int numports = 1;
+	char *portlist = NULL;
+	double seconds = 5, warmup = 1;
+	struct pollfd fds[MAXCONNS];
+	unsigned long long start, stop, now;
+	long sentcounted = 0;
+	unsigned long long cpustart = 0, cpuend = 0; /* server CPU time, in microseconds */
+	int i;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-h") == 0 && (i+1) < argc) {
+			host = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+			portlist = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numsenders);
+		}
+		else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numreceivers);
+		}
+		else if (strcmp(argv[i], "-m") == 0 && (i+1) < argc) {
+			mode = strcmp(argv[i+1], "any") == 0 ? 'a' : strcmp(argv[i+1], "all") == 0 ? 'l' : strcmp(argv[i+1], "channel") == 0 ? 'c' : 'n';
+		}
+		else if (strcmp(argv[i], "-k") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &recipients);
+		}
+		else if (strcmp(argv[i], "-b") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &size);
+		}
+		else if (strcmp(argv[i], "-w") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &window);
+		}
+		else if (strcmp(argv[i], "-d") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &seconds);
+		}
+		else if (strcmp(argv[i], "-W") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &warmup);
+		}
+		else if (strcmp(argv[i], "-e") == 0 && (i+1) < argc) {
+			binary = strcmp(argv[i+1], "binary") == 0 ? 1 : 0;
+		}
+		else if (strcmp(argv[i], "-P") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &serverpid);
+		}
+		else if (strcmp(argv[i], "-f") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numflooders);
+		}
+		else if (strcmp(argv[i], "-i") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &pace);
+		}
+	}
+	if (portlist != NULL) {
+		char *entry;
+		numports = 0;
+		for (entry=strtok(portlist, ","); entry!=NULL && numports<MAXPORTS; entry=strtok(NULL, ",")) {
+			sscanf(entry, "%d", &ports[numports++]);
+		}
+		if (numports == 0 || entry != NULL) {
+			fprintf(stderr, "Error: give 1 to %d ports\n", MAXPORTS);
+			exit(1);
+		}
+	}
+	if (numsenders < 1 || numreceivers < 0 || numflooders < 0 || numsenders+numreceivers+numflooders > SERVERCLIENTS*numports) {
+		fprintf(stderr, "Error: need 1 or more senders and at most %d clients in all\n", SERVERCLIENTS*numports);
+		exit(1);
+	}
+	if (numports > 1 && (binary != 0 || mode == 'c')) {
+		fprintf(stderr, "Error: binary and channel runs need a single port\n");
+		exit(1);
+	}
+	if ((mode == 'n' || mode == 'c') && (recipients < 1 || recipients > numreceivers)) {
+		fprintf(stderr, "Error: named and channel modes need 1 to receivers recipients\n");
+		exit(1);
+	}
+	if (size < 24 || size > CHATSIZE) { /* room for the timestamp and sender */
+		fprintf(stderr, "Error: size must be from 24 to %d\n", CHATSIZE);
+		exit(1);
+	}
+	if (window < 1) {
+		window = 1;
+	}
+	numconns = numsenders + numreceivers;
+	perchat = mode == 'n' ? recipients : mode == 'a' ? 1 : mode == 'c' ? recipients+1 : numconns;
+	if (mode == 'a' && numconns < 2) {
+		fprintf(stderr, "Error: ANY needs 2 or more clients\n");
+		exit(1);
+	}
+
+	for (i=0; i<numconns+numflooders; i++) {
+		conns[i].socket = connect_client(host, ports[i % numports]);
+		join_client(&conns[i], i);
+		fds[i].fd = conns[i].socket;
+		fds[i].events = POLLIN;
+	}
+	for (i=0; i<numconns+numflooders; i++) { /* forget the roster updates sent while the others joined */
+		conns[i].inlen = 0;
+	}
+	if (numflooders > 0) {
+		char body[CHATSIZE+1];
+		memset(body, 'f', size);
+		body[size] = '\0';
+		floodlength = 0;
+		floodchat = strlen("(cchat(ALL)())") + size;
+		while (floodlength + floodchat < (int) sizeof(floodbatch)) {
+			floodlength += sprintf(floodbatch+floodlength, "(cchat(ALL)(%s))", body);
+		}
+		for (i=numconns; i<numconns+numflooders; i++) {
+			fcntl(conns[i].socket, F_SETFL, fcntl(conns[i].socket, F_GETFL) | O_NONBLOCK);
+			fds[i].events = POLLIN | POLLOUT;
+		}
+	}
+	if (binary != 0) {
+		for (i=0; i<numconns; i++) {
+			switch_to_binary(&conns[i]);
+		}
+	}
+	if (mode == 'c') { /* open every sender's channel and wait until all its members are in */
+		int r;
+		for (i=0; i<numsenders; i++) {
+			enter_channel(&conns[i], i);
+			for (r=0; r<recipients; r++) {
+				enter_channel(&conns[numsenders + (i*recipients + r) % numreceivers], i);
+			}
+		}
+		while (entered < (long) numsenders*(recipients+1)) {
+			if (poll(fds, numconns, 1000) <= 0) {
+				fprintf(stderr, "Error: the server answered %ld of %d channel entries\n", entered, numsenders*(recipients+1));
+				exit(1);
+			}
+			for (i=0; i<numconns; i++) {
+				if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+					read_conn(&conns[i]);
+				}
+			}
+		}
+	}
+
+	start = now_nanos();
+	measurestart = start + (unsigned long long) (warmup * 1e9);
+	measureend = measurestart + (unsigned long long) (seconds * 1e9);
+	stop = measureend + DRAINSECS * 1000000000ULL;
+	now = start;
+	for (i=0; i<numsenders && pace > 0; i++) { /* spread the paced senders over the first interval */
+		conns[i].nextsend = start + 1000000000ULL / pace * i / numsenders;
+	}
+	while (now < stop) {
+		long inflight = 0;
+		unsigned long long wake = now + 100000000ULL; /* poll for at most 100 ms */
+		struct timespec timeout;
+		if (serverpid != 0 && cpustart == 0 && now >= measurestart) {
+			cpustart = server_cpu();
+		}
+		if (serverpid != 0 && cpuend == 0 && now >= measureend) {
+			cpuend = server_cpu();
+		}
+		if (now < measureend) { /* top up every sender's window */
+			for (i=0; i<numsenders; i++) {
+				while (conns[i].pending <= (long) (window-1) * perchat && (pace == 0 || conns[i].nextsend <= now)) {
+					send_chat(i, now);
+					if (now >= measurestart) {
+						sentcounted++;
+					}
+					if (pace > 0) { /* a sender held back by its window does not catch up later in a burst */
+						conns[i].nextsend += 1000000000ULL / pace;
+						if (conns[i].nextsend < now) {
+							conns[i].nextsend = now;
+						}
+					}
+				}
+				if (pace > 0 && conns[i].nextsend > now && conns[i].nextsend < wake) { /* else it waits on its window */
+					wake = conns[i].nextsend;
+				}
+			}
+		}
+		for (i=0; i<numsenders; i++) {
+			inflight += conns[i].pending;
+		}
+		if (now >= measureend && inflight == 0) {
+			break;
+		}
+		timeout.tv_sec = (wake - now) / 1000000000ULL;
+		timeout.tv_nsec = (wake - now) % 1000000000ULL;
+		if (ppoll(fds, numconns+numflooders, &timeout, NULL) < 0) {
+			perror("ppoll");
+			exit(1);
+		}
+		for (i=0; i<numconns; i++) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+				read_conn(&conns[i]);
+			}
+		}
+		for (i=numconns; i<numconns+numflooders; i++) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+				drain_flooder(&conns[i], &fds[i]);
+			}
+			if ((fds[i].revents & POLLOUT) != 0 && now < measureend) {
+				flood(&conns[i], &fds[i]);
+			}
+			else if (now >= measureend) {
+				fds[i].events = POLLIN;
+			}
+		}
+		now = now_nanos();
+	}
+	for (i=0; i<numconns+numflooders; i++) {
+		close(conns[i].socket);
+	}
+
+	qsort(latencies, numlatencies, sizeof(unsigned long long), compare_latencies);
+	printf("encoding=%s servers=%d ", binary != 0 ? "binary" : "text", numports);
+	printf("mode=%s senders=%d receivers=%d recipients=%d size=%d window=%d seconds=%.2f sent=%ld delivered=%ld strikes=%ld msgs_per_sec=%.0f bytes_per_sec=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f",
+		mode == 'n' ? "named" : mode == 'a' ? "any" : mode == 'c' ? "channel" : "all", numsenders, numreceivers, mode == 'n' ? recipients : perchat, size, window, seconds,
+		sentcounted, delivered, strikes, delivered / seconds, deliveredbytes / seconds,
+		percentile(0.5) / 1000.0, percentile(0.99) / 1000.0, percentile(0.999) / 1000.0, percentile(1.0) / 1000.0);
+	if (numflooders > 0) {
+		long floodsent = 0;
+		int dropped = 0;
+		for (i=numconns; i<numconns+numflooders; i++) {
+			floodsent += conns[i].sent;
+			dropped += fds[i].fd < 0 ? 1 : 0;
+		}
+		printf(" flooders=%d flood_sent=%ld flooders_dropped=%d", numflooders, floodsent, dropped);
+	}
+	if (serverpid != 0) {
+		printf(" server_cpu_us_per_msg=%.3f", delivered > 0 && cpuend > cpustart ? (double) (cpuend-cpustart) / delivered : 0.0);
+	}
+	printf("\n");
+	if (strikes != 0) {
+		fprintf(stderr, "Warning: the server gave %ld strikes - results are suspect\n", strikes);
+	}
+	exit(0);
+}
+
+
+
+
+/* Connect to the server, with Nagle off so each chat goes out when it is sent. */
+static int connect_client(char *host, int port)
+{
+	struct sockaddr_in sad;
+	int sd, flag = 1;
+
+	memset((char *)&sad, 0, sizeof(sad));
+	sad.sin_family = AF_INET;
+	sad.sin_port = htons((u_short)port);
+	if (inet_pton(AF_INET, host, &sad.sin_addr) != 1) {
+		fprintf(stderr, "Error: bad host address %s\n", host);
+		exit(1);
+	}
+	sd = socket(PF_INET, SOCK_STREAM, 0);
+	if (sd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (connect(sd, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+	return sd;
+}
+
+
+
+
+/* Join as SEND<n> or RECV<n>, and wait for the sjoin to learn the name the server gave. */
+static void join_client(conninfo *conn, int number)
+{
+	char message[64];
+	char *found;
+	int nbytes;
+
+	if (number < numsenders) {
+		snprintf(message, sizeof(message), "(cjoin(SEND%d))", number);
+	}
+	else if (number >= numconns) {
+		snprintf(message, sizeof(message), "(cjoin(FLOOD%d))", number-numconns);
+	}
+	else {
+		snprintf(message, sizeof(message), "(cjoin(RECV%d))", number-numsenders);
+	}
+	if (write(conn->socket, message, strlen(message)) < 0) {
+		perror("write");
+		exit(1);
+	}
+	while ((found = strstr(conn->in, "(sjoin(")) == NULL || strchr(found+7, ')') == NULL) {
+		if (strstr(conn->in, "(snovac)") != NULL) {
+			fprintf(stderr, "Error: the server has no room for %d clients\n", numconns);
+			exit(1);
+		}
+		nbytes = read(conn->socket, conn->in+conn->inlen, INSIZE-conn->inlen);
+		if (nbytes <= 0) {
+			fprintf(stderr, "Error: the server dropped client %d while joining\n", number);
+			exit(1);
+		}
+		conn->inlen += nbytes;
+		conn->in[conn->inlen] = '\0';
+	}
+	sscanf(found+7, "%12[^)]", conn->name);
+}
+
+
+
+
+/* Send (cbin), wait for (sbin), and read frames until the roster gives every client's ID. */
+static void switch_to_binary(conninfo *conn)
+{
+	char *found;
+	int nbytes, begin;
+
+	if (write(conn->socket, "(cbin)", 6) < 0) {
+		perror("write");
+		exit(1);
+	}
+	conn->inlen = 0;
+	conn->in[0] = '\0';
+	while ((found = strstr(conn->in, "(sbin)")) == NULL) {
+		nbytes = read(conn->socket, conn->in+conn->inlen, INSIZE-conn->inlen);
+		if (nbytes <= 0) {
+			fprintf(stderr, "Error: the server dropped %s - does it speak binary frames?\n", conn->name);
+			exit(1);
+		}
+		conn->inlen += nbytes;
+		conn->in[conn->inlen] = '\0';
+	}
+	begin = found+6 - conn->in; /* frames start right after */
+	memmove(conn->in, conn->in+begin, conn->inlen-begin);
+	conn->inlen -= begin;
+	conn->id = (unsigned int) -1;
+	while (conn->id == (unsigned int) -1) {
+		unsigned char *pos = (unsigned char *) conn->in;
+		unsigned int length;
+		int used = get_varint(pos, pos+conn->inlen, &length);
+		if (used > 0 && conn->inlen-used >= (int) length) {
+			if (length > 0 && pos[used] == BIN_ROSTER) {
+				take_roster(pos+used+1, length-1);
+			}
+			memmove(conn->in, conn->in+used+length, conn->inlen-used-length);
+			conn->inlen -= used+length;
+			continue;
+		}
+		nbytes = read(conn->socket, conn->in+conn->inlen, INSIZE-conn->inlen);
+		if (nbytes <= 0) {
+			fprintf(stderr, "Error: the server dropped %s while switching to binary\n", conn->name);
+			exit(1);
+		}
+		conn->inlen += nbytes;
+	}
+}
+
+
+
+
+/* Put a client in a sender's channel, C<sender>. The answer is counted in entered when it arrives. */
+static void enter_channel(conninfo *conn, int sender)
+{
+	char message[64];
+	int length;
+
+	if (binary != 0) {
+		length = snprintf(message+2, sizeof(message)-2, "C%d", sender);
+		message[0] = (char) (length+1);
+		message[1] = BIN_ENTER;
+		length += 2;
+	}
+	else {
+		length = snprintf(message, sizeof(message), "(center(C%d))", sender);
+	}
+	if (write(conn->socket, message, length) != length) {
+		perror("write");
+		exit(1);
+	}
+}
+
+
+
+
+/* Give each client the ID the roster lists for its name. */
+static void take_roster(unsigned char *roster, int length)
+{
+	unsigned char *pos = roster, *end = roster+length;
+	char name[NAMESIZE+1];
+	unsigned int id;
+	int used, namelength, i;
+
+	while (pos < end) {
+		used = get_varint(pos, end, &id);
+		if (used <= 0 || pos+used >= end) {
+			return;
+		}
+		pos += used;
+		namelength = *pos++;
+		if (namelength > NAMESIZE || pos+namelength > end) {
+			return;
+		}
+		memcpy(name, pos, namelength);
+		name[namelength] = '\0';
+		pos += namelength;
+		for (i=0; i<numconns; i++) {
+			if (strcmp(conns[i].name, name) == 0) {
+				conns[i].id = id;
+			}
+		}
+	}
+}
+
+
+
+
+/* Send one chat from a sender, stamped with the time and the sender's number. */
+static void send_chat(int sender, unsigned long long now)
+{
+	char body[CHATSIZE+1], message[CHATSIZE+MAXCONNS*(NAMESIZE+1)+32];
+	char names[MAXCONNS*(NAMESIZE+1)+1];
+	int length, r;
+
+	if (mode == 'c') {
+		snprintf(names, sizeof(names), "#C%d", sender);
+	}
+	else if (mode == 'n') { /* the next recipients receivers in turn */
+		names[0] = '\0';
+		for (r=0; r<recipients; r++) {
+			conninfo *receiver = &conns[numsenders + (conns[sender].sent*recipients + r) % numreceivers];
+			if (r > 0) {
+				strcat(names, ",");
+			}
+			strcat(names, receiver->name);
+		}
+	}
+	else {
+		strcpy(names, mode == 'a' ? "ANY" : "ALL");
+	}
+	length = snprintf(body, sizeof(body), "%llu:%d:", now, sender);
+	memset(body+length, 'x', size-length);
+	body[size] = '\0';
+	if (binary != 0) { /* varint length, opcode, recipient count and IDs, message */
+		unsigned char frame[sizeof(message)];
+		int framelength = 1;
+		frame[0] = mode == 'a' ? BIN_ANY : mode == 'c' ? BIN_CHANNEL : BIN_CHAT;
+		if (mode == 'c') { /* channel name length, then name */
+			frame[1] = (unsigned char) (strlen(names)-1);
+			memcpy(frame+2, names+1, frame[1]);
+			framelength += 1+frame[1];
+		}
+		else if (mode != 'a') {
+			framelength += put_varint(frame+framelength, mode == 'n' ? recipients : 0);
+			for (r=0; mode == 'n' && r<recipients; r++) {
+				framelength += put_varint(frame+framelength, conns[numsenders + (conns[sender].sent*recipients + r) % numreceivers].id);
+			}
+		}
+		memcpy(frame+framelength, body, size);
+		framelength += size;
+		length = put_varint((unsigned char *) message, framelength);
+		memcpy(message+length, frame, framelength);
+		length += framelength;
+	}
+	else {
+		length = snprintf(message, sizeof(message), "(cchat(%s)(%s))", names, body);
+	}
+	if (write(conns[sender].socket, message, length) != length) {
+		perror("write");
+		exit(1);
+	}
+	conns[sender].pending += perchat;
+	conns[sender].sent++;
+}
+
+
+
+
+/* Write as much more of the flood batch as a flooder's socket takes now, counting each chat finished. */
+static void flood(conninfo *conn, struct pollfd *fd)
+{
+	int nbytes;
+
+	while (1) {
+		nbytes = send(conn->socket, floodbatch+conn->floodoffset, floodlength-conn->floodoffset, MSG_NOSIGNAL);
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (nbytes <= 0) { /* dropped by the server - drain_flooder() notices */
+			fd->events = POLLIN;
+			return;
+		}
+		conn->sent += (conn->floodoffset+nbytes) / floodchat - conn->floodoffset / floodchat;
+		conn->floodoffset = (conn->floodoffset+nbytes) % floodlength;
+	}
+}
+
+
+
+
+/* Read and discard what has arrived for a flooder, and stop polling it once the server drops it. */
+static void drain_flooder(conninfo *conn, struct pollfd *fd)
+{
+	char discard[INSIZE];
+	int nbytes;
+
+	while ((nbytes = read(conn->socket, discard, sizeof(discard))) > 0) {
+	}
+	if (nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		fd->fd = -1;
+	}
+}
+
+
+
+
+/* Read what has arrived on a connection and take each complete message out of it. */
+static void read_conn(conninfo *conn)
+{
+	int nbytes, depth = 0, i, begin = 0;
+
+	nbytes = read(conn->socket, conn->in+conn->inlen, INSIZE-conn->inlen);
+	if (nbytes <= 0) {
+		fprintf(stderr, "Error: the server dropped %s after %ld strikes - a smaller window may help\n", conn->name, strikes);
+		exit(1);
+	}
+	conn->inlen += nbytes;
+	if (binary != 0) {
+		read_frames(conn);
+		return;
+	}
+	for (i=0; i<conn->inlen; i++) {
+		if (conn->in[i] == '(') {
+			if (depth == 0) {
+				begin = i;
+			}
+			depth++;
+		}
+		else if (conn->in[i] == ')' && depth > 0) {
+			depth--;
+			if (depth == 0) {
+				take_message(conn->in+begin, i+1-begin);
+				begin = i+1;
+			}
+		}
+		else if (depth == 0) {
+			begin = i+1;
+		}
+	}
+	memmove(conn->in, conn->in+begin, conn->inlen-begin);
+	conn->inlen -= begin;
+	if (conn->inlen >= INSIZE) { /* a message too long to be the server's - drop it */
+		conn->inlen = 0;
+	}
+}
+
+
+
+
+/* Take each complete frame out of a binary connection's input. Text messages come wrapped in BIN_TEXT. */
+static void read_frames(conninfo *conn)
+{
+	unsigned char *start = (unsigned char *) conn->in, *pos = start, *end = start + conn->inlen;
+	unsigned int length, id;
+	int used, idlength;
+
+	while ((used = get_varint(pos, end, &length)) > 0 && end-pos-used >= (long) length) {
+		if (length > 0 && pos[used] == BIN_TEXT) {
+			take_message((char *) pos+used+1, length-1);
+		}
+		else if (length > 0 && pos[used] == BIN_SCHAT && (idlength = get_varint(pos+used+1, pos+used+length, &id)) > 0) {
+			take_chat((char *) pos+used+1+idlength, used+length);
+		}
+		pos += used + length;
+	}
+	memmove(start, pos, end-pos);
+	conn->inlen = end-pos;
+	if (conn->inlen >= INSIZE) { /* a frame too long to be the server's - drop it */
+		conn->inlen = 0;
+	}
+}
+
+
+
+
+/* Account for one message from the server. Only schats, schans, senters and strikes matter. */
+static void take_message(char *message, int length)
+{
+	char *body;
+
+	if (strncmp(message, "(strike(", 8) == 0) {
+		strikes++;
+		return;
+	}
+	if (strncmp(message, "(senter(", 8) == 0) {
+		entered++;
+		return;
+	}
+	if (strncmp(message, "(schan(", 7) == 0 && (body = strstr(message, ")(")) != NULL) { /* skip the channel name */
+		message = body+1;
+	}
+	else if (strncmp(message, "(schat(", 7) != 0) {
+		return;
+	}
+	if ((body = strstr(message, ")(")) == NULL) {
+		return;
+	}
+	take_chat(body+2, length);
+}
+
+
+
+
+/* Account for one delivered chat, given its body and the bytes it took on the wire. */
+static void take_chat(char *body, int length)
+{
+	unsigned long long sent, now;
+	int sender;
+
+	now = now_nanos();
+	if (sscanf(body, "%llu:%d:", &sent, &sender) != 2 || sender < 0 || sender >= numsenders) {
+		return;
+	}
+	conns[sender].pending--;
+	if (sent >= measurestart && sent < measureend) {
+		delivered++;
+		deliveredbytes += length;
+		add_latency(now - sent);
+	}
+}
+
+
+
+
+/* Write value as a varint - 7 bits a byte, low bits first. Returns the number of bytes written. */
+static int put_varint(unsigned char *out, unsigned int value)
+{
+	int used = 0;
+
+	while (value >= 0x80) {
+		out[used++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	out[used++] = (unsigned char) value;
+	return used;
+}
+
+
+
+
+/* Read a varint, reading nothing at or past end. Returns the number of bytes read, 0 if it is not all there, -1 if it is too long. */
+static int get_varint(unsigned char *pos, unsigned char *end, unsigned int *value)
+{
+	int used = 0;
+
+	*value = 0;
+	while (pos+used < end) {
+		if (used == 5) {
+			return -1;
+		}
+		*value |= (unsigned int) (pos[used] & 0x7f) << (7*used);
+		if ((pos[used++] & 0x80) == 0) {
+			return used;
+		}
+	}
+	return used == 5 ? -1 : 0;
+}
+
+
+
+
+/* User plus system CPU time the server has used, in microseconds, from /proc/<pid>/stat. */
+static unsigned long long server_cpu()
+{
+	char path[64], stat[1024], *fields;
+	unsigned long long utime, stime;
+	FILE *file;
+	size_t nbytes;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", serverpid);
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+	nbytes = fread(stat, 1, sizeof(stat)-1, file);
+	fclose(file);
+	stat[nbytes] = '\0';
+	fields = strrchr(stat, ')'); /* the command name may hold spaces */
+	if (fields == NULL || sscanf(fields+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+		fprintf(stderr, "Error: cannot read the CPU time of process %d\n", serverpid);
+		exit(1);
+	}
+	return (utime + stime) * 1000000ULL / (unsigned long long) sysconf(_SC_CLK_TCK);
+}
+
+
+
+
+static void add_latency(unsigned long long nanos)
+{
+	if (numlatencies == maxlatencies) {
+		maxlatencies = maxlatencies > 0 ? maxlatencies*2 : 65536;
+		latencies = realloc(latencies, maxlatencies*sizeof(unsigned long long));
+		if (latencies == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	latencies[numlatencies++] = nanos;
+}
+
+
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+
+
+/* Latency, in nanoseconds, at a fraction of the sorted latencies - nearest rank. */
+static double percentile(double fraction)
+{
+	long rank;
+
+	if (numlatencies == 0) {
+		return 0.0;
+	}
+	rank = (long) (fraction * numlatencies + 0.999999) - 1;
+	if (rank < 0) {
+		rank = 0;
+	}
+	if (rank >= numlatencies) {
+		rank = numlatencies - 1;
+	}
+	return (double) latencies[rank];
+}
+
+
+
+
+static unsigned long long now_nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
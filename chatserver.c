@@ -2,7 +2,14 @@
 #define closesocket close
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -14,10 +21,17 @@
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
+#include "logger.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "compress.h"
 
 #define PROTOPORT 36724 /* default protocol port number */
+#define STATSPORT 36726 /* default stats port number */
 #define QLEN 30 /* size of request queue */
+#ifndef MAXCLIENTS
 #define MAXCLIENTS 30 /* maximum allowable number of clients */
+#endif
 #define BUFSIZE 481  /* server's maximum buffer size */
 #define MAXMESSAGE 480 /* length of maximum allowable message */
 #define NAMESIZE 12 /* length of maximum allowable name */
@@ -25,9 +39,56 @@
 #define SUFFIXSIZE 3 /* length of maximum name suffix */
 #define CHATSIZE 80 /* maximum chat message length */
 
+#define MAXCHANNELS 4096 /* most channels open at once */
+#define CHANNELBUCKETS 4096 /* number of channel name hash buckets - a power of two */
+#define MAXMEMBERSHIPS 16 /* most channels one client may be in */
+#define HISTORYSLOTS 256 /* chats to ALL kept in the history ring */
+#define HISTORYMAGIC 0x31484843U /* "CHH1" - marks a history file this server can read */
+
+#define MAXNODES 16 /* most servers in a federation */
+#define MAXNAMES (MAXCLIENTS*MAXNODES) /* most names a name table holds - every player in the federation */
+#define NAMETABLEBUCKETS 512 /* number of name table hash buckets - a power of two */
+#define VNODES 64 /* points each server has on the name ownership ring */
+#define RELAYBUFSIZE 65536 /* bytes of frames buffered each way on a relay link */
+#define LISTLIMIT (MAXMESSAGE-2*NAMESIZE-48) /* longest player list, leaving room for the rest of an sjoin */
+#define RELAY_HELLO 1 /* relay frame: number of the server dialing */
+#define RELAY_ADD 2 /* relay frame: name of a player who joined */
+#define RELAY_REMOVE 3 /* relay frame: name of a player who left, or of a claim given up */
+#define RELAY_CLAIM 4 /* relay frame: client number, client ID, name wanted - sent to the name's owner */
+#define RELAY_GRANT 5 /* relay frame: client number, client ID, name granted */
+#define RELAY_DENY 6 /* relay frame: client number, client ID, server holding the name, name */
+#define RELAY_CHAT 7 /* relay frame: sender name, recipient count, recipient names, message - no recipients means ALL */
+#define RELAY_SYNC 8 /* relay frame: empty - every player of the sender's has been sent since the link came up */
+#define DIALWAIT 200 /* milliseconds a relay link dial may take before it is given up */
+#define REDIALMIN 250000 /* microseconds before a dropped relay link is dialed again - doubled after each failed dial */
+#define REDIALMAX 8000000 /* longest wait between dials */
+
+#define HANDOFF_LISTEN 1 /* handoff record carrying the listening socket */
+#define HANDOFF_CLIENT 2 /* handoff record carrying a client's socket and state */
+#define HANDOFF_DONE 3 /* last handoff record - the replacement answers it with a byte once it has everything */
+#define HANDOFF_RELAY 4 /* handoff record carrying the socket listening for relay links */
+
+#define WHEELSLOTS 512 /* slots in the timer wheel - a power of two */
+#define WHEELTICK 100000 /* microseconds each wheel slot covers */
+
 #define CLEAR 1
 #define NOCLEAR 0 /* indicators for whether a client's info should be cleared on write error */
 
+#define MAXFRAME 400 /* longest binary frame, not counting its length */
+#define BIN_CHAT 0x01 /* client frame: recipient count, recipient IDs, message - no recipients means ALL */
+#define BIN_ANY 0x02 /* client frame: message for ANY */
+#define BIN_STAT 0x03 /* client frame: ask for the roster */
+#define BIN_ENTER 0x04 /* client frame: channel name to enter */
+#define BIN_LEAVE 0x05 /* client frame: channel name to leave */
+#define BIN_CHANNEL 0x06 /* client frame: channel name length, channel name, message */
+#define BIN_PONG 0x07 /* client frame: empty - an answer to (sping), showing the client is there */
+#define BIN_TEXT 0x80 /* server frame: a text protocol message, as is */
+#define BIN_SCHAT 0x81 /* server frame: sender ID, message */
+#define BIN_ROSTER 0x82 /* server frame: ID, name length and name of each player */
+#define BIN_ZTEXT 0x83 /* server frame: length of the text expanded, then text protocol messages compressed by zip_compress() */
+#define ZIPMIN 128 /* shortest message compressed - longer than any chat, so only rosters and replays are */
+#define ZIPHEADROOM 8 /* bytes kept in front of compressed text for its frame header */
+
 /*------------------------------------------------------------------------
 * Program: chatserver
 *
@@ -37,9 +98,193 @@
 * (3) respond appropriately to any client messages
 * (4) go back to step (1)
 *
-* Syntax: chatserver
+* Build: gcc -o chatserver chatserver.c logger.c metrics.c handoff.c compress.c -lpthread
+* Add -DLOGDEBUG to log every message received, not just connections,
+* names and strikes.
+* Add -DMAXCLIENTS=n for n client slots instead of 30 - fewer than
+* FD_SETSIZE less the server's own sockets, as it waits with select().
+*
+* Binary framing: a joined client may send (cbin). The server answers
+* (sbin) and a roster frame, and from then on both directions use binary
+* frames - a varint length (7 bits a byte, low bits first, high bit set
+* on all but the last byte) counting the bytes that follow, an opcode
+* byte, and a payload. Players are addressed by numeric ID, not name, so
+* chats are dispatched without scanning, and a chat between binary clients
+* is forwarded straight from the sender's receive buffer. Text clients are
+* not affected, and chats pass between text and binary clients both ways.
+* Client frames: BIN_CHAT, BIN_ANY, BIN_STAT. Server frames: BIN_SCHAT,
+* BIN_ROSTER, and BIN_TEXT carrying every other message (sjoin, sstat,
+* strike). Anything sent behind (cbin) before (sbin) arrives is dropped.
+* Frames longer than MAXFRAME draw a toolong strike and are skipped.
+*
+* Compression: a text client may send (czip), joined or not - before
+* (cjoin), so that its history replay is compressed too. The server
+* answers (szip) and from then on sends it only server frames: BIN_TEXT,
+* and BIN_ZTEXT for any message of ZIPMIN bytes or more that shrinks when
+* compressed - in practice sjoin and sstat with long rosters, and the
+* history replay, which is compressed whole into one frame. The client
+* keeps sending text until it sends (cbin), if it does. Each BIN_ZTEXT
+* frame is compressed on its own against the fixed dictionary of
+* compress.c, so it can be expanded alone, and one compressed for a
+* broadcast - an sstat after a join or leave - is written as is to every
+* client that takes them. The last replay compressed is kept until
+* history grows, so a run of joins compresses it once.
+*
+* Channels: a joined client enters a channel with (center(NAME)) and
+* leaves it with (cleave(NAME)), answered by (senter(NAME)) and
+* (sleave(NAME)). Channel names follow the rules for player names. A
+* channel is opened by its first member and closed when its last member
+* leaves. (cchat(#NAME)(message)) from a member reaches every member,
+* sender included, as (schan(NAME)(SENDER)(message)). Each channel keeps
+* a dense array of its members, so a channel message costs the same
+* whatever the number of other clients and channels, and is formatted
+* once and written to each member as is. Binary clients use BIN_ENTER,
+* BIN_LEAVE and BIN_CHANNEL, and receive the server's channel messages in
+* BIN_TEXT frames. A client may be in at most MAXMEMBERSHIPS channels.
+*
+* History: given -H file, the last HISTORYSLOTS chats to ALL are kept,
+* as the schat messages text clients were sent, in a ring in file, which
+* is mapped into memory and so outlives the server with nothing to save
+* or load. A newly named client - a new player, or one back after a drop
+* - is sent the last replay of them in one write, after its sjoin.
+* Adding a chat is a copy into the next slot; the server never syncs the
+* file itself, and leaves writing it back to the kernel, so history
+* survives the server crashing but may lose its last chats if the
+* machine does. A chat's slot is marked valid only once it is complete,
+* and a file written by a server with a different ring layout is
+* started afresh.
+*
+* Hot restart: a server started with -U path waits on a Unix-domain
+* socket at path for its replacement. The replacement, started with
+* -T path, connects and is sent the listening socket and every client's
+* socket, each with the client's state - name, strikes, binary framing,
+* unparsed input and channels - in one handoff record. The old server
+* closes its stats port first, so the replacement can open it, and exits
+* once the replacement has acknowledged the last record. Clients see no
+* disconnect: connections waiting to be accepted stay queued on the
+* shared listening socket, and input sent during the handoff waits in the
+* kernel for the new server. If the replacement fails before its
+* acknowledgement, the old server reopens its stats port and carries on.
+* Metrics counters start again from zero in the replacement; the history
+* file, if any, is simply mapped again. Both servers must be the same
+* build of the handoff record, which the replacement checks by size.
+*
+* Federation: servers started with the same -F list of relay addresses,
+* each with its own number in the list given by -N, form a mesh. Each
+* server listens on its own relay address and dials every other one at
+* startup - servers not yet up dial it when they start - so every pair
+* shares one TCP link, which carries binary frames like those of binary
+* framing. Frames for a link are gathered in its buffer through a pass of
+* the server loop and written together at the end of it, and the link is
+* never waited on: a link whose buffer fills is dropped.
+* Over the links the servers keep each other's rosters - a server sends
+* its players when a link comes up and each join and leave after - so
+* sjoin and sstat list the whole federation (cut short at LISTLIMIT).
+* A chat naming a player on another server, or sent to ALL, is relayed
+* once per server it reaches, with all of that server's recipients, and
+* delivered there as an schat from the sender. Names are unique across
+* the federation: each name is owned by one server, picked by consistent
+* hashing of the name onto a ring of VNODES points per server, and a
+* server whose client asks for a name owned elsewhere claims it from the
+* owner, sending sjoin only once the owner grants it. A denied name is
+* taken to be in use and the next ~n alternative is claimed. A name whose
+* owner's link is down is taken to be in use too, as it may be there, so
+* a partition never gives one name out twice. When a link goes down, the
+* players on the far side leave the roster, but the names they hold from
+* this server stay held until the link is back and the far side's roster
+* - ended by RELAY_SYNC - shows which they gave up meanwhile. The
+* lower-numbered server of the two dials a dropped link again, after
+* REDIALMIN and then twice as long after each failure, up to REDIALMAX.
+* A server that restarts forgets the names it gave out until the others'
+* rosters reach it. A server handing off passes its relay listening socket along, and the
+* replacement dials every server afresh. Relayed chats reach binary
+* clients as schat messages in BIN_TEXT frames. ANY, binary IDs and
+* channels reach local players only.
+*
+* Rate limits: each client has a token bucket, and all clients together
+* have another, earning tokens at a steady rate up to a burst. A chat
+* costs a token for each delivery it can make - one for ANY or a single
+* name, one per name listed, the channel's members for a channel, and the
+* players here for ALL - but never more than a whole burst. It is charged
+* before it is dispatched, to both buckets, which are brought up to date
+* only then, from the monotonic clock. A chat over a limit is dealt with
+* by the policy: delay sends it but stops reading the client (or every
+* client, for the global bucket) until the bucket has earned back its
+* debt, leaving further input to back up in the kernel and the client's
+* TCP window; drop discards it; strike discards it and strikes the client
+* with (strike(n)(flood)) - the global bucket only ever drops. A flooding
+* client can so cost the server no more than its rate in deliveries.
+*
+* Heartbeats: the server only learns that a client is gone when a read
+* returns 0 or a write fails, so a peer that vanished without a FIN or
+* RST would hold its slot for good. Given -B beat, a client that has sent
+* nothing for beat seconds is sent (sping), and again every beat seconds
+* it stays silent; it may answer (cpong), or BIN_PONG in binary, though
+* anything it sends will do. A ping to a vanished peer goes unacknowledged,
+* and TCP gives up on it, dropping the client, after its retransmission
+* timeout - or after -W milliseconds, the socket's TCP_USER_TIMEOUT.
+* Given -I idle, a client that sends nothing for idle seconds is dropped
+* outright. -A turns on TCP keepalive for the same purpose without any
+* traffic the client sees. Timers are kept in a hashed wheel of
+* WHEELSLOTS slots a WHEELTICK apart: a client's one timer is armed for
+* its next ping or timeout, reading a client only notes the tick, and a
+* timer found due early is armed again for the right tick, so timers
+* cost O(1) a client a tick. A replacement server starts every client's
+* timer afresh.
+*
+* Snapshots: a hot restart keeps the players only while the old server
+* is up to hand them over, and history is only the chats. Given -s file,
+* every player's name, strikes and channels are snapshotted to file every
+* period seconds they have changed - a few kilobytes, written, synced and
+* renamed into place by a forked child, so the server never waits on the
+* disk and a crash leaves the last whole snapshot. A server started with
+* -s and not -T loads the snapshot, and holds its players - in the roster
+* and their channels, with no connection - until a client joins under the
+* same name, which takes the player's strikes and channels and joins as
+* usual with a new ID, or until grace seconds pass and the player leaves.
+* Chats to a held player are dropped, and ANY never picks one. A
+* federated server announces its held players to the others like any, so
+* their names stay its own. Held players are handed over to a replacement
+* as well, and their grace starts over there.
+*
+* Syntax: chatserver [-p port] [-M statsport] [-H file] [-K replay]
+*                    [-U path] [-T path] [-F relays -N node]
+*                    [-R rate[:burst]] [-G rate[:burst]] [-L policy]
+*                    [-B beat] [-I idle] [-A keepidle[:interval[:count]]]
+*                    [-W usertimeout] [-s snapshot] [-i period] [-g grace]
 *
 * port - protocol port number to use
+* statsport - port on 127.0.0.1 serving metrics in the Prometheus text
+*             format, 0 for none - default STATSPORT
+* file - file holding the history ring - default none, keeping no history
+* replay - chats from history sent to each newly named client, at most
+*          HISTORYSLOTS - default 32
+* -U path - Unix-domain socket to wait on for a replacement - default none
+* -T path - Unix-domain socket of the server to take over from, instead of
+*           opening the port - default none
+* relays - comma-separated host:port relay addresses of every server in
+*          the federation, in the same order for all - default none
+* node - this server's place in relays, counting from 0
+* -R rate - tokens a second each client earns, 0 for no limit - default 0
+* -G rate - tokens a second all clients earn together, 0 for no limit -
+*           default 0
+* burst - most tokens a bucket holds - default the rate, and at least
+*         MAXCLIENTS
+* policy - delay, drop or strike - default delay
+* beat - seconds of silence before a client is sent (sping), 0 for none -
+*        default 0
+* idle - seconds of silence before a client is dropped, 0 for never -
+*        default 0
+* keepidle, interval, count - seconds idle before TCP keepalive probes,
+*        seconds between them and probes unanswered before the connection
+*        is dropped - default no keepalive, and the system's interval and
+*        count
+* usertimeout - milliseconds written data may go unacknowledged before
+*        the connection is dropped - default the system's
+* snapshot - file the players are snapshotted to, and loaded from at
+*        startup if it is there - default none
+* period - seconds between snapshots - default 5
+* grace - seconds a player loaded from a snapshot is held for - default 60
 *
 * Note: The port argument is optional. If no port is specified,
 * the server uses the default given by PROTOPORT.
@@ -48,20 +293,243 @@
 */
 
 /* global variables */
+/* A token bucket - see admit_chat(). It holds millionths of a token, so refilling it is integer arithmetic on microseconds. */
 typedef struct {
-		int used;
-		int joined;
-		int sent;
-		char *name;
+		long long level; /* below 0 while a delayed client works off its debt */
+		unsigned long long refilled; /* when level was last brought up to date, from now_micros() */
+	} tokenbucket;
+typedef struct {
+		char name[NAMESIZE+1]; /* kept inline so name lookups do not chase a pointer */
+		int namenext; /* next client in the same name bucket, MAXCLIENTS at end of list */
 		int socket;
-		char *clibuf;
 		int charcount;
 		int strikes;
 		int resync;
+		char *clibuf; /* cold - taken from bufslab when the client is read and given back once no partial message is left in it, NULL while it holds none */
+		int binary; /* set once the client has switched to binary frames - charcount is then bytes held in clibuf */
+		int skip; /* bytes of an oversized binary frame still to be discarded */
+		unsigned int id; /* ID binary clients address this client by - steps by MAXCLIENTS each time the slot is named */
+		short memberof[MAXMEMBERSHIPS]; /* channels the client is in, in no order - short, as MAXCHANNELS fits */
+		int nummemberof;
+		int claiming; /* claims made for the name while its owner has yet to grant one, 0 once it has */
+		char requested[NAMESIZE+1]; /* name asked for, converted, to pick another from if the claim is denied */
+		tokenbucket bucket; /* chats the client may send - see admit_chat() */
+		int zip; /* set once the client has sent (czip) - everything sent to it is then framed, and long messages compressed */
+		unsigned int heard, pinged; /* wheel ticks when the client last sent anything, and was last sent (sping) */
+		unsigned int due; /* wheel tick its timer is due, 0 if not armed */
+		int timernext, timerprev; /* neighbours in its wheel slot's list, MAXCLIENTS at either end */
 	} clientinfo;
 clientinfo clientarray[MAXCLIENTS]; /* structure to hold client info */
+
+/* Hot per-client flags, kept as bitsets apart from clientarray so that roster scans and broadcasts touch a word per 64 clients and skip empty words. */
+#define SETWORDS ((MAXCLIENTS+63)/64)
+typedef unsigned long long clientset[SETWORDS];
+#define IN_SET(set, i) (((set)[(i)>>6] >> ((i)&63)) & 1ULL)
+#define ADD_TO_SET(set, i) ((set)[(i)>>6] |= 1ULL << ((i)&63))
+#define REMOVE_FROM_SET(set, i) ((set)[(i)>>6] &= ~(1ULL << ((i)&63)))
+clientset usedset, joinedset; /* clients connected and joined */
+clientset pausedset; /* clients not read until their buckets earn back their debt */
+typedef struct {
+		unsigned long long *set;
+		int word; /* word of set being walked */
+		unsigned long long bits; /* bits of that word not yet visited */
+	} setwalk; /* walk over a clientset - see first_in_set() */
+#define NAMEBUCKETS 64 /* number of name hash buckets - a power of two, at least MAXCLIENTS */
+int namebucket[NAMEBUCKETS]; /* first client in each name bucket, MAXCLIENTS if empty */
+unsigned int sentgen[MAXCLIENTS]; /* chatgen of the last chat message sent to each client */
+unsigned int chatgen = 0; /* number of the chat message being sent - bumped by send_chat() so sentgen never needs clearing */
+
+/* Channels are found by name through their own hash buckets. Free channel slots are kept on a stack linked through next, so opening and closing channels never calls malloc. */
+typedef struct {
+		char name[NAMESIZE+1];
+		int next; /* next channel in the same name bucket, or on the free stack - MAXCHANNELS at end of list */
+		int nummembers; /* 0 if the channel is free */
+		int members[MAXCLIENTS]; /* clients in the channel, in no order */
+	} channelinfo;
+channelinfo channels[MAXCHANNELS];
+int channelbucket[CHANNELBUCKETS]; /* first channel in each name bucket, MAXCHANNELS if empty */
+int freechannels; /* top of the free channel stack, MAXCHANNELS if none are free */
+int numchannels = 0; /* channels open */
+
+/* The history ring, as laid out in its file. next counts up forever and picks the slot, so the ring needs no head or tail. */
+typedef struct {
+		unsigned long long seq; /* number of the chat in the slot, 0 while the slot is being written */
+		int length; /* bytes of text */
+		char text[MAXMESSAGE]; /* the schat message as sent to text clients */
+	} historyslot;
+typedef struct {
+		unsigned int magic; /* HISTORYMAGIC */
+		unsigned int numslots; /* HISTORYSLOTS */
+		unsigned int slotsize; /* sizeof(historyslot) */
+		unsigned int unused;
+		unsigned long long next; /* number of the next chat to be kept - the first is 1 */
+		historyslot slots[HISTORYSLOTS];
+	} historyring;
+historyring *history = NULL; /* NULL if no history is kept */
+char *historypath = NULL;
+int replay = 32;
+
+/* A text message's BIN_ZTEXT frame, made on first use so that a message sent to many clients is compressed once - see write_text(). */
+typedef struct {
+		int length; /* bytes of frame, 0 until compressed, -1 if the message does not shrink */
+		unsigned char *start; /* the frame, within space */
+		unsigned char space[ZIPHEADROOM+MAXMESSAGE];
+	} zipframe;
+char replaytext[HISTORYSLOTS*MAXMESSAGE]; /* the replay as one run of messages, to be compressed */
+unsigned char replayspace[ZIPHEADROOM+HISTORYSLOTS*MAXMESSAGE];
+unsigned char *replayframe; /* BIN_ZTEXT frame of the last replay compressed, within replayspace */
+int replayframelength; /* -1 if it did not shrink */
+int replaytextlength, replayframecount; /* bytes and chats of text in it */
+unsigned long long replaynext = 0; /* history->next when replayframe was made, 0 if none was */
+
+/* Name tables map names to servers - the players on other servers, and the names this server owns, by the server holding each. Entries are chained in hash buckets, and free entries on a stack through next. */
+typedef struct {
+		char name[NAMESIZE+1];
+		int node; /* server the name is held by */
+		int stale; /* set in claims while the link to node is down - the name stays held unless node's roster leaves it out once the link is back */
+		int next; /* next entry in the same bucket, or on the free stack - MAXNAMES at end of list */
+		int used;
+	} nameentry;
+typedef struct {
+		nameentry entries[MAXNAMES];
+		int buckets[NAMETABLEBUCKETS];
+		int free; /* top of the free stack */
+		int count; /* entries in use */
+	} nametable;
+nametable remoteplayers; /* players on other servers */
+nametable claims; /* names this server owns that are in use, and where */
+unsigned int remotegen[MAXNAMES]; /* chatgen of the last chat relayed to each remote player */
+
+/* A relay link to another server in the federation. */
+typedef struct {
+		struct sockaddr_in addr; /* its relay address */
+		int socket; /* -1 while the link is down */
+		int inlen; /* bytes of unparsed frames in in */
+		int outlen; /* bytes of frames in out not yet written */
+		int dialed; /* set if this server dialed the link */
+		unsigned long long incarnation; /* the far server's, from its RELAY_HELLO - 0 until it arrives */
+		unsigned long long redialat; /* when to dial the link again, from now_micros() - 0 if this server is not redialing it */
+		long long redialwait; /* microseconds to wait after the next failed dial */
+		unsigned char in[RELAYBUFSIZE];
+		unsigned char out[RELAYBUFSIZE];
+	} relaylink;
+relaylink links[MAXNODES];
+int numnodes = 0; /* servers in the federation, 0 if not federated */
+int nodeno = -1; /* this server's number */
+int relayport = -1; /* socket listening for relay links */
+int pendinglinks[MAXNODES]; /* links accepted but not yet introduced by RELAY_HELLO, -1 if free */
+typedef struct {
+		unsigned int point;
+		int node;
+	} ringpoint;
+ringpoint ring[MAXNODES*VNODES]; /* name ownership ring, sorted by point */
+unsigned char relaynames[MAXNODES][MAXMESSAGE]; /* recipients on each server of the chat being sent, as relay names */
+int relaynameslen[MAXNODES], relaycount[MAXNODES];
+int rosterchanged = 0; /* set when another server's players changed in this pass */
+unsigned long long incarnation = 0; /* when this server started, in microseconds - tells a restarted server's links from its old ones */
+
+/* A client as handed to a replacement server - see hand_off() and take_over(). */
+typedef struct {
+		int size; /* sizeof(handoffrecord), to catch a replacement built differently */
+		int kind; /* HANDOFF_LISTEN, HANDOFF_RELAY, HANDOFF_CLIENT or HANDOFF_DONE */
+		int client_no;
+		int joined;
+		char name[NAMESIZE+1];
+		int claiming; /* set if the name is still being claimed - it is claimed again */
+		char requested[NAMESIZE+1];
+		int charcount;
+		int strikes;
+		int resync;
+		int binary;
+		int zip;
+		int skip;
+		unsigned int id;
+		int nummemberof;
+		char channels[MAXMEMBERSHIPS][NAMESIZE+1]; /* names of the channels the client is in */
+		int away; /* set for a seat held from a snapshot, which comes without a socket */
+		char clibuf[BUFSIZE];
+	} handoffrecord;
+int clientrate = 0, clientburst = 0; /* -R: tokens a second each client earns, 0 for no limit, and most it can save */
+int globalrate = 0, globalburst = 0; /* -G: the same for all clients together */
+char limitpolicy = 'd'; /* -L: 'd' delay, 'x' drop or 's' strike a chat over its limit */
+tokenbucket globalbucket;
+
+/* Heartbeat and idle timers: each client's next check is hashed by the tick it is due into a wheel of WHEELSLOTS lists, linked through clientinfo, so arming and disarming a timer and turning the wheel a tick cost O(1) a client, however long the timeouts. */
+int wheel[WHEELSLOTS]; /* first client in each slot's list, MAXCLIENTS if none */
+unsigned long long wheelstart; /* when tick 0 began, from now_micros() */
+unsigned int wheeltick = 0; /* last tick the wheel has been turned to */
+unsigned int wheelwake = 0; /* first tick after it with a timer in its slot, 0 until worked out again */
+int numtimers = 0; /* timers armed */
+unsigned int beatticks = 0, idleticks = 0; /* -B and -I in ticks, 0 for none */
+int keepidle = 0, keepintvl = 0, keepcnt = 0; /* -A: seconds idle before TCP keepalive probes, seconds between them and probes before giving up - 0 idle for no keepalive, 0 for the others for the system's defaults */
+int usertimeout = 0; /* -W: milliseconds written data may go unacknowledged before TCP gives up, 0 for the system's default */
+
+char *handoffpath = NULL; /* where to wait for a replacement, NULL for nowhere */
+char *takeoverpath = NULL; /* where to find the server being replaced, NULL to start afresh */
+int handoffport = -1;
+
+/* Snapshots of the players, for a server started cold after a crash - see save_snapshot() and load_snapshot(). */
+#define SNAPSHOTVERSION 1
+typedef struct {
+		char magic[4]; /* "CHSS" */
+		int version;
+		int maxclients; /* MAXCLIENTS of the server that wrote it */
+		clientset joined; /* slots named */
+	} snapshotheader;
+typedef struct {
+		char name[NAMESIZE+1];
+		int strikes;
+		int nummemberof;
+		char channels[MAXMEMBERSHIPS][NAMESIZE+1]; /* names of the channels the player is in */
+	} seatinfo; /* what a snapshot keeps of each player - the connection, ID and framing are not kept */
+#define SNAPSHOTSIZE (sizeof(snapshotheader) + MAXCLIENTS*sizeof(seatinfo))
+char *snapshotfile = NULL; /* -s: file the players are snapshotted to and loaded from, NULL if none */
+char *snapshottemp = NULL; /* file a snapshot is written to before it is renamed over snapshotfile */
+int snapinterval = 5; /* -i: seconds between snapshots - default 5 */
+int grace = 60; /* -g: seconds a loaded seat is held for its owner to reclaim - default 60 */
+char snapimage[2][SNAPSHOTSIZE]; /* the last snapshot written, and the one being built */
+int snaplength[2] = {0, 0};
+int snapcurrent = 0; /* which of snapimage holds the last snapshot written */
+pid_t snapwriter = 0; /* child writing a snapshot, 0 if none */
+time_t snaptime; /* when the last snapshot was taken */
+time_t loadtime; /* when the seats in awayset began to be held */
+clientset awayset; /* seats loaded from a snapshot whose owner has not reconnected - in usedset and joinedset, with no socket, and never claiming, paused or timed, so a walk over usedset that touches sockets must skip them */
+int numaway = 0; /* number of entries in awayset */
+
+/* Client receive buffers and read_from_client()'s scratch buffer are carved from one arena allocated at startup, and handed out and taken back through a stack of free buffer numbers, so connecting, disconnecting and receiving never call malloc. A client holds a buffer only from being read until no partial message is left in it, and the stack hands out the buffer given back last, so clients that are idle, or send whole messages, share a few buffers that stay in cache, and the rest of the arena is never touched. */
+#define NUMBUFS (MAXCLIENTS+1) /* a receive buffer per client, plus the scratch buffer */
+typedef struct {
+		char *arena; /* NUMBUFS buffers of BUFSIZE bytes, back to back */
+		int freebufs[NUMBUFS]; /* numbers of the free buffers */
+		int numfree; /* number of entries in freebufs */
+		int inuse; /* buffers handed out and not given back */
+		int peak; /* most buffers ever in use at once */
+		long taken; /* buffers handed out since startup */
+		long returned; /* buffers given back since startup */
+	} bufslab;
+bufslab slab;
+char *scratch; /* read_from_client()'s buffer for the printable part of what was received */
+
+/* Metrics served on the stats port - see register_metrics(). */
+int statsport = STATSPORT;
+int numconnected = 0; /* clients connected, joined or not */
+unsigned long long acceptcount, refusecount, dropcount; /* connections accepted, refused for no vacancy, and dropped for any reason */
+unsigned long long readcount, readbytes; /* recv() calls that returned data, and the bytes they returned */
+unsigned long long chatcount, deliverycount; /* cchat messages sent, and schat and schan messages they were delivered as */
+unsigned long long malformedcount, toolongcount; /* strikes by reason */
+unsigned long long historycount, replaycount; /* chats added to history, and chats sent from it */
+unsigned long long relayoutcount, relayincount, relaybytes; /* chats relayed to and from other servers, and bytes written on relay links */
+int numlinks = 0; /* relay links up */
+unsigned long long clientlimitcount, globallimitcount; /* chats over a limit - delayed, dropped or struck */
+int numpaused = 0; /* clients not being read while they work off a delay */
+unsigned long long pingcount, idlecount; /* (sping) heartbeats sent, and clients dropped for silence */
+unsigned long long ziptextbytes, zipsentbytes; /* bytes of text sent in BIN_ZTEXT frames, and bytes of those frames */
+unsigned long long snapshotcount, reclaimcount, releasecount; /* snapshots written, and loaded seats reclaimed or released */
+histogram ziptime; /* compressing one message or replay */
+histogram receivetime; /* from recv() returning to everything received being parsed and delivered */
+histogram delivertime; /* handling one cchat, from parsing its recipients to the last schat written */
 int numplayers = 0; /* total number of players that have joined */
-fd_set total_set, read_set; /* fd_sets to use with select */
+fd_set total_set, read_set, write_set; /* fd_sets to use with select - only the stats port writes through write_set */
 char buf[BUFSIZE]; /* buffer for sending and receiving messages */
 int minplayers = 3; /* minimum number of players needed to start a game */
 int lobbytime = 10; /* number of seconds until game begins if numplayers >= minplayers */
@@ -71,17 +539,108 @@ char listbuf[MAXMESSAGE]; /* buffer for building player list */
 	
 /* helper functions */
 static void initialize_clientinfo(int client_no);
+static inline int first_in_set(setwalk *walk, clientset set);
+static inline int next_in_walk(setwalk *walk);
+static unsigned int hash_string(char *string);
+static unsigned int hash_name(char *name);
+static void add_name(int client_no);
+static void remove_name(int client_no);
+static int  find_client(char *name);
+static void init_channels();
+static int  find_channel(char *name);
+static int  find_membership(int client_no, int channel);
+static void enter_channel(char **name, int client_no);
+static int  add_member(char *name, int client_no);
+static void leave_channel(char **name, int client_no);
+static void remove_member(int channel, int client_no);
+static void send_to_channel(int channel, int client_no, char *text);
+static void open_history(char *path);
+static void append_history(char *sender, char *text);
+static void replay_history(int client_no);
+static void hand_off(int listensocket);
+static int  take_over(char *path);
+static void restore_client(handoffrecord *record, int socket);
+static int  build_snapshot(char *image);
+static void save_snapshot();
+static void reap_snapshot();
+static void load_snapshot();
+static void reclaim_seat(int seat, int client_no);
+static void release_seats();
+static long long snapshot_wait();
+static void init_nametable(nametable *table);
+static int  table_find(nametable *table, char *name);
+static void table_add(nametable *table, char *name, int node);
+static void table_remove(nametable *table, int entry);
+static int  name_taken(char *name);
+static unsigned int mix_hash(unsigned int hash);
+static int  compare_points(const void *a, const void *b);
+static int  owner_of(char *name);
+static int  find_link(int socket);
+static void start_federation(char *relays);
+static int  dial_link(int node);
+static long long redial_links();
+static void link_up(int node, int socket, int dialed);
+static void link_down(int node);
+static void accept_link();
+static void read_pending_link(int pending);
+static void read_link(int node);
+static void dispatch_relay(int node, unsigned char *frame, int length);
+static void queue_frame(int node, int opcode, unsigned char *payload, int length);
+static void flush_link(int node);
+static void flush_links();
+static int  put_relay_name(unsigned char *out, char *name);
+static int  get_relay_name(unsigned char **pos, unsigned char *end, char *name);
+static void send_name(int node, int opcode, char *name);
+static int  claim_name(int client_no, char *name);
+static void send_claim(int client_no, int owner);
+static void complete_join(int client_no);
+static void release_name(int client_no);
+static int  route_chat(char *name, int client_no, char *message, int length);
+static void relay_chat(int client_no, char *text, int all);
+static void send_player_lists();
 static void clear_clientinfo(int client_no);
+static void init_slab();
+static char *take_buffer();
+static void return_buffer(char *buffer);
+static void log_buffers();
+static void attach_buffer(int client_no);
+static void detach_buffer(int client_no);
 static void write_to_client(int socket, int client_no, int clear);
+static void writev_to_client(int client_no, struct iovec *iov, int iovcnt);
+static int  write_text(int socket, int client_no, char *text, int length, zipframe *zipped);
+static int  zip_text(char *text, int length, unsigned char *space, int room, unsigned char **frame);
+static void broadcast_roster(int except);
+static void write_failed(int socket, int client_no);
 static void read_from_client(int socket, int client_no);
 static void parse_message(int client_no);
 static void send_chat(char **message, char **recipients, int client_no);
+static int  pick_any(int client_no);
+static void deliver_chat(int recipient, int sender, char *message, int length, char *text);
+static void parse_frames(int client_no);
+static void dispatch_frame(int client_no, unsigned char *frame, int length);
+static void send_roster(int client_no);
+static int  put_varint(unsigned char *out, unsigned int value);
+static int  get_varint(unsigned char *pos, unsigned char *end, unsigned int *value);
 static int  find_name_end(char **current);
 static void convert_name(char **name);
 static void assign_name(char **name, int client_no);
 static void build_player_list();
 static int  find_right_paren(char **current, int *numchars);
 static void send_strike(int client_no, char reason);
+static void parse_rate(char *arg, int *rate, int *burst);
+static void refill_bucket(tokenbucket *bucket, int rate, int burst, unsigned long long now);
+static int  admit_chat(int client_no, int cost);
+static long long hold_paused();
+static void init_wheel();
+static unsigned int current_tick();
+static void arm_timer(int client_no, unsigned int due);
+static void disarm_timer(int client_no);
+static long long turn_wheel();
+static void start_timer(int client_no);
+static void schedule_check(int client_no);
+static void check_client(int client_no);
+static void tune_socket(int socket);
+static void register_metrics();
 
 
 
@@ -91,6 +650,8 @@ static void send_strike(int client_no, char reason);
 int main(int argc, char **argv)
 {
 	signal(SIGPIPE, SIG_IGN);
+	log_start(LOGLEVEL);
+	register_metrics();
 
 	//struct hostent *ptrh; /* pointer to a host table entry */
 	struct protoent *ptrp; /* pointer to a protocol table entry */
@@ -98,15 +659,23 @@ int main(int argc, char **argv)
 	struct sockaddr_in cad; /* structure to hold client address */
 	struct timeval timeout; /* structure to hold timeout info for select */
 	int listensocket, tempsd; /* socket descriptors for listen port and acceptance */
-	int port; /* protocol port number */
+	int port = PROTOPORT; /* protocol port number */
 	int alen; /* length of address */
+	char *relays = NULL; /* -F list of relay addresses */
+	int node; /* relay link being read */
 	
 	timeout.tv_sec = 0; timeout.tv_usec = 0; /*initialize timeval struct */
 	FD_ZERO (&total_set); /* initialize fd_set */
 	int i;
-	for (i=0;i<30;i++) { /* initialize client info structure */
+	init_slab();
+	scratch = take_buffer();
+	init_channels();
+	for (i=0;i<MAXCLIENTS;i++) { /* initialize client info structure */
 		initialize_clientinfo(i);
 	}
+	for (i=0;i<NAMEBUCKETS;i++) { /* no names yet */
+		namebucket[i] = MAXCLIENTS;
+	}
 	
 	srand(time(NULL));
 	
@@ -116,59 +685,201 @@ int main(int argc, char **argv)
 	sad.sin_family = AF_INET; /* set family to Internet */
 	sad.sin_addr.s_addr = INADDR_ANY; /* set the local IP address */
 	
-	port = PROTOPORT; /* use default port number */
+	/* Get values from command line. */
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &port);
+		}
+		else if (strcmp(argv[i], "-F") == 0 && (i+1) < argc) {
+			relays = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-N") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &nodeno);
+		}
+		else if (strcmp(argv[i], "-M") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &statsport);
+		}
+		else if (strcmp(argv[i], "-H") == 0 && (i+1) < argc) {
+			historypath = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-K") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &replay);
+		}
+		else if (strcmp(argv[i], "-U") == 0 && (i+1) < argc) {
+			handoffpath = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-T") == 0 && (i+1) < argc) {
+			takeoverpath = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-R") == 0 && (i+1) < argc) {
+			parse_rate(argv[i+1], &clientrate, &clientburst);
+		}
+		else if (strcmp(argv[i], "-G") == 0 && (i+1) < argc) {
+			parse_rate(argv[i+1], &globalrate, &globalburst);
+		}
+		else if (strcmp(argv[i], "-L") == 0 && (i+1) < argc) {
+			limitpolicy = strcmp(argv[i+1], "drop") == 0 ? 'x' : strcmp(argv[i+1], "strike") == 0 ? 's' : 'd';
+		}
+		else if (strcmp(argv[i], "-B") == 0 && (i+1) < argc) {
+			double secs = 0;
+			sscanf(argv[i+1], "%lf", &secs);
+			beatticks = secs > 0 ? (unsigned int) (secs*1000000/WHEELTICK + 0.999) : 0;
+		}
+		else if (strcmp(argv[i], "-I") == 0 && (i+1) < argc) {
+			double secs = 0;
+			sscanf(argv[i+1], "%lf", &secs);
+			idleticks = secs > 0 ? (unsigned int) (secs*1000000/WHEELTICK + 0.999) : 0;
+		}
+		else if (strcmp(argv[i], "-A") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d:%d:%d", &keepidle, &keepintvl, &keepcnt);
+		}
+		else if (strcmp(argv[i], "-W") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &usertimeout);
+		}
+		else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+			snapshotfile = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-i") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &snapinterval);
+		}
+		else if (strcmp(argv[i], "-g") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &grace);
+		}
+	}
+	if (snapinterval < 1) {
+		snapinterval = 5;
+	}
+	if (grace < 0) {
+		grace = 60;
+	}
+	init_wheel();
+	if (snapshotfile != NULL) {
+		snapshottemp = malloc(strlen(snapshotfile)+5);
+		sprintf(snapshottemp, "%s.tmp", snapshotfile);
+		if (takeoverpath == NULL) { /* a replacement takes the players from the server it replaces instead */
+			load_snapshot();
+		}
+	}
+	
 	if (port > 0) { /* test for illegal value */
 		sad.sin_port = htons((u_short)port);
 	} else { /* print error message and exit */
-		fprintf(stderr,"bad port number %s\n",argv[1]);
+		fprintf(stderr,"bad port number %d\n",port);
 		exit(1);
 	}
-	
-	/* Map TCP transport protocol name to protocol number */
-	if ( ((long)(ptrp = getprotobyname("tcp"))) == 0) {
-		fprintf(stderr, "cannot map \"tcp\" to protocol number");
-		exit(1);
+	if (takeoverpath != NULL) { /* take the listening socket and every client from the running server */
+		listensocket = take_over(takeoverpath);
 	}
+	else {
+		/* Map TCP transport protocol name to protocol number */
+		if ( ((long)(ptrp = getprotobyname("tcp"))) == 0) {
+			fprintf(stderr, "cannot map \"tcp\" to protocol number");
+			exit(1);
+		}
 	
-	/* Create a socket */
-	listensocket = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
-	if (listensocket < 0) {
-		perror ("socket");
-		exit(1);
-	}
+		/* Create a socket */
+		listensocket = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
+		if (listensocket < 0) {
+			perror ("socket");
+			exit(1);
+		}
 	
-	/* Eliminate "Address already in use" error message. */
-	int flag = 1;
-	if (setsockopt(listensocket,SOL_SOCKET,SO_REUSEADDR,&flag,sizeof(int)) == -1) { 
-    	perror("setsockopt"); 
-    	exit(1); 
-	}
+		/* Eliminate "Address already in use" error message. */
+		int flag = 1;
+		if (setsockopt(listensocket,SOL_SOCKET,SO_REUSEADDR,&flag,sizeof(int)) == -1) { 
+	    	perror("setsockopt"); 
+	    	exit(1); 
+		}
 	
-	/* Bind a local address to the socket */
-	if (bind(listensocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
-		perror ("bind");
-		exit(1);
-	}
+		/* Bind a local address to the socket */
+		if (bind(listensocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+			perror ("bind");
+			exit(1);
+		}
 	
-	/* Specify size of request queue */
-	if (listen(listensocket, QLEN) < 0) {
-		perror ("listen");
-		exit(1);
+		/* Specify size of request queue */
+		if (listen(listensocket, QLEN) < 0) {
+			perror ("listen");
+			exit(1);
+		}
 	}
 	FD_SET (listensocket, &total_set);
 	
+	if (statsport > 0) {
+		open_stats_port(statsport);
+	}
+	if (historypath != NULL) {
+		open_history(historypath);
+	}
+	if (replay < 0 || replay > HISTORYSLOTS) {
+		replay = HISTORYSLOTS;
+	}
+	if (handoffpath != NULL) {
+		handoffport = open_handoff_port(handoffpath);
+		if (handoffport < 0) {
+			exit(1);
+		}
+		FD_SET (handoffport, &total_set);
+	}
+	if (relays != NULL) {
+		start_federation(relays);
+	}
+	
 	int client_no;
+	long long wait; /* microseconds until a delayed client may be read, -1 if none is */
+	long long tick; /* microseconds until the timer wheel's next tick, -1 if no timer is armed */
+	long long redial; /* microseconds until a dropped relay link is dialed again, -1 if none is waiting */
+	long long snap; /* microseconds until a snapshot or the release of held seats is due, -1 if neither ever is */
 	
 	/* Main server loop */
 	while (1) {
+		tick = turn_wheel(); /* first, as it may drop clients */
 		read_set = total_set;
-		if (select (FD_SETSIZE, &read_set, NULL, NULL, NULL) < 0) {
+		wait = hold_paused();
+		if (tick >= 0 && (wait < 0 || tick < wait)) {
+			wait = tick;
+		}
+		redial = (numnodes > 0) ? redial_links() : -1;
+		if (redial >= 0 && (wait < 0 || redial < wait)) {
+			wait = redial;
+		}
+		snap = snapshot_wait();
+		if (snap >= 0 && (wait < 0 || snap < wait)) { /* wake for the next snapshot or held seat release */
+			wait = snap;
+		}
+		if (wait >= 0) {
+			timeout.tv_sec = wait / 1000000;
+			timeout.tv_usec = wait % 1000000;
+		}
+		FD_ZERO (&write_set);
+		set_stats_fds(&read_set, &write_set);
+		for (node=0; node<numnodes; node++) { /* wake when a backed-up relay link can take more */
+			if (links[node].socket >= 0 && links[node].outlen > 0) {
+				FD_SET (links[node].socket, &write_set);
+			}
+		}
+		if (select (FD_SETSIZE, &read_set, &write_set, NULL, wait >= 0 ? &timeout : NULL) < 0) {
 			perror ("select");
 			exit (1);
 		}		
+		serve_stats(&read_set, &write_set); /* takes the stats fds out of read_set */
 		for (i=0; i<FD_SETSIZE; i++) {
 			if (FD_ISSET (i, &read_set)) {
-				if (i == listensocket) {
+				if (i == handoffport) { /* a replacement has come for the sockets */
+					hand_off(listensocket);
+				}
+				else if (i == relayport) { /* another server is dialing */
+					accept_link();
+				}
+				else if (numnodes > 0 && (node = find_link(i)) >= 0) { /* relay frames - or a link being introduced, numbered MAXNODES up */
+					if (node < MAXNODES) {
+						read_link(node);
+					}
+					else {
+						read_pending_link(node-MAXNODES);
+					}
+				}
+				else if (i == listensocket) {
 					/* connection ready to be accepted */
 					alen = sizeof(cad);
 					if ((tempsd = accept(listensocket, (struct sockaddr *)&cad, &alen)) < 0) {
@@ -176,17 +887,23 @@ int main(int argc, char **argv)
 						exit (1);
 					}
 					for (client_no=0; client_no<MAXCLIENTS; client_no++) {
-						if (clientarray[client_no].used == 0)
+						if (IN_SET(usedset, client_no) == 0)
 						break;
 					}
 					if (client_no < MAXCLIENTS) { /* add new connection to clientarray */
-fprintf (stderr, "Accepted: Client %d\n", client_no);
+log_info("Accepted: Client %d", client_no);
 						FD_SET (tempsd, &total_set);
-						clientarray[client_no].used = 1;
+						ADD_TO_SET(usedset, client_no);
 						clientarray[client_no].socket = tempsd;
+						clientarray[client_no].clibuf = NULL; /* one is taken when there is something to read */
+						tune_socket(tempsd);
+						start_timer(client_no);
+						numconnected++;
+						count_event(&acceptcount);
 					}
 					else { /* send no vacancy message and drop connection */
-fprintf (stderr, "Refused: Client %d\n", client_no);
+log_info("Refused: Client %d", client_no);
+						count_event(&refusecount);
 						sprintf(buf, "(snovac)");
 						write_to_client(tempsd, client_no, NOCLEAR);
 						closesocket(tempsd);
@@ -194,42 +911,71 @@ fprintf (stderr, "Refused: Client %d\n", client_no);
 				}
 				else {
 					/* data available on already-connected socket */
-					int nbytes = recv (i, buf, BUFSIZE, MSG_DONTWAIT);
+					int nbytes;
 					for (client_no=0; client_no<MAXCLIENTS; client_no++) {
 						if (clientarray[client_no].socket == i)
 						break;
 					}
+					if (client_no == MAXCLIENTS) { /* dropped for a write error earlier in this pass */
+						continue;
+					}
+					attach_buffer(client_no);
+					if (numtimers > 0) {
+						clientarray[client_no].heard = current_tick();
+					}
+					if (clientarray[client_no].binary != 0) { /* frames go straight into the client's buffer, unfiltered */
+						nbytes = recv (i, clientarray[client_no].clibuf+clientarray[client_no].charcount, BUFSIZE-clientarray[client_no].charcount, MSG_DONTWAIT);
+					}
+					else {
+						nbytes = recv (i, buf, BUFSIZE, MSG_DONTWAIT);
+					}
 					if (nbytes < 0) {
-fprintf (stderr, "Error: recv on client %d\n", client_no);
+log_error("recv on client %d", client_no);
+						detach_buffer(client_no);
 					}
 					else if (nbytes == 0) { /* client has died - drop its connection and clear its info */
 						closesocket(i);
-fprintf (stderr, "Dropped: Client %d - died\n", client_no);
-						if (clientarray[client_no].joined != 0) {
+log_info("Dropped: Client %d - died", client_no);
+						if (IN_SET(joinedset, client_no) != 0) {
 							numplayers--;
-							clientarray[client_no].joined = 0;
-							build_player_list();
-							int i;
-							for (i=0; i<MAXCLIENTS; i++) {
-								if (clientarray[i].joined != 0 && i != client_no) {
-									sprintf(buf, "(sstat(%s))", listbuf);
-									write_to_client(clientarray[i].socket, i, CLEAR);
-								}
-							}
-							memset(listbuf, '\0', MAXMESSAGE);
+							REMOVE_FROM_SET(joinedset, client_no);
+							broadcast_roster(client_no);
 						}
 						FD_CLR (i, &total_set);
 						clear_clientinfo(client_no);
 					}
+					else if (clientarray[client_no].binary != 0) { /* dispatch every complete frame */
+						unsigned long long received = now_micros();
+						count_event(&readcount);
+						__atomic_fetch_add(&readbytes, nbytes, __ATOMIC_RELAXED);
+						clientarray[client_no].charcount += nbytes;
+						parse_frames(client_no);
+						detach_buffer(client_no);
+						record_value(&receivetime, now_micros() - received);
+					}
 					else { /* transfer data to client's buffer and attempt to parse message */
+						unsigned long long received = now_micros();
+						count_event(&readcount);
+						__atomic_fetch_add(&readbytes, nbytes, __ATOMIC_RELAXED);
 						read_from_client(i, client_no);
                         memset(buf, '\0', BUFSIZE);
 						parse_message(client_no);
 						memset(buf, '\0', BUFSIZE);
+						detach_buffer(client_no);
+						record_value(&receivetime, now_micros() - received);
 					}
 				}
 			}
 		}
+		if (numaway > 0) {
+			release_seats();
+		}
+		if (numnodes > 0) {
+			flush_links(); /* write what the pass relayed, one write per link */
+		}
+		if (snapshotfile != NULL) {
+			save_snapshot();
+		}
 	}
 	
 	exit(0);
@@ -242,7 +988,7 @@ fprintf (stderr, "Dropped: Client %d - died\n", client_no);
 
 void read_from_client(int socket, int client_no)
 {
-	char *tempstart = malloc(BUFSIZE*sizeof(char));
+	char *tempstart = scratch;
 	char *tempend = tempstart;
 	char *tempbufp = buf;
 	int numchars = clientarray[client_no].charcount;
@@ -257,7 +1003,6 @@ void read_from_client(int socket, int client_no)
 	*tempend = '\0';
 	strncat(clientarray[client_no].clibuf, tempstart, BUFSIZE-clientarray[client_no].charcount);
     clientarray[client_no].charcount = numchars;
-	free(tempstart);
 }
 
 
@@ -267,10 +1012,10 @@ void read_from_client(int socket, int client_no)
 
 static void parse_message(int client_no)
 {
-    char *tempbufp = clientarray[client_no].clibuf;
+    char *tempbufp = clientarray[client_no].clibuf; /* walks clibuf - what is left is moved down to its start, so copies overlap and use memmove */
     int numchars;
     
-fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf, client_no);
+log_debug("Message: '%s' from client %d", clientarray[client_no].clibuf, client_no);
     
     if (clientarray[client_no].resync == 0) { /* not resychronizing - parse normally */
         numchars = 0;
@@ -279,8 +1024,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                 return;
             }
             send_strike(client_no, 'm');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 clientarray[client_no].charcount = 0;
                 parse_message(client_no);
             }
@@ -292,8 +1037,8 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                 return;
             }
             send_strike(client_no, 'm');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 clientarray[client_no].charcount = 0;
                 parse_message(client_no);
             }
@@ -320,9 +1065,9 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                             }
                             else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                 send_strike(client_no, 'l');
-                                if (clientarray[client_no].used != 0) {
+                                if (IN_SET(usedset, client_no) != 0) {
                                 	clientarray[client_no].resync = 1;
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -337,9 +1082,9 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                 }
                                 else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                     send_strike(client_no, 'l');
-                                    if (clientarray[client_no].used != 0) {
+                                    if (IN_SET(usedset, client_no) != 0) {
                                     	clientarray[client_no].resync = 1;
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -347,9 +1092,12 @@ fprintf (stderr, "Message: '%s' from client %d\n", clientarray[client_no].clibuf
                                 numchars++;
                                 tempbufp++;
                                 if (*tempbufp == ')') { /* proper cchat - truncate message if necessary and send to recipients */
-fprintf (stderr, "Cchat: client %d\n", client_no);
-									if (clientarray[client_no].joined != 0) {
+log_debug("Cchat: client %d", client_no);
+									if (IN_SET(joinedset, client_no) != 0) {
+										unsigned long long chatstart = now_micros();
+										count_event(&chatcount);
 										send_chat(&message, &recipients, client_no);
+										record_value(&delivertime, now_micros() - chatstart);
 									}
 									else {
 										send_strike(client_no, 'm');
@@ -361,7 +1109,7 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                                         return;
                                     }
                                     else {
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -371,8 +1119,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                                 }
                                 else { /* message malformed - send strike and resynchronize */
                                     send_strike(client_no, 'm');
-                                    if (clientarray[client_no].used != 0) {
-                                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                         clientarray[client_no].charcount = 0;
                                         parse_message(client_no);
                                     }
@@ -383,8 +1131,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                             }
                             else {
                                 send_strike(client_no, 'm');
-                                if (clientarray[client_no].used != 0) {
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                if (IN_SET(usedset, client_no) != 0) {
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -395,8 +1143,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                         }
                         else {
                             send_strike(client_no, 'm');
-                            if (clientarray[client_no].used != 0) {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -407,8 +1155,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                     }
                     else {
                         send_strike(client_no, 'm');
-                        if (clientarray[client_no].used != 0) {
-                            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             clientarray[client_no].charcount = 0;
                             parse_message(client_no);
                         }
@@ -419,8 +1167,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                 }
                 else {
                     send_strike(client_no, 'm');
-                    if (clientarray[client_no].used != 0) {
-                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         clientarray[client_no].charcount = 0;
                         parse_message(client_no);
                     }
@@ -431,8 +1179,8 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
             }
             else {
                 send_strike(client_no, 'm');
-                if (clientarray[client_no].used != 0) {
-                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     clientarray[client_no].charcount = 0;
                     parse_message(client_no);
                 }
@@ -458,9 +1206,9 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                             }
                             else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
                                 send_strike(client_no, 'l');
-                                if (clientarray[client_no].used != 0) {
+                                if (IN_SET(usedset, client_no) != 0) {
                                 	clientarray[client_no].resync = 1;
-                                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                     clientarray[client_no].charcount = 0;
                                     parse_message(client_no);
                                 }
@@ -468,16 +1216,15 @@ fprintf (stderr, "Cchat: client %d\n", client_no);
                             numchars++;
                             tempbufp++;
                             if (*tempbufp == ')') { /* proper cjoin - apply naming algorithm if necessary and assign name */
-fprintf (stderr, "Cjoin: client %d - ", client_no);
-                            	if (clientarray[client_no].joined == 0) {
-fprintf (stderr, "new player\n");
+                            	if (IN_SET(joinedset, client_no) == 0 && clientarray[client_no].claiming == 0) {
+log_debug("Cjoin: client %d - new player", client_no);
                                 	assign_name(&name, client_no);
                                 }
                                 else {
-fprintf (stderr, "already joined\n");
+log_debug("Cjoin: client %d - already joined", client_no);
 									send_strike(client_no, 'm');
                                 }
-fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name);
+log_info("Name: client %d: %s", client_no, clientarray[client_no].name);
                             	tempbufp++;
                             	if (*tempbufp == '\0') {
                                 	memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
@@ -485,7 +1232,7 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                                 	return;
                             	}
                             	else {
-                                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 	clientarray[client_no].charcount = 0;
                                 	parse_message(client_no);
                             	}
@@ -495,8 +1242,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                         	}
                         	else { /* message malformed - send strike and resynchronize */
                             	send_strike(client_no, 'm');
-                            	if (clientarray[client_no].used != 0) {
-                                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            	if (IN_SET(usedset, client_no) != 0) {
+                                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 	clientarray[client_no].charcount = 0;
                                 	parse_message(client_no);
                             	}
@@ -507,8 +1254,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                     	}
                     	else {
                         	send_strike(client_no, 'm');
-                        	if (clientarray[client_no].used != 0) {
-                            	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        	if (IN_SET(usedset, client_no) != 0) {
+                            	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             	clientarray[client_no].charcount = 0;
                             	parse_message(client_no);
                         	}
@@ -519,8 +1266,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
                 	}
                  	else {
                     	send_strike(client_no, 'm');
-                    	if (clientarray[client_no].used != 0) {
-                        	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    	if (IN_SET(usedset, client_no) != 0) {
+                        	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         	clientarray[client_no].charcount = 0;
                         	parse_message(client_no);
                     	}
@@ -531,8 +1278,8 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
             	}
             	else {
                 	send_strike(client_no, 'm');
-                	if (clientarray[client_no].used != 0) {
-                    	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                	if (IN_SET(usedset, client_no) != 0) {
+                    	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     	clientarray[client_no].charcount = 0;
                     	parse_message(client_no);
                 	}
@@ -543,32 +1290,91 @@ fprintf (stderr, "Name: client %d: %s\n", client_no, clientarray[client_no].name
         	}
         	else {
             	send_strike(client_no, 'm');
-           		if (clientarray[client_no].used != 0) {
-                	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+           		if (IN_SET(usedset, client_no) != 0) {
+                	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                 	clientarray[client_no].charcount = 0;
                 	parse_message(client_no);
             	}
         	}
     	}
-    	else if (*tempbufp == 's') { /* look for stat message */
+    	else if (*tempbufp == 'b') { /* look for switch to binary frames */
             tempbufp++;
-            if (*tempbufp == 't') {
+            if (*tempbufp == 'i') {
                 tempbufp++;
-                if (*tempbufp == 'a') {
+                if (*tempbufp == 'n') {
                     tempbufp++;
-                    if (*tempbufp == 't') {
-                        tempbufp++;
-                        if (*tempbufp == ')') { /* proper cstat - respond with list of players */
-fprintf (stderr, "Cstat: client %d\n", client_no);
-							if (clientarray[client_no].joined != 0) {
-                            	build_player_list();
-                            	sprintf(buf, "(sstat(%s))", listbuf);
-                            	memset(listbuf, '\0', MAXMESSAGE);
-                            	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+                    if (*tempbufp == ')') { /* proper cbin - answer in text, then switch */
+log_debug("Cbin: client %d", client_no);
+                        if (IN_SET(joinedset, client_no) != 0) {
+                            sprintf(buf, "(sbin)");
+                            write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+                            if (IN_SET(usedset, client_no) != 0) {
+                                clientarray[client_no].binary = 1;
+                                memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                                clientarray[client_no].charcount = 0;
+                                send_roster(client_no);
                             }
-                            else {
-								send_strike(client_no, 'm');
-							}
+                            return;
+                        }
+                        send_strike(client_no, 'm');
+                        tempbufp++;
+                        if (*tempbufp == '\0') {
+                            memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                            clientarray[client_no].charcount = 0;
+                            return;
+                        }
+                        else if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                    else if (*tempbufp == '\0') { /* message not finished - stop parsing */
+                        return;
+                    }
+                    else { /* message malformed - send strike and resynchronize */
+                        send_strike(client_no, 'm');
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                }
+                else if (*tempbufp == '\0') {
+                    return;
+                }
+                else {
+                    send_strike(client_no, 'm');
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                        clientarray[client_no].charcount = 0;
+                        parse_message(client_no);
+                    }
+                }
+            }
+            else if (*tempbufp == '\0') {
+                return;
+            }
+            else {
+                send_strike(client_no, 'm');
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                    clientarray[client_no].charcount = 0;
+                    parse_message(client_no);
+                }
+            }
+    	}
+    	else if (*tempbufp == 'p') { /* look for pong message */
+            tempbufp++;
+            if (*tempbufp == 'o') {
+                tempbufp++;
+                if (*tempbufp == 'n') {
+                    tempbufp++;
+                    if (*tempbufp == 'g') {
+                        tempbufp++;
+                        if (*tempbufp == ')') { /* proper cpong - being read was all it was for */
+log_debug("Cpong: client %d", client_no);
                             tempbufp++;
                             if (*tempbufp == '\0') {
                                 memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
@@ -576,7 +1382,7 @@ fprintf (stderr, "Cstat: client %d\n", client_no);
                                 return;
                             }
                             else {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -586,8 +1392,8 @@ fprintf (stderr, "Cstat: client %d\n", client_no);
                         }
                         else { /* message malformed - send strike and resynchronize */
                             send_strike(client_no, 'm');
-                            if (clientarray[client_no].used != 0) {
-                                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                                 clientarray[client_no].charcount = 0;
                                 parse_message(client_no);
                             }
@@ -598,8 +1404,8 @@ fprintf (stderr, "Cstat: client %d\n", client_no);
                     }
                     else {
                         send_strike(client_no, 'm');
-                        if (clientarray[client_no].used != 0) {
-                            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                             clientarray[client_no].charcount = 0;
                             parse_message(client_no);
                         }
@@ -610,8 +1416,8 @@ fprintf (stderr, "Cstat: client %d\n", client_no);
                 }
                 else {
                     send_strike(client_no, 'm');
-                    if (clientarray[client_no].used != 0) {
-                        sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                         clientarray[client_no].charcount = 0;
                         parse_message(client_no);
                     }
@@ -622,330 +1428,3350 @@ fprintf (stderr, "Cstat: client %d\n", client_no);
             }
             else {
                 send_strike(client_no, 'm');
-                if (clientarray[client_no].used != 0) {
-                    sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
                     clientarray[client_no].charcount = 0;
                     parse_message(client_no);
                 }
             }
     	}
-    	else if (*tempbufp == '\0') {
-        	return;
-    	}
-    	else {
-        	send_strike(client_no, 'm');
-        	if (clientarray[client_no].used != 0) {
-            	sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
-            	clientarray[client_no].charcount = 0;
-            	parse_message(client_no);
-       		}
-    	}
-    }
-    else { /* resynchronizing - look for "(c" sequence */
-        numchars = clientarray[client_no].charcount;
-        int success = 0;
-        while (*tempbufp != '\0' && numchars < MAXMESSAGE) {
-            if (*tempbufp == '(') {
-                char *peek = tempbufp; peek++;
-                if (*peek == 'c') {
-                    success = 1;
-                    break;
+    	else if (*tempbufp == 'z') { /* look for switch to compressed frames */
+            tempbufp++;
+            if (*tempbufp == 'i') {
+                tempbufp++;
+                if (*tempbufp == 'p') {
+                    tempbufp++;
+                    if (*tempbufp == ')') { /* proper czip - answer in text, then switch */
+log_debug("Czip: client %d", client_no);
+                        sprintf(buf, "(szip)");
+                        write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+                        if (IN_SET(usedset, client_no) == 0) {
+                            return;
+                        }
+                        clientarray[client_no].zip = 1;
+                        tempbufp++;
+                        if (*tempbufp == '\0') {
+                            memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                            clientarray[client_no].charcount = 0;
+                            return;
+                        }
+                        else {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                    else if (*tempbufp == '\0') { /* message not finished - stop parsing */
+                        return;
+                    }
+                    else { /* message malformed - send strike and resynchronize */
+                        send_strike(client_no, 'm');
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                }
+                else if (*tempbufp == '\0') {
+                    return;
+                }
+                else {
+                    send_strike(client_no, 'm');
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                        clientarray[client_no].charcount = 0;
+                        parse_message(client_no);
+                    }
                 }
             }
-            tempbufp++;
-            numchars++;
-        }
-        if (success != 0) {
-            clientarray[client_no].resync = 0;
-            sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
-            clientarray[client_no].charcount = 0;
-            parse_message(client_no);
-        }
-        else if (numchars > MAXMESSAGE) { /* exceeded max message length - send strike and resynchronize */
-            send_strike(client_no, 'l');
-            if (clientarray[client_no].used != 0) {
-                sprintf(clientarray[client_no].clibuf, "%s", tempbufp);
-                clientarray[client_no].charcount = 0;
-                parse_message(client_no);
+            else if (*tempbufp == '\0') {
+                return;
             }
-        }
-        else if (*tempbufp == '\0') { /* reached end of message - clear buffer and stop parsing */
-            memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
-            clientarray[client_no].charcount += numchars;
-        }
-    }
-}
-
-
-
-
-
-
-static void send_chat(char **message, char **recipients, int client_no)
-{
-	int zero = 0;
-	char *messageend = *message;
+            else {
+                send_strike(client_no, 'm');
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                    clientarray[client_no].charcount = 0;
+                    parse_message(client_no);
+                }
+            }
+    	}
+        else if (*tempbufp == 'e') { /* look for center message */
+            numchars++;
+            tempbufp++;
+            if (*tempbufp == 'n') {
+                numchars++;
+                tempbufp++;
+                if (*tempbufp == 't') {
+                    numchars++;
+                    tempbufp++;
+                    if (*tempbufp == 'e') {
+                        numchars++;
+                        tempbufp++;
+                        if (*tempbufp == 'r') {
+                            numchars++;
+                            tempbufp++;
+                            if (*tempbufp == '(') {
+                                char *name = tempbufp; name++;
+                                int result = find_right_paren(&tempbufp, &numchars);
+                                if (result == 0) {
+                                    return;
+                                }
+                                else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
+                                    send_strike(client_no, 'l');
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        clientarray[client_no].resync = 1;
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                    return;
+                                }
+                                numchars++;
+                                tempbufp++;
+                                if (*tempbufp == ')') { /* proper center - add client to the channel, opening it if need be */
+log_debug("Center: client %d", client_no);
+                                    if (IN_SET(joinedset, client_no) != 0) {
+                                        enter_channel(&name, client_no);
+                                    }
+                                    else {
+                                        send_strike(client_no, 'm');
+                                    }
+                                    tempbufp++;
+                                    if (*tempbufp == '\0') {
+                                        memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                                        clientarray[client_no].charcount = 0;
+                                        return;
+                                    }
+                                    else if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                }
+                                else if (*tempbufp == '\0') { /* message not finished - stop parsing */
+                                    return;
+                                }
+                                else { /* message malformed - send strike and resynchronize */
+                                    send_strike(client_no, 'm');
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                }
+                            }
+                            else if (*tempbufp == '\0') {
+                                return;
+                            }
+                            else {
+                                send_strike(client_no, 'm');
+                                if (IN_SET(usedset, client_no) != 0) {
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                    clientarray[client_no].charcount = 0;
+                                    parse_message(client_no);
+                                }
+                            }
+                        }
+                        else if (*tempbufp == '\0') {
+                            return;
+                        }
+                        else {
+                            send_strike(client_no, 'm');
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                clientarray[client_no].charcount = 0;
+                                parse_message(client_no);
+                            }
+                        }
+                    }
+                    else if (*tempbufp == '\0') {
+                        return;
+                    }
+                    else {
+                        send_strike(client_no, 'm');
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                }
+                else if (*tempbufp == '\0') {
+                    return;
+                }
+                else {
+                    send_strike(client_no, 'm');
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                        clientarray[client_no].charcount = 0;
+                        parse_message(client_no);
+                    }
+                }
+            }
+            else if (*tempbufp == '\0') {
+                return;
+            }
+            else {
+                send_strike(client_no, 'm');
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                    clientarray[client_no].charcount = 0;
+                    parse_message(client_no);
+                }
+            }
+        }
+        else if (*tempbufp == 'l') { /* look for cleave message */
+            numchars++;
+            tempbufp++;
+            if (*tempbufp == 'e') {
+                numchars++;
+                tempbufp++;
+                if (*tempbufp == 'a') {
+                    numchars++;
+                    tempbufp++;
+                    if (*tempbufp == 'v') {
+                        numchars++;
+                        tempbufp++;
+                        if (*tempbufp == 'e') {
+                            numchars++;
+                            tempbufp++;
+                            if (*tempbufp == '(') {
+                                char *name = tempbufp; name++;
+                                int result = find_right_paren(&tempbufp, &numchars);
+                                if (result == 0) {
+                                    return;
+                                }
+                                else if (result == -1) { /* max message length exceeded - send strike and resynchronize */
+                                    send_strike(client_no, 'l');
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        clientarray[client_no].resync = 1;
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                    return;
+                                }
+                                numchars++;
+                                tempbufp++;
+                                if (*tempbufp == ')') { /* proper cleave - take client out of the channel */
+log_debug("Cleave: client %d", client_no);
+                                    if (IN_SET(joinedset, client_no) != 0) {
+                                        leave_channel(&name, client_no);
+                                    }
+                                    else {
+                                        send_strike(client_no, 'm');
+                                    }
+                                    tempbufp++;
+                                    if (*tempbufp == '\0') {
+                                        memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                                        clientarray[client_no].charcount = 0;
+                                        return;
+                                    }
+                                    else if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                }
+                                else if (*tempbufp == '\0') { /* message not finished - stop parsing */
+                                    return;
+                                }
+                                else { /* message malformed - send strike and resynchronize */
+                                    send_strike(client_no, 'm');
+                                    if (IN_SET(usedset, client_no) != 0) {
+                                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                        clientarray[client_no].charcount = 0;
+                                        parse_message(client_no);
+                                    }
+                                }
+                            }
+                            else if (*tempbufp == '\0') {
+                                return;
+                            }
+                            else {
+                                send_strike(client_no, 'm');
+                                if (IN_SET(usedset, client_no) != 0) {
+                                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                    clientarray[client_no].charcount = 0;
+                                    parse_message(client_no);
+                                }
+                            }
+                        }
+                        else if (*tempbufp == '\0') {
+                            return;
+                        }
+                        else {
+                            send_strike(client_no, 'm');
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                clientarray[client_no].charcount = 0;
+                                parse_message(client_no);
+                            }
+                        }
+                    }
+                    else if (*tempbufp == '\0') {
+                        return;
+                    }
+                    else {
+                        send_strike(client_no, 'm');
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                }
+                else if (*tempbufp == '\0') {
+                    return;
+                }
+                else {
+                    send_strike(client_no, 'm');
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                        clientarray[client_no].charcount = 0;
+                        parse_message(client_no);
+                    }
+                }
+            }
+            else if (*tempbufp == '\0') {
+                return;
+            }
+            else {
+                send_strike(client_no, 'm');
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                    clientarray[client_no].charcount = 0;
+                    parse_message(client_no);
+                }
+            }
+        }
+    	else if (*tempbufp == 's') { /* look for stat message */
+            tempbufp++;
+            if (*tempbufp == 't') {
+                tempbufp++;
+                if (*tempbufp == 'a') {
+                    tempbufp++;
+                    if (*tempbufp == 't') {
+                        tempbufp++;
+                        if (*tempbufp == ')') { /* proper cstat - respond with list of players */
+log_debug("Cstat: client %d", client_no);
+							if (IN_SET(joinedset, client_no) != 0) {
+                            	build_player_list();
+                            	sprintf(buf, "(sstat(%s))", listbuf);
+                            	memset(listbuf, '\0', MAXMESSAGE);
+                            	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+                            }
+                            else {
+								send_strike(client_no, 'm');
+							}
+                            tempbufp++;
+                            if (*tempbufp == '\0') {
+                                memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+                                clientarray[client_no].charcount = 0;
+                                return;
+                            }
+                            else {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                clientarray[client_no].charcount = 0;
+                                parse_message(client_no);
+                            }
+                        }
+                        else if (*tempbufp == '\0') { /* message not finished - stop parsing */
+                            return;
+                        }
+                        else { /* message malformed - send strike and resynchronize */
+                            send_strike(client_no, 'm');
+                            if (IN_SET(usedset, client_no) != 0) {
+                                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                                clientarray[client_no].charcount = 0;
+                                parse_message(client_no);
+                            }
+                        }
+                    }
+                    else if (*tempbufp == '\0') {
+                        return;
+                    }
+                    else {
+                        send_strike(client_no, 'm');
+                        if (IN_SET(usedset, client_no) != 0) {
+                            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                            clientarray[client_no].charcount = 0;
+                            parse_message(client_no);
+                        }
+                    }
+                }
+                else if (*tempbufp == '\0') {
+                    return;
+                }
+                else {
+                    send_strike(client_no, 'm');
+                    if (IN_SET(usedset, client_no) != 0) {
+                        memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                        clientarray[client_no].charcount = 0;
+                        parse_message(client_no);
+                    }
+                }
+            }
+            else if (*tempbufp == '\0') {
+                return;
+            }
+            else {
+                send_strike(client_no, 'm');
+                if (IN_SET(usedset, client_no) != 0) {
+                    memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                    clientarray[client_no].charcount = 0;
+                    parse_message(client_no);
+                }
+            }
+    	}
+    	else if (*tempbufp == '\0') {
+        	return;
+    	}
+    	else {
+        	send_strike(client_no, 'm');
+        	if (IN_SET(usedset, client_no) != 0) {
+            	memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+            	clientarray[client_no].charcount = 0;
+            	parse_message(client_no);
+       		}
+    	}
+    }
+    else { /* resynchronizing - look for "(c" sequence */
+        numchars = clientarray[client_no].charcount;
+        int success = 0;
+        while (*tempbufp != '\0' && numchars < MAXMESSAGE) {
+            if (*tempbufp == '(') {
+                char *peek = tempbufp; peek++;
+                if (*peek == 'c') {
+                    success = 1;
+                    break;
+                }
+            }
+            tempbufp++;
+            numchars++;
+        }
+        if (success != 0) {
+            clientarray[client_no].resync = 0;
+            memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+            clientarray[client_no].charcount = 0;
+            parse_message(client_no);
+        }
+        else if (numchars > MAXMESSAGE) { /* exceeded max message length - send strike and resynchronize */
+            send_strike(client_no, 'l');
+            if (IN_SET(usedset, client_no) != 0) {
+                memmove(clientarray[client_no].clibuf, tempbufp, strlen(tempbufp)+1);
+                clientarray[client_no].charcount = 0;
+                parse_message(client_no);
+            }
+        }
+        else if (*tempbufp == '\0') { /* reached end of message - clear buffer and stop parsing */
+            memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
+            clientarray[client_no].charcount += numchars;
+        }
+    }
+}
+
+
+
+
+
+
+static void send_chat(char **message, char **recipients, int client_no)
+{
+	int zero = 0;
+	char *messageend = *message;
 	find_right_paren(&messageend, &zero);
 	*messageend = '\0';
 	
-	/* Truncate chat message. */
-	char short_message[CHATSIZE+1];
-	snprintf(short_message, CHATSIZE+1, "%s", *message);
+	/* Truncate chat message. */
+	char short_message[CHATSIZE+1];
+	snprintf(short_message, CHATSIZE+1, "%s", *message);
+	
+	/* Strip any illegal characters from chat message. */
+	char *original = short_message;
+	char *stripped = original;
+	while (*original != '\0') {
+		if (*original != '(') {
+			*stripped = *original;
+			stripped++;
+		}
+		original++;
+	}
+	*stripped = '\0';
+	int shortlength = strlen(short_message);
+	
+	char *namestart = *recipients;
+	char *nameend = namestart;
+	int result = find_name_end(&nameend);
+	*nameend = '\0';
+	
+	char convertedname[NAMESIZE+1];
+	char *cnameptr = convertedname;
+	sprintf(convertedname, "%s", namestart);
+	convert_name(&cnameptr);
+
+	int i;
+
+	/* Check for "ANY" or "ALL" recipient. */
+	if (result == 0) {
+		if (strcasecmp("ANY", namestart) == 0) {
+			if (admit_chat(client_no, 1) == 0) {
+				return;
+			}
+			i = pick_any(client_no);
+			if (i < MAXCLIENTS) {
+				deliver_chat(i, client_no, short_message, shortlength, short_message);
+			}
+			return;
+		}
+		else if (strcasecmp("ALL", namestart) == 0) {
+			setwalk walk;
+			if (admit_chat(client_no, numplayers) == 0) {
+				return;
+			}
+			append_history(clientarray[client_no].name, short_message);
+			relay_chat(client_no, short_message, 1);
+			for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+				deliver_chat(i, client_no, short_message, shortlength, short_message);
+			}
+			return;
+		}
+		else if (*namestart == '#') { /* a channel the sender is in */
+			int channel = find_channel(convertedname);
+			if (channel == MAXCHANNELS || find_membership(client_no, channel) < 0) {
+				send_strike(client_no, 'm');
+			}
+			else if (admit_chat(client_no, channels[channel].nummembers) != 0) {
+				send_to_channel(channel, client_no, short_message);
+			}
+			return;
+		}
+	}
+	
+	/* Charge a token for each name listed - the first is already cut off at its comma. */
+	int cost = 1;
+	if (result != 0) {
+		char *pos;
+		for (pos=nameend+1, cost=2; *pos != ')' && *pos != '\0'; pos++) {
+			if (*pos == ',') {
+				cost++;
+			}
+		}
+	}
+	if (admit_chat(client_no, cost) == 0) {
+		return;
+	}
+	
+	/* Send message to all valid recipients. Each name is looked up in its name bucket, and a client has already been sent this message if its sentgen is the current chatgen. Recipients on other servers are gathered by server and relayed once the names run out. */
+	int strikesent = 0;
+	if (++chatgen == 0) { /* wrapped - forget the old generations */
+		memset(sentgen, 0, sizeof(sentgen));
+		memset(remotegen, 0, sizeof(remotegen));
+		chatgen = 1;
+	}
+	for (i=0; i<numnodes; i++) {
+		relaycount[i] = 0;
+		relaynameslen[i] = 0;
+	}
+	while (result != 0) {
+		if (route_chat(cnameptr, client_no, short_message, shortlength) < 0 && strikesent == 0) { /* unknown name, or named twice */
+			send_strike(client_no, 'm');
+			strikesent = 1;
+		}
+		nameend++;
+		namestart = nameend;
+		result = find_name_end(&nameend);
+		*nameend = '\0';
+		memset(convertedname, '\0', NAMESIZE+1);
+		sprintf(convertedname, "%s", namestart);
+		convert_name(&cnameptr);
+	}
+	if (route_chat(cnameptr, client_no, short_message, shortlength) < 0 && strikesent == 0) {
+		send_strike(client_no, 'm');
+		strikesent = 1;
+	}
+	relay_chat(client_no, short_message, 0);
+}
+
+
+
+
+
+/* Pick the recipient of a chat to ANY - any other player connected, MAXCLIENTS if there is none. */
+static int pick_any(int client_no)
+{
+	int i;
+	int numhere = numplayers - numaway; /* seats held from a snapshot have no one to read the chat */
+	
+	if (numhere < 2) {
+		return MAXCLIENTS;
+	}
+	if (numhere == 2) {
+		setwalk walk;
+		for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+			if (i != client_no && IN_SET(awayset, i) == 0) {
+				return i;
+			}
+		}
+		return MAXCLIENTS;
+	}
+	int numhops = (rand() % (numhere-1)) + 1;
+	i = client_no;
+	while(numhops > 0) {
+		i = (i+1) % MAXCLIENTS;
+		if (IN_SET(joinedset, i) != 0 && IN_SET(awayset, i) == 0) {
+			numhops--;
+		}
+	}
+	return i;
+}
+
+
+
+
+/*
+ * Deliver a chat to one recipient. message and length are the bytes as
+ * sent, forwarded as they are to binary clients; text is the same message
+ * truncated and stripped for the text protocol.
+ */
+static void deliver_chat(int recipient, int sender, char *message, int length, char *text)
+{
+	if (clientarray[recipient].binary != 0) {
+		struct iovec iov[2];
+		unsigned char header[16];
+		unsigned char id[8];
+		int idlength = put_varint(id, clientarray[sender].id);
+		int used = put_varint(header, 1+idlength+length);
+		header[used++] = BIN_SCHAT;
+		memcpy(header+used, id, idlength);
+		iov[0].iov_base = header;
+		iov[0].iov_len = used+idlength;
+		iov[1].iov_base = message;
+		iov[1].iov_len = length;
+		writev_to_client(recipient, iov, 2);
+	}
+	else {
+		sprintf(buf, "(schat(%s)(%s))", clientarray[sender].name, text);
+		write_to_client(clientarray[recipient].socket, recipient, CLEAR);
+	}
+	count_event(&deliverycount);
+}
+
+
+
+
+/* Dispatch every complete frame in a binary client's buffer, and keep any partial frame at its start. */
+static void parse_frames(int client_no)
+{
+	unsigned char *start = (unsigned char *) clientarray[client_no].clibuf;
+	unsigned char *pos = start;
+	unsigned char *end = start + clientarray[client_no].charcount;
+	unsigned int length;
+	int used;
+	
+	while (pos < end) {
+		if (clientarray[client_no].skip > 0) { /* still discarding an oversized frame */
+			int discard = clientarray[client_no].skip < end-pos ? clientarray[client_no].skip : (int) (end-pos);
+			pos += discard;
+			clientarray[client_no].skip -= discard;
+			continue;
+		}
+		used = get_varint(pos, end, &length);
+		if (used == 0) { /* length not all here yet */
+			break;
+		}
+		if (used < 0 || length == 0) { /* no frame can start like this - drop everything held */
+			send_strike(client_no, 'm');
+			pos = end;
+		}
+		else if (length > MAXFRAME) {
+			send_strike(client_no, 'l');
+			clientarray[client_no].skip = (int) length;
+			pos += used;
+		}
+		else if (end-pos-used < (long) length) { /* frame not all here yet */
+			break;
+		}
+		else {
+			dispatch_frame(client_no, pos+used, (int) length);
+			pos += used + length;
+		}
+		if (IN_SET(usedset, client_no) == 0) { /* dropped - its buffer is gone */
+			return;
+		}
+	}
+	memmove(start, pos, end-pos);
+	clientarray[client_no].charcount = (int) (end-pos);
+}
+
+
+
+
+/* Act on one binary frame, opcode first. */
+static void dispatch_frame(int client_no, unsigned char *frame, int length)
+{
+	unsigned char *pos = frame+1;
+	unsigned char *end = frame+length;
+	unsigned char *message;
+	char text[CHATSIZE+1];
+	unsigned int count, id;
+	int i, c, used, channel, textlength = 0;
+	
+	if (IN_SET(joinedset, client_no) == 0) {
+		send_strike(client_no, 'm');
+		return;
+	}
+	if (frame[0] == BIN_STAT) {
+log_debug("Bstat: client %d", client_no);
+		send_roster(client_no);
+		return;
+	}
+	if (frame[0] == BIN_PONG) { /* being read was all it was for */
+		return;
+	}
+	if (frame[0] == BIN_ENTER || frame[0] == BIN_LEAVE) { /* the name, made a string for convert_name() */
+		char name[MAXFRAME+1];
+		char *nameptr = name;
+		memcpy(name, pos, end-pos);
+		name[end-pos] = '\0';
+		if (frame[0] == BIN_ENTER) {
+			enter_channel(&nameptr, client_no);
+		}
+		else {
+			leave_channel(&nameptr, client_no);
+		}
+		return;
+	}
+	if (frame[0] != BIN_CHAT && frame[0] != BIN_ANY && frame[0] != BIN_CHANNEL) {
+		send_strike(client_no, 'm');
+		return;
+	}
+	count = 0;
+	channel = MAXCHANNELS;
+	if (frame[0] == BIN_CHANNEL) { /* find the channel, which the sender must be in */
+		char name[NAMESIZE+1];
+		char converted[256];
+		char *convertedptr = converted;
+		if (pos >= end || *pos > NAMESIZE || end-pos-1 < *pos) {
+			send_strike(client_no, 'm');
+			return;
+		}
+		memcpy(name, pos+1, *pos);
+		name[*pos] = '\0';
+		sprintf(converted, "%s", name);
+		convert_name(&convertedptr);
+		channel = find_channel(converted);
+		if (channel == MAXCHANNELS || find_membership(client_no, channel) < 0) {
+			send_strike(client_no, 'm');
+			return;
+		}
+		message = pos+1+*pos;
+	}
+	else if (frame[0] == BIN_CHAT) { /* step over the recipients to find the message */
+		used = get_varint(pos, end, &count);
+		if (used <= 0 || count > MAXCLIENTS) {
+			send_strike(client_no, 'm');
+			return;
+		}
+		pos += used;
+		message = pos;
+		for (i=0; i<(int) count; i++) {
+			used = get_varint(message, end, &id);
+			if (used <= 0) {
+				send_strike(client_no, 'm');
+				return;
+			}
+			message += used;
+		}
+	}
+	else {
+		message = pos;
+	}
+	
+	/* Truncate the message, and make the text protocol's version of it. */
+	if (end-message > CHATSIZE) {
+		end = message + CHATSIZE;
+	}
+	for (i=0; i<end-message; i++) {
+		if (isprint(message[i]) != 0 && message[i] != '(') {
+			text[textlength++] = message[i];
+		}
+	}
+	text[textlength] = '\0';
+	
+	if (admit_chat(client_no, frame[0] == BIN_CHANNEL ? channels[channel].nummembers : frame[0] == BIN_ANY ? 1 : count == 0 ? numplayers : (int) count) == 0) {
+		return;
+	}
+	
+log_debug("Bchat: client %d", client_no);
+	unsigned long long chatstart = now_micros();
+	count_event(&chatcount);
+	if (frame[0] == BIN_CHANNEL) {
+		send_to_channel(channel, client_no, text);
+	}
+	else if (frame[0] == BIN_ANY) {
+		c = pick_any(client_no);
+		if (c < MAXCLIENTS) {
+			deliver_chat(c, client_no, (char *) message, end-message, text);
+		}
+	}
+	else if (count == 0) { /* ALL */
+		setwalk walk;
+		append_history(clientarray[client_no].name, text);
+		relay_chat(client_no, text, 1);
+		for (c=first_in_set(&walk, joinedset); c<MAXCLIENTS; c=next_in_walk(&walk)) {
+			deliver_chat(c, client_no, (char *) message, end-message, text);
+		}
+	}
+	else { /* IDs map straight to slots - a client already sent this message has sentgen equal to chatgen */
+		int strikesent = 0;
+		if (++chatgen == 0) {
+			memset(sentgen, 0, sizeof(sentgen));
+			chatgen = 1;
+		}
+		for (i=0; i<(int) count; i++) {
+			pos += get_varint(pos, end, &id);
+			c = id % MAXCLIENTS;
+			if (IN_SET(joinedset, c) == 0 || clientarray[c].id != id || sentgen[c] == chatgen) { /* unknown ID, or named twice */
+				if (strikesent == 0) {
+					send_strike(client_no, 'm');
+					strikesent = 1;
+				}
+			}
+			else {
+				deliver_chat(c, client_no, (char *) message, end-message, text);
+				sentgen[c] = chatgen;
+			}
+			if (IN_SET(usedset, client_no) == 0) {
+				break;
+			}
+		}
+	}
+	record_value(&delivertime, now_micros() - chatstart);
+}
+
+
+
+
+/* Send a binary client the ID and name of every player. */
+static void send_roster(int client_no)
+{
+	unsigned char roster[MAXCLIENTS*(NAMESIZE+6)+8];
+	unsigned char header[8];
+	struct iovec iov[2];
+	int i, length = 1, used;
+	setwalk walk;
+	
+	roster[0] = BIN_ROSTER;
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		int namelength = strlen(clientarray[i].name);
+		length += put_varint(roster+length, clientarray[i].id);
+		roster[length++] = (unsigned char) namelength;
+		memcpy(roster+length, clientarray[i].name, namelength);
+		length += namelength;
+	}
+	used = put_varint(header, length);
+	iov[0].iov_base = header;
+	iov[0].iov_len = used;
+	iov[1].iov_base = roster;
+	iov[1].iov_len = length;
+	writev_to_client(client_no, iov, 2);
+}
+
+
+
+
+/* Write value as a varint - 7 bits a byte, low bits first. Returns the number of bytes written. */
+static int put_varint(unsigned char *out, unsigned int value)
+{
+	int used = 0;
+	
+	while (value >= 0x80) {
+		out[used++] = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	out[used++] = (unsigned char) value;
+	return used;
+}
+
+
+
+
+/* Read a varint from pos, reading nothing at or past end. Returns the number of bytes read, 0 if it is not all there, -1 if it is too long. */
+static int get_varint(unsigned char *pos, unsigned char *end, unsigned int *value)
+{
+	int used = 0;
+	
+	*value = 0;
+	while (pos+used < end) {
+		if (used == 5) {
+			return -1;
+		}
+		*value |= (unsigned int) (pos[used] & 0x7f) << (7*used);
+		if ((pos[used++] & 0x80) == 0) {
+			return used;
+		}
+	}
+	return used == 5 ? -1 : 0;
+}
+
+
+
+
+
+static int find_name_end(char **current)
+{
+    char *pos = *current;
+    
+    while (*pos != ')' && *pos != ',') {
+        pos++;
+    }
+    *current = pos;
+    if (*pos == ')') {
+        return 0;
+    }
+    else {
+        return 1;
+    }
+}
+
+
+
+
+static void convert_name(char **name)
+{
+	char *namepos = *name;
+	char temp[480];
+	char *temppos = temp;
+	
+	/* Copy name into temp string. */
+	while (*namepos != ')' && *namepos != '\0') {
+		if (*namepos != ' ') {
+			*temppos = *namepos;
+			temppos++;
+		}
+		namepos++;
+	}
+	*temppos = '\0';
+
+	/* Remove any illegal characters (non-alphanumeric/dot). */
+	temppos = temp;
+	char *copy = temppos;
+	while (*temppos != '\0') {
+		if (isalnum(*temppos) != 0 || *temppos == '.') {
+			*copy = *temppos;
+			copy++;
+		}
+		temppos++;
+	}
+	*copy = '\0';
+	
+	/* Remove leading and trailing periods. */
+	temppos = temp;
+	copy = temppos;
+	int removing = 1;
+	while (*temppos != '\0') {
+		if (*temppos != '.') {
+			*copy = *temppos;
+			copy++;
+			removing = 0;
+		}
+		else if (removing == 0) {
+			*copy = *temppos;
+			copy++;
+		}
+		temppos++;
+	}
+	*copy = '\0';
+	copy--;
+	while (copy != temp) {
+		if (*copy != '.') {
+			break;
+		}
+		copy--;
+	}
+	copy++;
+	*copy = '\0';
+	
+	/* Remove all but last dot. */
+	int num_dots = 0;
+	temppos = temp;
+	while (*temppos != '\0') {
+		if (*temppos == '.') {
+			num_dots++;
+		}
+		temppos++;
+	}
+	char *last_dot;
+	if (num_dots > 0) {
+		char extension[480];
+		while (*copy != '.') {
+			copy--;
+		}
+		last_dot = copy;
+		sprintf(extension, "%s", last_dot);
+		temppos = temp;
+		copy = temppos;
+		while (temppos != last_dot) {
+			if (*temppos != '.') {
+				*copy = *temppos;
+				copy++;
+			}
+			temppos++;
+		}
+		*copy = '\0';
+		strcat(temp, extension);
+		for (last_dot = temp; *last_dot != '.'; last_dot++);
+	}
+	
+	/* Convert name to uppercase. */
+	temppos = temp;
+	while (*temppos != '\0') {
+		*temppos = toupper(*temppos);
+		++temppos;
+	}
+	
+	/* Truncate name before dot to 8 characters, and name after dot to 3 characters. */
+	char short_name[13];
+	if (num_dots > 0) {
+		*last_dot = '\0';
+		snprintf(short_name, BODYSIZE+1, "%s", temp);
+		*last_dot = '.';
+		strncat(short_name, last_dot, SUFFIXSIZE+1);
+		sprintf(temp, "%s", short_name);
+		last_dot = temp;
+		while (*last_dot != '.') {
+			last_dot++;
+		}
+	}
+	else {
+		snprintf(short_name, BODYSIZE+1, "%s", temp);
+		sprintf(temp, "%s", short_name);
+	}
+	
+	/* Place converted name into destination string. */
+	sprintf(*name, "%s", temp);
+}
+
+
+
+
+
+
+static void assign_name(char **name, int client_no)
+{
+	char temp[480];
+	char *temppos = temp;
+	sprintf(temp, "%s", *name);
+	convert_name(&temppos);
+	
+	/* Send strike if name is empty. */
+	if (strlen(temp) == 0) { /* zero length name - send strike */
+		send_strike(client_no, 'm');
+		return;
+	}
+	
+	/* Send strike if name is a reserved word. */
+	if (strcmp("ALL", temp) == 0 || strcmp("ANY", temp) == 0) {
+		send_strike(client_no, 'm');
+		return;
+	}
+
+	/* A player held from a snapshot is back. */
+	int seat = find_client(temp);
+	if (seat != MAXCLIENTS && IN_SET(awayset, seat) != 0) {
+		reclaim_seat(seat, client_no);
+		return;
+	}
+
+	/* Check for matches - anywhere in the federation. */
+	int j, match = 0;
+	if (name_taken(temp) != 0) {
+		match = 1;
+	}
+	if (match == 0) { /* no matches - assign name */
+		sprintf(clientarray[client_no].name, "%s", temp);
+	}
+	else { /* match found - assign first unmatched alternative */
+		char tentative[NAMESIZE+1];
+		char number[5];
+		int offset = 1;
+		int num_dots = 0;
+		while (*temppos != '\0') {
+			if (*temppos == '.') {
+				num_dots = 1;
+				break;
+			}
+			temppos++;
+		}
+		for (j=1; j<31; j++) {
+			memset(tentative, '\0', NAMESIZE+1);
+			memset(number, '\0', 5);
+			if (j < 10) {
+				snprintf(tentative, BODYSIZE-1, "%s", temp);
+			}
+			else if (j < 100) {
+				snprintf(tentative, BODYSIZE-2, "%s", temp);
+			}
+			else {
+				snprintf(tentative, BODYSIZE-3, "%s", temp);
+			}
+			sprintf(number, "~%d", j);
+			strcat(tentative, number);
+			if (num_dots > 0) {
+				strcat(tentative, temppos);
+			}
+			match = 0;
+			if (name_taken(tentative) != 0) {
+				match = 1;
+				offset++;
+			}
+			if (match == 0) {
+				break;
+			}
+		}
+		sprintf(clientarray[client_no].name, "%s", tentative);
+	}
+	if (claim_name(client_no, temp) != 0) { /* owned by another server - the join completes when it grants the name */
+		return;
+	}
+	complete_join(client_no);
+}
+
+
+
+
+/* Make a named client a player, and tell everyone - the client with sjoin, the other players with sstat, and the other servers with RELAY_ADD. */
+static void complete_join(int client_no)
+{
+	int i;
+	
+	clientarray[client_no].claiming = 0;
+	add_name(client_no);
+	clientarray[client_no].id += MAXCLIENTS; /* a new ID, so IDs held for the slot's last player reach nobody */
+	if (numnodes > 0) {
+		if (owner_of(clientarray[client_no].name) == nodeno) {
+			table_add(&claims, clientarray[client_no].name, nodeno);
+		}
+		for (i=0; i<numnodes; i++) {
+			send_name(i, RELAY_ADD, clientarray[client_no].name);
+		}
+	}
+
+	/* update player information, send sjoin to new player and sstat to all others */
+	ADD_TO_SET(joinedset, client_no);
+	numplayers++;
+	build_player_list();
+	sprintf(buf, "(sjoin(%s)(%s)(%d,%d,%d))", clientarray[client_no].name, listbuf, minplayers, lobbytime, timeout);
+	memset(listbuf, '\0', MAXMESSAGE);
+	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+	if (IN_SET(usedset, client_no) != 0) {
+		replay_history(client_no);
+	}
+	broadcast_roster(client_no);
+}
+
+
+
+
+
+
+static void build_player_list()
+{
+	int added = 0;
+	int i;
+	setwalk walk;
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (added == 0) {
+			sprintf(listbuf, "%s", clientarray[i].name);
+		}
+		else {
+			strcat(listbuf, ",");
+			strcat(listbuf, clientarray[i].name);
+		}
+		added++;
+	}
+	if (added == numplayers) {
+	}
+	else {
+log_error("player list does not agree with numplayers");
+	}
+	for (i=0; i<MAXNAMES && remoteplayers.count > 0; i++) { /* then the players on other servers, while they fit */
+		if (remoteplayers.entries[i].used != 0 && strlen(listbuf) + strlen(remoteplayers.entries[i].name) + 1 < LISTLIMIT) {
+			if (listbuf[0] != '\0') {
+				strcat(listbuf, ",");
+			}
+			strcat(listbuf, remoteplayers.entries[i].name);
+		}
+	}
+}
+
+
+
+
+
+
+static int find_right_paren(char **current, int *numchars)
+{
+    char *pos = *current; pos++;
+    int chars = *numchars;
+    
+    while (*pos != '\0' && chars < MAXMESSAGE) {
+        chars++;
+        if (*pos == ')') {
+            break;
+        }
+        pos++;
+    }
+    *numchars = chars;
+    if (*pos == '\0') {
+    	*current = pos;
+        return 0;
+    }
+    else if (chars >= MAXMESSAGE) {
+    	*current = pos;
+        return -1;
+    }
+    else {
+        *current = pos;
+        return 1;
+    }
+}
+
+
+
+
+
+
+void send_strike(int client_no, char reason)
+{
+    clientarray[client_no].strikes += 1;
+    
+    if (reason == 'm') { /* send 'malformed' strike */
+        sprintf(buf, "(strike(%d)(malformed))", clientarray[client_no].strikes);
+        count_event(&malformedcount);
+        clientarray[client_no].resync = 1;
+        clientarray[client_no].charcount = 0;
+    }
+    else if (reason == 'b') { /* send 'badint' strike */
+        sprintf(buf, "(strike(%d)(badint))", clientarray[client_no].strikes);
+        clientarray[client_no].resync = 1;
+        clientarray[client_no].charcount = 0;
+    }
+    else if (reason == 't') { /* send 'timeout' strike */
+        sprintf(buf, "(strike(%d)(timeout))", clientarray[client_no].strikes);
+    }
+    else if (reason == 'r') { /* send 'flood' strike - the chat was well formed, so no resync */
+        sprintf(buf, "(strike(%d)(flood))", clientarray[client_no].strikes);
+    }
+    else if (reason == 'l') { /* send 'toolong' strike */
+        sprintf(buf, "(strike(%d)(toolong))", clientarray[client_no].strikes);
+        count_event(&toolongcount);
+        clientarray[client_no].resync = 1;
+        clientarray[client_no].charcount = 0;
+    }
+    write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+log_info("Strike: %d to client %d", clientarray[client_no].strikes, client_no);
+    
+    if (IN_SET(usedset, client_no) != 0 && clientarray[client_no].strikes == 3) { /* 3rd strike - drop client connection */
+        closesocket(clientarray[client_no].socket);
+log_info("Dropped: Client %d - 3 strikes", client_no);
+        if (IN_SET(joinedset, client_no) != 0) { /* client had a name - send sstat to all players */
+				numplayers--;
+				REMOVE_FROM_SET(joinedset, client_no);
+				broadcast_roster(client_no);
+		}
+        FD_CLR (clientarray[client_no].socket, &total_set);
+        clear_clientinfo(client_no);
+    }
+}
+
+
+
+
+
+
+/* Write the text message in buf to a client - framed as write_text() frames it. */
+void write_to_client(int socket, int client_no, int clear)
+{
+	zipframe zipped;
+	zipped.length = 0;
+	if (write_text(socket, client_no, buf, strlen(buf), &zipped) < 0) {
+		if (clear == CLEAR) {
+			write_failed(socket, client_no);
+		}
+		else {
+log_info("Dropped: Client %d - Write error", client_no);
+		}
+	}
+	memset(buf, '\0', BUFSIZE);
+}
+
+
+
+
+static void writev_to_client(int client_no, struct iovec *iov, int iovcnt)
+{
+	if (IN_SET(awayset, client_no) != 0) { /* held seat - no one to tell */
+		return;
+	}
+	if (writev(clientarray[client_no].socket, iov, iovcnt) < 0) {
+		write_failed(clientarray[client_no].socket, client_no);
+	}
+}
+
+
+
+
+/*
+ * Write a text message to a client: as it is to a text client, in a
+ * BIN_TEXT frame to a binary or zip client, or as the BIN_ZTEXT frame in
+ * zipped to a zip client if the message is long enough and shrinks.
+ * zipped is compressed the first time it is needed, so a message written
+ * to many clients with the same zipped is compressed at most once.
+ * Returns what writev() does.
+ */
+static int write_text(int socket, int client_no, char *text, int length, zipframe *zipped)
+{
+	struct iovec iov[2];
+	unsigned char header[8];
+	int iovcnt = 0;
+	
+	if (client_no < MAXCLIENTS && IN_SET(awayset, client_no) != 0) { /* held seat - no one to tell */
+		return length;
+	}
+	if (client_no < MAXCLIENTS && clientarray[client_no].zip != 0 && length >= ZIPMIN) {
+		if (zipped->length == 0) {
+			zipped->length = zip_text(text, length, zipped->space, sizeof(zipped->space), &zipped->start);
+		}
+		if (zipped->length > 0) {
+			__atomic_fetch_add(&ziptextbytes, length, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&zipsentbytes, zipped->length, __ATOMIC_RELAXED);
+			return write(socket, zipped->start, zipped->length);
+		}
+	}
+	if (client_no < MAXCLIENTS && (clientarray[client_no].binary != 0 || clientarray[client_no].zip != 0)) {
+		int used = put_varint(header, length+1);
+		header[used] = BIN_TEXT;
+		iov[iovcnt].iov_base = header;
+		iov[iovcnt++].iov_len = used+1;
+	}
+	iov[iovcnt].iov_base = text;
+	iov[iovcnt++].iov_len = length;
+	return writev(socket, iov, iovcnt);
+}
+
+
+
+
+/* Compress text into a BIN_ZTEXT frame in space, of room bytes, and point frame at it. Returns the frame's length, -1 if it would be no shorter than the text. */
+static int zip_text(char *text, int length, unsigned char *space, int room, unsigned char **frame)
+{
+	unsigned char header[ZIPHEADROOM];
+	unsigned long long started = now_micros();
+	int zlength, used, textused;
+	
+	textused = put_varint(header, length);
+	zlength = zip_compress(text, length, space+ZIPHEADROOM, length-textused-4 < room-ZIPHEADROOM ? length-textused-4 : room-ZIPHEADROOM);
+	record_value(&ziptime, now_micros()-started);
+	if (zlength <= 0) {
+		return -1;
+	}
+	used = put_varint(header, 1+textused+zlength);
+	header[used++] = BIN_ZTEXT;
+	used += put_varint(header+used, length);
+	*frame = space+ZIPHEADROOM-used;
+	memcpy(*frame, header, used);
+	return used+zlength;
+}
+
+
+
+
+/* Send the roster to every player here but except - MAXCLIENTS for none. It is formatted once, and compressed at most once for all the zip clients. */
+static void broadcast_roster(int except)
+{
+	char text[MAXMESSAGE+16];
+	zipframe zipped;
+	int i, length;
+	setwalk walk;
+	
+	build_player_list();
+	length = sprintf(text, "(sstat(%s))", listbuf);
+	memset(listbuf, '\0', MAXMESSAGE);
+	zipped.length = 0;
+	for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (i != except && write_text(clientarray[i].socket, i, text, length, &zipped) < 0) {
+			write_failed(clientarray[i].socket, i);
+		}
+	}
+}
+
+
+
+
+static void write_failed(int socket, int client_no)
+{
+	if (IN_SET(usedset, client_no) == 0 || socket < 0) { /* already dropped - by a write that failed earlier in the same broadcast */
+		return;
+	}
+log_info("Dropped: Client %d - Write error", client_no);
+	if (IN_SET(joinedset, client_no) != 0) {
+		numplayers--;
+		REMOVE_FROM_SET(joinedset, client_no);
+		broadcast_roster(client_no);
+	}
+	closesocket(socket);
+	FD_CLR (socket, &total_set);
+	clear_clientinfo(client_no);
+}
+
+
+
+
+
+
+/* Start walking set and return its first client, MAXCLIENTS if none. */
+static inline int first_in_set(setwalk *walk, clientset set)
+{
+	walk->set = set;
+	walk->word = 0;
+	walk->bits = set[0];
+	return next_in_walk(walk);
+}
+
+
+
+
+/* Return the next client in the set being walked, MAXCLIENTS once all have been visited. Clients removed from the set during the walk - dropped by a failed write, say - are skipped. */
+static inline int next_in_walk(setwalk *walk)
+{
+	int client;
+	
+	walk->bits &= walk->set[walk->word];
+	while (walk->bits == 0) {
+		if (++walk->word >= SETWORDS) {
+			return MAXCLIENTS;
+		}
+		walk->bits = walk->set[walk->word];
+	}
+	client = (walk->word<<6) + __builtin_ctzll(walk->bits);
+	walk->bits &= walk->bits - 1;
+	return client;
+}
+
+
+
+
+
+
+/* FNV-1a hash of a string. */
+static unsigned int hash_string(char *string)
+{
+	unsigned int hash = 2166136261U;
+	
+	while (*string != '\0') {
+		hash ^= (unsigned char) *string;
+		hash *= 16777619U;
+		string++;
+	}
+	return hash;
+}
+
+
+
+
+/* Hash of a name, reduced to its name bucket. */
+static unsigned int hash_name(char *name)
+{
+	return hash_string(name) & (NAMEBUCKETS-1);
+}
+
+
+
+
+/* Put a newly named client at the head of its name bucket. */
+static void add_name(int client_no)
+{
+	unsigned int bucket = hash_name(clientarray[client_no].name);
+	clientarray[client_no].namenext = namebucket[bucket];
+	namebucket[bucket] = client_no;
+}
+
+
+
+
+/* Unlink a client from its name bucket. Clients that never joined have no name and are in no bucket. */
+static void remove_name(int client_no)
+{
+	int *link;
+	
+	if (clientarray[client_no].name[0] == '\0') {
+		return;
+	}
+	link = &namebucket[hash_name(clientarray[client_no].name)];
+	while (*link != MAXCLIENTS) {
+		if (*link == client_no) {
+			*link = clientarray[client_no].namenext;
+			break;
+		}
+		link = &clientarray[*link].namenext;
+	}
+	clientarray[client_no].namenext = MAXCLIENTS;
+}
+
+
+
+
+/* Return the client with the given name, MAXCLIENTS if there is none. */
+static int find_client(char *name)
+{
+	int i;
+	
+	for (i=namebucket[hash_name(name)]; i!=MAXCLIENTS; i=clientarray[i].namenext) {
+		if (strcmp(clientarray[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return MAXCLIENTS;
+}
+
+
+
+
+
+
+/* Empty every channel name bucket and put every channel on the free stack, lowest-numbered on top. */
+static void init_channels()
+{
+	int c;
+	
+	for (c=0; c<CHANNELBUCKETS; c++) {
+		channelbucket[c] = MAXCHANNELS;
+	}
+	for (c=0; c<MAXCHANNELS; c++) {
+		channels[c].nummembers = 0;
+		channels[c].next = c+1; /* MAXCHANNELS after the last */
+	}
+	freechannels = 0;
+}
+
+
+
+
+/* Return the open channel with the given name, MAXCHANNELS if there is none. */
+static int find_channel(char *name)
+{
+	int c;
+	
+	for (c=channelbucket[hash_string(name) & (CHANNELBUCKETS-1)]; c!=MAXCHANNELS; c=channels[c].next) {
+		if (strcmp(channels[c].name, name) == 0) {
+			return c;
+		}
+	}
+	return MAXCHANNELS;
+}
+
+
+
+
+/* Return where a channel is in a client's memberof, -1 if the client is not in it. */
+static int find_membership(int client_no, int channel)
+{
+	int k;
+	
+	for (k=0; k<clientarray[client_no].nummemberof; k++) {
+		if (clientarray[client_no].memberof[k] == channel) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+
+
+
+/* Put a client in the named channel, opening the channel if it is not open, and answer senter. Entering a channel the client is already in is answered the same. */
+static void enter_channel(char **name, int client_no)
+{
+	char temp[480];
+	char *temppos = temp;
+	int channel;
+	
+	snprintf(temp, sizeof(temp), "%s", *name);
+	convert_name(&temppos);
+	if (strlen(temp) == 0) { /* zero length name - send strike */
+		send_strike(client_no, 'm');
+		return;
+	}
+	channel = find_channel(temp);
+	if (channel != MAXCHANNELS && find_membership(client_no, channel) >= 0) {
+		sprintf(buf, "(senter(%s))", temp);
+		write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+		return;
+	}
+	if (clientarray[client_no].nummemberof == MAXMEMBERSHIPS || add_member(temp, client_no) == MAXCHANNELS) {
+		send_strike(client_no, 'm');
+		return;
+	}
+	sprintf(buf, "(senter(%s))", temp);
+	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+}
+
+
+
+
+/* Put a client in a channel it is not in, opening the channel if it is not open. Returns the channel, MAXCHANNELS if it could not be opened. */
+static int add_member(char *name, int client_no)
+{
+	int channel = find_channel(name);
+	
+	if (channel == MAXCHANNELS) { /* open it */
+		if (freechannels == MAXCHANNELS) {
+log_warn("Channels: all %d in use - client %d cannot open %s", MAXCHANNELS, client_no, name);
+			return MAXCHANNELS;
+		}
+		channel = freechannels;
+		freechannels = channels[channel].next;
+		sprintf(channels[channel].name, "%s", name);
+		unsigned int bucket = hash_string(name) & (CHANNELBUCKETS-1);
+		channels[channel].next = channelbucket[bucket];
+		channelbucket[bucket] = channel;
+		numchannels++;
+	}
+	channels[channel].members[channels[channel].nummembers++] = client_no;
+	clientarray[client_no].memberof[clientarray[client_no].nummemberof++] = channel;
+	return channel;
+}
+
+
+
+
+/* Take a client out of the named channel and answer sleave. Leaving a channel the client is not in draws a strike. */
+static void leave_channel(char **name, int client_no)
+{
+	char temp[480];
+	char *temppos = temp;
+	int channel;
+	
+	snprintf(temp, sizeof(temp), "%s", *name);
+	convert_name(&temppos);
+	channel = find_channel(temp);
+	if (channel == MAXCHANNELS || find_membership(client_no, channel) < 0) {
+		send_strike(client_no, 'm');
+		return;
+	}
+	remove_member(channel, client_no);
+	sprintf(buf, "(sleave(%s))", temp);
+	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+}
+
+
+
+
+/* Take a client out of a channel it is in, closing the channel if that leaves it empty. */
+static void remove_member(int channel, int client_no)
+{
+	channelinfo *chan = &channels[channel];
+	int k, *link;
+	
+	for (k=0; k<chan->nummembers; k++) {
+		if (chan->members[k] == client_no) {
+			chan->members[k] = chan->members[--chan->nummembers];
+			break;
+		}
+	}
+	k = find_membership(client_no, channel);
+	clientarray[client_no].memberof[k] = clientarray[client_no].memberof[--clientarray[client_no].nummemberof];
+	if (chan->nummembers > 0) {
+		return;
+	}
+	link = &channelbucket[hash_string(chan->name) & (CHANNELBUCKETS-1)]; /* close it */
+	while (*link != MAXCHANNELS) {
+		if (*link == channel) {
+			*link = chan->next;
+			break;
+		}
+		link = &channels[*link].next;
+	}
+	memset(chan->name, '\0', NAMESIZE+1);
+	chan->next = freechannels;
+	freechannels = channel;
+	numchannels--;
+}
+
+
+
+
+/* Send a chat to every member of a channel. The schan message is formatted once and written to each member as is - binary members get it behind a BIN_TEXT header, also built once. */
+static void send_to_channel(int channel, int client_no, char *text)
+{
+	char message[MAXMESSAGE];
+	unsigned char header[8];
+	struct iovec iov[2];
+	int members[MAXCLIENTS];
+	int nummembers = channels[channel].nummembers;
+	int k, length, used;
+	
+	length = snprintf(message, sizeof(message), "(schan(%s)(%s)(%s))", channels[channel].name, clientarray[client_no].name, text);
+	used = put_varint(header, length+1);
+	header[used++] = BIN_TEXT;
+	iov[0].iov_base = header;
+	iov[0].iov_len = used;
+	iov[1].iov_base = message;
+	iov[1].iov_len = length;
+	memcpy(members, channels[channel].members, nummembers*sizeof(int)); /* a failed write drops its member, which changes the channel's array */
+	for (k=0; k<nummembers; k++) {
+		int member = members[k];
+		if (IN_SET(joinedset, member) == 0) { /* dropped earlier in this loop */
+			continue;
+		}
+		if (clientarray[member].binary != 0 || clientarray[member].zip != 0) {
+			writev_to_client(member, iov, 2);
+		}
+		else {
+			writev_to_client(member, iov+1, 1);
+		}
+		count_event(&deliverycount);
+	}
+}
+
+
+
+
+
+
+/* Map the history file, creating it if need be. A file that is not a history ring of this layout is started afresh. */
+static void open_history(char *path)
+{
+	int fd;
+	
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (ftruncate(fd, sizeof(historyring)) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+	history = mmap(NULL, sizeof(historyring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (history == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd); /* the mapping keeps the file */
+	if (history->magic != HISTORYMAGIC || history->numslots != HISTORYSLOTS || history->slotsize != sizeof(historyslot) || history->next == 0) {
+		if (history->magic != 0) {
+log_warn("History: %s is not a history ring this server can read - starting afresh", path);
+		}
+		memset(history, 0, sizeof(historyring));
+		history->magic = HISTORYMAGIC;
+		history->numslots = HISTORYSLOTS;
+		history->slotsize = sizeof(historyslot);
+		history->next = 1;
+	}
+log_info("History: %llu chats kept in %s", history->next-1 < HISTORYSLOTS ? history->next-1 : (unsigned long long) HISTORYSLOTS, path);
+}
+
+
+
+
+/* Keep a chat to ALL in the history ring, overwriting the oldest. The slot is marked invalid while it is written, so a crash mid-copy leaves no torn chat to replay. */
+static void append_history(char *sender, char *text)
+{
+	historyslot *slot;
+	unsigned long long seq;
+	
+	if (history == NULL) {
+		return;
+	}
+	seq = history->next;
+	slot = &history->slots[seq % HISTORYSLOTS];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELEASE);
+	slot->length = snprintf(slot->text, MAXMESSAGE, "(schat(%s)(%s))", sender, text);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&history->next, seq+1, __ATOMIC_RELEASE);
+	count_event(&historycount);
+}
+
+
+
+
+/* Send a newly named client the last replay chats from history, oldest first, straight from the ring in one writev - or to a zip client in one BIN_ZTEXT frame, kept for the next until history grows. */
+static void replay_history(int client_no)
+{
+	struct iovec iov[2*HISTORYSLOTS];
+	unsigned char headers[HISTORYSLOTS][8];
+	unsigned long long seq, first;
+	int iovcnt = 0, count = 0, length = 0;
+	int zip = clientarray[client_no].zip;
+	
+	if (history == NULL || replay == 0) {
+		return;
+	}
+	if (zip == 0 || replaynext != history->next || replayframelength < 0) { /* not compressed for an earlier client since the last chat */
+		first = history->next > (unsigned long long) replay ? history->next - replay : 1;
+		for (seq=first; seq<history->next; seq++) {
+			historyslot *slot = &history->slots[seq % HISTORYSLOTS];
+			if (slot->seq != seq || slot->length <= 0 || slot->length >= MAXMESSAGE) { /* torn by a crash */
+				continue;
+			}
+			if (zip != 0) { /* framed one by one as well, in case the run does not shrink */
+				int used = put_varint(headers[count], slot->length+1);
+				headers[count][used] = BIN_TEXT;
+				iov[iovcnt].iov_base = headers[count];
+				iov[iovcnt++].iov_len = used+1;
+				memcpy(replaytext+length, slot->text, slot->length);
+				length += slot->length;
+			}
+			iov[iovcnt].iov_base = slot->text;
+			iov[iovcnt++].iov_len = slot->length;
+			count++;
+		}
+		if (count == 0) {
+			return;
+		}
+		if (zip != 0 && replaynext != history->next) {
+			replayframelength = length >= ZIPMIN ? zip_text(replaytext, length, replayspace, sizeof(replayspace), &replayframe) : -1;
+			replaytextlength = length;
+			replayframecount = count;
+			replaynext = history->next;
+		}
+	}
+	if (zip != 0 && replayframelength > 0) {
+		if (write(clientarray[client_no].socket, replayframe, replayframelength) < 0) {
+			write_failed(clientarray[client_no].socket, client_no);
+			return;
+		}
+		__atomic_fetch_add(&ziptextbytes, replaytextlength, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&zipsentbytes, replayframelength, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&replaycount, replayframecount, __ATOMIC_RELAXED);
+		return;
+	}
+	writev_to_client(client_no, iov, iovcnt);
+	__atomic_fetch_add(&replaycount, count, __ATOMIC_RELAXED);
+}
+
+
+
+
+
+
+/* Hand the listening socket and every client to the replacement connecting on the handoff port, and exit once it has them all. If it fails, carry on as before. */
+static void hand_off(int listensocket)
+{
+	handoffrecord record;
+	int conn, client_no, k, sent;
+	char ack;
+	setwalk walk;
+	
+	conn = accept_handoff(handoffport);
+	if (conn < 0) {
+		return;
+	}
+log_info("Handoff: replacement connected - handing over %d clients", numconnected);
+	close_stats_port();
+	memset(&record, 0, sizeof(record));
+	record.size = sizeof(record);
+	record.kind = HANDOFF_LISTEN;
+	sent = write_fd(conn, &record, sizeof(record), listensocket) == sizeof(record);
+	if (sent != 0 && relayport >= 0) { /* the relay links themselves are dialed again by the replacement */
+		record.kind = HANDOFF_RELAY;
+		sent = write_fd(conn, &record, sizeof(record), relayport) == sizeof(record);
+	}
+	for (client_no=first_in_set(&walk, usedset); sent != 0 && client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		memset(&record, 0, sizeof(record));
+		record.size = sizeof(record);
+		record.kind = HANDOFF_CLIENT;
+		record.client_no = client_no;
+		record.joined = (int) IN_SET(joinedset, client_no);
+		memcpy(record.name, clientarray[client_no].name, NAMESIZE+1);
+		record.claiming = clientarray[client_no].claiming;
+		memcpy(record.requested, clientarray[client_no].requested, NAMESIZE+1);
+		record.charcount = clientarray[client_no].charcount;
+		record.strikes = clientarray[client_no].strikes;
+		record.resync = clientarray[client_no].resync;
+		record.binary = clientarray[client_no].binary;
+		record.zip = clientarray[client_no].zip;
+		record.skip = clientarray[client_no].skip;
+		record.id = clientarray[client_no].id;
+		record.nummemberof = clientarray[client_no].nummemberof;
+		for (k=0; k<record.nummemberof; k++) {
+			memcpy(record.channels[k], channels[clientarray[client_no].memberof[k]].name, NAMESIZE+1);
+		}
+		record.away = (int) IN_SET(awayset, client_no);
+		if (clientarray[client_no].clibuf != NULL) {
+			memcpy(record.clibuf, clientarray[client_no].clibuf, BUFSIZE);
+		}
+		sent = write_fd(conn, &record, sizeof(record), clientarray[client_no].socket) == sizeof(record);
+	}
+	if (sent != 0) {
+		memset(&record, 0, sizeof(record));
+		record.size = sizeof(record);
+		record.kind = HANDOFF_DONE;
+		sent = write_fd(conn, &record, sizeof(record), -1) == sizeof(record);
+	}
+	if (sent != 0 && read(conn, &ack, 1) == 1) { /* the replacement has everything - its copies of the sockets keep them open */
+		if (snapwriter != 0) { /* let the last snapshot land before the replacement writes its own */
+			waitpid(snapwriter, NULL, 0);
+		}
+log_info("Handoff: complete - exiting");
+		exit(0);
+	}
+log_error("Handoff: replacement failed - carrying on");
+	close(conn);
+	if (statsport > 0) {
+		open_stats_port(statsport);
+	}
+}
+
+
+
+
+/* Take the listening socket and every client from the server waiting on path, and acknowledge them. Returns the listening socket. */
+static int take_over(char *path)
+{
+	handoffrecord record;
+	int conn, fd, listensocket = -1;
+	char ack = 1;
+	
+	conn = connect_handoff(path);
+	if (conn < 0) {
+		exit(1);
+	}
+	while (1) {
+		if (read_fd(conn, &record, sizeof(record), &fd) != sizeof(record) || record.size != sizeof(record)) {
+log_error("Handoff: bad record from %s - is it the same build?", path);
+			exit(1);
+		}
+		if (record.kind == HANDOFF_DONE) {
+			break;
+		}
+		else if (record.kind == HANDOFF_LISTEN && fd >= 0) {
+			listensocket = fd;
+		}
+		else if (record.kind == HANDOFF_RELAY && fd >= 0) {
+			relayport = fd;
+		}
+		else if (record.kind == HANDOFF_CLIENT && (fd >= 0 || record.away != 0)) {
+			restore_client(&record, fd);
+		}
+		else {
+log_error("Handoff: record of kind %d without a socket from %s", record.kind, path);
+			exit(1);
+		}
+	}
+	if (listensocket < 0) {
+log_error("Handoff: no listening socket from %s", path);
+		exit(1);
+	}
+	if (write(conn, &ack, 1) != 1) {
+		perror("write");
+		exit(1);
+	}
+	close(conn);
+	if (numaway > 0) { /* the held seats' grace starts over */
+		time(&loadtime);
+	}
+log_info("Handoff: took over %d clients, %d of them players, and %d held seats from %s", numconnected, numplayers-numaway, numaway, path);
+	return listensocket;
+}
+
+
+
+
+/* Set up a client handed over by the server being replaced, as it was there. */
+static void restore_client(handoffrecord *record, int socket)
+{
+	int client_no = record->client_no;
+	int k;
+	
+	if (client_no < 0 || client_no >= MAXCLIENTS || IN_SET(usedset, client_no) != 0) {
+log_error("Handoff: bad client number %d", client_no);
+		if (socket >= 0) {
+			close(socket);
+		}
+		return;
+	}
+	clientarray[client_no].socket = socket;
+	clientarray[client_no].clibuf = NULL;
+	if (record->charcount > 0 || record->clibuf[0] != '\0') { /* part of a message was pending */
+		clientarray[client_no].clibuf = take_buffer();
+		memcpy(clientarray[client_no].clibuf, record->clibuf, BUFSIZE);
+	}
+	clientarray[client_no].charcount = record->charcount;
+	clientarray[client_no].strikes = record->strikes;
+	clientarray[client_no].resync = record->resync;
+	clientarray[client_no].binary = record->binary;
+	clientarray[client_no].zip = record->zip;
+	clientarray[client_no].skip = record->skip;
+	clientarray[client_no].id = record->id;
+	ADD_TO_SET(usedset, client_no);
+	if (record->away != 0) { /* a seat held from a snapshot - the player, with no connection */
+		ADD_TO_SET(awayset, client_no);
+		numaway++;
+	}
+	else {
+		FD_SET (socket, &total_set);
+		numconnected++;
+		tune_socket(socket);
+		start_timer(client_no);
+	}
+	if (record->joined != 0) {
+		memcpy(clientarray[client_no].name, record->name, NAMESIZE+1);
+		clientarray[client_no].name[NAMESIZE] = '\0';
+		add_name(client_no);
+		ADD_TO_SET(joinedset, client_no);
+		numplayers++;
+		for (k=0; k<record->nummemberof && k<MAXMEMBERSHIPS; k++) {
+			record->channels[k][NAMESIZE] = '\0';
+			add_member(record->channels[k], client_no);
+		}
+	}
+	else if (record->claiming != 0) { /* start_federation() claims it again */
+		memcpy(clientarray[client_no].name, record->name, NAMESIZE+1);
+		clientarray[client_no].name[NAMESIZE] = '\0';
+		memcpy(clientarray[client_no].requested, record->requested, NAMESIZE+1);
+		clientarray[client_no].requested[NAMESIZE] = '\0';
+		clientarray[client_no].claiming = 1;
+	}
+}
+
+
+
+
+
+
+/*
+ * Lay out a snapshot of the players in image: a header saying which slots
+ * are named, then the name, strikes and channels of each. Connections,
+ * IDs and framing are not kept - a player coming back gets them afresh.
+ * Returns its length.
+ */
+static int build_snapshot(char *image)
+{
+	snapshotheader header;
+	seatinfo seat;
+	int length = sizeof(header);
+	int i, k;
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CHSS", 4);
+	header.version = SNAPSHOTVERSION;
+	header.maxclients = MAXCLIENTS;
+	memcpy(header.joined, joinedset, sizeof(clientset));
+	memcpy(image, &header, sizeof(header));
+	for (i=0; i<MAXCLIENTS; i++) {
+		memset(&seat, 0, sizeof(seat));
+		if (IN_SET(joinedset, i) != 0) {
+			memcpy(seat.name, clientarray[i].name, NAMESIZE+1);
+			seat.strikes = clientarray[i].strikes;
+			seat.nummemberof = clientarray[i].nummemberof;
+			for (k=0; k<seat.nummemberof; k++) {
+				memcpy(seat.channels[k], channels[clientarray[i].memberof[k]].name, NAMESIZE+1);
+			}
+		}
+		memcpy(image+length, &seat, sizeof(seat));
+		length += sizeof(seat);
+	}
+	return length;
+}
+
+
+
+
+/*
+ * Every snapinterval seconds, snapshot the players if they changed since
+ * the last snapshot written. The snapshot is built here, which takes
+ * microseconds, and written, synced and renamed over snapshotfile by a
+ * forked child, so the server never waits on the disk and a crash leaves
+ * the last whole snapshot in place. A snapshot is skipped if the last one
+ * is still being written.
+ */
+static void save_snapshot()
+{
+	time_t now = time(NULL);
+	int next = 1 - snapcurrent;
+	pid_t pid;
+	
+	if (snapwriter != 0) {
+		reap_snapshot();
+	}
+	if (difftime(now, snaptime) < (double)snapinterval) {
+		return;
+	}
+	snaptime = now;
+	if (snapwriter != 0) {
+		return;
+	}
+	snaplength[next] = build_snapshot(snapimage[next]);
+	if (snaplength[next] == snaplength[snapcurrent] && memcmp(snapimage[next], snapimage[snapcurrent], snaplength[next]) == 0) {
+		return;
+	}
+	pid = fork();
+	if (pid < 0) {
+log_warn("Snapshot: cannot fork to write %s", snapshotfile);
+		return;
+	}
+	if (pid == 0) { /* child - it must not log, as the logger's thread is not copied */
+		int fd = open(snapshottemp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, snapimage[next], snaplength[next]) != snaplength[next] || fsync(fd) < 0 || rename(snapshottemp, snapshotfile) < 0) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	snapwriter = pid;
+	snapcurrent = next;
+}
+
+
+
+
+/* Collect the child writing a snapshot if it has finished. One that failed is written again at the next interval. */
+static void reap_snapshot()
+{
+	int status;
+	
+	if (waitpid(snapwriter, &status, WNOHANG) != snapwriter) {
+		return;
+	}
+	snapwriter = 0;
+	if (WIFEXITED(status) != 0 && WEXITSTATUS(status) == 0) {
+		count_event(&snapshotcount);
+log_debug("Snapshot: wrote %d bytes, %d players", snaplength[snapcurrent], numplayers);
+	}
+	else {
+log_warn("Snapshot: could not write %s", snapshotfile);
+		snaplength[snapcurrent] = 0;
+	}
+}
+
+
+
+
+/*
+ * Start from the snapshot in snapshotfile, if there is one. Its players
+ * are held - named, in the roster and in their channels, but with no
+ * connection - until their owners join again under the same names or
+ * grace seconds pass. Called before the federation starts, so the names
+ * held are announced to the other servers like any others. A snapshot
+ * written by a build with different limits is ignored.
+ */
+static void load_snapshot()
+{
+	snapshotheader header;
+	seatinfo seat;
+	struct stat info;
+	unsigned long long start = now_micros();
+	char *image = snapimage[0];
+	int fd, length, i, k, channel;
+	
+	fd = open(snapshotfile, O_RDONLY);
+	if (fd < 0) {
+log_info("Snapshot: none at %s - starting cold", snapshotfile);
+		return;
+	}
+	length = (int) read(fd, image, SNAPSHOTSIZE);
+	if (fstat(fd, &info) < 0) {
+		info.st_mtime = time(NULL);
+	}
+	close(fd);
+	memcpy(&header, image, sizeof(header));
+	if (length < (int) sizeof(header) || memcmp(header.magic, "CHSS", 4) != 0 || header.version != SNAPSHOTVERSION || header.maxclients != MAXCLIENTS || length != build_snapshot(snapimage[1])) {
+log_warn("Snapshot: %s is not a version %d snapshot from this build - starting cold", snapshotfile, SNAPSHOTVERSION);
+		return;
+	}
+	
+	for (i=0; i<MAXCLIENTS; i++) {
+		memcpy(&seat, image + sizeof(header) + i*sizeof(seat), sizeof(seat));
+		if (IN_SET(header.joined, i) == 0) {
+			continue;
+		}
+		seat.name[NAMESIZE] = '\0';
+		if (seat.name[0] == '\0' || find_client(seat.name) != MAXCLIENTS) {
+log_warn("Snapshot: seat %d has no name or a name taken already - left out", i);
+			continue;
+		}
+		memcpy(clientarray[i].name, seat.name, NAMESIZE+1);
+		clientarray[i].strikes = seat.strikes;
+		add_name(i);
+		ADD_TO_SET(usedset, i);
+		ADD_TO_SET(joinedset, i);
+		ADD_TO_SET(awayset, i);
+		numplayers++;
+		numaway++;
+		for (k=0; k<seat.nummemberof && k<MAXMEMBERSHIPS; k++) {
+			seat.channels[k][NAMESIZE] = '\0';
+			channel = find_channel(seat.channels[k]);
+			if (seat.channels[k][0] != '\0' && (channel == MAXCHANNELS || find_membership(i, channel) < 0)) {
+				add_member(seat.channels[k], i);
+			}
+		}
+	}
+	time(&loadtime);
+	snaplength[0] = length; /* what was loaded is the last snapshot written */
+	snapcurrent = 0;
+log_info("Snapshot: loaded %d players and %d channels from %s, %ld seconds old, in %llu us - held for %d seconds", numaway, numchannels, snapshotfile, (long) difftime(loadtime, info.st_mtime), now_micros() - start, grace);
+}
+
+
+
+
+/* A client has joined under the name of a seat held from a snapshot: give it the seat's name, strikes and channels, drop the seat, and join the client as usual, with a new ID. */
+static void reclaim_seat(int seat, int client_no)
+{
+	int channel;
+	
+	if (clientarray[seat].strikes > clientarray[client_no].strikes) {
+		clientarray[client_no].strikes = clientarray[seat].strikes;
+	}
+	while (clientarray[seat].nummemberof > 0) { /* the client enters first, so a channel the seat alone was in stays open */
+		channel = clientarray[seat].memberof[0];
+		add_member(channels[channel].name, client_no);
+		remove_member(channel, seat);
+	}
+	memcpy(clientarray[client_no].name, clientarray[seat].name, NAMESIZE+1);
+	remove_name(seat);
+	numplayers--;
+	numaway--;
+	initialize_clientinfo(seat); /* quietly - the name stays held across the federation, as the client takes it over */
+	count_event(&reclaimcount);
+log_info("Reclaimed: client %d took back %s, held in slot %d", client_no, clientarray[client_no].name, seat);
+	complete_join(client_no);
+}
+
+
+
+
+/* Once grace seconds have passed since the seats were loaded, give up those no one reclaimed, as if their players had left. */
+static void release_seats()
+{
+	int i;
+	setwalk walk;
+	
+	if (difftime(time(NULL), loadtime) < (double)grace) {
+		return;
+	}
+	for (i=first_in_set(&walk, awayset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+log_info("Released: seat %d (%s) - not reclaimed", i, clientarray[i].name);
+		count_event(&releasecount);
+		numplayers--;
+		REMOVE_FROM_SET(joinedset, i);
+		clear_clientinfo(i);
+	}
+	broadcast_roster(MAXCLIENTS);
+}
+
+
+
+
+/* Microseconds until a snapshot or the release of held seats is due, -1 if neither ever is. */
+static long long snapshot_wait()
+{
+	double wait, held;
+	
+	if (snapshotfile == NULL && numaway == 0) {
+		return -1;
+	}
+	wait = (snapshotfile != NULL) ? (double)snapinterval - difftime(time(NULL), snaptime) : (double)grace;
+	if (numaway > 0) {
+		held = (double)grace - difftime(time(NULL), loadtime);
+		if (held < wait) {
+			wait = held;
+		}
+	}
+	return (wait > 0) ? (long long)(wait*1000000) : 0;
+}
+
+
+
+
+
+
+/* Empty a name table - every bucket empty and every entry on the free stack. */
+static void init_nametable(nametable *table)
+{
+	int i;
+	
+	for (i=0; i<NAMETABLEBUCKETS; i++) {
+		table->buckets[i] = MAXNAMES;
+	}
+	for (i=0; i<MAXNAMES; i++) {
+		table->entries[i].used = 0;
+		table->entries[i].next = i+1;
+	}
+	table->free = 0;
+	table->count = 0;
+}
+
+
+
+
+/* Return the entry for name in a name table, MAXNAMES if there is none. */
+static int table_find(nametable *table, char *name)
+{
+	int entry = table->buckets[hash_string(name) & (NAMETABLEBUCKETS-1)];
+	
+	while (entry != MAXNAMES && strcmp(table->entries[entry].name, name) != 0) {
+		entry = table->entries[entry].next;
+	}
+	return entry;
+}
+
+
+
+
+/* Record name in a name table as held by node, in place of whichever server held it before. */
+static void table_add(nametable *table, char *name, int node)
+{
+	int entry = table_find(table, name);
+	int *bucket;
+	
+	if (entry == MAXNAMES) {
+		if (table->free == MAXNAMES) {
+log_error("Relay: name table full - %s not added", name);
+			return;
+		}
+		entry = table->free;
+		table->free = table->entries[entry].next;
+		snprintf(table->entries[entry].name, NAMESIZE+1, "%s", name);
+		bucket = &table->buckets[hash_string(name) & (NAMETABLEBUCKETS-1)];
+		table->entries[entry].next = *bucket;
+		*bucket = entry;
+		table->entries[entry].used = 1;
+		table->count++;
+	}
+	table->entries[entry].node = node;
+	table->entries[entry].stale = 0;
+}
+
+
+
+
+/* Take an entry out of its bucket in a name table and put it on the free stack. */
+static void table_remove(nametable *table, int entry)
+{
+	int *link = &table->buckets[hash_string(table->entries[entry].name) & (NAMETABLEBUCKETS-1)];
+	
+	while (*link != entry) {
+		link = &table->entries[*link].next;
+	}
+	*link = table->entries[entry].next;
+	table->entries[entry].used = 0;
+	table->entries[entry].next = table->free;
+	table->free = entry;
+	table->count--;
+}
+
+
+
+
+/* Whether a name is in use anywhere this server knows of - by a player here or on another server, by a client here waiting on a claim, or under a claim this server granted. */
+static int name_taken(char *name)
+{
+	int i, owner;
+	setwalk walk;
+	
+	if (find_client(name) != MAXCLIENTS) {
+		return 1;
+	}
+	if (numnodes == 0) {
+		return 0;
+	}
+	if (table_find(&remoteplayers, name) != MAXNAMES || table_find(&claims, name) != MAXNAMES) {
+		return 1;
+	}
+	owner = owner_of(name);
+	if (owner != nodeno && links[owner].socket < 0) { /* its owner cannot be asked - it may be in use over there */
+		return 1;
+	}
+	for (i=first_in_set(&walk, usedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+		if (clientarray[i].claiming != 0 && strcmp(clientarray[i].name, name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+
+
+/* Spread the bits of a hash over the whole word, so nearby names land far apart on the ring (the MurmurHash3 finalizer). */
+static unsigned int mix_hash(unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+
+
+
+/* Order ring points for qsort(). */
+static int compare_points(const void *a, const void *b)
+{
+	const ringpoint *pa = a, *pb = b;
 	
-	/* Strip any illegal characters from chat message. */
-	char *original = short_message;
-	char *stripped = original;
-	while (*original != '\0') {
-		if (*original != '(') {
-			*stripped = *original;
-			stripped++;
+	if (pa->point != pb->point) {
+		return pa->point < pb->point ? -1 : 1;
+	}
+	return pa->node - pb->node;
+}
+
+
+
+
+/* Return the server owning a name - the one with the first ring point at or after the name's hash, going round. */
+static int owner_of(char *name)
+{
+	unsigned int point = mix_hash(hash_string(name));
+	int low = 0, high = numnodes*VNODES, middle;
+	
+	while (low < high) {
+		middle = (low+high)/2;
+		if (ring[middle].point < point) {
+			low = middle+1;
+		}
+		else {
+			high = middle;
 		}
-		original++;
 	}
-	*stripped = '\0';
+	if (low == numnodes*VNODES) {
+		low = 0;
+	}
+	return ring[low].node;
+}
+
+
+
+
+/* Return the server whose relay link is on socket, MAXNODES plus its number in pendinglinks if it is a link not yet introduced, -1 if it is neither. */
+static int find_link(int socket)
+{
+	int node;
 	
-	char *namestart = *recipients;
-	char *nameend = namestart;
-	int result = find_name_end(&nameend);
-	*nameend = '\0';
+	for (node=0; node<numnodes; node++) {
+		if (links[node].socket == socket) {
+			return node;
+		}
+	}
+	for (node=0; node<MAXNODES; node++) {
+		if (pendinglinks[node] == socket) {
+			return MAXNODES+node;
+		}
+	}
+	return -1;
+}
+
+
+
+
+/* Join the federation at the comma-separated relay addresses in relays as server nodeno: listen on this server's own address, lay out the ownership ring, and dial every other server. Servers not up yet dial this one when they start. */
+static void start_federation(char *relays)
+{
+	char *entry, *colon;
+	char pointname[32];
+	int node, v, port, client_no, flag = 1;
+	setwalk walk;
 	
-	char convertedname[NAMESIZE+1];
-	char *cnameptr = convertedname;
-	sprintf(convertedname, "%s", namestart);
-	convert_name(&cnameptr);
+	for (entry=strtok(relays, ","); entry!=NULL; entry=strtok(NULL, ",")) {
+		if (numnodes == MAXNODES) {
+			fprintf(stderr, "too many relay addresses - at most %d\n", MAXNODES);
+			exit(1);
+		}
+		colon = strrchr(entry, ':');
+		port = 0;
+		if (colon != NULL) {
+			*colon = '\0';
+			sscanf(colon+1, "%d", &port);
+		}
+		memset(&links[numnodes].addr, 0, sizeof(links[numnodes].addr));
+		links[numnodes].addr.sin_family = AF_INET;
+		links[numnodes].addr.sin_port = htons((u_short)port);
+		if (port <= 0 || port > 65535 || inet_pton(AF_INET, entry, &links[numnodes].addr.sin_addr) != 1) {
+			fprintf(stderr, "bad relay address %s\n", entry);
+			exit(1);
+		}
+		links[numnodes].socket = -1;
+		links[numnodes].inlen = 0;
+		links[numnodes].outlen = 0;
+		links[numnodes].redialat = 0;
+		numnodes++;
+	}
+	if (nodeno < 0 || nodeno >= numnodes) {
+		fprintf(stderr, "bad node number %d - must be 0 to %d\n", nodeno, numnodes-1);
+		exit(1);
+	}
+	incarnation = now_micros();
+	
+	if (relayport < 0) { /* not handed over by the server being replaced */
+		relayport = socket(PF_INET, SOCK_STREAM, 0);
+		if (relayport < 0) {
+			perror ("socket");
+			exit(1);
+		}
+		if (setsockopt(relayport, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int)) == -1) {
+			perror("setsockopt");
+			exit(1);
+		}
+		if (bind(relayport, (struct sockaddr *)&links[nodeno].addr, sizeof(links[nodeno].addr)) < 0) {
+			perror ("bind");
+			exit(1);
+		}
+		if (listen(relayport, MAXNODES) < 0) {
+			perror ("listen");
+			exit(1);
+		}
+	}
+	FD_SET (relayport, &total_set);
+	for (node=0; node<MAXNODES; node++) {
+		pendinglinks[node] = -1;
+	}
+	init_nametable(&remoteplayers);
+	init_nametable(&claims);
+	for (node=0; node<numnodes; node++) {
+		for (v=0; v<VNODES; v++) {
+			sprintf(pointname, "%d#%d", node, v);
+			ring[node*VNODES+v].point = mix_hash(hash_string(pointname));
+			ring[node*VNODES+v].node = node;
+		}
+	}
+	qsort(ring, numnodes*VNODES, sizeof(ringpoint), compare_points);
+	for (client_no=first_in_set(&walk, joinedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) { /* players handed over */
+		if (owner_of(clientarray[client_no].name) == nodeno) {
+			table_add(&claims, clientarray[client_no].name, nodeno);
+		}
+	}
+	for (client_no=first_in_set(&walk, usedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) { /* claims handed over - sent again as their owners' links come up */
+		if (clientarray[client_no].claiming != 0 && claim_name(client_no, clientarray[client_no].requested) == 0) {
+			complete_join(client_no);
+		}
+	}
+	
+	for (node=0; node<numnodes; node++) {
+		if (node != nodeno && dial_link(node) < 0 && nodeno < node) { /* a server up but out of reach is dialed again - one not up yet dials this one */
+			links[node].redialwait = REDIALMIN;
+			links[node].redialat = now_micros() + REDIALMIN;
+		}
+	}
+log_info("Relay: server %d of %d, %d links up", nodeno, numnodes, numlinks);
+}
 
-	int i;
 
-	/* Check for "ANY" or "ALL" recipient. */
-	if (result == 0) {
-		if (strcasecmp("ANY", namestart) == 0) {
-			if (numplayers > 1) {
-				if (numplayers == 2) {
-					for (i=0; i<MAXCLIENTS; i++) {
-						if (i != client_no && clientarray[i].joined != 0) {
-							sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-							write_to_client(clientarray[i].socket, i, CLEAR);
-						}
-					}
-				}
-				else {
-					int numhops = (rand() % (numplayers-1)) + 1;
-					int i = client_no;
-					while(numhops > 0) {
-						i = (i+1) % MAXCLIENTS;
-						if (clientarray[i].joined != 0) {
-							numhops--;
-						}
-					}
-					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-					write_to_client(clientarray[i].socket, i, CLEAR);
-				}
+
+
+/* Dial the server node and put the link into service. Returns 0 if it is up, -1 if the dial failed or took longer than DIALWAIT. */
+static int dial_link(int node)
+{
+	struct timeval limit;
+	int sock;
+	
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+log_error("Relay: socket for server %d", node);
+		return -1;
+	}
+	limit.tv_sec = DIALWAIT / 1000;
+	limit.tv_usec = (DIALWAIT % 1000) * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit)); /* bounds connect() - the link is non-blocking once up */
+	if (connect(sock, (struct sockaddr *)&links[node].addr, sizeof(links[node].addr)) < 0) {
+		closesocket(sock);
+		return -1;
+	}
+	links[node].incarnation = 0;
+	link_up(node, sock, 1);
+	return 0;
+}
+
+
+
+
+/* Dial again each dropped link whose wait is over, doubling the wait, up to REDIALMAX, after each failure. Returns microseconds until the next dial is due, -1 if no link is waiting for one. */
+static long long redial_links()
+{
+	unsigned long long now = now_micros();
+	long long next = -1;
+	int node;
+	
+	for (node=0; node<numnodes; node++) {
+		if (links[node].socket >= 0 || links[node].redialat == 0) {
+			continue;
+		}
+		if (now >= links[node].redialat) {
+			if (dial_link(node) == 0) {
+				continue;
 			}
+			now = now_micros();
+			links[node].redialwait = (links[node].redialwait*2 < REDIALMAX) ? links[node].redialwait*2 : REDIALMAX;
+			links[node].redialat = now + links[node].redialwait;
+log_debug("Relay: dial to server %d failed - trying again in %lld ms", node, links[node].redialwait/1000);
+		}
+		if (next < 0 || (long long) (links[node].redialat - now) < next) {
+			next = links[node].redialat - now;
+		}
+	}
+	return next;
+}
+
+
+
+
+/* Put a link to node into service on socket, in place of any link it had, and introduce this server and its players over it, ending with RELAY_SYNC. Claims waiting for node to be reachable are sent after. dialed is set if this server dialed it. */
+static void link_up(int node, int socket, int dialed)
+{
+	unsigned char payload[16];
+	int client_no, used, flag = 1;
+	setwalk walk;
+	
+	if (links[node].socket >= 0) {
+		link_down(node);
+	}
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+	links[node].socket = socket;
+	links[node].dialed = dialed;
+	links[node].inlen = 0;
+	links[node].outlen = 0;
+	links[node].redialat = 0;
+	FD_SET (socket, &total_set);
+	numlinks++;
+log_info("Relay: link to server %d up", node);
+	used = put_varint(payload, nodeno);
+	memcpy(payload+used, &incarnation, sizeof(incarnation));
+	queue_frame(node, RELAY_HELLO, payload, used+sizeof(incarnation));
+	for (client_no=first_in_set(&walk, joinedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		send_name(node, RELAY_ADD, clientarray[client_no].name);
+	}
+	queue_frame(node, RELAY_SYNC, payload, 0);
+	for (client_no=first_in_set(&walk, usedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		if (clientarray[client_no].claiming != 0 && owner_of(clientarray[client_no].name) == node) {
+			send_claim(client_no, node);
+		}
+	}
+}
+
+
+
+
+/*
+ * Take the link to node out of service and forget the players there. The
+ * names this server owns that they hold stay held, marked stale, as they
+ * may still be in use there: RELAY_SYNC frees those node's roster leaves
+ * out once the link is back. Clients here waiting on a claim from node
+ * pick another name. The lower-numbered server of the two dials the link
+ * again.
+ */
+static void link_down(int node)
+{
+	int entry, client_no;
+	setwalk walk;
+	
+	if (links[node].socket < 0) {
+		return;
+	}
+	closesocket(links[node].socket);
+	FD_CLR (links[node].socket, &total_set);
+	links[node].socket = -1;
+	links[node].inlen = 0;
+	links[node].outlen = 0;
+	numlinks--;
+log_info("Relay: link to server %d down", node);
+	for (entry=0; entry<MAXNAMES; entry++) {
+		if (remoteplayers.entries[entry].used != 0 && remoteplayers.entries[entry].node == node) {
+			table_remove(&remoteplayers, entry);
+			rosterchanged = 1;
+		}
+		if (claims.entries[entry].used != 0 && claims.entries[entry].node == node) {
+			claims.entries[entry].stale = 1;
+		}
+	}
+	if (nodeno < node) {
+		links[node].redialwait = REDIALMIN;
+		links[node].redialat = now_micros() + REDIALMIN;
+	}
+	for (client_no=first_in_set(&walk, usedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		if (clientarray[client_no].claiming != 0 && owner_of(clientarray[client_no].name) == node) {
+			char *requested = clientarray[client_no].requested;
+log_warn("Relay: server %d went down before granting %s - picking another name", node, clientarray[client_no].name);
+			assign_name(&requested, client_no);
+		}
+	}
+}
+
+
+
+
+/* Accept a link another server dialed. It is pending until its RELAY_HELLO says which server it is. */
+static void accept_link()
+{
+	int sock, pending;
+	
+	sock = accept(relayport, NULL, NULL);
+	if (sock < 0) {
+log_error("Relay: accept failed");
+		return;
+	}
+	for (pending=0; pending<MAXNODES; pending++) {
+		if (pendinglinks[pending] < 0) {
+			break;
+		}
+	}
+	if (pending == MAXNODES) {
+log_warn("Relay: too many links waiting to be introduced - refused one");
+		closesocket(sock);
+		return;
+	}
+	pendinglinks[pending] = sock;
+	FD_SET (sock, &total_set);
+}
+
+
+
+
+/* Read the RELAY_HELLO on a pending link, leaving whatever follows it in the socket, and put the link into service. If both servers dialed each other at once, the link dialed by the lower-numbered server is kept; a link from a restarted server always replaces the old one. */
+static void read_pending_link(int pending)
+{
+	int sock = pendinglinks[pending];
+	unsigned char hello[32];
+	unsigned int length, node;
+	unsigned long long theirs;
+	int nbytes, used, nodeused;
+	
+	nbytes = recv(sock, hello, sizeof(hello), MSG_PEEK | MSG_DONTWAIT);
+	if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (nbytes > 0) {
+		used = get_varint(hello, hello+nbytes, &length);
+		if (used == 0 || (used > 0 && length < sizeof(hello)-used && nbytes < used+(int)length)) { /* not all here yet */
 			return;
 		}
-		else if (strcasecmp("ALL", namestart) == 0) {
-			for (i=0; i<MAXCLIENTS; i++) {
-				if (clientarray[i].joined != 0) {
-					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-					write_to_client(clientarray[i].socket, i, CLEAR);
-				}
+		if (used > 0 && length < sizeof(hello)-used && hello[used] == RELAY_HELLO
+			&& (nodeused = get_varint(hello+used+1, hello+used+length, &node)) > 0
+			&& length == 1+(unsigned int)nodeused+sizeof(theirs) && node < (unsigned int)numnodes && node != (unsigned int)nodeno) {
+			recv(sock, hello, used+length, 0);
+			memcpy(&theirs, hello+used+1+nodeused, sizeof(theirs));
+			pendinglinks[pending] = -1;
+			if (links[node].socket >= 0 && links[node].dialed != 0 && nodeno < (int)node
+				&& (links[node].incarnation == 0 || links[node].incarnation == theirs)) { /* dialed each other - keep this server's link */
+				FD_CLR (sock, &total_set);
+				closesocket(sock);
+				return;
 			}
+			link_up(node, sock, 0);
+			links[node].incarnation = theirs;
 			return;
 		}
 	}
+log_warn("Relay: dropping a link that did not introduce itself");
+	FD_CLR (sock, &total_set);
+	closesocket(sock);
+	pendinglinks[pending] = -1;
+}
+
+
+
+
+/* Read what has arrived on the link to node and dispatch every complete frame, keeping any partial frame at the start of its buffer. */
+static void read_link(int node)
+{
+	relaylink *link = &links[node];
+	unsigned int length;
+	int nbytes, used, start = 0;
 	
-	/* Send message to all valid recipients. */
-	int namefound, strikesent;
-	while (result != 0) {
-		namefound = 0;
-		for (i=0; i<MAXCLIENTS; i++) {
-			if (strcmp(clientarray[i].name, cnameptr) == 0) {
-				namefound = 1;
-				if (clientarray[i].sent == 0) {
-					sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
+	nbytes = recv(link->socket, link->in+link->inlen, RELAYBUFSIZE-link->inlen, MSG_DONTWAIT);
+	if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (nbytes <= 0) {
+		link_down(node);
+		return;
+	}
+	link->inlen += nbytes;
+	while (1) {
+		used = get_varint(link->in+start, link->in+link->inlen, &length);
+		if (used == 0) {
+			break;
+		}
+		if (used < 0 || length == 0 || length > RELAYBUFSIZE-8) {
+log_error("Relay: bad frame length from server %d - dropping the link", node);
+			link_down(node);
+			return;
+		}
+		if (start+used+(int)length > link->inlen) {
+			break;
+		}
+		dispatch_relay(node, link->in+start+used, length);
+		if (link->socket < 0) { /* dropped while dispatching */
+			return;
+		}
+		start += used+length;
+	}
+	memmove(link->in, link->in+start, link->inlen-start);
+	link->inlen -= start;
+}
+
+
+
+
+/* Act on one frame from the server at the far end of a relay link. */
+static void dispatch_relay(int node, unsigned char *frame, int length)
+{
+	unsigned char *pos = frame+1;
+	unsigned char *end = frame+length;
+	unsigned char payload[16+NAMESIZE];
+	unsigned char *names;
+	char name[NAMESIZE+1];
+	char text[CHATSIZE+1];
+	unsigned int client_no, id, count, k;
+	int used, entry, i;
+	
+	if (frame[0] == RELAY_HELLO) { /* the far end of a link this server dialed, introducing itself back */
+		used = get_varint(pos, end, &k);
+		if (used > 0 && end-pos == used+(int)sizeof(links[node].incarnation)) {
+			memcpy(&links[node].incarnation, pos+used, sizeof(links[node].incarnation));
+		}
+	}
+	else if (frame[0] == RELAY_ADD) {
+		if (get_relay_name(&pos, end, name) != 0) {
+			goto bad;
+		}
+		table_add(&remoteplayers, name, node);
+		if (owner_of(name) == nodeno) { /* hold it for node - it may have been taken while the link was down */
+			entry = table_find(&claims, name);
+			if (entry != MAXNAMES && claims.entries[entry].node != node) {
+log_warn("Relay: %s joined on server %d but is held by server %d", name, node, claims.entries[entry].node);
+			}
+			else {
+				table_add(&claims, name, node);
+			}
+		}
+		rosterchanged = 1;
+	}
+	else if (frame[0] == RELAY_REMOVE) {
+		if (get_relay_name(&pos, end, name) != 0) {
+			goto bad;
+		}
+		entry = table_find(&remoteplayers, name);
+		if (entry != MAXNAMES && remoteplayers.entries[entry].node == node) {
+			table_remove(&remoteplayers, entry);
+			rosterchanged = 1;
+		}
+		entry = table_find(&claims, name);
+		if (entry != MAXNAMES && claims.entries[entry].node == node) {
+			table_remove(&claims, entry);
+		}
+	}
+	else if (frame[0] == RELAY_SYNC) { /* node's roster is all here - names still stale were given up while the link was down */
+		for (entry=0; entry<MAXNAMES; entry++) {
+			if (claims.entries[entry].used != 0 && claims.entries[entry].node == node && claims.entries[entry].stale != 0) {
+log_info("Relay: %s no longer held by server %d", claims.entries[entry].name, node);
+				table_remove(&claims, entry);
+			}
+		}
+	}
+	else if (frame[0] == RELAY_CLAIM) { /* node wants a name this server owns */
+		if ((used = get_varint(pos, end, &client_no)) <= 0) {
+			goto bad;
+		}
+		pos += used;
+		if ((used = get_varint(pos, end, &id)) <= 0) {
+			goto bad;
+		}
+		pos += used;
+		if (get_relay_name(&pos, end, name) != 0) {
+			goto bad;
+		}
+		used = put_varint(payload, client_no);
+		used += put_varint(payload+used, id);
+		entry = table_find(&claims, name);
+		if (entry != MAXNAMES && claims.entries[entry].node != node) {
+			used += put_varint(payload+used, claims.entries[entry].node);
+			used += put_relay_name(payload+used, name);
+			queue_frame(node, RELAY_DENY, payload, used);
+		}
+		else {
+			table_add(&claims, name, node);
+			used += put_relay_name(payload+used, name);
+			queue_frame(node, RELAY_GRANT, payload, used);
+		}
+	}
+	else if (frame[0] == RELAY_GRANT || frame[0] == RELAY_DENY) { /* the answer to a claim - for a client that may have left since */
+		unsigned int holder = 0;
+		if ((used = get_varint(pos, end, &client_no)) <= 0) {
+			goto bad;
+		}
+		pos += used;
+		if ((used = get_varint(pos, end, &id)) <= 0) {
+			goto bad;
+		}
+		pos += used;
+		if (frame[0] == RELAY_DENY) {
+			if ((used = get_varint(pos, end, &holder)) <= 0) {
+				goto bad;
+			}
+			pos += used;
+		}
+		if (get_relay_name(&pos, end, name) != 0) {
+			goto bad;
+		}
+		if (client_no >= MAXCLIENTS || IN_SET(usedset, client_no) == 0 || clientarray[client_no].id != id
+			|| clientarray[client_no].claiming == 0 || strcmp(clientarray[client_no].name, name) != 0) {
+log_debug("Relay: answer from server %d for %s came too late", node, name);
+		}
+		else if (frame[0] == RELAY_GRANT) {
+			complete_join(client_no);
+		}
+		else if (clientarray[client_no].claiming <= 31) { /* in use there - pick the next alternative */
+			char *requested = clientarray[client_no].requested;
+			if (holder != (unsigned int)nodeno && holder < (unsigned int)numnodes && table_find(&remoteplayers, name) == MAXNAMES) {
+				table_add(&remoteplayers, name, holder);
+			}
+			assign_name(&requested, client_no);
+		}
+		else { /* the name and every alternative denied */
+log_warn("Relay: no free alternative to %s - taking it unclaimed", name);
+			complete_join(client_no);
+		}
+	}
+	else if (frame[0] == RELAY_CHAT) { /* a chat from a player on node - to ALL if it names no recipients */
+		if (get_relay_name(&pos, end, name) != 0 || (used = get_varint(pos, end, &count)) <= 0) {
+			goto bad;
+		}
+		pos += used;
+		names = pos;
+		for (k=0; k<count; k++) {
+			if (get_relay_name(&pos, end, text) != 0) {
+				goto bad;
+			}
+		}
+		count_event(&relayincount);
+		used = end-pos < CHATSIZE ? (int) (end-pos) : CHATSIZE;
+		memcpy(text, pos, used);
+		text[used] = '\0';
+		if (count == 0) {
+			setwalk walk;
+			append_history(name, text);
+			for (i=first_in_set(&walk, joinedset); i<MAXCLIENTS; i=next_in_walk(&walk)) {
+				sprintf(buf, "(schat(%s)(%s))", name, text);
+				write_to_client(clientarray[i].socket, i, CLEAR);
+				count_event(&deliverycount);
+			}
+		}
+		else {
+			char recipient[NAMESIZE+1];
+			for (k=0; k<count; k++) {
+				get_relay_name(&names, end, recipient);
+				i = find_client(recipient);
+				if (i != MAXCLIENTS) {
+					sprintf(buf, "(schat(%s)(%s))", name, text);
 					write_to_client(clientarray[i].socket, i, CLEAR);
-					clientarray[i].sent = 1;
-				}
-				else if (strikesent == 0) {
-					send_strike(client_no, 'm');
-					strikesent = 1;
+					count_event(&deliverycount);
 				}
 			}
 		}
-		if (namefound == 0 && strikesent == 0) {
-			send_strike(client_no, 'm');
-			strikesent = 1;
+	}
+	else {
+log_warn("Relay: unknown frame %d from server %d", frame[0], node);
+	}
+	return;
+	
+bad:
+log_error("Relay: malformed frame %d from server %d - dropping the link", frame[0], node);
+	link_down(node);
+}
+
+
+
+
+/* Add a frame to the output buffer of the link to node, to be written at the end of the pass. A link too backed up to take it is dropped. */
+static void queue_frame(int node, int opcode, unsigned char *payload, int length)
+{
+	relaylink *link = &links[node];
+	int used;
+	
+	if (link->socket < 0) {
+		return;
+	}
+	if (link->outlen+length+6 > RELAYBUFSIZE) {
+		flush_link(node);
+		if (link->socket < 0) {
+			return;
+		}
+		if (link->outlen+length+6 > RELAYBUFSIZE) {
+log_error("Relay: link to server %d backed up - dropping it", node);
+			link_down(node);
+			return;
 		}
-		nameend++;
-		namestart = nameend;
-		result = find_name_end(&nameend);
-		*nameend = '\0';
-		memset(convertedname, '\0', NAMESIZE+1);
-		sprintf(convertedname, "%s", namestart);
-		convert_name(&cnameptr);
 	}
-	namefound = 0;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (strcmp(clientarray[i].name, cnameptr) == 0) {
-			namefound = 1;
-			if (clientarray[i].sent == 0) {
-				sprintf(buf, "(schat(%s)(%s))", clientarray[client_no].name, short_message);
-				write_to_client(clientarray[i].socket, i, CLEAR);
-				clientarray[i].sent = 1;
-			}
-			else if (strikesent == 0) {
-				send_strike(client_no, 'm');
-				strikesent = 1;
-			}
-		}
+	used = put_varint(link->out+link->outlen, length+1);
+	link->out[link->outlen+used] = opcode;
+	memcpy(link->out+link->outlen+used+1, payload, length);
+	link->outlen += used+1+length;
+}
+
+
+
+
+/* Write as much of the link to node's output buffer as the socket takes now, keeping the rest. */
+static void flush_link(int node)
+{
+	relaylink *link = &links[node];
+	int nbytes;
+	
+	if (link->socket < 0 || link->outlen == 0) {
+		return;
 	}
-	if (namefound == 0 && strikesent == 0) {
-		send_strike(client_no, 'm');
-		strikesent = 1;
+	nbytes = send(link->socket, link->out, link->outlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (nbytes < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+log_error("Relay: write to server %d failed - dropping the link", node);
+			link_down(node);
+		}
+		return;
 	}
+	__atomic_fetch_add(&relaybytes, nbytes, __ATOMIC_RELAXED);
+	memmove(link->out, link->out+nbytes, link->outlen-nbytes);
+	link->outlen -= nbytes;
+}
+
+
+
+
+/* End of a pass: send players the roster if another server changed it, then write what the pass queued on each link. */
+static void flush_links()
+{
+	int node;
 	
-	/* Reset 'sent' flag for all players. */
-	for (i=0; i<MAXCLIENTS; i++) {
-		clientarray[i].sent = 0;
+	if (rosterchanged != 0) {
+		send_player_lists();
+	}
+	for (node=0; node<numnodes; node++) {
+		flush_link(node);
 	}
 }
 
 
 
 
+/* Write a name as a relay name - a length byte, then the name. Returns the bytes written. */
+static int put_relay_name(unsigned char *out, char *name)
+{
+	int length = strlen(name);
+	
+	out[0] = length;
+	memcpy(out+1, name, length);
+	return length+1;
+}
+
 
-static int find_name_end(char **current)
+
+
+/* Read a relay name at *pos into name, moving *pos past it. Returns -1, reading nothing, if it is too long or runs past end. */
+static int get_relay_name(unsigned char **pos, unsigned char *end, char *name)
 {
-    char *pos = *current;
-    
-    while (*pos != ')' && *pos != ',') {
-        pos++;
-    }
-    *current = pos;
-    if (*pos == ')') {
-        return 0;
-    }
-    else {
-        return 1;
-    }
+	int length;
+	
+	if (*pos >= end || (*pos)[0] > NAMESIZE || *pos+1+(*pos)[0] > end) {
+		return -1;
+	}
+	length = (*pos)[0];
+	memcpy(name, *pos+1, length);
+	name[length] = '\0';
+	*pos += length+1;
+	return 0;
 }
 
 
 
 
-static void convert_name(char **name)
+/* Send node a frame holding nothing but a name - RELAY_ADD or RELAY_REMOVE. */
+static void send_name(int node, int opcode, char *name)
 {
-	char *namepos = *name;
-	char temp[480];
-	char *temppos = temp;
+	unsigned char payload[NAMESIZE+1];
 	
-	/* Copy name into temp string. */
-	while (*namepos != ')' && *namepos != '\0') {
-		if (*namepos != ' ') {
-			*temppos = *namepos;
-			temppos++;
-		}
-		namepos++;
+	if (node == nodeno || links[node].socket < 0) {
+		return;
 	}
-	*temppos = '\0';
+	queue_frame(node, opcode, payload, put_relay_name(payload, name));
+}
 
-	/* Remove any illegal characters (non-alphanumeric/dot). */
-	temppos = temp;
-	char *copy = temppos;
-	while (*temppos != '\0') {
-		if (isalnum(*temppos) != 0 || *temppos == '.') {
-			*copy = *temppos;
-			copy++;
-		}
-		temppos++;
+
+
+
+/* Claim a newly picked name from the server owning it, if that is another one. base is the name asked for, converted, which a denied claim picks the next alternative from. Returns 1 if the join must wait for the owner's answer - sent once its link is up if it is down - 0 if it can go ahead. */
+static int claim_name(int client_no, char *base)
+{
+	int owner;
+	
+	if (numnodes == 0) {
+		return 0;
 	}
-	*copy = '\0';
+	owner = owner_of(clientarray[client_no].name);
+	if (owner == nodeno) {
+		return 0;
+	}
+	clientarray[client_no].claiming++;
+	if (base != clientarray[client_no].requested) {
+		snprintf(clientarray[client_no].requested, NAMESIZE+1, "%s", base);
+	}
+	if (links[owner].socket < 0) { /* the claim is sent when the link comes up */
+log_warn("Relay: server %d owns %s but is not linked - waiting for it", owner, clientarray[client_no].name);
+		return 1;
+	}
+	send_claim(client_no, owner);
+	return 1;
+}
+
+
+
+
+static void send_claim(int client_no, int owner)
+{
+	unsigned char payload[16+NAMESIZE];
+	int used;
 	
-	/* Remove leading and trailing periods. */
-	temppos = temp;
-	copy = temppos;
-	int removing = 1;
-	while (*temppos != '\0') {
-		if (*temppos != '.') {
-			*copy = *temppos;
-			copy++;
-			removing = 0;
-		}
-		else if (removing == 0) {
-			*copy = *temppos;
-			copy++;
-		}
-		temppos++;
+	used = put_varint(payload, client_no);
+	used += put_varint(payload+used, clientarray[client_no].id);
+	used += put_relay_name(payload+used, clientarray[client_no].name);
+	queue_frame(owner, RELAY_CLAIM, payload, used);
+}
+
+
+
+
+/* Give up a leaving client's name across the federation - tell the other servers, and free it here if this server owns it. A client still waiting on a claim has its tentative name given up the same way. */
+static void release_name(int client_no)
+{
+	int node, entry;
+	
+	if (numnodes == 0 || clientarray[client_no].name[0] == '\0') {
+		return;
 	}
-	*copy = '\0';
-	copy--;
-	while (copy != temp) {
-		if (*copy != '.') {
-			break;
-		}
-		copy--;
+	for (node=0; node<numnodes; node++) {
+		send_name(node, RELAY_REMOVE, clientarray[client_no].name);
 	}
-	copy++;
-	*copy = '\0';
+	entry = table_find(&claims, clientarray[client_no].name);
+	if (entry != MAXNAMES && claims.entries[entry].node == nodeno) {
+		table_remove(&claims, entry);
+	}
+}
+
+
+
+
+/* Deliver a chat to the named player if they are here, or add them to the chat's recipients on the server they are on. Returns -1 if there is no such player, or they were named already. */
+static int route_chat(char *name, int client_no, char *message, int length)
+{
+	int i, node;
 	
-	/* Remove all but last dot. */
-	int num_dots = 0;
-	temppos = temp;
-	while (*temppos != '\0') {
-		if (*temppos == '.') {
-			num_dots++;
+	i = find_client(name);
+	if (i != MAXCLIENTS) {
+		if (sentgen[i] == chatgen) {
+			return -1;
 		}
-		temppos++;
+		deliver_chat(i, client_no, message, length, message);
+		sentgen[i] = chatgen;
+		return 0;
 	}
-	char *last_dot;
-	if (num_dots > 0) {
-		char extension[480];
-		while (*copy != '.') {
-			copy--;
+	if (numnodes == 0 || (i = table_find(&remoteplayers, name)) == MAXNAMES || remotegen[i] == chatgen) {
+		return -1;
+	}
+	node = remoteplayers.entries[i].node;
+	if (relaynameslen[node]+NAMESIZE+1 > MAXMESSAGE) {
+		return -1;
+	}
+	relaynameslen[node] += put_relay_name(relaynames[node]+relaynameslen[node], name);
+	relaycount[node]++;
+	remotegen[i] = chatgen;
+	return 0;
+}
+
+
+
+
+/* Relay a chat to the other servers - to every one for ALL, otherwise to those route_chat() gathered recipients for. */
+static void relay_chat(int client_no, char *text, int all)
+{
+	unsigned char payload[NAMESIZE+8+MAXMESSAGE+CHATSIZE];
+	int node, used, namelength, textlength;
+	
+	if (numnodes == 0) {
+		return;
+	}
+	namelength = put_relay_name(payload, clientarray[client_no].name);
+	textlength = strlen(text);
+	for (node=0; node<numnodes; node++) {
+		if (links[node].socket < 0 || (all == 0 && relaycount[node] == 0)) {
+			continue;
 		}
-		last_dot = copy;
-		sprintf(extension, "%s", last_dot);
-		temppos = temp;
-		copy = temppos;
-		while (temppos != last_dot) {
-			if (*temppos != '.') {
-				*copy = *temppos;
-				copy++;
-			}
-			temppos++;
+		used = namelength;
+		if (all != 0) {
+			used += put_varint(payload+used, 0);
 		}
-		*copy = '\0';
-		strcat(temp, extension);
-		for (last_dot = temp; *last_dot != '.'; last_dot++);
+		else {
+			used += put_varint(payload+used, relaycount[node]);
+			memcpy(payload+used, relaynames[node], relaynameslen[node]);
+			used += relaynameslen[node];
+		}
+		memcpy(payload+used, text, textlength);
+		queue_frame(node, RELAY_CHAT, payload, used+textlength);
+		count_event(&relayoutcount);
 	}
+}
+
+
+
+
+/* Send every player here the roster, after a change on another server. */
+static void send_player_lists()
+{
+	rosterchanged = 0;
+	broadcast_roster(MAXCLIENTS);
+}
+
+
+
+
+
+
+/* Carve the arena into buffers, zeroed, and mark them all free. */
+static void init_slab()
+{
+	int n;
 	
-	/* Convert name to uppercase. */
-	temppos = temp;
-	while (*temppos != '\0') {
-		*temppos = toupper(*temppos);
-		++temppos;
+	slab.arena = calloc(NUMBUFS*BUFSIZE, sizeof(char));
+	if (slab.arena == NULL) {
+		log_error("cannot allocate buffer arena");
+		exit(1);
 	}
+	for (n=0; n<NUMBUFS; n++) {
+		slab.freebufs[n] = NUMBUFS-1-n; /* lowest-numbered buffer on top */
+	}
+	slab.numfree = NUMBUFS;
+	slab.inuse = 0;
+	slab.peak = 0;
+	slab.taken = 0;
+	slab.returned = 0;
+}
+
+
+
+
+/* Hand out a buffer - free buffers are always zeroed. There is a buffer for every client slot, so running out is a bug. */
+static char *take_buffer()
+{
+	char *buffer;
 	
-	/* Truncate name before dot to 8 characters, and name after dot to 3 characters. */
-	char short_name[13];
-	if (num_dots > 0) {
-		*last_dot = '\0';
-		snprintf(short_name, BODYSIZE+1, "%s", temp);
-		*last_dot = '.';
-		strncat(short_name, last_dot, SUFFIXSIZE+1);
-		sprintf(temp, "%s", short_name);
-		last_dot = temp;
-		while (*last_dot != '.') {
-			last_dot++;
+	if (slab.numfree == 0) {
+		log_error("buffer arena exhausted");
+		exit(1);
+	}
+	buffer = slab.arena + slab.freebufs[--slab.numfree]*BUFSIZE;
+	slab.taken++;
+	slab.inuse++;
+	if (slab.inuse > slab.peak) {
+		slab.peak = slab.inuse;
+	}
+	return buffer;
+}
+
+
+
+
+/* Take a buffer back. It is zeroed and left alone until it is handed out again. */
+static void return_buffer(char *buffer)
+{
+	memset(buffer, '\0', BUFSIZE);
+	slab.freebufs[slab.numfree++] = (int) ((buffer-slab.arena)/BUFSIZE);
+	slab.returned++;
+	slab.inuse--;
+}
+
+
+
+
+/* Log the arena's use - at debug level, as it is called on every drop; the stats port serves the same counts. */
+static void log_buffers()
+{
+log_debug("Buffers: %d of %d in use (peak %d), %ld taken, %ld returned, %d bytes of arena", slab.inuse, NUMBUFS, slab.peak, slab.taken, slab.returned, NUMBUFS*BUFSIZE);
+}
+
+
+
+
+/* Give a client about to be read a buffer, unless it still holds one with part of a message in it. */
+static void attach_buffer(int client_no)
+{
+	if (clientarray[client_no].clibuf == NULL) {
+		clientarray[client_no].clibuf = take_buffer();
+	}
+}
+
+
+
+
+/* Take back a client's buffer once no partial message is left in it - text clients hold none when it starts with '\0', binary ones when charcount is 0. */
+static void detach_buffer(int client_no)
+{
+	if (IN_SET(usedset, client_no) == 0 || clientarray[client_no].clibuf == NULL) { /* dropped while being read - its buffer is back already */
+		return;
+	}
+	if (clientarray[client_no].binary != 0 ? clientarray[client_no].charcount == 0 : clientarray[client_no].clibuf[0] == '\0') {
+		return_buffer(clientarray[client_no].clibuf);
+		clientarray[client_no].clibuf = NULL;
+		clientarray[client_no].charcount = 0;
+	}
+}
+
+
+
+
+
+
+void clear_clientinfo(int client_no)
+{
+	if (IN_SET(usedset, client_no) == 0) { /* already cleared */
+		return;
+	}
+	if (IN_SET(awayset, client_no) != 0) { /* held seat - there is no connection or buffer */
+		REMOVE_FROM_SET(awayset, client_no);
+		numaway--;
+	}
+	else {
+		if (clientarray[client_no].clibuf != NULL) { /* give back any buffer - clibuf is left pointing at it, zeroed, so a parse that dropped its own client can finish */
+			return_buffer(clientarray[client_no].clibuf);
 		}
+		log_buffers();
+		numconnected--;
+		count_event(&dropcount);
 	}
-	else {
-		snprintf(short_name, BODYSIZE+1, "%s", temp);
-		sprintf(temp, "%s", short_name);
+	REMOVE_FROM_SET(usedset, client_no);
+	REMOVE_FROM_SET(joinedset, client_no);
+	clientarray[client_no].socket = -1;
+	release_name(client_no);
+	remove_name(client_no);
+	while (clientarray[client_no].nummemberof > 0) {
+		remove_member(clientarray[client_no].memberof[0], client_no);
 	}
-	
-	/* Place converted name into destination string. */
-	sprintf(*name, "%s", temp);
+	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
+	clientarray[client_no].charcount = 0;
+	clientarray[client_no].strikes = 0;
+	clientarray[client_no].resync = 0;
+	clientarray[client_no].binary = 0;
+	clientarray[client_no].zip = 0;
+	clientarray[client_no].skip = 0;
+	clientarray[client_no].claiming = 0;
+	clientarray[client_no].bucket.level = 0; /* refilled to a full burst the first time it is charged */
+	clientarray[client_no].bucket.refilled = 0;
+	REMOVE_FROM_SET(pausedset, client_no);
+	disarm_timer(client_no);
 }
 
 
@@ -953,93 +4779,161 @@ static void convert_name(char **name)
 
 
 
-static void assign_name(char **name, int client_no)
+void initialize_clientinfo(int client_no)
 {
-	char temp[480];
-	char *temppos = temp;
-	sprintf(temp, "%s", *name);
-	convert_name(&temppos);
-	
-	/* Send strike if name is empty. */
-	if (strlen(temp) == 0) { /* zero length name - send strike */
-		send_strike(client_no, 'm');
-		return;
+	REMOVE_FROM_SET(usedset, client_no);
+	REMOVE_FROM_SET(awayset, client_no);
+	REMOVE_FROM_SET(joinedset, client_no);
+	clientarray[client_no].socket = -1;
+	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
+	clientarray[client_no].namenext = MAXCLIENTS;
+	clientarray[client_no].clibuf = NULL;
+	clientarray[client_no].charcount = 0;
+	clientarray[client_no].strikes = 0;
+	clientarray[client_no].resync = 0;
+	clientarray[client_no].binary = 0;
+	clientarray[client_no].zip = 0;
+	clientarray[client_no].skip = 0;
+	clientarray[client_no].id = client_no;
+	clientarray[client_no].nummemberof = 0;
+	clientarray[client_no].claiming = 0;
+	clientarray[client_no].bucket.level = 0;
+	clientarray[client_no].bucket.refilled = 0;
+	clientarray[client_no].due = 0;
+}
+
+
+
+
+
+
+/* Read a -R or -G argument, rate[:burst]. The burst defaults to the rate, and is at least MAXCLIENTS so a chat to ALL can always be afforded. */
+static void parse_rate(char *arg, int *rate, int *burst)
+{
+	*rate = 0;
+	*burst = 0;
+	sscanf(arg, "%d:%d", rate, burst);
+	if (*rate < 0) {
+		*rate = 0;
+	}
+	if (*burst < *rate) {
+		*burst = *rate;
 	}
+	if (*burst < MAXCLIENTS) {
+		*burst = MAXCLIENTS;
+	}
+}
+
+
+
+
+/* Bring a bucket up to now, earning rate tokens a second up to burst. */
+static void refill_bucket(tokenbucket *bucket, int rate, int burst, unsigned long long now)
+{
+	long long full = (long long) burst * 1000000;
+	unsigned long long elapsed = now - bucket->refilled;
 	
-	/* Send strike if name is a reserved word. */
-	if (strcmp("ALL", temp) == 0 || strcmp("ANY", temp) == 0) {
-		send_strike(client_no, 'm');
-		return;
+	if (bucket->level >= full || elapsed >= (unsigned long long) (full - bucket->level) / rate) {
+		bucket->level = full;
+	}
+	else {
+		bucket->level += (long long) elapsed * rate;
 	}
+	bucket->refilled = now;
+}
 
-	/* Check for matches. */
-	int i, j, match = 0;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (strcmp(clientarray[i].name, temp) == 0) {
-			match = 1;
-			break;
+
+
+
+/* Charge a chat its cost in tokens to the sender's bucket and the global one, before it is dispatched. Returns 1 if it should go ahead, 0 if the policy has dropped it. */
+static int admit_chat(int client_no, int cost)
+{
+	tokenbucket *bucket = &clientarray[client_no].bucket;
+	unsigned long long now;
+	long long clientcost = 0, globalcost = 0;
+	
+	if (clientrate == 0 && globalrate == 0) {
+		return 1;
+	}
+	now = now_micros();
+	if (clientrate > 0) {
+		refill_bucket(bucket, clientrate, clientburst, now);
+		clientcost = (long long) (cost < clientburst ? cost : clientburst) * 1000000;
+		if (limitpolicy != 'd' && bucket->level < clientcost) {
+			count_event(&clientlimitcount);
+			if (limitpolicy == 's') {
+				send_strike(client_no, 'r');
+			}
+			return 0;
 		}
 	}
-	if (match == 0) { /* no matches - assign name */
-		sprintf(clientarray[client_no].name, "%s", temp);
+	if (globalrate > 0) {
+		refill_bucket(&globalbucket, globalrate, globalburst, now);
+		globalcost = (long long) (cost < globalburst ? cost : globalburst) * 1000000;
+		if (limitpolicy != 'd' && globalbucket.level < globalcost) {
+			count_event(&globallimitcount);
+			return 0;
+		}
 	}
-	else { /* match found - assign first unmatched alternative */
-		char tentative[NAMESIZE+1];
-		char number[5];
-		int offset = 1;
-		int num_dots = 0;
-		while (*temppos != '\0') {
-			if (*temppos == '.') {
-				num_dots = 1;
-				break;
-			}
-			temppos++;
+	
+	/* Within both limits - or delaying, in which case a bucket may go into debt and the client is held until it is paid off. */
+	if (clientrate > 0) {
+		bucket->level -= clientcost;
+		if (bucket->level < 0) {
+			count_event(&clientlimitcount);
+			ADD_TO_SET(pausedset, client_no);
 		}
-		for (j=1; j<31; j++) {
-			memset(tentative, '\0', NAMESIZE+1);
-			memset(number, '\0', 5);
-			if (j < 10) {
-				snprintf(tentative, BODYSIZE-1, "%s", temp);
-			}
-			else if (j < 100) {
-				snprintf(tentative, BODYSIZE-2, "%s", temp);
-			}
-			else {
-				snprintf(tentative, BODYSIZE-3, "%s", temp);
-			}
-			sprintf(number, "~%d", j);
-			strcat(tentative, number);
-			if (num_dots > 0) {
-				strcat(tentative, temppos);
-			}
-			for (i=0; i<MAXCLIENTS; i++) {
-				match = 0;
-				if (strcmp(clientarray[i].name, tentative) == 0) {
-					match = 1;
-					offset++;
-					break;
+	}
+	if (globalrate > 0) {
+		globalbucket.level -= globalcost;
+		if (globalbucket.level < 0) {
+			count_event(&globallimitcount);
+		}
+	}
+	return 1;
+}
+
+
+
+
+/* Take the clients working off a delay out of read_set - every client while the global bucket is in debt. Returns the microseconds until the first of them may be read again, -1 if none is held. */
+static long long hold_paused()
+{
+	unsigned long long now;
+	long long wait = -1, until;
+	int client_no;
+	setwalk walk;
+	
+	if (limitpolicy != 'd' || (clientrate == 0 && globalrate == 0)) {
+		return -1;
+	}
+	now = now_micros();
+	numpaused = 0;
+	if (globalrate > 0) {
+		refill_bucket(&globalbucket, globalrate, globalburst, now);
+		if (globalbucket.level < 0) {
+			for (client_no=first_in_set(&walk, usedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+				if (IN_SET(awayset, client_no) == 0) { /* a held seat has no socket */
+					FD_CLR (clientarray[client_no].socket, &read_set);
 				}
 			}
-			if (match == 0) {
-				break;
-			}
+			wait = (-globalbucket.level + globalrate - 1) / globalrate;
 		}
-		sprintf(clientarray[client_no].name, "%s", tentative);
 	}
-
-	/* update player information, send sjoin to new player and sstat to all others */
-	clientarray[client_no].joined = 1;
-	numplayers++;
-	build_player_list();
-	sprintf(buf, "(sjoin(%s)(%s)(%d,%d,%d))", clientarray[client_no].name, listbuf, minplayers, lobbytime, timeout);
-	write_to_client(clientarray[client_no].socket, client_no, CLEAR);
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (clientarray[i].joined == 1 && i != client_no) {
-			sprintf(buf, "(sstat(%s))", listbuf);
-			write_to_client(clientarray[i].socket, i, CLEAR);
+	for (client_no=first_in_set(&walk, pausedset); client_no<MAXCLIENTS; client_no=next_in_walk(&walk)) {
+		refill_bucket(&clientarray[client_no].bucket, clientrate, clientburst, now);
+		if (clientarray[client_no].bucket.level >= 0) {
+			REMOVE_FROM_SET(pausedset, client_no);
+			continue;
+		}
+		FD_CLR (clientarray[client_no].socket, &read_set);
+		numpaused++;
+		until = (-clientarray[client_no].bucket.level + clientrate - 1) / clientrate;
+		if (wait < 0 || until < wait) {
+			wait = until;
 		}
 	}
-	memset(listbuf, '\0', MAXMESSAGE);
+	return wait;
 }
 
 
@@ -1047,158 +4941,216 @@ static void assign_name(char **name, int client_no)
 
 
 
-static void build_player_list()
+/* Empty every slot of the timer wheel and start its clock. */
+static void init_wheel()
 {
-	int added = 0;
-	int i;
-	for (i=0; i<MAXCLIENTS; i++) {
-		if (clientarray[i].joined != 0) {
-			if (added == 0) {
-				sprintf(listbuf, "%s", clientarray[i].name);
-			}
-			else {
-				strcat(listbuf, ",");
-				strcat(listbuf, clientarray[i].name);
-			}
-			added++;
-		}
-	}
-	if (added == numplayers) {
-	}
-	else {
-fprintf(stderr, "Error: player list does not agree with numplayers\n");
+	int slot;
+	
+	for (slot=0; slot<WHEELSLOTS; slot++) {
+		wheel[slot] = MAXCLIENTS;
 	}
+	wheelstart = now_micros();
+	wheeltick = 0;
+	wheelwake = 0;
 }
 
 
 
 
+static unsigned int current_tick()
+{
+	return (unsigned int) ((now_micros() - wheelstart) / WHEELTICK);
+}
+
+
 
 
-static int find_right_paren(char **current, int *numchars)
+/* Put a client's timer in the slot for tick due - or the next tick, if due has passed. */
+static void arm_timer(int client_no, unsigned int due)
 {
-    char *pos = *current; pos++;
-    int chars = *numchars;
-    
-    while (*pos != '\0' && chars < MAXMESSAGE) {
-        chars++;
-        if (*pos == ')') {
-            break;
-        }
-        pos++;
-    }
-    *numchars = chars;
-    if (*pos == '\0') {
-    	*current = pos;
-        return 0;
-    }
-    else if (chars >= MAXMESSAGE) {
-    	*current = pos;
-        return -1;
-    }
-    else {
-        *current = pos;
-        return 1;
-    }
+	int slot;
+	
+	if (numtimers == 0) { /* the wheel stood still while it was empty */
+		wheeltick = current_tick();
+	}
+	if ((int) (due - wheeltick) <= 0) {
+		due = wheeltick + 1;
+	}
+	slot = due & (WHEELSLOTS-1);
+	if (wheelwake != 0 && (int) (due - wheelwake) < 0) {
+		wheelwake = due;
+	}
+	clientarray[client_no].due = due;
+	clientarray[client_no].timerprev = MAXCLIENTS;
+	clientarray[client_no].timernext = wheel[slot];
+	if (wheel[slot] < MAXCLIENTS) {
+		clientarray[wheel[slot]].timerprev = client_no;
+	}
+	wheel[slot] = client_no;
+	numtimers++;
 }
 
 
 
 
+static void disarm_timer(int client_no)
+{
+	int next = clientarray[client_no].timernext;
+	int prev = clientarray[client_no].timerprev;
+	
+	if (clientarray[client_no].due == 0) {
+		return;
+	}
+	if (prev < MAXCLIENTS) {
+		clientarray[prev].timernext = next;
+	}
+	else {
+		wheel[clientarray[client_no].due & (WHEELSLOTS-1)] = next;
+	}
+	if (next < MAXCLIENTS) {
+		clientarray[next].timerprev = prev;
+	}
+	clientarray[client_no].due = 0;
+	numtimers--;
+}
+
+
 
 
-void send_strike(int client_no, char reason)
+/*
+ * Turn the wheel up to the current tick, checking each client whose timer
+ * is due. A slot holds every timer due on a tick equal to it modulo
+ * WHEELSLOTS, so those due rounds later stay where they are. Returns
+ * microseconds until the next tick whose slot holds a timer, -1 if no
+ * timer is armed - so the server sleeps through empty ticks.
+ */
+static long long turn_wheel()
 {
-    clientarray[client_no].strikes += 1;
-    
-    if (reason == 'm') { /* send 'malformed' strike */
-        sprintf(buf, "(strike(%d)(malformed))", clientarray[client_no].strikes);
-        clientarray[client_no].resync = 1;
-        clientarray[client_no].charcount = 0;
-    }
-    else if (reason == 'b') { /* send 'badint' strike */
-        sprintf(buf, "(strike(%d)(badint))", clientarray[client_no].strikes);
-        clientarray[client_no].resync = 1;
-        clientarray[client_no].charcount = 0;
-    }
-    else if (reason == 't') { /* send 'timeout' strike */
-        sprintf(buf, "(strike(%d)(timeout))", clientarray[client_no].strikes);
-    }
-    else if (reason == 'l') { /* send 'toolong' strike */
-        sprintf(buf, "(strike(%d)(toolong))", clientarray[client_no].strikes);
-        clientarray[client_no].resync = 1;
-        clientarray[client_no].charcount = 0;
-    }
-    write_to_client(clientarray[client_no].socket, client_no, CLEAR);
-fprintf(stderr, "Strike: %d to client %d\n", clientarray[client_no].strikes, client_no);
-    
-    if (clientarray[client_no].used != 0 && clientarray[client_no].strikes == 3) { /* 3rd strike - drop client connection */
-        closesocket(clientarray[client_no].socket);
-fprintf (stderr, "Dropped: Client %d - 3 strikes\n", client_no);
-        if (clientarray[client_no].joined != 0) { /* client had a name - send sstat to all players */
-				numplayers--;
-				clientarray[client_no].joined = 0;
-				build_player_list();
-				int i;
-				for (i=0; i<MAXCLIENTS; i++) {
-					if (clientarray[i].joined != 0 && i != client_no) {
-						sprintf(buf, "(sstat(%s))", listbuf);
-						write_to_client(clientarray[i].socket, i, CLEAR);
-					}
-				}
-				memset(listbuf, '\0', MAXMESSAGE); 
+	int due[MAXCLIENTS];
+	unsigned long long elapsed;
+	unsigned int tick;
+	long long wait;
+	int client_no, numdue, k;
+	
+	if (numtimers == 0) {
+		return -1;
+	}
+	elapsed = now_micros() - wheelstart;
+	tick = (unsigned int) (elapsed / WHEELTICK);
+	while ((int) (tick - wheeltick) > 0) {
+		wheeltick++;
+		wheelwake = 0;
+		numdue = 0;
+		for (client_no=wheel[wheeltick & (WHEELSLOTS-1)]; client_no<MAXCLIENTS; client_no=clientarray[client_no].timernext) {
+			if ((int) (clientarray[client_no].due - wheeltick) <= 0) {
+				due[numdue++] = client_no;
+			}
 		}
-        FD_CLR (clientarray[client_no].socket, &total_set);
-        clear_clientinfo(client_no);
-    }
+		for (k=0; k<numdue; k++) { /* checked apart from the walk, as a check may drop other clients too */
+			if (clientarray[due[k]].due != 0) {
+				disarm_timer(due[k]);
+				check_client(due[k]);
+			}
+		}
+	}
+	if (numtimers == 0) {
+		return -1;
+	}
+	if (wheelwake == 0) { /* find the next slot with a timer, a rotation on at most */
+		for (k=1; k<WHEELSLOTS && wheel[(wheeltick+k) & (WHEELSLOTS-1)] == MAXCLIENTS; k++) {
+		}
+		wheelwake = wheeltick + k;
+	}
+	wait = (long long) wheelwake * WHEELTICK - (long long) elapsed;
+	return wait > 0 ? wait : 0;
 }
 
 
 
 
+/* Start timing a client's silence from now, if heartbeats or idle timeouts are on. */
+static void start_timer(int client_no)
+{
+	if (beatticks == 0 && idleticks == 0) {
+		return;
+	}
+	clientarray[client_no].heard = current_tick();
+	clientarray[client_no].pinged = clientarray[client_no].heard;
+	schedule_check(client_no);
+}
+
+
 
 
-void write_to_client(int socket, int client_no, int clear)
+/* Arm a client's timer for whichever comes first - its idle timeout, or its next heartbeat, a beat after it was last heard from or pinged. */
+static void schedule_check(int client_no)
 {
-	if (write(socket, &buf, strlen(buf)*sizeof(char)) < 0) {
-fprintf (stderr, "Dropped: Client %d - Write error\n", client_no);
-		if (clear == CLEAR) {
-			if (clientarray[client_no].joined != 0) {
-				numplayers--;
-				clientarray[client_no].joined = 0;
-				build_player_list();
-				int i;
-				for (i=0; i<MAXCLIENTS; i++) {
-					if (clientarray[i].joined != 0 && i != client_no) {
-						sprintf(buf, "(sstat(%s))", listbuf);
-						write_to_client(clientarray[i].socket, i, CLEAR);
-					}
-				}
-				memset(listbuf, '\0', MAXMESSAGE);
-			}
-			FD_CLR (socket, &total_set);
-			clear_clientinfo(client_no);
-		}
+	unsigned int heard = clientarray[client_no].heard;
+	unsigned int pinged = clientarray[client_no].pinged;
+	unsigned int last = (int) (pinged - heard) > 0 ? pinged : heard;
+	unsigned int due = 0;
+	
+	if (idleticks > 0) {
+		due = heard + idleticks;
 	}
-	memset(buf, '\0', BUFSIZE);
+	if (beatticks > 0 && (due == 0 || (int) (last + beatticks - due) < 0)) {
+		due = last + beatticks;
+	}
+	arm_timer(client_no, due);
 }
 
 
 
 
+/* A client's timer is due: drop it if it has been silent for the idle timeout, send it (sping) if for a beat since it was last heard from or pinged, and arm its timer again. */
+static void check_client(int client_no)
+{
+	unsigned int silent = wheeltick - clientarray[client_no].heard;
+	
+	if (idleticks > 0 && silent >= idleticks) {
+		closesocket(clientarray[client_no].socket);
+log_info("Dropped: Client %d - idle for %u ms", client_no, silent*(WHEELTICK/1000));
+		count_event(&idlecount);
+		if (IN_SET(joinedset, client_no) != 0) {
+			numplayers--;
+			REMOVE_FROM_SET(joinedset, client_no);
+			broadcast_roster(client_no);
+		}
+		FD_CLR (clientarray[client_no].socket, &total_set);
+		clear_clientinfo(client_no);
+		return;
+	}
+	if (beatticks > 0 && silent >= beatticks && wheeltick - clientarray[client_no].pinged >= beatticks) {
+		sprintf(buf, "(sping)");
+		write_to_client(clientarray[client_no].socket, client_no, CLEAR);
+		count_event(&pingcount);
+		if (IN_SET(usedset, client_no) == 0) { /* the write failed */
+			return;
+		}
+		clientarray[client_no].pinged = wheeltick;
+	}
+	schedule_check(client_no);
+}
+
 
 
-void clear_clientinfo(int client_no)
+
+/* Set the TCP keepalive and user timeout options given on the command line on a client's socket. */
+static void tune_socket(int socket)
 {
-	clientarray[client_no].used = 0;
-	clientarray[client_no].joined = 0;
-	clientarray[client_no].sent = 0;
-	clientarray[client_no].socket = -1;
-	memset(clientarray[client_no].name, '\0', NAMESIZE+1);
-	memset(clientarray[client_no].clibuf, '\0', BUFSIZE);
-	clientarray[client_no].charcount = 0;
-	clientarray[client_no].strikes = 0;
-	clientarray[client_no].resync = 0;
+	int flag = 1;
+	
+	if (keepidle > 0) {
+		if (setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(int)) < 0
+			|| setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(int)) < 0
+			|| (keepintvl > 0 && setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(int)) < 0)
+			|| (keepcnt > 0 && setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(int)) < 0)) {
+log_warn("Keepalive: cannot set on socket %d: %s", socket, strerror(errno));
+		}
+	}
+	if (usertimeout > 0 && setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &usertimeout, sizeof(int)) < 0) {
+log_warn("User timeout: cannot set on socket %d: %s", socket, strerror(errno));
+	}
 }
 
 
@@ -1206,15 +5158,41 @@ void clear_clientinfo(int client_no)
 
 
 
-void initialize_clientinfo(int client_no)
+/* Register everything served on the stats port. */
+static void register_metrics()
 {
-	clientarray[client_no].used = 0;
-	clientarray[client_no].joined = 0;
-	clientarray[client_no].sent = 0;
-	clientarray[client_no].socket = -1;
-	clientarray[client_no].name = malloc((NAMESIZE+1)*sizeof(char));
-	clientarray[client_no].clibuf = malloc(BUFSIZE*sizeof(char));
-	clientarray[client_no].charcount = 0;
-	clientarray[client_no].strikes = 0;
-	clientarray[client_no].resync = 0;
+	add_gauge("chatserver_clients", "state=\"connected\"", "Clients connected, by state.", &numconnected);
+	add_gauge("chatserver_clients", "state=\"joined\"", "Clients connected, by state.", &numplayers);
+	add_gauge("chatserver_channels", "", "Channels open.", &numchannels);
+	add_gauge("chatserver_held_seats", "", "Players loaded from a snapshot who have not come back for their names.", &numaway);
+	add_gauge("chatserver_receive_buffers", "", "Receive buffers held - by clients with part of a message pending, and the scratch buffer.", &slab.inuse);
+	add_gauge("chatserver_receive_buffers_peak", "", "Most receive buffers ever held at once.", &slab.peak);
+	add_counter("chatserver_connections_total", "result=\"accepted\"", "Connections accepted or refused for want of a free slot.", &acceptcount);
+	add_counter("chatserver_connections_total", "result=\"refused\"", "Connections accepted or refused for want of a free slot.", &refusecount);
+	add_counter("chatserver_disconnections_total", "", "Clients dropped - died, struck out or failed a write.", &dropcount);
+	add_counter("chatserver_reads_total", "", "Reads that returned data.", &readcount);
+	add_counter("chatserver_read_bytes_total", "", "Bytes read from clients.", &readbytes);
+	add_counter("chatserver_chats_total", "", "Chat messages sent by clients.", &chatcount);
+	add_counter("chatserver_deliveries_total", "", "Chat messages delivered to recipients.", &deliverycount);
+	add_counter("chatserver_history_total", "", "Chats to ALL added to the history ring.", &historycount);
+	add_counter("chatserver_history_replayed_total", "", "Chats sent from history to newly named clients.", &replaycount);
+	add_gauge("chatserver_relay_links", "", "Relay links to other servers up.", &numlinks);
+	add_counter("chatserver_relayed_chats_total", "direction=\"out\"", "Chats relayed to and from other servers, one per server reached.", &relayoutcount);
+	add_counter("chatserver_relayed_chats_total", "direction=\"in\"", "Chats relayed to and from other servers, one per server reached.", &relayincount);
+	add_counter("chatserver_relay_bytes_total", "", "Bytes written on relay links.", &relaybytes);
+	add_counter("chatserver_chats_limited_total", "bucket=\"client\"", "Chats over a rate limit - delayed, dropped or struck by the policy.", &clientlimitcount);
+	add_counter("chatserver_chats_limited_total", "bucket=\"global\"", "Chats over a rate limit - delayed, dropped or struck by the policy.", &globallimitcount);
+	add_gauge("chatserver_clients_paused", "", "Clients not being read while they work off a delay.", &numpaused);
+	add_counter("chatserver_zip_bytes_total", "form=\"text\"", "Bytes of text sent compressed, and bytes of the compressed frames sent for them.", &ziptextbytes);
+	add_counter("chatserver_zip_bytes_total", "form=\"compressed\"", "Bytes of text sent compressed, and bytes of the compressed frames sent for them.", &zipsentbytes);
+	add_histogram("chatserver_zip_seconds", "", "Time to compress one message or history replay.", &ziptime);
+	add_counter("chatserver_heartbeats_total", "", "Heartbeats (sping) sent to silent clients.", &pingcount);
+	add_counter("chatserver_idle_drops_total", "", "Clients dropped for sending nothing for the idle timeout.", &idlecount);
+	add_counter("chatserver_snapshots_total", "", "Snapshots of the players written.", &snapshotcount);
+	add_counter("chatserver_held_seats_total", "result=\"reclaimed\"", "Players loaded from a snapshot, by whether they came back for their names.", &reclaimcount);
+	add_counter("chatserver_held_seats_total", "result=\"released\"", "Players loaded from a snapshot, by whether they came back for their names.", &releasecount);
+	add_counter("chatserver_strikes_total", "reason=\"malformed\"", "Strikes given, by reason.", &malformedcount);
+	add_counter("chatserver_strikes_total", "reason=\"toolong\"", "Strikes given, by reason.", &toolongcount);
+	add_histogram("chatserver_receive_seconds", "", "Time from a read returning to everything in it being parsed and delivered.", &receivetime);
+	add_histogram("chatserver_deliver_seconds", "", "Time to deliver one chat message to its recipients.", &delivertime);
 }
@@ -0,0 +1,206 @@
+/* churnbench.c - benchmark of the servers' per-connection buffer handling before and after the buffer arena */
+#include <sys/time.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define MAXCLIENTS 30
+#define BUFSIZE 481 /* chatserver's buffer size */
+#define NUMBUFS (MAXCLIENTS+1)
+
+/*------------------------------------------------------------------------
+* Program: churnbench
+*
+* Purpose: time the buffer work the servers do as clients come and go, the
+* way it used to be done and the way it is done now. Each connection is
+* (1) accepted into a free slot
+* (2) sent a number of messages, each copied through read_from_client()
+* (3) dropped, clearing its slot
+* Old: every slot's clibuf malloc'd once at startup and zeroed on drop, and
+* a scratch buffer malloc'd and freed on every receive. New: clibufs and
+* the scratch buffer carved from one arena, a clibuf taken from the free
+* stack on accept and given back, zeroed, on drop. The parsing that follows
+* a receive is the same in both and is left out.
+*
+* Build: gcc -O2 -o churnbench churnbench.c
+*
+* Syntax: churnbench [-c connections] [-m messages]
+*
+* connections   number of connections accepted and dropped
+* messages      number of messages each connection sends
+*
+* All arguments are optional. The default values are as follows:
+*   connections = 1000000
+*   messages = 4
+*
+*------------------------------------------------------------------------
+*/
+
+typedef struct {
+		char *clibuf;
+		int charcount;
+	} slot;
+
+slot oldslots[MAXCLIENTS], newslots[MAXCLIENTS];
+char *arena; /* NUMBUFS buffers of BUFSIZE bytes */
+int freebufs[NUMBUFS]; /* numbers of the free buffers */
+int numfree;
+char *scratch;
+char received[BUFSIZE] = "(cchat(ALICE,BOB)(hello there))"; /* what recv() put in buf */
+
+static void old_receive(slot *client);
+static void new_receive(slot *client);
+static char *take_buffer();
+static void return_buffer(char *buffer);
+static double now_secs();
+
+
+
+
+int main(int argc, char **argv)
+{
+	int connections = 1000000, messages = 4;
+	int c, m, n;
+	long checksum = 0;
+	double start, oldtime, newtime;
+
+	for (n=1;n<argc;n++) {
+		if (strcmp(argv[n], "-c") == 0 && (n+1) < argc) {
+			sscanf(argv[n+1], "%d", &connections);
+		}
+		else if (strcmp(argv[n], "-m") == 0 && (n+1) < argc) {
+			sscanf(argv[n+1], "%d", &messages);
+		}
+	}
+	if (connections < 1) {
+		connections = 1000000;
+	}
+	if (messages < 0) {
+		messages = 4;
+	}
+
+	/* Old: buffers malloc'd at startup, scratch malloc'd per receive. */
+	for (n=0; n<MAXCLIENTS; n++) {
+		oldslots[n].clibuf = malloc(BUFSIZE*sizeof(char));
+		memset(oldslots[n].clibuf, '\0', BUFSIZE);
+	}
+	start = now_secs();
+	for (c=0; c<connections; c++) {
+		slot *client = &oldslots[c % MAXCLIENTS];
+		for (m=0; m<messages; m++) {
+			client->charcount = 0;
+			old_receive(client);
+			checksum += client->charcount;
+			client->clibuf[0] = '\0';
+		}
+		memset(client->clibuf, '\0', BUFSIZE);
+		client->charcount = 0;
+	}
+	oldtime = now_secs() - start;
+
+	/* New: buffers from the arena's free stack. */
+	arena = calloc(NUMBUFS*BUFSIZE, sizeof(char));
+	for (n=0; n<NUMBUFS; n++) {
+		freebufs[n] = NUMBUFS-1-n;
+	}
+	numfree = NUMBUFS;
+	scratch = take_buffer();
+	start = now_secs();
+	for (c=0; c<connections; c++) {
+		slot *client = &newslots[c % MAXCLIENTS];
+		client->clibuf = take_buffer();
+		for (m=0; m<messages; m++) {
+			client->charcount = 0;
+			new_receive(client);
+			checksum -= client->charcount;
+			client->clibuf[0] = '\0';
+		}
+		return_buffer(client->clibuf);
+		client->charcount = 0;
+	}
+	newtime = now_secs() - start;
+
+	printf("%d connections, %d messages each\n", connections, messages);
+	printf("old %8.1f ns  new %8.1f ns  per connection (%.2fx)\n", oldtime*1e9/connections, newtime*1e9/connections, newtime > 0 ? oldtime/newtime : 0.0);
+	printf("%.0f connections/s old, %.0f connections/s new\n", oldtime > 0 ? connections/oldtime : 0.0, newtime > 0 ? connections/newtime : 0.0);
+	if (checksum != 0) { /* both must have received the same text */
+		fprintf(stderr, "Error: old and new disagree (%ld)\n", checksum);
+		exit(1);
+	}
+	exit(0);
+}
+
+
+
+
+/* read_from_client() as it was. */
+static void old_receive(slot *client)
+{
+	char *tempstart = malloc(BUFSIZE*sizeof(char));
+	char *tempend = tempstart;
+	char *tempbufp = received;
+	int numchars = client->charcount;
+	while (*tempbufp != '\0' && numchars < BUFSIZE) {
+		if (isprint(*tempbufp) != 0) {
+			*tempend = *tempbufp;
+			tempend++;
+		}
+		tempbufp++;
+		numchars++;
+	}
+	*tempend = '\0';
+	strncat(client->clibuf, tempstart, BUFSIZE-client->charcount);
+	client->charcount = numchars;
+	free(tempstart);
+}
+
+
+
+
+/* read_from_client() as it is. */
+static void new_receive(slot *client)
+{
+	char *tempstart = scratch;
+	char *tempend = tempstart;
+	char *tempbufp = received;
+	int numchars = client->charcount;
+	while (*tempbufp != '\0' && numchars < BUFSIZE) {
+		if (isprint(*tempbufp) != 0) {
+			*tempend = *tempbufp;
+			tempend++;
+		}
+		tempbufp++;
+		numchars++;
+	}
+	*tempend = '\0';
+	strncat(client->clibuf, tempstart, BUFSIZE-client->charcount);
+	client->charcount = numchars;
+}
+
+
+
+
+static char *take_buffer()
+{
+	return arena + freebufs[--numfree]*BUFSIZE;
+}
+
+
+
+
+static void return_buffer(char *buffer)
+{
+	memset(buffer, '\0', BUFSIZE);
+	freebufs[numfree++] = (int) ((buffer-arena)/BUFSIZE);
+}
+
+
+
+
+static double now_secs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
@@ -0,0 +1,219 @@
+/* compress.c - LZ77 compression of text messages against a dictionary of protocol strings and name characters */
+#include <string.h>
+#include "compress.h"
+
+#define ZIPHASHBITS 12 /* bits of a 4-byte string's hash */
+#define ZIPHASHSIZE (1 << ZIPHASHBITS) /* entries in the hash table */
+#define MINMATCH 4 /* shortest match encoded */
+#define MAXDISTANCE 65535 /* farthest back a match can start */
+
+/* Strings found in many messages - the rest of the protocol's messages, and the characters names are made of. Both ends must have the same one. */
+static const char zipdictionary[] =
+    "(strike(1)(malformed))(strike(2)(toolong))(strike(3)(flood))"
+    "(senter((sleave((schan((sbin)(szip)"
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "~1,~2,~3,~4,~5,~6,~7,~8,~9,"
+    "(sjoin((sstat((schat(ALL)(";
+#define DICTLENGTH ((int) sizeof(zipdictionary) - 1)
+
+static int primedtable[ZIPHASHSIZE]; /* the hash table with the dictionary's strings in it - copied in for each message */
+static int primed = 0;
+static unsigned char window[DICTLENGTH+ZIPMAXINPUT]; /* the dictionary, followed by the message being compressed */
+
+/* helper functions */
+static unsigned int hash4(const unsigned char *p);
+static void prime_table();
+static int  put_sequence(unsigned char **out, unsigned char *end, const unsigned char *literals, int numliterals, int distance, int matchlength);
+static unsigned char *put_extra(unsigned char *out, int value);
+static int  get_extra(const unsigned char **in, const unsigned char *end, int *value);
+
+
+
+
+/* Compress length bytes of in into out. Returns the bytes written, 0 if they would not fit in room - so room one less than length keeps only a message that shrinks. */
+int zip_compress(const char *in, int length, unsigned char *out, int room)
+{
+    int table[ZIPHASHSIZE];
+    unsigned char *op = out;
+    unsigned char *end = out+room;
+    int pos, anchor, last;
+
+    if (length <= 0 || length > ZIPMAXINPUT) {
+        return 0;
+    }
+    if (primed == 0) {
+        prime_table();
+    }
+    memcpy(table, primedtable, sizeof(table));
+    memcpy(window+DICTLENGTH, in, length);
+    last = DICTLENGTH+length;
+    pos = anchor = DICTLENGTH;
+    while (pos+MINMATCH <= last) {
+        unsigned int hash = hash4(window+pos);
+        int candidate = table[hash];
+        int matchlength = MINMATCH;
+        table[hash] = pos;
+        if (candidate < 0 || pos-candidate > MAXDISTANCE || memcmp(window+candidate, window+pos, MINMATCH) != 0) {
+            pos++;
+            continue;
+        }
+        while (pos+matchlength < last && window[candidate+matchlength] == window[pos+matchlength]) {
+            matchlength++;
+        }
+        if (put_sequence(&op, end, window+anchor, pos-anchor, pos-candidate, matchlength) < 0) {
+            return 0;
+        }
+        pos += matchlength;
+        anchor = pos;
+    }
+    if (put_sequence(&op, end, window+anchor, last-anchor, 0, 0) < 0) {
+        return 0;
+    }
+    return (int) (op-out);
+}
+
+
+
+
+/* Expand length bytes of a compressed message into out. Returns the bytes of message, -1 if it is malformed or longer than room. */
+int zip_expand(const unsigned char *in, int length, char *out, int room)
+{
+    const unsigned char *ip = in;
+    const unsigned char *end = in+length;
+    int produced = 0;
+
+    while (ip < end) {
+        int token = *ip++;
+        int numliterals = token >> 4;
+        int matchlength = (token & 15) + MINMATCH;
+        int distance, k;
+        if (numliterals == 15 && get_extra(&ip, end, &numliterals) < 0) {
+            return -1;
+        }
+        if (numliterals > end-ip || numliterals > room-produced) {
+            return -1;
+        }
+        memcpy(out+produced, ip, numliterals);
+        ip += numliterals;
+        produced += numliterals;
+        if (ip == end) { /* the last sequence has no match */
+            break;
+        }
+        if (end-ip < 2) {
+            return -1;
+        }
+        distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (matchlength == 15+MINMATCH && get_extra(&ip, end, &matchlength) < 0) {
+            return -1;
+        }
+        if (distance == 0 || distance > produced+DICTLENGTH || matchlength > room-produced) {
+            return -1;
+        }
+        for (k=0; k<matchlength; k++) { /* a byte at a time, as the match may overlap what it makes */
+            int from = produced-distance;
+            out[produced++] = from < 0 ? zipdictionary[DICTLENGTH+from] : out[from];
+        }
+    }
+    return produced;
+}
+
+
+
+
+static unsigned int hash4(const unsigned char *p)
+{
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761U) >> (32-ZIPHASHBITS);
+}
+
+
+
+
+/* Put the dictionary in the window and its strings in the primed table, later ones over earlier. */
+static void prime_table()
+{
+    int pos;
+
+    memcpy(window, zipdictionary, DICTLENGTH);
+    for (pos=0; pos<ZIPHASHSIZE; pos++) {
+        primedtable[pos] = -1;
+    }
+    for (pos=0; pos+MINMATCH<=DICTLENGTH; pos++) {
+        primedtable[hash4(window+pos)] = pos;
+    }
+    primed = 1;
+}
+
+
+
+
+/* Write a sequence of literals and a match - none if matchlength is 0. Returns -1 if it would pass end. */
+static int put_sequence(unsigned char **out, unsigned char *end, const unsigned char *literals, int numliterals, int distance, int matchlength)
+{
+    unsigned char *op = *out;
+    int need = 1+numliterals;
+
+    if (numliterals >= 15) {
+        need += (numliterals-15)/255 + 1;
+    }
+    if (matchlength > 0) {
+        need += 2;
+        if (matchlength-MINMATCH >= 15) {
+            need += (matchlength-MINMATCH-15)/255 + 1;
+        }
+    }
+    if (need > end-op) {
+        return -1;
+    }
+    *op++ = ((numliterals < 15 ? numliterals : 15) << 4) | (matchlength == 0 ? 0 : (matchlength-MINMATCH < 15 ? matchlength-MINMATCH : 15));
+    if (numliterals >= 15) {
+        op = put_extra(op, numliterals-15);
+    }
+    memcpy(op, literals, numliterals);
+    op += numliterals;
+    if (matchlength > 0) {
+        *op++ = distance & 0xff;
+        *op++ = distance >> 8;
+        if (matchlength-MINMATCH >= 15) {
+            op = put_extra(op, matchlength-MINMATCH-15);
+        }
+    }
+    *out = op;
+    return 0;
+}
+
+
+
+
+/* Write the part of a length past its token's 15, in bytes of 255 and a last one below. */
+static unsigned char *put_extra(unsigned char *out, int value)
+{
+    while (value >= 255) {
+        *out++ = 255;
+        value -= 255;
+    }
+    *out++ = value;
+    return out;
+}
+
+
+
+
+/* Add the bytes of a length past its token's 15 to value. Returns -1 if they run past end or add up to more than any message. */
+static int get_extra(const unsigned char **in, const unsigned char *end, int *value)
+{
+    const unsigned char *ip = *in;
+    int byte;
+
+    do {
+        if (ip == end || *value > ZIPMAXINPUT) {
+            return -1;
+        }
+        byte = *ip++;
+        *value += byte;
+    } while (byte == 255);
+    *in = ip;
+    return 0;
+}
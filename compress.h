@@ -0,0 +1,38 @@
+/* compress.h - an LZ77 codec for the servers' text messages, primed with a dictionary of the protocol's common strings */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*------------------------------------------------------------------------
+* Module: compress
+*
+* Purpose: shrink the long text messages a server sends - rosters, and
+* runs of chats replayed from history - for clients that ask for it:
+* (1) the server compresses a message with zip_compress(), once however
+*     many clients it goes to, and writes the same bytes to each
+* (2) the client expands it with zip_expand()
+* Each message is compressed on its own, with no state carried from one
+* to the next, so a compressed message can be shared between clients and
+* a client can expand any message it receives.
+*
+* The format is LZ4's sequences, in a window that starts with a fixed
+* dictionary both ends know: protocol strings like "(sstat(" and "(schat(",
+* and the letters, digits and "~n" suffixes names are made of. A short
+* message so finds matches from its first byte. Each sequence is a token
+* byte - literal count in the high four bits, match length less 4 in the
+* low four, 15 meaning more follows in bytes of up to 255 - then the
+* literals, then the match's distance back as two bytes, low byte first,
+* then any more match length. The last sequence is literals only.
+* The compressor is greedy, with a hash table of 4-byte strings whose
+* dictionary entries are worked out once and copied in for each message.
+*
+* Build: compile compress.c with the program using it.
+*
+*------------------------------------------------------------------------
+*/
+
+#define ZIPMAXINPUT 131072 /* longest message zip_compress() takes */
+
+int  zip_compress(const char *in, int length, unsigned char *out, int room);
+int  zip_expand(const unsigned char *in, int length, char *out, int room);
+
+#endif
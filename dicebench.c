@@ -0,0 +1,169 @@
+/* dicebench.c - check and benchmark of byzantium.c's lane-based battle dice against the scalar reference */
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "byzantium.h"
+
+/*------------------------------------------------------------------------
+* Program: dicebench
+*
+* Purpose: make sure roll_exchanges(), which rolls and sorts the dice for
+* DICELANES exchanges at once, gives the same results as the scalar
+* roll_exchanges_scalar(), and measure how much faster it is:
+* (1) check - for each pairing of attacking (3 dice) and defending (2 dice)
+*     sides, seed two streams alike from seed, roll exchanges from one with
+*     each path, and compare every exchange's losses and the streams after
+* (2) benchmark - roll exchanges with each path and print the nanoseconds
+*     per exchange
+* Exits with status 1 if the paths disagree anywhere.
+*
+* Build: gcc -O3 -o dicebench dicebench.c byzantium.c -lpthread
+*
+* Syntax: dicebench [-n exchanges] [-s seed]
+*
+* exchanges     number of exchanges rolled for each pairing, rounded up to
+*               a multiple of DICELANES
+* seed          seed for the dice streams
+*
+* All arguments are optional. The default values are as follows:
+*   exchanges = 10000000
+*   seed = 1
+*
+*------------------------------------------------------------------------
+*/
+
+long numexchanges = 10000000;
+unsigned int seed = 1;
+int sink = 0; /* losses summed up, so the benchmark loops are not optimized away */
+
+static void seed_stream(dicestream *stream, unsigned int value);
+static long check_pairing(int acount, int bcount, long *aloss, long *bloss);
+static double time_path(int scalar, int acount, int bcount);
+static double now_secs();
+
+
+
+
+int main(int argc, char **argv)
+{
+	int counts[4][2] = {{3, 3}, {3, 2}, {2, 3}, {2, 2}};
+	int i, failed = 0;
+	long mismatches, aloss, bloss;
+	double lanes, scalar;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-n") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%ld", &numexchanges);
+		}
+		else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%u", &seed);
+		}
+	}
+	if (numexchanges < DICELANES) {
+		numexchanges = 10000000;
+	}
+	numexchanges = (numexchanges + DICELANES-1) / DICELANES * DICELANES;
+
+	for (i=0; i<4; i++) {
+		mismatches = check_pairing(counts[i][0], counts[i][1], &aloss, &bloss);
+		printf("%d vs %d dice: %ld exchanges, a lost %ld, b lost %ld, %ld mismatches\n", counts[i][0], counts[i][1], numexchanges, aloss, bloss, mismatches);
+		if (mismatches > 0) {
+			failed = 1;
+		}
+	}
+	for (i=0; i<4; i++) {
+		scalar = time_path(1, counts[i][0], counts[i][1]);
+		lanes = time_path(0, counts[i][0], counts[i][1]);
+		printf("%d vs %d dice: scalar %6.2f ns  lanes %6.2f ns per exchange (%.1fx)\n", counts[i][0], counts[i][1], scalar*1e9, lanes*1e9, lanes > 0 ? scalar/lanes : 0.0);
+	}
+	if (failed != 0) {
+		fprintf(stderr, "Error: roll_exchanges() does not match roll_exchanges_scalar()\n");
+		exit(1);
+	}
+	exit(0);
+}
+
+
+
+
+/* Seed a stream's lanes from value with xorshift, as the engine seeds a skirmish's. */
+static void seed_stream(dicestream *stream, unsigned int value)
+{
+	int lane;
+
+	value |= 1;
+	for (lane=0; lane<DICELANES; lane++) {
+		value ^= value << 13;
+		value ^= value >> 17;
+		value ^= value << 5;
+		stream->state[lane] = value | 1;
+	}
+}
+
+
+
+
+/* Roll numexchanges exchanges with both paths from the same seed. Returns the number of exchanges, and stream states at the end, that differ. */
+static long check_pairing(int acount, int bcount, long *aloss, long *bloss)
+{
+	dicestream lanes, scalar;
+	int laneloss[2][DICELANES], scalarloss[2][DICELANES];
+	long done, mismatches = 0;
+	int lane;
+
+	seed_stream(&lanes, seed);
+	seed_stream(&scalar, seed);
+	*aloss = 0;
+	*bloss = 0;
+	for (done=0; done<numexchanges; done+=DICELANES) {
+		roll_exchanges(&lanes, acount, bcount, laneloss[0], laneloss[1]);
+		roll_exchanges_scalar(&scalar, acount, bcount, scalarloss[0], scalarloss[1]);
+		for (lane=0; lane<DICELANES; lane++) {
+			if (laneloss[0][lane] != scalarloss[0][lane] || laneloss[1][lane] != scalarloss[1][lane]) {
+				mismatches++;
+			}
+			*aloss += laneloss[0][lane];
+			*bloss += laneloss[1][lane];
+		}
+	}
+	if (memcmp(&lanes, &scalar, sizeof(dicestream)) != 0) {
+		mismatches++;
+	}
+	return mismatches;
+}
+
+
+
+
+/* Seconds per exchange rolled with one path. */
+static double time_path(int scalar, int acount, int bcount)
+{
+	dicestream stream;
+	int aloss[DICELANES], bloss[DICELANES];
+	long done;
+	double start;
+
+	seed_stream(&stream, seed);
+	start = now_secs();
+	for (done=0; done<numexchanges; done+=DICELANES) {
+		if (scalar != 0) {
+			roll_exchanges_scalar(&stream, acount, bcount, aloss, bloss);
+		}
+		else {
+			roll_exchanges(&stream, acount, bcount, aloss, bloss);
+		}
+		sink += aloss[done % DICELANES] - bloss[(done+1) % DICELANES];
+	}
+	return (now_secs() - start) / numexchanges;
+}
+
+
+
+
+static double now_secs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
@@ -0,0 +1,159 @@
+/* handoff.c - Unix-domain sockets for handing a server's sockets and state to its replacement */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include "handoff.h"
+#include "logger.h"
+
+/* helper functions */
+static int  set_address(struct sockaddr_un *sun, const char *path);
+
+
+
+
+/* Listen for a replacement at path, replacing any socket left there. Returns the listening socket, -1 on error. */
+int open_handoff_port(const char *path)
+{
+    struct sockaddr_un sun;
+    int port;
+
+    if (set_address(&sun, path) < 0) {
+        return -1;
+    }
+    port = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (port < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(port, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(port, 1) < 0) {
+        perror(path);
+        close(port);
+        return -1;
+    }
+    log_info("Handoff: waiting for a replacement on %s", path);
+    return port;
+}
+
+
+
+
+/* Accept the replacement. Returns the connection, -1 on error. */
+int accept_handoff(int port)
+{
+    int conn;
+
+    conn = accept(port, NULL, NULL);
+    if (conn < 0) {
+        perror("accept");
+    }
+    return conn;
+}
+
+
+
+
+/* Connect to the server being replaced. Returns the connection, -1 on error. */
+int connect_handoff(const char *path)
+{
+    struct sockaddr_un sun;
+    int conn;
+
+    if (set_address(&sun, path) < 0) {
+        return -1;
+    }
+    conn = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (conn < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        perror(path);
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+
+
+
+/* Send nbytes from ptr, and with them sendfd unless it is -1. */
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd)
+{
+    struct msghdr msg;
+    struct iovec iov[1];
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } control_un;
+    struct cmsghdr *cmptr;
+
+    memset(&msg, 0, sizeof(msg));
+    if (sendfd >= 0) {
+        msg.msg_control = control_un.control;
+        msg.msg_controllen = sizeof(control_un.control);
+        cmptr = CMSG_FIRSTHDR(&msg);
+        cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+        cmptr->cmsg_level = SOL_SOCKET;
+        cmptr->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmptr), &sendfd, sizeof(int));
+    }
+    iov[0].iov_base = ptr;
+    iov[0].iov_len = nbytes;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    return sendmsg(fd, &msg, 0);
+}
+
+
+
+
+/* Read up to nbytes into ptr, and the descriptor sent with them into recvfd - -1 if none was sent. */
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd)
+{
+    struct msghdr msg;
+    struct iovec iov[1];
+    ssize_t n;
+    union {
+        struct cmsghdr cm;
+        char control[CMSG_SPACE(sizeof(int))];
+    } control_un;
+    struct cmsghdr *cmptr;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof(control_un.control);
+    iov[0].iov_base = ptr;
+    iov[0].iov_len = nbytes;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    *recvfd = -1;
+    n = recvmsg(fd, &msg, 0);
+    if (n <= 0) {
+        return n;
+    }
+    cmptr = CMSG_FIRSTHDR(&msg);
+    if (cmptr != NULL && cmptr->cmsg_len == CMSG_LEN(sizeof(int)) && cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS) {
+        memcpy(recvfd, CMSG_DATA(cmptr), sizeof(int));
+    }
+    return n;
+}
+
+
+
+
+static int set_address(struct sockaddr_un *sun, const char *path)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        log_error("handoff path %s is too long", path);
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* handoff.h - passing sockets and state from a running server to its replacement over a Unix-domain socket */
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+
+/*------------------------------------------------------------------------
+* Module: handoff
+*
+* Purpose: let a new server process take over from an old one without
+* dropping a connection:
+* (1) the old server listens on a Unix-domain socket with
+*     open_handoff_port(), next to its other sockets in select()
+* (2) the new server calls connect_handoff() with the same path and the
+*     old one accepts with accept_handoff()
+* (3) the old server sends its listening socket and each client socket
+*     with write_fd(), one record of state per socket, and the new server
+*     reads them with read_fd()
+* The sockets are SOCK_SEQPACKET, so each record arrives whole and with
+* its descriptor, and a short read means a mismatched peer. The protocol
+* of records - what they hold and the order they come in - is the
+* server's.
+*
+* write_fd() and read_fd() are those of UNIX Network Programming
+* (lib/write_fd.c and lib/read_fd.c), taking a descriptor of -1 to mean
+* none.
+*
+* Build: compile handoff.c with the program using it.
+*
+*------------------------------------------------------------------------
+*/
+
+int  open_handoff_port(const char *path);
+int  accept_handoff(int port);
+int  connect_handoff(const char *path);
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd);
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd);
+
+#endif
@@ -0,0 +1,738 @@
+/* loadgen.c - open-loop load generator for the chat servers: fixed-rate chats, latency from intended send times */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define PROTOPORT 36724 /* default protocol port number */
+#define CHATSIZE 80 /* the server's maximum chat message length */
+#define NAMESIZE 12 /* the server's maximum name length */
+#define INSIZE 640 /* bytes of unparsed input kept per connection */
+#define OUTSIZE 2048 /* bytes of unsent output kept per sender */
+#define MAXTHREADS 64
+#define MAXSTEPS 64
+#define MAXCONNECTING 64 /* connects each thread has outstanding at once */
+#define PORTSPERADDR 25000 /* connections per local loopback address, to stay inside the ephemeral port range */
+#define SUBBITS 4 /* histogram buckets are 2^SUBBITS to an octave */
+#define HISTBUCKETS 1024
+#define DRAINSECS 2 /* seconds to wait for chats still in flight after the last step */
+
+/*------------------------------------------------------------------------
+* Program: loadgen
+*
+* Purpose: find the load a chat server saturates at without the
+* coordinated omission of closed-loop clients, which stop sending while
+* they wait and so never see the queue they would have built:
+* (1) open connections connections over threads threads, each thread
+*     driving its share with epoll, and join each one
+* (2) send chats from every joined connection on a fixed schedule - the
+*     target rate of each step is split evenly over the senders, and every
+*     chat has an intended send time whether or not the generator or the
+*     server keeps up
+* (3) stamp each chat with its intended send time, and when it arrives take
+*     latency from that time, not from when it was actually written - a
+*     chat written late because the socket was full or the generator was
+*     behind is charged for the wait
+* (4) step the rate from rate up by step, steps times, and print one
+*     key=value line per step and a summary line
+* Each chat is sent to the next joined connection by name. Connections the
+* server refuses are closed and counted.
+*
+* Per step: target_rate, sent_rate, delivered_rate (chats intended in the
+* step that arrived by the end of the run), p50_us to max_us latency,
+* lag_p99_us (how late the generator itself wrote chats - if this is high
+* the generator, not the server, is the bottleneck), and strikes. The
+* summary gives saturation_rate, the highest target rate delivered at 95%
+* or better with p99 latency within limit, and dropped, the joined
+* connections the server closed during the run.
+*
+* Latencies are kept in log-linear histograms, 16 buckets to an octave, so
+* percentiles are within about 6%.
+*
+* Build: gcc -O2 -o loadgen loadgen.c -lpthread
+*
+* Syntax: loadgen [-h host] [-p port] [-c connections] [-t threads]
+*                 [-r rate] [-i step] [-n steps] [-d seconds] [-b size]
+*                 [-l limit]
+*
+* host          address of the server
+* port          port of the server
+* connections   number of connections to hold open
+* threads       number of threads driving them
+* rate          chats per second sent in the first step
+* step          chats per second added in each later step
+* steps         number of steps
+* seconds       length of each step
+* size          length of each chat message, at most CHATSIZE
+* limit         p99 latency, in microseconds, a step may have and still count
+*               as keeping up
+*
+* All arguments are optional. The default values are as follows:
+*   host = 127.0.0.1
+*   port = 36724
+*   connections = 30
+*   threads = 4
+*   rate = 10000
+*   step = 10000
+*   steps = 10
+*   seconds = 5
+*   size = 64
+*   limit = 10000
+*
+* For more than 25000 connections to a loopback host, connections are
+* spread over local addresses 127.0.0.1, 127.0.0.2, ... so each has
+* ephemeral ports to spare. The open file limit is raised as far as allowed.
+*
+*------------------------------------------------------------------------
+*/
+
+#define CONNECTING 0
+#define JOINING 1
+#define JOINED 2
+#define CLOSED 3
+
+typedef struct {
+		int socket;
+		int state;
+		char name[NAMESIZE+1]; /* as assigned by the server */
+		char *target; /* name of the connection this one sends to */
+		char in[INSIZE+1]; /* received and not yet parsed */
+		int inlen;
+		char *out; /* chats not yet written - allocated on joining */
+		int outlen;
+		int sender; /* number among all senders, for staggering */
+		int step; /* step of the next chat */
+		long next; /* number of the next chat within the step */
+	} conninfo;
+
+typedef struct {
+		int number;
+		int epollfd;
+		int timerfd; /* armed for the next chat due from this thread */
+		int first; /* this thread drives connections first, first+numthreads, ... */
+		int opened; /* connections this thread has started connecting */
+		int connecting; /* connections outstanding */
+		int settled; /* connections joined or closed */
+		int *senders; /* its joined connections */
+		int numsenders;
+		long sent[MAXSTEPS];
+		long delivered[MAXSTEPS];
+		long strikes[MAXSTEPS];
+		unsigned long long latency[MAXSTEPS][HISTBUCKETS]; /* nanoseconds from intended send to arrival */
+		unsigned long long lag[MAXSTEPS][HISTBUCKETS]; /* nanoseconds from intended send to actual write */
+	} threadinfo;
+
+conninfo *conns;
+threadinfo threads[MAXTHREADS];
+int numconns = 30, numthreads = 4, numsteps = 10, size = 64;
+double rate = 10000, stepinc = 10000, stepsecs = 5;
+struct sockaddr_in sad; /* server address */
+int numaddrs = 1; /* local loopback addresses spread over */
+int totalsenders = 0;
+int dropped = 0; /* joined connections the server closed during the run */
+volatile int running = 0; /* set once every connection has settled and the schedule has begun */
+volatile int finished = 0;
+unsigned long long runstart; /* when step 0 begins, from now_nanos() */
+unsigned long long stepnanos;
+
+/* helper functions */
+static void *drive_connections(void *arg);
+static void open_connection(threadinfo *thread, int c);
+static void connected(threadinfo *thread, conninfo *conn);
+static void read_conn(threadinfo *thread, conninfo *conn);
+static void take_message(threadinfo *thread, conninfo *conn, char *message);
+static void close_conn(threadinfo *thread, conninfo *conn);
+static unsigned long long send_due(threadinfo *thread, conninfo *conn, unsigned long long now);
+static int  flush_out(threadinfo *thread, conninfo *conn);
+static int  bucket_of(unsigned long long nanos);
+static unsigned long long bucket_top(int bucket);
+static double percentile(unsigned long long *hist, double fraction);
+static int  current_step(unsigned long long now);
+static unsigned long long now_nanos();
+
+
+
+
+int main(int argc, char **argv)
+{
+	char *host = "127.0.0.1";
+	int port = PROTOPORT;
+	double limit = 10000;
+	pthread_t tids[MAXTHREADS];
+	struct rlimit rl;
+	int i, s, b;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-h") == 0 && (i+1) < argc) {
+			host = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &port);
+		}
+		else if (strcmp(argv[i], "-c") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numconns);
+		}
+		else if (strcmp(argv[i], "-t") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numthreads);
+		}
+		else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &rate);
+		}
+		else if (strcmp(argv[i], "-i") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &stepinc);
+		}
+		else if (strcmp(argv[i], "-n") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numsteps);
+		}
+		else if (strcmp(argv[i], "-d") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &stepsecs);
+		}
+		else if (strcmp(argv[i], "-b") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &size);
+		}
+		else if (strcmp(argv[i], "-l") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%lf", &limit);
+		}
+	}
+	if (numconns < 2 || numthreads < 1 || numthreads > MAXTHREADS || numsteps < 1 || numsteps > MAXSTEPS || rate <= 0 || stepsecs <= 0) {
+		fprintf(stderr, "Error: need 2 or more connections, 1 to %d threads, 1 to %d steps, and a rate and length above 0\n", MAXTHREADS, MAXSTEPS);
+		exit(1);
+	}
+	if (size < 24 || size > CHATSIZE) { /* room for the timestamp and step */
+		fprintf(stderr, "Error: size must be from 24 to %d\n", CHATSIZE);
+		exit(1);
+	}
+	if (numthreads > numconns) {
+		numthreads = numconns;
+	}
+	stepnanos = (unsigned long long) (stepsecs * 1e9);
+
+	memset((char *)&sad, 0, sizeof(sad));
+	sad.sin_family = AF_INET;
+	sad.sin_port = htons((u_short)port);
+	if (inet_pton(AF_INET, host, &sad.sin_addr) != 1) {
+		fprintf(stderr, "Error: bad host address %s\n", host);
+		exit(1);
+	}
+	if ((ntohl(sad.sin_addr.s_addr) >> 24) == 127) {
+		numaddrs = (numconns + PORTSPERADDR-1) / PORTSPERADDR;
+	}
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	conns = calloc(numconns, sizeof(conninfo));
+	if (conns == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* Connect and join everything, then hand out targets and start the schedule. */
+	for (i=0; i<numthreads; i++) {
+		threads[i].number = i;
+		threads[i].first = i;
+		threads[i].senders = malloc(((numconns+numthreads-1)/numthreads) * sizeof(int));
+		threads[i].epollfd = epoll_create1(0);
+		threads[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (threads[i].senders == NULL || threads[i].epollfd < 0 || threads[i].timerfd < 0) {
+			perror("setup");
+			exit(1);
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u32 = (unsigned int) numconns; /* not a connection */
+		epoll_ctl(threads[i].epollfd, EPOLL_CTL_ADD, threads[i].timerfd, &event);
+		if (pthread_create(&tids[i], NULL, drive_connections, &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	while (1) {
+		int settled = 0;
+		for (i=0; i<numthreads; i++) {
+			settled += __atomic_load_n(&threads[i].settled, __ATOMIC_ACQUIRE);
+		}
+		if (settled == numconns) {
+			break;
+		}
+		usleep(10000);
+	}
+	int joined = 0, *joinedlist = malloc(numconns * sizeof(int));
+	for (i=0; i<numconns; i++) {
+		if (conns[i].state == JOINED) {
+			joinedlist[joined++] = i;
+		}
+	}
+	if (joined < 2) {
+		fprintf(stderr, "Error: only %d connections joined - need 2 to chat\n", joined);
+		exit(1);
+	}
+	for (i=0; i<joined; i++) {
+		conninfo *conn = &conns[joinedlist[i]];
+		conn->target = conns[joinedlist[(i+1) % joined]].name;
+		conn->sender = i;
+	}
+	totalsenders = joined;
+	runstart = now_nanos() + 100000000ULL;
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	usleep((useconds_t) ((runstart - now_nanos()) / 1000));
+	while (now_nanos() < runstart + numsteps*stepnanos + DRAINSECS*1000000000ULL) {
+		usleep(100000);
+	}
+	__atomic_store_n(&finished, 1, __ATOMIC_RELEASE);
+	for (i=0; i<numthreads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	/* Merge the threads' counts and histograms step by step. */
+	double saturation = 0;
+	for (s=0; s<numsteps; s++) {
+		static unsigned long long latency[HISTBUCKETS], lag[HISTBUCKETS];
+		long sent = 0, delivered = 0, strikes = 0;
+		double target = rate + s*stepinc;
+		memset(latency, 0, sizeof(latency));
+		memset(lag, 0, sizeof(lag));
+		for (i=0; i<numthreads; i++) {
+			sent += threads[i].sent[s];
+			delivered += threads[i].delivered[s];
+			strikes += threads[i].strikes[s];
+			for (b=0; b<HISTBUCKETS; b++) {
+				latency[b] += threads[i].latency[s][b];
+				lag[b] += threads[i].lag[s][b];
+			}
+		}
+		double p99 = percentile(latency, 0.99) / 1000.0;
+		printf("step=%d target_rate=%.0f sent_rate=%.0f delivered_rate=%.0f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f lag_p99_us=%.1f strikes=%ld\n",
+			s, target, sent / stepsecs, delivered / stepsecs,
+			percentile(latency, 0.5) / 1000.0, percentile(latency, 0.9) / 1000.0, p99,
+			percentile(latency, 0.999) / 1000.0, percentile(latency, 1.0) / 1000.0, percentile(lag, 0.99) / 1000.0, strikes);
+		if (delivered >= 0.95 * target * stepsecs && p99 <= limit && target > saturation) {
+			saturation = target;
+		}
+	}
+	printf("connections=%d joined=%d refused=%d dropped=%d threads=%d size=%d seconds=%.2f limit_us=%.0f saturation_rate=%.0f\n",
+		numconns, joined, numconns-joined, dropped, numthreads, size, stepsecs, limit, saturation);
+	exit(0);
+}
+
+
+
+
+/*
+ * Thread body - connect and join this thread's connections, then send on
+ * schedule and read until finished. The timer is kept armed for the next
+ * chat due, so chats go out on time to the nanosecond clock rather than
+ * epoll_wait()'s milliseconds.
+ */
+static void *drive_connections(void *arg)
+{
+	threadinfo *thread = arg;
+	struct epoll_event events[256];
+	struct itimerspec due;
+	unsigned long long expirations;
+	int n, e, started = 0;
+
+	memset(&due, 0, sizeof(due));
+
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) == 0) {
+		while (thread->connecting < MAXCONNECTING && thread->first + thread->opened*numthreads < numconns) {
+			open_connection(thread, thread->first + thread->opened*numthreads);
+			thread->opened++;
+		}
+		n = epoll_wait(thread->epollfd, events, 256, started != 0 ? 100 : 10);
+		for (e=0; e<n; e++) {
+			if (events[e].data.u32 == (unsigned int) numconns) { /* the timer - a chat is due */
+				if (read(thread->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("read");
+				}
+				continue;
+			}
+			conninfo *conn = &conns[events[e].data.u32];
+			if (conn->state == CONNECTING) {
+				connected(thread, conn);
+			}
+			else {
+				if ((events[e].events & EPOLLOUT) != 0 && conn->state == JOINED && flush_out(thread, conn) < 0) {
+					continue;
+				}
+				if ((events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+					read_conn(thread, conn);
+				}
+			}
+		}
+		if (started == 0 && __atomic_load_n(&running, __ATOMIC_ACQUIRE) != 0) {
+			started = 1;
+		}
+		if (started != 0) {
+			unsigned long long now = now_nanos(), next = 0, when;
+			int s;
+			for (s=0; s<thread->numsenders; s++) {
+				when = send_due(thread, &conns[thread->senders[s]], now);
+				if (when != 0 && (next == 0 || when < next)) {
+					next = when;
+				}
+			}
+			if (next != 0) {
+				due.it_value.tv_sec = (time_t) (next / 1000000000ULL);
+				due.it_value.tv_nsec = (long) (next % 1000000000ULL);
+				timerfd_settime(thread->timerfd, TFD_TIMER_ABSTIME, &due, NULL);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+
+
+/* Start a non-blocking connect, from the local address this connection is spread to. */
+static void open_connection(threadinfo *thread, int c)
+{
+	conninfo *conn = &conns[c];
+	struct epoll_event event;
+	int flag = 1;
+
+	conn->socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (conn->socket < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+	if (numaddrs > 1) {
+		struct sockaddr_in local;
+		memset((char *)&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(0x7f000001 + c % numaddrs);
+		if (bind(conn->socket, (struct sockaddr *)&local, sizeof(local)) < 0) {
+			perror("bind");
+			exit(1);
+		}
+	}
+	conn->state = CONNECTING;
+	if (connect(conn->socket, (struct sockaddr *)&sad, sizeof(sad)) < 0 && errno != EINPROGRESS) {
+		perror("connect");
+		exit(1);
+	}
+	event.events = EPOLLOUT;
+	event.data.u32 = c;
+	epoll_ctl(thread->epollfd, EPOLL_CTL_ADD, conn->socket, &event);
+	thread->connecting++;
+}
+
+
+
+
+/* A connect finished - send the join, or count the connection closed if it failed. */
+static void connected(threadinfo *thread, conninfo *conn)
+{
+	struct epoll_event event;
+	char message[32];
+	int error = 0, length;
+	socklen_t len = sizeof(error);
+
+	thread->connecting--;
+	getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &error, &len);
+	if (error != 0) {
+		close_conn(thread, conn);
+		return;
+	}
+	length = snprintf(message, sizeof(message), "(cjoin(L%d))", (int) (conn - conns));
+	if (write(conn->socket, message, length) != length) {
+		close_conn(thread, conn);
+		return;
+	}
+	conn->state = JOINING;
+	event.events = EPOLLIN;
+	event.data.u32 = (unsigned int) (conn - conns);
+	epoll_ctl(thread->epollfd, EPOLL_CTL_MOD, conn->socket, &event);
+}
+
+
+
+
+/* Read what has arrived and take each complete message out of it. */
+static void read_conn(threadinfo *thread, conninfo *conn)
+{
+	int nbytes, depth = 0, i, begin = 0;
+
+	nbytes = read(conn->socket, conn->in+conn->inlen, INSIZE-conn->inlen);
+	if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN)) {
+		close_conn(thread, conn);
+		return;
+	}
+	if (nbytes < 0) {
+		return;
+	}
+	conn->inlen += nbytes;
+	for (i=0; i<conn->inlen && conn->state != CLOSED; i++) {
+		if (conn->in[i] == '(') {
+			if (depth == 0) {
+				begin = i;
+			}
+			depth++;
+		}
+		else if (conn->in[i] == ')' && depth > 0) {
+			depth--;
+			if (depth == 0) {
+				char saved = i+1 < conn->inlen ? conn->in[i+1] : '\0';
+				conn->in[i+1] = '\0';
+				take_message(thread, conn, conn->in+begin);
+				conn->in[i+1] = saved;
+				begin = i+1;
+			}
+		}
+		else if (depth == 0) {
+			begin = i+1;
+		}
+	}
+	if (conn->state == CLOSED) {
+		return;
+	}
+	memmove(conn->in, conn->in+begin, conn->inlen-begin);
+	conn->inlen -= begin;
+	if (conn->inlen >= INSIZE) { /* a message too long to be the server's - drop it */
+		conn->inlen = 0;
+	}
+}
+
+
+
+
+/* Act on one message from the server: sjoin and snovac while joining, schat and strike after. */
+static void take_message(threadinfo *thread, conninfo *conn, char *message)
+{
+	unsigned long long intended, now;
+	int step;
+	char *body;
+
+	if (conn->state == JOINING) {
+		if (strncmp(message, "(sjoin(", 7) == 0) {
+			sscanf(message+7, "%12[^)]", conn->name);
+			conn->out = malloc(OUTSIZE);
+			if (conn->out == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			conn->state = JOINED;
+			thread->senders[thread->numsenders++] = (int) (conn - conns);
+			__atomic_store_n(&thread->settled, thread->settled+1, __ATOMIC_RELEASE);
+		}
+		else if (strncmp(message, "(snovac)", 8) == 0) {
+			close_conn(thread, conn);
+		}
+		return;
+	}
+	step = current_step(now_nanos());
+	if (strncmp(message, "(strike(", 8) == 0) {
+		if (step >= 0 && step < numsteps) {
+			thread->strikes[step]++;
+		}
+		return;
+	}
+	if (strncmp(message, "(schat(", 7) != 0 || (body = strstr(message, ")(")) == NULL) {
+		return;
+	}
+	now = now_nanos();
+	if (sscanf(body+2, "%llu:%d:", &intended, &step) != 2 || step < 0 || step >= numsteps) {
+		return;
+	}
+	thread->delivered[step]++;
+	thread->latency[step][bucket_of(now > intended ? now - intended : 0)]++;
+}
+
+
+
+
+static void close_conn(threadinfo *thread, conninfo *conn)
+{
+	int state = conn->state;
+
+	if (state == CONNECTING) {
+		thread->connecting--;
+	}
+	close(conn->socket);
+	conn->state = CLOSED;
+	if (state == CONNECTING || state == JOINING) { /* it settled as closed */
+		__atomic_store_n(&thread->settled, thread->settled+1, __ATOMIC_RELEASE);
+	}
+	else if (state == JOINED) { /* dropped by the server - stop sending on it */
+		int s;
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		for (s=0; s<thread->numsenders; s++) {
+			if (&conns[thread->senders[s]] == conn) {
+				thread->senders[s] = thread->senders[--thread->numsenders];
+				break;
+			}
+		}
+	}
+}
+
+
+
+
+/*
+ * Write every chat whose intended send time has come. The intended time of
+ * chat next of a step is fixed by the schedule, so a sender that falls
+ * behind catches up with chats stamped with the times they should have
+ * gone out at. Returns when the next chat is due, 0 if there are no more
+ * or the socket is backed up.
+ */
+static unsigned long long send_due(threadinfo *thread, conninfo *conn, unsigned long long now)
+{
+	char body[CHATSIZE+1];
+	unsigned long long next = 0;
+
+	while (conn->step < numsteps) {
+		double target = rate + conn->step*stepinc;
+		double interval = 1e9 * totalsenders / target; /* nanoseconds between this sender's chats */
+		unsigned long long stepbegin = runstart + conn->step*stepnanos;
+		unsigned long long intended = stepbegin + (unsigned long long) (interval * conn->sender / totalsenders + interval * conn->next);
+		int length;
+		if (intended >= stepbegin + stepnanos) {
+			conn->step++;
+			conn->next = 0;
+			continue;
+		}
+		if (intended > now) {
+			next = intended;
+			break;
+		}
+		if (OUTSIZE - conn->outlen < CHATSIZE + NAMESIZE + 16) { /* the socket is backed up - wait for it */
+			break;
+		}
+		length = snprintf(body, sizeof(body), "%llu:%d:", intended, conn->step);
+		memset(body+length, 'x', size-length);
+		body[size] = '\0';
+		conn->outlen += snprintf(conn->out+conn->outlen, OUTSIZE-conn->outlen, "(cchat(%s)(%s))", conn->target, body);
+		thread->sent[conn->step]++;
+		thread->lag[conn->step][bucket_of(now - intended)]++;
+		conn->next++;
+	}
+	if (conn->outlen > 0) {
+		flush_out(thread, conn);
+	}
+	return next;
+}
+
+
+
+
+/* Write as much pending output as the socket takes, watching for writability while any is left. Returns -1 if the connection closed. */
+static int flush_out(threadinfo *thread, conninfo *conn)
+{
+	struct epoll_event event;
+	int nbytes, waiting = conn->outlen;
+
+	nbytes = write(conn->socket, conn->out, conn->outlen);
+	if (nbytes < 0 && errno != EAGAIN) {
+		close_conn(thread, conn);
+		return -1;
+	}
+	if (nbytes > 0) {
+		memmove(conn->out, conn->out+nbytes, conn->outlen-nbytes);
+		conn->outlen -= nbytes;
+	}
+	if ((waiting > 0) != (conn->outlen > 0) || nbytes < 0) { /* started or stopped waiting on the socket */
+		event.events = conn->outlen > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.u32 = (unsigned int) (conn - conns);
+		epoll_ctl(thread->epollfd, EPOLL_CTL_MOD, conn->socket, &event);
+	}
+	return 0;
+}
+
+
+
+
+/* Bucket for a value: exact below 2^SUBBITS, then 2^SUBBITS buckets to each octave. */
+static int bucket_of(unsigned long long nanos)
+{
+	int octave;
+
+	if (nanos < (1ULL << SUBBITS)) {
+		return (int) nanos;
+	}
+	octave = 63 - __builtin_clzll(nanos);
+	return (octave-SUBBITS+1) * (1 << SUBBITS) + (int) ((nanos >> (octave-SUBBITS)) & ((1 << SUBBITS) - 1));
+}
+
+
+
+
+/* Largest value that falls in a bucket. */
+static unsigned long long bucket_top(int bucket)
+{
+	int octave, sub;
+
+	if (bucket < (1 << SUBBITS)) {
+		return (unsigned long long) bucket;
+	}
+	octave = bucket / (1 << SUBBITS) + SUBBITS - 1;
+	sub = bucket % (1 << SUBBITS);
+	return ((unsigned long long) ((1 << SUBBITS) + sub + 1) << (octave-SUBBITS)) - 1;
+}
+
+
+
+
+/* Value, in nanoseconds, at a fraction of the values counted in a histogram. */
+static double percentile(unsigned long long *hist, double fraction)
+{
+	unsigned long long total = 0, seen = 0, rank;
+	int b;
+
+	for (b=0; b<HISTBUCKETS; b++) {
+		total += hist[b];
+	}
+	if (total == 0) {
+		return 0.0;
+	}
+	rank = (unsigned long long) (fraction * total + 0.999999);
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (b=0; b<HISTBUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank) {
+			return (double) bucket_top(b);
+		}
+	}
+	return (double) bucket_top(HISTBUCKETS-1);
+}
+
+
+
+
+/* Step under way at a time, -1 before the run and numsteps after it. */
+static int current_step(unsigned long long now)
+{
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE) == 0 || now < runstart) {
+		return -1;
+	}
+	if (now >= runstart + numsteps*stepnanos) {
+		return numsteps;
+	}
+	return (int) ((now - runstart) / stepnanos);
+}
+
+
+
+
+static unsigned long long now_nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
@@ -0,0 +1,378 @@
+/* logger.c - leveled asynchronous logging: per-thread rings of binary records drained by a background thread */
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "logger.h"
+
+#define LOGMAXARGS 8 /* most arguments a record holds - later ones are written as their conversion */
+#define LOGTEXTSIZE 152 /* bytes a record holds for copies of its string arguments */
+#define LOGRINGSIZE 4096 /* records in each thread's ring - a power of two */
+#define LOGMAXRINGS 64 /* most threads that can log */
+#define LOGOUTSIZE 65536 /* bytes formatted before each write */
+#define LOGIDLEUS 2000 /* microseconds the flusher sleeps when the rings are empty */
+
+typedef union {
+        long long i; /* %d %i %u %x %X %o %c, whatever their length modifier */
+        double d; /* %f %e %g */
+        void *p; /* %p */
+        int s; /* %s - offset of the copy in the record's text */
+    } logarg;
+
+typedef struct {
+        struct timeval time; /* when log_write() was called */
+        const char *format;
+        int level;
+        int numargs; /* number of entries in args */
+        logarg args[LOGMAXARGS];
+        char text[LOGTEXTSIZE]; /* copies of the string arguments, each NUL-terminated */
+    } logrecord;
+
+typedef struct {
+        logrecord records[LOGRINGSIZE];
+        unsigned long head; /* records written - stored only by the thread owning the ring */
+        unsigned long tail; /* records formatted - stored only by the flusher */
+        unsigned long dropped; /* records dropped because the ring was full - stored only by the owner */
+        unsigned long dropsreported; /* dropped when it was last reported - flusher only */
+    } logring;
+
+int loglevel = LOGLEVEL; /* most detailed level written */
+logring *logrings[LOGMAXRINGS]; /* every thread's ring, in the order the threads first logged */
+int lognumrings = 0; /* number of entries in logrings */
+pthread_mutex_t logringlock = PTHREAD_MUTEX_INITIALIZER; /* held while a ring is added */
+pthread_mutex_t logdrainlock = PTHREAD_MUTEX_INITIALIZER; /* held while the rings are drained */
+char logout[LOGOUTSIZE]; /* formatted records waiting to be written - drainer only */
+int logoutlen = 0;
+const char *levelnames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static __thread logring *myring = NULL; /* this thread's ring, NULL until it first logs */
+
+/* helper functions */
+static logring *add_ring();
+static const char *next_conversion(const char *pos, const char **specstart, char *kind);
+static void *flush_logs(void *arg);
+static int  drain_rings();
+static void format_record(logrecord *record);
+static void write_out();
+
+
+
+
+/* Set the level and start the flusher. Call before logging from any thread. */
+void log_start(int level)
+{
+    pthread_t thread;
+
+    loglevel = level;
+    if (pthread_create(&thread, NULL, flush_logs, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+    atexit(log_flush);
+}
+
+
+
+
+/* Store a record in the calling thread's ring. Never blocks and never formats. */
+void log_write(int level, const char *format, ...)
+{
+    logring *ring = myring;
+    logrecord *record;
+    unsigned long head;
+    const char *pos, *specstart;
+    char kind;
+    int textused = 0;
+    va_list ap;
+
+    if (level > loglevel) {
+        return;
+    }
+    if (ring == NULL) { /* first record from this thread */
+        ring = myring = add_ring();
+        if (ring == NULL) {
+            return;
+        }
+    }
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOGRINGSIZE) { /* full - drop it */
+        __atomic_store_n(&ring->dropped, ring->dropped+1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    record = &ring->records[head & (LOGRINGSIZE-1)];
+    gettimeofday(&record->time, NULL);
+    record->format = format;
+    record->level = level;
+    record->numargs = 0;
+    va_start(ap, format);
+    pos = format;
+    while (record->numargs < LOGMAXARGS && (pos = next_conversion(pos, &specstart, &kind)) != NULL) {
+        logarg *arg = &record->args[record->numargs++];
+        if (kind == 'I') {
+            arg->i = va_arg(ap, int);
+        }
+        else if (kind == 'L') {
+            arg->i = va_arg(ap, long);
+        }
+        else if (kind == 'Q') {
+            arg->i = va_arg(ap, long long);
+        }
+        else if (kind == 'Z') {
+            arg->i = (long long) va_arg(ap, size_t);
+        }
+        else if (kind == 'D') {
+            arg->d = va_arg(ap, double);
+        }
+        else if (kind == 'P') {
+            arg->p = va_arg(ap, void *);
+        }
+        else { /* 'S' - copy as much of the string as fits */
+            const char *string = va_arg(ap, const char *);
+            int room = LOGTEXTSIZE - textused - 1;
+            int length = 0;
+            if (string == NULL) {
+                string = "(null)";
+            }
+            while (length < room && string[length] != '\0') {
+                length++;
+            }
+            memcpy(record->text+textused, string, length);
+            record->text[textused+length] = '\0';
+            arg->s = textused;
+            textused += length + (textused+length < LOGTEXTSIZE-1 ? 1 : 0); /* a full text area leaves later strings empty */
+        }
+    }
+    va_end(ap);
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+
+
+
+/* Write out every record logged so far. Run at exit, and safe to call from any thread at any time. */
+void log_flush()
+{
+    while (drain_rings() > 0) {
+    }
+}
+
+
+
+
+/* Give the calling thread a ring. Returns NULL if there are too many threads. */
+static logring *add_ring()
+{
+    logring *ring = NULL;
+
+    pthread_mutex_lock(&logringlock);
+    if (lognumrings < LOGMAXRINGS) {
+        ring = calloc(1, sizeof(logring));
+        if (ring != NULL) {
+            logrings[lognumrings] = ring;
+            __atomic_store_n(&lognumrings, lognumrings+1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&logringlock);
+    return ring;
+}
+
+
+
+
+/* Find the next conversion at or after pos. Returns the character after it, NULL if there is none.
+   Sets specstart to its '%' and kind to how its argument is passed: I int, L long, Q long long,
+   Z size_t, D double, P pointer, S string. */
+static const char *next_conversion(const char *pos, const char **specstart, char *kind)
+{
+    int longs;
+
+    while (*pos != '\0') {
+        if (*pos != '%') {
+            pos++;
+            continue;
+        }
+        *specstart = pos++;
+        if (*pos == '%') { /* literal percent */
+            pos++;
+            continue;
+        }
+        while (*pos != '\0' && strchr("-+ #0123456789.", *pos) != NULL) {
+            pos++;
+        }
+        longs = 0;
+        *kind = 'I';
+        while (*pos == 'h' || *pos == 'l' || *pos == 'z') {
+            if (*pos == 'l') {
+                longs++;
+            }
+            else if (*pos == 'z') {
+                *kind = 'Z';
+            }
+            pos++;
+        }
+        if (*pos == '\0') {
+            return NULL;
+        }
+        if (strchr("diuxXoc", *pos) != NULL) {
+            if (longs == 1) {
+                *kind = 'L';
+            }
+            else if (longs > 1) {
+                *kind = 'Q';
+            }
+        }
+        else if (strchr("feEgG", *pos) != NULL) {
+            *kind = 'D';
+        }
+        else if (*pos == 'p') {
+            *kind = 'P';
+        }
+        else if (*pos == 's') {
+            *kind = 'S';
+        }
+        else { /* not something log_write() can store - leave the rest of the format as text */
+            return NULL;
+        }
+        return pos+1;
+    }
+    return NULL;
+}
+
+
+
+
+/* Flusher thread body - drain the rings, and sleep a little whenever they are empty. */
+static void *flush_logs(void *arg)
+{
+    while (1) {
+        if (drain_rings() == 0) {
+            usleep(LOGIDLEUS);
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/* Format and write the records in every ring. Returns the number of records written. */
+static int drain_rings()
+{
+    int r, numrings, count = 0;
+    unsigned long head, dropped;
+    logring *ring;
+
+    pthread_mutex_lock(&logdrainlock);
+    numrings = __atomic_load_n(&lognumrings, __ATOMIC_ACQUIRE);
+    for (r=0; r<numrings; r++) {
+        ring = logrings[r];
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (ring->tail != head) {
+            format_record(&ring->records[ring->tail & (LOGRINGSIZE-1)]);
+            __atomic_store_n(&ring->tail, ring->tail+1, __ATOMIC_RELEASE);
+            count++;
+        }
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropsreported) {
+            if (LOGOUTSIZE - logoutlen < 256) {
+                write_out();
+            }
+            logoutlen += snprintf(logout+logoutlen, LOGOUTSIZE-logoutlen, "WARN %lu log records dropped - ring %d was full\n", dropped - ring->dropsreported, r);
+            ring->dropsreported = dropped;
+        }
+    }
+    write_out();
+    pthread_mutex_unlock(&logdrainlock);
+    return count;
+}
+
+
+
+
+/* Append a record to logout as text: time, level, then the message and a newline. */
+static void format_record(logrecord *record)
+{
+    const char *pos = record->format, *next, *specstart;
+    char spec[32];
+    char kind;
+    int n = 0, room, length;
+
+    if (LOGOUTSIZE - logoutlen < 1024) {
+        write_out();
+    }
+    logoutlen += snprintf(logout+logoutlen, LOGOUTSIZE-logoutlen, "%ld.%06ld %s ", (long) record->time.tv_sec, (long) record->time.tv_usec, levelnames[record->level]);
+    while (1) {
+        next = n < record->numargs ? next_conversion(pos, &specstart, &kind) : NULL;
+        if (next == NULL) { /* copy the rest as text, undoubling any %% */
+            while (*pos != '\0' && logoutlen < LOGOUTSIZE-1) {
+                if (*pos == '%' && *(pos+1) == '%') {
+                    pos++;
+                }
+                logout[logoutlen++] = *pos++;
+            }
+            break;
+        }
+        while (pos < specstart && logoutlen < LOGOUTSIZE-1) { /* text before the conversion */
+            if (*pos == '%' && *(pos+1) == '%') {
+                pos++;
+            }
+            logout[logoutlen++] = *pos++;
+        }
+        length = next - specstart;
+        if (length >= (int) sizeof(spec)) {
+            length = sizeof(spec) - 1;
+        }
+        memcpy(spec, specstart, length);
+        spec[length] = '\0';
+        room = LOGOUTSIZE - logoutlen - 1;
+        if (kind == 'I') {
+            length = snprintf(logout+logoutlen, room, spec, (int) record->args[n].i);
+        }
+        else if (kind == 'L') {
+            length = snprintf(logout+logoutlen, room, spec, (long) record->args[n].i);
+        }
+        else if (kind == 'Q') {
+            length = snprintf(logout+logoutlen, room, spec, record->args[n].i);
+        }
+        else if (kind == 'Z') {
+            length = snprintf(logout+logoutlen, room, spec, (size_t) record->args[n].i);
+        }
+        else if (kind == 'D') {
+            length = snprintf(logout+logoutlen, room, spec, record->args[n].d);
+        }
+        else if (kind == 'P') {
+            length = snprintf(logout+logoutlen, room, spec, record->args[n].p);
+        }
+        else {
+            length = snprintf(logout+logoutlen, room, spec, record->text + record->args[n].s);
+        }
+        if (length > 0) {
+            logoutlen += length < room ? length : room - 1;
+        }
+        pos = next;
+        n++;
+    }
+    logout[logoutlen++] = '\n';
+}
+
+
+
+
+/* Write logout to stderr and empty it. */
+static void write_out()
+{
+    int sent = 0, result;
+
+    while (sent < logoutlen) {
+        result = write(2, logout+sent, logoutlen-sent);
+        if (result <= 0) {
+            break;
+        }
+        sent += result;
+    }
+    logoutlen = 0;
+}
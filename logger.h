@@ -0,0 +1,54 @@
+/* logger.h - leveled asynchronous logging for the servers, written to stderr by a background thread */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*------------------------------------------------------------------------
+* Module: logger
+*
+* Purpose: take logging off the servers' hot paths. A call to log_error(),
+* log_warn(), log_info() or log_debug() does no formatting and no I/O:
+* (1) the format string is walked to find its arguments
+* (2) the arguments are stored, strings copied, in a fixed-size binary
+*     record in the calling thread's ring - each thread has its own ring,
+*     so a thread never waits on another
+* (3) a background thread drains the rings every few milliseconds, formats
+*     the records and writes them to stderr in batches
+* If a ring is full the record is dropped, and the number dropped is logged
+* once there is room. Records still in the rings are written at exit().
+*
+* Format strings must be string literals, as records keep a pointer to
+* them. They take %d %i %u %x %X %o %c %s %f %e %g %p with the flags, width,
+* precision and h/l/ll/z length modifiers printf takes, but not '*'. Strings
+* longer than a record holds are truncated. A newline is added to every
+* record.
+*
+* Records below LOGLEVEL are not written. log_debug() compiles to nothing,
+* and its arguments are not evaluated, unless built with -DLOGDEBUG, which
+* also makes LOGLEVEL LOG_DEBUG.
+*
+* Build: compile logger.c with the program using it and link -lpthread.
+*
+*------------------------------------------------------------------------
+*/
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifdef LOGDEBUG
+#define LOGLEVEL LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOGLEVEL LOG_INFO
+#define log_debug(...) ((void) 0)
+#endif
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+void log_start(int level);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_flush();
+
+#endif
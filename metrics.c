@@ -0,0 +1,393 @@
+/* metrics.c - registry of counters, gauges and histograms, and the stats port that serves them */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "logger.h"
+
+#define MAXMETRICS 64 /* most metrics a server can register */
+#define MAXSTATSCONNS 8 /* most scrapers served at once - the oldest is dropped to make room */
+#define STATSREQSIZE 2048 /* bytes of a request read before answering anyway */
+#define STATSOUTSIZE 65536 /* most bytes in a response */
+
+typedef struct {
+        char type; /* 'c' counter, 'g' gauge, 'h' histogram */
+        const char *name;
+        const char *labels; /* "" for none */
+        const char *help;
+        void *value; /* the server's counter, gauge or histogram */
+    } metricinfo;
+
+typedef struct {
+        int socket; /* -1 if the slot is free */
+        int reading; /* 1 until the request has been read, then 0 while the response is written */
+        int reqlen; /* bytes of request read */
+        char request[STATSREQSIZE];
+        int outlen; /* bytes of response */
+        int sent; /* bytes of response written */
+        char out[STATSOUTSIZE];
+        unsigned long long opened; /* when the connection was accepted, for picking the oldest */
+    } statsconn;
+
+metricinfo metrics[MAXMETRICS];
+int nummetrics = 0;
+int statslistensocket = -1;
+statsconn statsconns[MAXSTATSCONNS];
+char statsbody[STATSOUTSIZE]; /* response body, rendered before it is copied behind the header */
+
+/* helper functions */
+static void add_metric(char type, const char *name, const char *labels, const char *help, void *value);
+static void accept_scraper();
+static void read_request(statsconn *conn);
+static void write_response(statsconn *conn);
+static void close_scraper(statsconn *conn);
+static int  render_metrics(char *out, int size);
+static int  bucket_of(unsigned long long micros);
+static unsigned long long bucket_top(int bucket);
+
+
+
+
+void add_counter(const char *name, const char *labels, const char *help, unsigned long long *counter)
+{
+    add_metric('c', name, labels, help, counter);
+}
+
+
+
+
+void add_gauge(const char *name, const char *labels, const char *help, int *gauge)
+{
+    add_metric('g', name, labels, help, gauge);
+}
+
+
+
+
+void add_histogram(const char *name, const char *labels, const char *help, histogram *hist)
+{
+    add_metric('h', name, labels, help, hist);
+}
+
+
+
+
+/* Count a value, in microseconds, in its bucket. */
+void record_value(histogram *hist, unsigned long long micros)
+{
+    __atomic_fetch_add(&hist->counts[bucket_of(micros)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, micros, __ATOMIC_RELAXED);
+}
+
+
+
+
+/* Microseconds on a clock that never jumps, for timing things. */
+unsigned long long now_micros()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000ULL + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+
+
+
+/* Listen for scrapers on port, on the loopback interface only. Returns the listening socket. */
+int open_stats_port(int port)
+{
+    struct sockaddr_in sad;
+    int flag = 1, i;
+
+    for (i=0; i<MAXSTATSCONNS; i++) {
+        statsconns[i].socket = -1;
+    }
+    statslistensocket = socket(PF_INET, SOCK_STREAM, 0);
+    if (statslistensocket < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (setsockopt(statslistensocket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int)) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+    memset((char *)&sad, 0, sizeof(sad));
+    sad.sin_family = AF_INET;
+    sad.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sad.sin_port = htons((u_short)port);
+    if (bind(statslistensocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(statslistensocket, MAXSTATSCONNS) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    fcntl(statslistensocket, F_SETFL, O_NONBLOCK);
+    log_info("Stats: serving metrics on 127.0.0.1:%d", port);
+    return statslistensocket;
+}
+
+
+
+
+/* Add the stats port and the scrapers to the sets passed to select(). */
+void set_stats_fds(fd_set *readset, fd_set *writeset)
+{
+    int i;
+
+    if (statslistensocket < 0) {
+        return;
+    }
+    FD_SET(statslistensocket, readset);
+    for (i=0; i<MAXSTATSCONNS; i++) {
+        if (statsconns[i].socket >= 0) {
+            FD_SET(statsconns[i].socket, statsconns[i].reading != 0 ? readset : writeset);
+        }
+    }
+}
+
+
+
+
+/* Serve whatever select() found ready, and take the stats fds out of readset so the caller only sees its own. */
+void serve_stats(fd_set *readset, fd_set *writeset)
+{
+    int i;
+
+    if (statslistensocket < 0) {
+        return;
+    }
+    for (i=0; i<MAXSTATSCONNS; i++) {
+        statsconn *conn = &statsconns[i];
+        if (conn->socket < 0) {
+            continue;
+        }
+        if (conn->reading != 0 && FD_ISSET(conn->socket, readset)) {
+            FD_CLR(conn->socket, readset);
+            read_request(conn);
+        }
+        else if (conn->reading == 0 && FD_ISSET(conn->socket, writeset)) {
+            FD_CLR(conn->socket, writeset);
+            write_response(conn);
+        }
+    }
+    if (FD_ISSET(statslistensocket, readset)) {
+        FD_CLR(statslistensocket, readset);
+        accept_scraper();
+    }
+}
+
+
+
+
+/* Stop serving - close the stats port and every scraper - so that another process can open it. */
+void close_stats_port()
+{
+    int i;
+
+    if (statslistensocket < 0) {
+        return;
+    }
+    for (i=0; i<MAXSTATSCONNS; i++) {
+        if (statsconns[i].socket >= 0) {
+            close_scraper(&statsconns[i]);
+        }
+    }
+    close(statslistensocket);
+    statslistensocket = -1;
+}
+
+
+
+
+static void add_metric(char type, const char *name, const char *labels, const char *help, void *value)
+{
+    if (nummetrics >= MAXMETRICS) {
+        log_error("too many metrics - %s not registered", name);
+        return;
+    }
+    metrics[nummetrics].type = type;
+    metrics[nummetrics].name = name;
+    metrics[nummetrics].labels = labels;
+    metrics[nummetrics].help = help;
+    metrics[nummetrics].value = value;
+    nummetrics++;
+}
+
+
+
+
+/* Accept a scraper into a free slot, dropping the oldest scraper if there is none. */
+static void accept_scraper()
+{
+    int socket, i, slot = -1;
+
+    socket = accept(statslistensocket, NULL, NULL);
+    if (socket < 0) {
+        return;
+    }
+    if (socket >= FD_SETSIZE) { /* select() cannot watch it */
+        close(socket);
+        return;
+    }
+    for (i=0; i<MAXSTATSCONNS; i++) {
+        if (statsconns[i].socket < 0) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 || statsconns[i].opened < statsconns[slot].opened) {
+            slot = i;
+        }
+    }
+    if (statsconns[slot].socket >= 0) {
+        close_scraper(&statsconns[slot]);
+    }
+    fcntl(socket, F_SETFL, O_NONBLOCK);
+    statsconns[slot].socket = socket;
+    statsconns[slot].reading = 1;
+    statsconns[slot].reqlen = 0;
+    statsconns[slot].outlen = 0;
+    statsconns[slot].sent = 0;
+    statsconns[slot].opened = now_micros();
+}
+
+
+
+
+/* Read the request until its blank line, then render the response. Every request gets the metrics, whatever its path. */
+static void read_request(statsconn *conn)
+{
+    int nbytes, bodylen;
+
+    nbytes = recv(conn->socket, conn->request+conn->reqlen, STATSREQSIZE-1-conn->reqlen, MSG_DONTWAIT);
+    if (nbytes <= 0) {
+        close_scraper(conn);
+        return;
+    }
+    conn->reqlen += nbytes;
+    conn->request[conn->reqlen] = '\0';
+    if (strstr(conn->request, "\r\n\r\n") == NULL && strstr(conn->request, "\n\n") == NULL && conn->reqlen < STATSREQSIZE-1) {
+        return; /* wait for the rest */
+    }
+    bodylen = render_metrics(statsbody, STATSOUTSIZE-256);
+    conn->outlen = snprintf(conn->out, 256, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", bodylen);
+    memcpy(conn->out+conn->outlen, statsbody, bodylen);
+    conn->outlen += bodylen;
+    conn->sent = 0;
+    conn->reading = 0;
+    write_response(conn);
+}
+
+
+
+
+/* Write as much of the response as the socket takes, and close once it is all sent. */
+static void write_response(statsconn *conn)
+{
+    int nbytes;
+
+    nbytes = send(conn->socket, conn->out+conn->sent, conn->outlen-conn->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (nbytes < 0) {
+        close_scraper(conn);
+        return;
+    }
+    conn->sent += nbytes;
+    if (conn->sent >= conn->outlen) {
+        close_scraper(conn);
+    }
+}
+
+
+
+
+static void close_scraper(statsconn *conn)
+{
+    close(conn->socket);
+    conn->socket = -1;
+}
+
+
+
+
+/* Write every metric in the text format. Returns the number of bytes written. */
+static int render_metrics(char *out, int size)
+{
+    int m, b, len = 0;
+    const char *lastname = "";
+    const char *types[] = {"counter", "gauge", "histogram"};
+
+    for (m=0; m<nummetrics && len<size-512; m++) {
+        metricinfo *metric = &metrics[m];
+        const char *comma = metric->labels[0] != '\0' ? "," : "";
+        const char *lbrace = metric->labels[0] != '\0' ? "{" : "";
+        const char *rbrace = metric->labels[0] != '\0' ? "}" : "";
+        if (strcmp(metric->name, lastname) != 0) {
+            len += snprintf(out+len, size-len, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help, metric->name, types[metric->type == 'c' ? 0 : metric->type == 'g' ? 1 : 2]);
+            lastname = metric->name;
+        }
+        if (metric->type == 'c') {
+            len += snprintf(out+len, size-len, "%s%s%s%s %llu\n", metric->name, lbrace, metric->labels, rbrace, __atomic_load_n((unsigned long long *)metric->value, __ATOMIC_RELAXED));
+        }
+        else if (metric->type == 'g') {
+            len += snprintf(out+len, size-len, "%s%s%s%s %d\n", metric->name, lbrace, metric->labels, rbrace, *(int *)metric->value);
+        }
+        else {
+            histogram *hist = metric->value;
+            unsigned long long total = 0;
+            for (b=0; b<HISTBUCKETS && len<size-256; b++) {
+                total += __atomic_load_n(&hist->counts[b], __ATOMIC_RELAXED);
+                len += snprintf(out+len, size-len, "%s_bucket{%s%sle=\"%.6f\"} %llu\n", metric->name, metric->labels, comma, bucket_top(b) / 1000000.0, total);
+            }
+            total += __atomic_load_n(&hist->counts[HISTBUCKETS], __ATOMIC_RELAXED);
+            len += snprintf(out+len, size-len, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", metric->name, metric->labels, comma, total);
+            len += snprintf(out+len, size-len, "%s_sum%s%s%s %.6f\n", metric->name, lbrace, metric->labels, rbrace, __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1000000.0);
+            len += snprintf(out+len, size-len, "%s_count%s%s%s %llu\n", metric->name, lbrace, metric->labels, rbrace, total);
+        }
+        if (len > size) {
+            len = size;
+        }
+    }
+    return len;
+}
+
+
+
+
+/* Bucket for a value: 0 and 1 us have their own, then each octave [2^e, 2^(e+1)) is split in two halves. */
+static int bucket_of(unsigned long long micros)
+{
+    int octave;
+
+    if (micros < 2) {
+        return (int) micros;
+    }
+    octave = 63 - __builtin_clzll(micros);
+    if (octave >= HISTOCTAVES) {
+        return HISTBUCKETS; /* overflow */
+    }
+    return 2 + (octave-1)*2 + (int) ((micros >> (octave-1)) & 1);
+}
+
+
+
+
+/* Largest value, in microseconds, that falls in a bucket. */
+static unsigned long long bucket_top(int bucket)
+{
+    int octave;
+
+    if (bucket < 2) {
+        return (unsigned long long) bucket;
+    }
+    octave = (bucket-2)/2 + 1;
+    return ((3ULL + (unsigned long long) ((bucket-2)%2)) << (octave-1)) - 1;
+}
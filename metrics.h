@@ -0,0 +1,61 @@
+/* metrics.h - counters, gauges and latency histograms for the servers, served as Prometheus text on a local stats port */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <sys/select.h>
+
+/*------------------------------------------------------------------------
+* Module: metrics
+*
+* Purpose: let the servers count what they do and time how long it takes,
+* and serve the numbers to a Prometheus scraper without blocking their
+* event loops:
+* (1) at startup the server registers its counters, gauges and histograms
+*     by address with add_counter(), add_gauge() and add_histogram(), and
+*     opens the stats port with open_stats_port()
+* (2) on the hot path it bumps counters with count_event() and records
+*     latencies with record_value() - both single atomic adds, no locks
+* (3) around select() it calls set_stats_fds() and serve_stats(), which
+*     accept scrapers, read their requests and write the text format
+*     (version 0.0.4) back a piece at a time as their sockets allow
+* (4) a server handing over to a replacement calls close_stats_port() so
+*     the replacement can open the port
+*
+* Gauges are ints the server already keeps, read when a scraper asks.
+* Histograms are HDR-style: values in microseconds fall into buckets two
+* to an octave, so every bucket is within 50% of its values, from 1 us to
+* about 4.5 minutes. They are served in seconds.
+*
+* Metrics registered with the same name one after another share HELP and
+* TYPE lines and are told apart by their labels, e.g. phase="plan".
+*
+* Build: compile metrics.c with the program using it.
+*
+*------------------------------------------------------------------------
+*/
+
+#define HISTOCTAVES 28 /* octaves of microseconds covered by a histogram */
+#define HISTBUCKETS (2*HISTOCTAVES) /* buckets, plus an overflow bucket after them */
+
+typedef struct {
+        unsigned long long counts[HISTBUCKETS+1]; /* values in each bucket, overflow last */
+        unsigned long long sum; /* total of all values, in microseconds */
+    } histogram;
+
+/* Add one to a counter. */
+static inline void count_event(unsigned long long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+void add_counter(const char *name, const char *labels, const char *help, unsigned long long *counter);
+void add_gauge(const char *name, const char *labels, const char *help, int *gauge);
+void add_histogram(const char *name, const char *labels, const char *help, histogram *hist);
+void record_value(histogram *hist, unsigned long long micros);
+unsigned long long now_micros();
+int  open_stats_port(int port);
+void set_stats_fds(fd_set *readset, fd_set *writeset);
+void serve_stats(fd_set *readset, fd_set *writeset);
+void close_stats_port();
+
+#endif
@@ -0,0 +1,229 @@
+/* rosterbench.c - benchmark of the servers' roster scans with the old clientinfo layout and the bitset layout */
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NAMESIZE 12 /* length of maximum allowable name */
+#define SETWORDS(n) (((n)+63)/64)
+
+/*------------------------------------------------------------------------
+* Program: rosterbench
+*
+* Purpose: time the loops the servers run over every client, with clients
+* laid out the way clientinfo used to be and the way it is now:
+* (1) broadcast - visit every joined client and pick up its socket
+* (2) lookup - find a joined client by name
+* Old layout: one record per client holding the used/joined/sent flags, the
+* socket and counters, with the name behind a separate malloc. New layout:
+* used and joined kept as bitsets walked a word at a time, and the name
+* inline in the record. The work done per visited client is the same, so
+* the difference is the cost of the scan itself.
+*
+* Build: gcc -O2 -o rosterbench rosterbench.c
+*
+* Syntax: rosterbench [-n clients] [-j percent] [-r repeats]
+*
+* clients       number of client slots
+* percent       percentage of slots holding a joined client
+* repeats       number of times each loop is run
+*
+* All arguments are optional. The default values are as follows:
+*   clients = 10000
+*   percent = 50
+*   repeats = 2000
+*
+*------------------------------------------------------------------------
+*/
+
+typedef struct { /* clientinfo as it was */
+		int used;
+		int joined;
+		int playing;
+		int fighting;
+		int sent;
+		int offersent;
+		char *name;
+		int socket;
+		char *clibuf;
+		int charcount;
+		int strikes;
+		int resync;
+		int troops;
+		int plangiven;
+		int offers;
+	} oldclientinfo;
+
+typedef struct { /* clientinfo as it is */
+		char name[NAMESIZE+1];
+		int socket;
+		int charcount;
+		int strikes;
+		int resync;
+		char *clibuf;
+	} newclientinfo;
+
+oldclientinfo *oldarray;
+newclientinfo *newarray;
+unsigned long long *usedset, *joinedset;
+int numclients = 10000;
+
+typedef struct {
+		unsigned long long *set;
+		int word; /* word of set being walked */
+		unsigned long long bits; /* bits of that word not yet visited */
+	} setwalk;
+
+static inline int first_in_set(setwalk *walk, unsigned long long *set);
+static inline int next_in_walk(setwalk *walk);
+static double now_secs();
+
+
+
+
+int main(int argc, char **argv)
+{
+	int percent = 50, repeats = 2000;
+	int i, r, found;
+	long long checksum = 0;
+	double start, oldbroadcast, newbroadcast, oldlookup, newlookup;
+	char target[NAMESIZE+1];
+	setwalk walk;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-n") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numclients);
+		}
+		else if (strcmp(argv[i], "-j") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &percent);
+		}
+		else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &repeats);
+		}
+	}
+	if (numclients < 1) {
+		numclients = 10000;
+	}
+
+	/* Fill both layouts with the same clients. Names are allocated in a shuffled order so the old layout's name pointers are scattered as they would be after clients come and go. */
+	oldarray = calloc(numclients, sizeof(oldclientinfo));
+	newarray = calloc(numclients, sizeof(newclientinfo));
+	usedset = calloc(SETWORDS(numclients), sizeof(unsigned long long));
+	joinedset = calloc(SETWORDS(numclients), sizeof(unsigned long long));
+	int *order = malloc(numclients*sizeof(int));
+	for (i=0; i<numclients; i++) {
+		order[i] = i;
+	}
+	srand(1);
+	for (i=numclients-1; i>0; i--) {
+		int j = rand() % (i+1), t = order[i];
+		order[i] = order[j]; order[j] = t;
+	}
+	for (i=0; i<numclients; i++) {
+		int c = order[i];
+		oldarray[c].name = malloc((NAMESIZE+1)*sizeof(char));
+		oldarray[c].clibuf = malloc(610);
+		newarray[c].clibuf = oldarray[c].clibuf;
+		snprintf(oldarray[c].name, NAMESIZE+1, "U%d", c);
+		snprintf(newarray[c].name, NAMESIZE+1, "U%d", c);
+		oldarray[c].socket = newarray[c].socket = c + 4;
+		if (rand() % 100 < percent) {
+			oldarray[c].used = oldarray[c].joined = 1;
+			usedset[c>>6] |= 1ULL << (c&63);
+			joinedset[c>>6] |= 1ULL << (c&63);
+		}
+	}
+	for (i=numclients-1; i>=0 && oldarray[i].joined == 0; i--) {
+	}
+	snprintf(target, sizeof(target), "U%d", i < 0 ? 0 : i); /* the last joined client - the worst case for a lookup */
+
+	/* Broadcast: visit every joined client. */
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		for (i=0; i<numclients; i++) {
+			if (oldarray[i].joined != 0) {
+				checksum += oldarray[i].socket;
+			}
+		}
+	}
+	oldbroadcast = now_secs() - start;
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		for (i=first_in_set(&walk, joinedset); i<numclients; i=next_in_walk(&walk)) {
+			checksum -= newarray[i].socket;
+		}
+	}
+	newbroadcast = now_secs() - start;
+
+	/* Lookup: find a joined client by name. */
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		for (found=0; found<numclients; found++) {
+			if (oldarray[found].joined != 0 && strcmp(oldarray[found].name, target) == 0) {
+				break;
+			}
+		}
+		checksum += found;
+	}
+	oldlookup = now_secs() - start;
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		for (found=first_in_set(&walk, joinedset); found<numclients; found=next_in_walk(&walk)) {
+			if (strcmp(newarray[found].name, target) == 0) {
+				break;
+			}
+		}
+		checksum -= found;
+	}
+	newlookup = now_secs() - start;
+
+	printf("%d clients, %d%% joined, %d repeats, record size %d -> %d bytes\n", numclients, percent, repeats, (int)sizeof(oldclientinfo), (int)sizeof(newclientinfo));
+	printf("broadcast  old %8.2f us  new %8.2f us  per pass (%.2fx)\n", oldbroadcast*1e6/repeats, newbroadcast*1e6/repeats, newbroadcast > 0 ? oldbroadcast/newbroadcast : 0.0);
+	printf("lookup     old %8.2f us  new %8.2f us  per pass (%.2fx)\n", oldlookup*1e6/repeats, newlookup*1e6/repeats, newlookup > 0 ? oldlookup/newlookup : 0.0);
+	if (checksum != 0) { /* both layouts must have visited the same clients */
+		fprintf(stderr, "Error: layouts disagree (%lld)\n", checksum);
+		exit(1);
+	}
+	exit(0);
+}
+
+
+
+
+/* Start walking set and return its first client, numclients if none - as in the servers. */
+static inline int first_in_set(setwalk *walk, unsigned long long *set)
+{
+	walk->set = set;
+	walk->word = 0;
+	walk->bits = set[0];
+	return next_in_walk(walk);
+}
+
+
+
+
+/* Return the next client in the set being walked, numclients once all have been visited. */
+static inline int next_in_walk(setwalk *walk)
+{
+	int client;
+
+	while (walk->bits == 0) {
+		if (++walk->word >= SETWORDS(numclients)) {
+			return numclients;
+		}
+		walk->bits = walk->set[walk->word];
+	}
+	client = (walk->word<<6) + __builtin_ctzll(walk->bits);
+	walk->bits &= walk->bits - 1;
+	return client;
+}
+
+
+
+
+static double now_secs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
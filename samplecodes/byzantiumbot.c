@@ -0,0 +1,790 @@
+/* byzantiumbot.c - code for a load generator that plays Byzantium against a byzantiums server with many bot clients */
+#define closesocket close
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define PROTOPORT 36724 /* default protocol port number */
+#define MAXBOTS 30 /* most bots one generator can run - the server's client limit */
+#define BOTBUFSIZE 4096 /* size of each bot's receive buffer */
+#define MAXROSTER 30 /* most players remembered from an sstat */
+#define NAMESIZE 12 /* length of maximum allowable name */
+#define BUCKETS 32 /* latency histogram buckets, bucket n holds latencies below 2^n microseconds */
+#define NUMSTRATEGIES 4
+#define NUMPHASES 4
+char localhost[] = "localhost"; /* default host name */
+
+/*------------------------------------------------------------------------
+* Program: byzantiumbot
+*
+* Purpose: drive a byzantiums server end to end with many players at once.
+* One process opens a connection per bot and repeatedly does the following:
+* (1) wait for server messages on any bot's connection, or for a bot's
+*     thinking time to run out
+* (2) split the input into complete messages and answer PLAN, OFFER and
+*     ACTION prompts according to the bot's strategy
+* (3) send each answer once the bot's configured delay has passed
+* Bots play game after game, reconnecting if the server drops them. At the
+* end a report gives rounds per minute and a latency histogram per phase.
+* With -r the run is repeated for each player count in a list, and one line
+* of round-end latency percentiles is printed per count.
+*
+* Phase latency is the time from a bot's answer being sent to the server's
+* next prompt arriving, so it measures the server rather than the bots:
+*   PLAN      answer to a PLAN until the next PLAN
+*   OFFER     answer to a PLAN or OFFER until the next OFFER/OFFERL
+*   ACTION    answer to an OFFER or ACTION until the next ACTION
+*   BATTLE    last ACTION answer until the round's NOTIFY messages
+*   ROUNDEND  last ACTION answer until every connected bot has had the
+*             round's NOTIFY messages
+*
+* Build: gcc -O2 -o byzantiumbot byzantiumbot.c
+*
+* Syntax: byzantiumbot [-h] [-s server] [-p port] [-n bots] [-b strategies]
+*                      [-d mindelay,maxdelay] [-T seconds] [-g games] [-x prefix]
+*                      [-r counts]
+*
+* -h          print a description of the parameters and exit
+* server      IP address or name of a computer on which byzantiums is executing
+* port        protocol port number the server is using
+* bots        number of bot connections to open
+* strategies  comma-separated strategies handed out in turn to the bots, from:
+*             random, weakest, strongest, pacifist
+* mindelay, maxdelay  range in milliseconds a bot waits before answering
+* seconds     how long to run before reporting
+* games       stop after this many games have finished (0 for no limit)
+* prefix      name prefix for the bots, followed by the bot number
+* counts      comma-separated player counts to sweep, running the bots for
+*             seconds at each count (the default runs bots once)
+*
+* All arguments are optional. The default values are as follows:
+*   server = "localhost"
+*   port = 36724
+*   bots = 3
+*   strategies = random,weakest,strongest,pacifist
+*   mindelay,maxdelay = 0,0
+*   seconds = 60
+*   games = 0
+*   prefix = "BOT"
+*
+*------------------------------------------------------------------------
+*/
+
+typedef struct {
+        char name[NAMESIZE+1];
+        int troops;
+    } rosterentry;
+
+typedef struct {
+        int socket; /* connection to the server, -1 if not connected */
+        int strategy;
+        char name[NAMESIZE+1]; /* name the server gave this bot */
+        char inbuf[BOTBUFSIZE]; /* received bytes not yet parsed */
+        int inlen;
+        char reply[200]; /* answer waiting to be sent */
+        int replyphase; /* phase of the prompt being answered */
+        long long replydue; /* time in microseconds the answer is due, 0 if none */
+        int notifyround; /* round number of the last NOTIFY this bot received */
+    } botinfo;
+
+typedef struct {
+        long count;
+        long long total; /* sum of all latencies in microseconds */
+        long long max;
+        long buckets[BUCKETS];
+    } histogram;
+
+static long long run_bots();
+static void reset_stats();
+static void connect_bot(int bot);
+static void drop_bot(int bot);
+static void read_bot(int bot);
+static void handle_message(int bot, char *message);
+static void handle_prompt(int bot, char **fields, int numfields);
+static void read_roster(char *list);
+static int connected_bots();
+static void schedule_reply(int bot, int phase);
+static void send_reply(int bot);
+static void record_latency(int phase, long long now);
+static void add_sample(histogram *hist, long long usecs);
+static long long percentile(histogram *hist, double fraction);
+static void print_report(long long elapsed);
+static void print_sweep_line(long long elapsed);
+static const char * pick_target(int bot, int strongest);
+static const char * pick_random(int bot);
+static int parse_strategies(char *list);
+static long long now_usecs();
+
+const char *strategynames[NUMSTRATEGIES] = {"random", "weakest", "strongest", "pacifist"};
+const char *phasenames[NUMPHASES] = {"PLAN", "OFFER", "ACTION", "BATTLE"};
+#define PH_PLAN 0
+#define PH_OFFER 1
+#define PH_ACTION 2
+#define PH_BATTLE 3
+
+botinfo bots[MAXBOTS];
+int numbots = 3; /* number of bots to run */
+int strategies[MAXBOTS]; /* strategies handed out to the bots in turn */
+int numstrategies = 0;
+int mindelay = 0, maxdelay = 0; /* range of time a bot thinks before answering, in milliseconds */
+int duration = 60; /* seconds to run */
+int maxgames = 0; /* games to play, 0 for no limit */
+char *prefix = "BOT"; /* bot name prefix */
+int sweepcounts[MAXBOTS]; /* player counts to sweep with -r */
+int numsweep = 0;
+struct sockaddr_in sad; /* server address */
+int tcpproto; /* protocol number for tcp */
+
+rosterentry roster[MAXROSTER]; /* players and troops from the last sstat */
+int rostersize = 0;
+histogram latency[NUMPHASES]; /* server latency for each phase */
+histogram roundtime; /* time from one round's NOTIFYs to the next round's */
+histogram roundend; /* time from the last ACTION answer until every bot has had the round's NOTIFYs */
+long long roundendstart = 0; /* time of the ACTION answer the current round's NOTIFYs follow, 0 if not timed */
+int roundendnotified = 0; /* bots that have had the current round's NOTIFYs */
+long long lastanswer = 0; /* time the last answer was sent, 0 once a prompt has been timed against it */
+int lastanswerphase = -1; /* phase of the prompt last answered */
+int lastnotifyround = -1; /* round number of the last NOTIFY seen */
+long long lastnotifytime = 0; /* time the last round's NOTIFYs arrived */
+int lastplanround = 0; /* round number of the last PLAN seen */
+long rounds = 0; /* rounds completed */
+long games = 0; /* games completed */
+long strikes = 0; /* strikes received by all bots */
+long reconnects = 0; /* times a bot had to reconnect */
+long messages = 0; /* server messages received */
+
+int main(int argc, char *argv[])
+{
+	struct hostent *ptrh; /* pointer to a host table entry */
+	struct protoent *ptrp; /* pointer to a protocol table entry */
+	char *server = localhost; /* server to connect to */
+	int port = PROTOPORT; /* port to connect to */
+	long long elapsed;
+	char *count;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	numstrategies = parse_strategies("random,weakest,strongest,pacifist");
+
+	/* Get values from command line. */
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+			server = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &port);
+		}
+		else if (strcmp(argv[i], "-n") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &numbots);
+		}
+		else if (strcmp(argv[i], "-b") == 0 && (i+1) < argc) {
+			numstrategies = parse_strategies(argv[i+1]);
+			if (numstrategies == 0) {
+				fprintf(stderr, "bad strategy list %s\n", argv[i+1]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-d") == 0 && (i+1) < argc) {
+			if (sscanf(argv[i+1], "%d,%d", &mindelay, &maxdelay) < 2) {
+				maxdelay = mindelay;
+			}
+		}
+		else if (strcmp(argv[i], "-T") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &duration);
+		}
+		else if (strcmp(argv[i], "-g") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &maxgames);
+		}
+		else if (strcmp(argv[i], "-x") == 0 && (i+1) < argc) {
+			prefix = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+			for (count=strtok(argv[i+1], ","); count!=NULL && numsweep<MAXBOTS; count=strtok(NULL, ",")) {
+				sweepcounts[numsweep] = atoi(count);
+				if (sweepcounts[numsweep] < 1 || sweepcounts[numsweep] > MAXBOTS) {
+					fprintf(stderr, "number of bots must be between 1 and %d\n", MAXBOTS);
+					exit(1);
+				}
+				numsweep++;
+			}
+		}
+		else if (strcmp(argv[i], "-h") == 0) {
+			fprintf(stderr, "This client implements the following (optional) command line parameters:\n-h                    print a description of the parameters and then exit\n-s server             server = IP address or name of a computer on which byzantiums is executing (default: \"localhost\")\n-p port               port = protocol port number server is using (default: 36724)\n-n bots               bots = number of bot connections (default: 3)\n-b strategies         strategies = comma-separated list of random, weakest, strongest, pacifist\n-d mindelay,maxdelay  range of milliseconds a bot waits before answering (default: 0,0)\n-T seconds            seconds to run before reporting (default: 60)\n-g games              stop after this many games (default: 0 = no limit)\n-x prefix             bot name prefix (default: \"BOT\")\n-r counts             sweep these comma-separated player counts and report round-end latency for each\n");
+			exit(0);
+		}
+	}
+	if (numbots < 1 || numbots > MAXBOTS) {
+		fprintf(stderr, "number of bots must be between 1 and %d\n", MAXBOTS);
+		exit(1);
+	}
+	if (mindelay < 0) {
+		mindelay = 0;
+	}
+	if (maxdelay < mindelay) {
+		maxdelay = mindelay;
+	}
+	if (port <= 0) {
+		fprintf(stderr, "bad port number %d\n", port);
+		exit(1);
+	}
+
+	/* Convert host name to equivalent IP address and copy to sad. */
+	memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
+	sad.sin_family = AF_INET; /* set family to Internet */
+	sad.sin_port = htons((u_short)port);
+	ptrh = gethostbyname(server);
+	if ( ((char *)ptrh) == NULL ) {
+		fprintf(stderr,"invalid host: %s\n", server);
+		exit(1);
+	}
+	memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+
+	/* Map TCP transport protocol name to protocol number. */
+	if ( ((long)(ptrp = getprotobyname("tcp"))) == 0) {
+		fprintf(stderr, "cannot map \"tcp\" to protocol number");
+		exit(1);
+	}
+	tcpproto = ptrp->p_proto;
+
+	srand((unsigned int) time(NULL));
+	if (numsweep == 0) {
+		elapsed = run_bots();
+		print_report(elapsed);
+		exit(0);
+	}
+
+	/* Sweep - a fresh set of bots for each player count, so each count's games start from the lobby. */
+	printf("%-8s %8s %10s %8s %10s %10s %10s %10s %10s\n", "players", "rounds", "rounds/min", "samples", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (i=0; i<numsweep; i++) {
+		numbots = sweepcounts[i];
+		reset_stats();
+		elapsed = run_bots();
+		print_sweep_line(elapsed);
+		fflush(stdout);
+		sleep(1); /* let the server drop the last count's bots and end their game */
+	}
+	exit(0);
+}
+
+
+
+/* Connect numbots bots, play for duration seconds or maxgames games, then disconnect them. Returns the time played in microseconds. */
+static long long run_bots()
+{
+	fd_set read_set; /* fd_set to use with select */
+	struct timeval selecttime; /* time until the next answer is due */
+	long long start, now, next;
+	int i;
+
+	for (i=0; i<numbots; i++) {
+		bots[i].socket = -1;
+		bots[i].strategy = strategies[i % numstrategies];
+		connect_bot(i);
+	}
+
+	/* Main loop */
+	start = now_usecs();
+	while (1) {
+		now = now_usecs();
+		if (now - start >= (long long)duration*1000000LL || (maxgames > 0 && games >= maxgames)) {
+			break;
+		}
+
+		/* Send any answers that are due, and sleep until the next one or the end of the run. */
+		next = start + (long long)duration*1000000LL;
+		for (i=0; i<numbots; i++) {
+			if (bots[i].replydue != 0 && bots[i].replydue <= now) {
+				send_reply(i);
+			}
+			if (bots[i].replydue != 0 && bots[i].replydue < next) {
+				next = bots[i].replydue;
+			}
+		}
+		selecttime.tv_sec = (next - now) / 1000000LL;
+		selecttime.tv_usec = (next - now) % 1000000LL;
+		if (next < now) {
+			selecttime.tv_sec = 0; selecttime.tv_usec = 0;
+		}
+
+		FD_ZERO (&read_set);
+		for (i=0; i<numbots; i++) {
+			if (bots[i].socket >= 0) {
+				FD_SET (bots[i].socket, &read_set);
+			}
+		}
+		if (select (FD_SETSIZE, &read_set, NULL, NULL, &selecttime) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror ("select");
+			exit (1);
+		}
+		for (i=0; i<numbots; i++) {
+			if (bots[i].socket >= 0 && FD_ISSET (bots[i].socket, &read_set)) {
+				read_bot(i);
+			}
+		}
+		for (i=0; i<numbots; i++) { /* bring back any bot the server dropped */
+			if (bots[i].socket < 0) {
+				reconnects++;
+				connect_bot(i);
+			}
+		}
+	}
+
+	now = now_usecs();
+	for (i=0; i<numbots; i++) {
+		if (bots[i].socket >= 0) {
+			closesocket(bots[i].socket);
+			bots[i].socket = -1;
+		}
+	}
+	return now - start;
+}
+
+
+
+static void reset_stats()
+{
+	memset(latency, 0, sizeof(latency));
+	memset(&roundtime, 0, sizeof(roundtime));
+	memset(&roundend, 0, sizeof(roundend));
+	roundendstart = 0;
+	roundendnotified = 0;
+	lastanswer = 0;
+	lastanswerphase = -1;
+	lastnotifyround = -1;
+	lastnotifytime = 0;
+	lastplanround = 0;
+	rostersize = 0;
+	rounds = 0;
+	games = 0;
+	strikes = 0;
+	reconnects = 0;
+	messages = 0;
+}
+
+
+
+/* Open a bot's connection and send cjoin. */
+static void connect_bot(int bot)
+{
+	char join[100];
+	int sd, flag = 1;
+
+	sd = socket(PF_INET, SOCK_STREAM, tcpproto);
+	if (sd < 0) {
+		fprintf(stderr, "socket creation failed\n");
+		exit(1);
+	}
+	if (connect(sd, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+		fprintf(stderr,"connect failed\n");
+		exit(1);
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)); /* answers are small - don't let Nagle hold them back */
+	bots[bot].socket = sd;
+	bots[bot].inlen = 0;
+	bots[bot].replydue = 0;
+	bots[bot].notifyround = -1;
+	snprintf(bots[bot].name, NAMESIZE+1, "%s%d", prefix, bot);
+	sprintf(join, "(cjoin(%s))", bots[bot].name);
+	write(sd, join, strlen(join));
+}
+
+
+
+static void drop_bot(int bot)
+{
+	fprintf(stderr, "%s: connection dropped\n", bots[bot].name);
+	closesocket(bots[bot].socket);
+	bots[bot].socket = -1;
+	bots[bot].replydue = 0;
+}
+
+
+
+/* Read what the server sent a bot and handle every complete message in it. */
+static void read_bot(int bot)
+{
+	botinfo *b = &bots[bot];
+	int n, pos, start, depth;
+
+	n = recv(b->socket, b->inbuf + b->inlen, BOTBUFSIZE - 1 - b->inlen, 0);
+	if (n <= 0) {
+		drop_bot(bot);
+		return;
+	}
+	b->inlen += n;
+
+	/* Messages are balanced parentheses - split at each return to depth zero. */
+	start = 0; depth = 0;
+	for (pos=0; pos<b->inlen; pos++) {
+		if (b->inbuf[pos] == '(') {
+			depth++;
+		}
+		else if (b->inbuf[pos] == ')' && depth > 0) {
+			depth--;
+			if (depth == 0) {
+				char message[BOTBUFSIZE];
+				memcpy(message, b->inbuf + start, pos + 1 - start);
+				message[pos + 1 - start] = '\0';
+				handle_message(bot, message);
+				start = pos + 1;
+			}
+		}
+		else if (depth == 0) { /* stray byte between messages */
+			start = pos + 1;
+		}
+	}
+	memmove(b->inbuf, b->inbuf + start, b->inlen - start);
+	b->inlen -= start;
+	if (b->inlen >= BOTBUFSIZE - 1) { /* message too long to ever complete - discard it */
+		b->inlen = 0;
+	}
+}
+
+
+
+static void handle_message(int bot, char *message)
+{
+	char *fields[8];
+	int numfields = 0;
+	char *pos;
+
+	messages++;
+	if (strncmp(message, "(schat(SERVER)(", 15) == 0) {
+		pos = message + 15;
+		pos[strcspn(pos, ")")] = '\0';
+		for (pos=strtok(pos, ","); pos!=NULL && numfields<8; pos=strtok(NULL, ",")) {
+			fields[numfields++] = pos;
+		}
+		if (numfields > 0) {
+			handle_prompt(bot, fields, numfields);
+		}
+	}
+	else if (strncmp(message, "(sjoin(", 7) == 0) { /* remember the name the server gave us */
+		pos = message + 7;
+		pos[strcspn(pos, ")")] = '\0';
+		snprintf(bots[bot].name, NAMESIZE+1, "%.12s", pos);
+	}
+	else if (strncmp(message, "(sstat(", 7) == 0) {
+		pos = message + 7;
+		pos[strcspn(pos, ")")] = '\0';
+		read_roster(pos);
+	}
+	else if (strncmp(message, "(strike(", 8) == 0) {
+		strikes++;
+fprintf(stderr, "%s: %s\n", bots[bot].name, message);
+	}
+}
+
+
+
+/* Answer a message from SERVER, and time it against the last answer sent. */
+static void handle_prompt(int bot, char **fields, int numfields)
+{
+	long long now = now_usecs();
+	int round = (numfields > 1) ? atoi(fields[1]) : 0;
+
+	if (strcmp(fields[0], "NOTIFY") == 0) { /* every bot gets the same NOTIFYs - count the round once */
+		if (round != lastnotifyround) {
+			roundendstart = (lastanswer != 0 && lastanswerphase == PH_ACTION) ? lastanswer : 0; /* an unfinished earlier round is not timed */
+			roundendnotified = 0;
+			record_latency(PH_BATTLE, now);
+			if (lastnotifytime != 0 && round == lastnotifyround + 1) {
+				add_sample(&roundtime, now - lastnotifytime);
+			}
+			lastnotifyround = round;
+			lastnotifytime = now;
+			rounds++;
+		}
+		if (bots[bot].notifyround != round) { /* the round ends once the last connected bot has its NOTIFYs */
+			bots[bot].notifyround = round;
+			roundendnotified++;
+			if (roundendstart != 0 && roundendnotified >= connected_bots()) {
+				add_sample(&roundend, now - roundendstart);
+				roundendstart = 0;
+			}
+		}
+		return;
+	}
+	if (strcmp(fields[0], "PLAN") == 0) {
+		if (round < lastplanround) { /* round numbers start over in a new game */
+			games++;
+			lastnotifytime = 0;
+		}
+		lastplanround = round;
+		record_latency(PH_PLAN, now);
+		if (bots[bot].strategy == 3) {
+			snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(PLAN,%d,PASS))", round);
+		}
+		else {
+			const char *ally = pick_target(bot, bots[bot].strategy != 2);
+			const char *target = (bots[bot].strategy == 0) ? pick_random(bot) : pick_target(bot, bots[bot].strategy == 2);
+			if (ally != NULL && target != NULL && strcmp(ally, target) != 0) {
+				snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(PLAN,%d,APPROACH,%s,%s))", round, ally, target);
+			}
+			else {
+				snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(PLAN,%d,PASS))", round);
+			}
+		}
+		schedule_reply(bot, PH_PLAN);
+	}
+	else if (strcmp(fields[0], "OFFER") == 0 || strcmp(fields[0], "OFFERL") == 0) {
+		record_latency(PH_OFFER, now);
+		if (numfields >= 3) { /* an offer from fields[2] - pacifists decline, random bots toss a coin, the rest accept */
+			int accept = (bots[bot].strategy == 3) ? 0 : (bots[bot].strategy == 0) ? rand() % 2 : 1;
+			snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(%s,%d,%s))", accept != 0 ? "ACCEPT" : "DECLINE", round, fields[2]);
+			schedule_reply(bot, PH_OFFER);
+		}
+	}
+	else if (strcmp(fields[0], "ACTION") == 0) {
+		const char *target = NULL;
+		record_latency(PH_ACTION, now);
+		if (bots[bot].strategy == 0) {
+			target = pick_random(bot);
+		}
+		else if (bots[bot].strategy != 3) {
+			target = pick_target(bot, bots[bot].strategy == 2);
+		}
+		if (target != NULL) {
+			snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(ACTION,%d,ATTACK,%s))", round, target);
+		}
+		else {
+			snprintf(bots[bot].reply, sizeof(bots[bot].reply), "(cchat(SERVER)(ACTION,%d,PASS))", round);
+		}
+		schedule_reply(bot, PH_ACTION);
+	}
+}
+
+
+
+/* Remember each player's troops from an sstat list of name,strikes,troops triples. */
+static void read_roster(char *list)
+{
+	char *name, *strikefield, *troopfield;
+	char *save = NULL;
+
+	rostersize = 0;
+	name = strtok_r(list, ",", &save);
+	while (name != NULL && rostersize < MAXROSTER) {
+		strikefield = strtok_r(NULL, ",", &save);
+		troopfield = strtok_r(NULL, ",", &save);
+		if (strikefield == NULL || troopfield == NULL) {
+			break;
+		}
+		snprintf(roster[rostersize].name, NAMESIZE+1, "%.12s", name);
+		roster[rostersize].troops = atoi(troopfield);
+		rostersize++;
+		name = strtok_r(NULL, ",", &save);
+	}
+}
+
+
+
+static int connected_bots()
+{
+	int i, count = 0;
+
+	for (i=0; i<numbots; i++) {
+		if (bots[i].socket >= 0) {
+			count++;
+		}
+	}
+	return count;
+}
+
+
+
+/* Hold the answer in bots[bot].reply until the bot's thinking time has passed. */
+static void schedule_reply(int bot, int phase)
+{
+	int delay = mindelay;
+
+	if (maxdelay > mindelay) {
+		delay += rand() % (maxdelay - mindelay + 1);
+	}
+	bots[bot].replyphase = phase;
+	bots[bot].replydue = now_usecs() + (long long)delay*1000LL;
+	if (delay == 0) {
+		send_reply(bot);
+	}
+}
+
+
+
+static void send_reply(int bot)
+{
+	int length = strlen(bots[bot].reply);
+
+	if (write(bots[bot].socket, bots[bot].reply, length) != length) {
+		drop_bot(bot);
+		return;
+	}
+	bots[bot].replydue = 0;
+	lastanswer = now_usecs();
+	lastanswerphase = bots[bot].replyphase;
+}
+
+
+
+/* Time a prompt against the answer that led to it. */
+static void record_latency(int phase, long long now)
+{
+	if (lastanswer == 0) {
+		return;
+	}
+	if (phase == PH_BATTLE && lastanswerphase != PH_ACTION) { /* NOTIFYs only follow ACTION answers */
+		return;
+	}
+	add_sample(&latency[phase], now - lastanswer);
+	lastanswer = 0;
+}
+
+
+
+static void add_sample(histogram *hist, long long usecs)
+{
+	int bucket = 0;
+
+	if (usecs < 0) {
+		usecs = 0;
+	}
+	while (bucket < BUCKETS-1 && (1LL << bucket) <= usecs) {
+		bucket++;
+	}
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->total += usecs;
+	if (usecs > hist->max) {
+		hist->max = usecs;
+	}
+}
+
+
+
+/* Upper bound of the bucket holding the given fraction of samples. */
+static long long percentile(histogram *hist, double fraction)
+{
+	long seen = 0;
+	int bucket;
+
+	for (bucket=0; bucket<BUCKETS; bucket++) {
+		seen += hist->buckets[bucket];
+		if (seen >= fraction * hist->count) {
+			return 1LL << bucket;
+		}
+	}
+	return hist->max;
+}
+
+
+
+static void print_report(long long elapsed)
+{
+	double minutes = elapsed / 60000000.0;
+	int phase, bucket;
+
+	printf("bots %d, elapsed %.1f s, games %ld, rounds %ld, rounds/min %.1f\n", numbots, elapsed / 1000000.0, games, rounds, minutes > 0 ? rounds / minutes : 0.0);
+	printf("messages %ld, strikes %ld, reconnects %ld\n", messages, strikes, reconnects);
+	printf("%-8s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (phase=0; phase<NUMPHASES+2; phase++) {
+		histogram *hist = (phase < NUMPHASES) ? &latency[phase] : (phase == NUMPHASES) ? &roundend : &roundtime;
+		printf("%-8s %8ld %10lld %10lld %10lld %10lld %10lld\n", phase < NUMPHASES ? phasenames[phase] : (phase == NUMPHASES) ? "ROUNDEND" : "ROUND", hist->count, hist->count > 0 ? hist->total / hist->count : 0, percentile(hist, 0.5), percentile(hist, 0.9), percentile(hist, 0.99), hist->max);
+	}
+	for (phase=0; phase<NUMPHASES; phase++) { /* full histograms, one line per non-empty bucket */
+		for (bucket=0; bucket<BUCKETS; bucket++) {
+			if (latency[phase].buckets[bucket] > 0) {
+				printf("hist %s <%lld us %ld\n", phasenames[phase], 1LL << bucket, latency[phase].buckets[bucket]);
+			}
+		}
+	}
+}
+
+
+
+/* One line of the -r sweep - round-end latency at the current player count. */
+static void print_sweep_line(long long elapsed)
+{
+	double minutes = elapsed / 60000000.0;
+
+	printf("%-8d %8ld %10.1f %8ld %10lld %10lld %10lld %10lld %10lld\n", numbots, rounds, minutes > 0 ? rounds / minutes : 0.0, roundend.count, roundend.count > 0 ? roundend.total / roundend.count : 0, percentile(&roundend, 0.5), percentile(&roundend, 0.9), percentile(&roundend, 0.99), roundend.max);
+}
+
+
+
+/* Name of the opponent with the most (strongest = 1) or fewest troops, NULL if none. */
+static const char * pick_target(int bot, int strongest)
+{
+	int i, best = -1;
+
+	for (i=0; i<rostersize; i++) {
+		if (strcmp(roster[i].name, bots[bot].name) == 0 || roster[i].troops <= 0) {
+			continue;
+		}
+		if (best < 0 || (strongest != 0 && roster[i].troops > roster[best].troops) || (strongest == 0 && roster[i].troops < roster[best].troops)) {
+			best = i;
+		}
+	}
+	return (best < 0) ? NULL : roster[best].name;
+}
+
+
+
+/* Name of a random opponent with troops, NULL if none. */
+static const char * pick_random(int bot)
+{
+	int candidates[MAXROSTER];
+	int i, count = 0;
+
+	for (i=0; i<rostersize; i++) {
+		if (strcmp(roster[i].name, bots[bot].name) != 0 && roster[i].troops > 0) {
+			candidates[count++] = i;
+		}
+	}
+	return (count == 0) ? NULL : roster[candidates[rand() % count]].name;
+}
+
+
+
+/* Fill strategies from a comma-separated list of names. Returns the number of entries, 0 if a name is unknown. */
+static int parse_strategies(char *list)
+{
+	char copy[256];
+	char *name;
+	int count = 0, strategy;
+
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (name=strtok(copy, ","); name!=NULL && count<MAXBOTS; name=strtok(NULL, ",")) {
+		for (strategy=0; strategy<NUMSTRATEGIES; strategy++) {
+			if (strcmp(name, strategynames[strategy]) == 0) {
+				break;
+			}
+		}
+		if (strategy == NUMSTRATEGIES) {
+			return 0;
+		}
+		strategies[count++] = strategy;
+	}
+	return count;
+}
+
+
+
+static long long now_usecs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec*1000000LL + tv.tv_usec;
+}
@@ -0,0 +1,183 @@
+/* zipbench.c - benchmark of compress.c on the rosters and history replays the chat server compresses */
+#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "compress.h"
+
+#define MAXMESSAGE 480 /* chatserver's longest message */
+#define LISTLIMIT (MAXMESSAGE-2*12-48) /* chatserver's longest player list */
+#define HISTORYSLOTS 256 /* chatserver's history ring */
+
+/*------------------------------------------------------------------------
+* Program: zipbench
+*
+* Purpose: measure what compression saves the chat server and what it
+* costs, on the messages it compresses:
+* (1) roster - an sstat of players named like people, with ~n suffixes,
+*     and one of players named by number, as chatbench names them
+* (2) replay - a run of replay schat messages to ALL, as sent to a newly
+*     named client
+* For each, the bytes before and after, and the microseconds to compress
+* and to expand one. Then, for a roster broadcast to clients players,
+* the microseconds spent compressing it once and sharing the bytes
+* against compressing it again for each of them.
+*
+* Build: gcc -O2 -o zipbench zipbench.c compress.c
+*
+* Syntax: zipbench [-n players] [-k replay] [-c clients] [-r repeats]
+*
+* players       players in the roster, until it reaches LISTLIMIT
+* replay        chats in the replay, at most HISTORYSLOTS
+* clients       players a roster is broadcast to
+* repeats       number of times each message is compressed and expanded
+*
+* All arguments are optional. The default values are as follows:
+*   players = 30
+*   replay = 32
+*   clients = 30
+*   repeats = 20000
+*
+*------------------------------------------------------------------------
+*/
+
+const char *firstnames[] = {"ALICE", "BOB", "CAROL", "DAVE", "EVE", "FRANK", "GRACE", "HEIDI", "IVAN", "JUDY", "MALLORY", "OSCAR", "PEGGY", "TRENT", "VICTOR", "WALTER"};
+const char *words[] = {"the", "attack", "at", "dawn", "is", "off", "hold", "your", "troops", "I", "will", "back", "you", "against", "who", "agrees", "to", "peace", "lol", "ok"};
+int repeats = 20000;
+
+static void measure(const char *label, char *text, int length);
+static double now_secs();
+
+
+
+
+int main(int argc, char **argv)
+{
+	int players = 30, replay = 32, clients = 30;
+	char people[MAXMESSAGE], numbered[MAXMESSAGE];
+	char message[MAXMESSAGE];
+	static char run[HISTORYSLOTS*MAXMESSAGE];
+	static unsigned char out[HISTORYSLOTS*MAXMESSAGE];
+	int i, k, length, runlength = 0;
+	double start, once, each;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i], "-n") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &players);
+		}
+		else if (strcmp(argv[i], "-k") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &replay);
+		}
+		else if (strcmp(argv[i], "-c") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &clients);
+		}
+		else if (strcmp(argv[i], "-r") == 0 && (i+1) < argc) {
+			sscanf(argv[i+1], "%d", &repeats);
+		}
+	}
+	if (replay < 1 || replay > HISTORYSLOTS) {
+		replay = 32;
+	}
+	if (repeats < 1) {
+		repeats = 20000;
+	}
+
+	/* Rosters, built as build_player_list() builds them - cut short at LISTLIMIT. */
+	srand(1);
+	strcpy(people, "");
+	strcpy(numbered, "");
+	for (i=0; i<players; i++) {
+		char name[16];
+		if (i < 16) {
+			snprintf(name, sizeof(name), "%s", firstnames[i]);
+		}
+		else {
+			snprintf(name, sizeof(name), "%s~%d", firstnames[rand()%16], 1+i/16);
+		}
+		if (strlen(people) + strlen(name) + 1 < LISTLIMIT) {
+			if (i > 0) {
+				strcat(people, ",");
+			}
+			strcat(people, name);
+		}
+		snprintf(name, sizeof(name), i%2 == 0 ? "S%d" : "R%d", i/2);
+		if (strlen(numbered) + strlen(name) + 1 < LISTLIMIT) {
+			if (i > 0) {
+				strcat(numbered, ",");
+			}
+			strcat(numbered, name);
+		}
+	}
+
+	/* The replay - chats to ALL from the people above, of a few words each. */
+	for (i=0; i<replay; i++) {
+		length = snprintf(message, sizeof(message), "(schat(%s)(", firstnames[rand() % (players < 16 ? (players > 0 ? players : 1) : 16)]);
+		for (k=rand()%10; k>=0; k--) {
+			length += snprintf(message+length, sizeof(message)-length, "%s%s", words[rand()%20], k > 0 ? " " : "");
+		}
+		length += snprintf(message+length, sizeof(message)-length, "))");
+		memcpy(run+runlength, message, length);
+		runlength += length;
+	}
+
+	length = snprintf(message, sizeof(message), "(sstat(%s))", people);
+	measure("roster, names", message, length);
+	length = snprintf(message, sizeof(message), "(sstat(%s))", numbered);
+	measure("roster, numbers", message, length);
+	measure("replay", run, runlength);
+
+	/* A roster broadcast: compressed once and shared, against compressed for each client. */
+	length = snprintf(message, sizeof(message), "(sstat(%s))", people);
+	start = now_secs();
+	for (i=0; i<repeats; i++) {
+		zip_compress(message, length, out, sizeof(out));
+	}
+	once = (now_secs() - start) / repeats;
+	start = now_secs();
+	for (i=0; i<repeats/clients+1; i++) {
+		for (k=0; k<clients; k++) {
+			zip_compress(message, length, out, sizeof(out));
+		}
+	}
+	each = (now_secs() - start) / (repeats/clients+1);
+	printf("broadcast to %d clients: shared %8.2f us  per client %8.2f us (%.1fx)\n", clients, once*1e6, each*1e6, once > 0 ? each/once : 0.0);
+	exit(0);
+}
+
+
+
+
+/* Compress and expand text repeats times, check it comes back the same, and print the sizes and times. */
+static void measure(const char *label, char *text, int length)
+{
+	static unsigned char out[HISTORYSLOTS*MAXMESSAGE];
+	static char back[HISTORYSLOTS*MAXMESSAGE];
+	int r, zlength = 0, expanded = 0;
+	double start, compress, expand;
+
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		zlength = zip_compress(text, length, out, sizeof(out));
+	}
+	compress = (now_secs() - start) / repeats;
+	start = now_secs();
+	for (r=0; r<repeats; r++) {
+		expanded = zip_expand(out, zlength, back, sizeof(back));
+	}
+	expand = (now_secs() - start) / repeats;
+	if (expanded != length || memcmp(back, text, length) != 0) {
+		fprintf(stderr, "Error: %s did not expand to what was compressed\n", label);
+		exit(1);
+	}
+	printf("%-16s %6d -> %6d bytes (%5.1f%%)  compress %8.2f us  expand %8.2f us\n", label, length, zlength, 100.0*zlength/length, compress*1e6, expand*1e6);
+}
+
+
+
+
+static double now_secs()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}